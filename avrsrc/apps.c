@@ -43,14 +43,20 @@
 #include "emv.h"
 #include "emv_values.h"
 #include "scd.h"
+#include "scd_cardcache.h"
 #include "scd_hal.h"
 #include "scd_io.h"
 #include "scd_logger.h"
+#include "scd_logsink.h"
+#include "scd_logvol.h"
+#include "scd_meta.h"
+#include "scd_summary.h"
 #include "scd_values.h"
 #include "serial.h"
 #include "terminal.h"
 #include "utils.h"
 #include "VirtualSerial.h"
+#include "MassStorage.h"
 
 /// Set this to 1 to enable LCD functionality
 #define LCD_ENABLED 1			
@@ -89,6 +95,8 @@ uint8_t VirtualSerial(log_struct_t *logger)
 {
   char *buf;
   char *response = NULL;
+  char c;
+  line_buffer_t line;
 
   if(GetLCDState() == 0)
     InitLCD();
@@ -107,15 +115,15 @@ uint8_t VirtualSerial(log_struct_t *logger)
   Led4On();
   fprintf(stderr, "VS Ready\n");
   _delay_ms(100);
+  ResetLineBuffer(&line);
 
   for (;;)
   {
-    buf = GetHostData(256);
+    if(!PollHostChar(&c))
+      continue;
+    buf = AddLineChar(&line, c);
     if(buf == NULL)
-    {
-      _delay_ms(100);
       continue;
-    }
 
     response = (char*)ProcessSerialData(buf, logger);
     free(buf);
@@ -139,15 +147,24 @@ uint8_t VirtualSerial(log_struct_t *logger)
 /**
  * Serial Port interface application
  *
+ * The USART is interrupt driven (see InitUSART) so characters received
+ * while a command is processed are kept in the receive ring buffer.
+ * Use AT+CUSTAT to get the throughput and overrun statistics.
+ *
  * @param baudUBRR the baud UBRR parameter as given in table 18-12 of
  * the datasheet, page 203. The formula is: baud = FCLK / (16 * (baudUBRR + 1)).
  * So for FCLK = 16 MHz and desired BAUD = 9600 bps => baudUBRR = 103.
+ * @param doubleSpeed set to non-zero for the double speed mode (U2X), where
+ * baud = FCLK / (8 * (baudUBRR + 1)), e.g. 1 Mbps => baudUBRR = 1.
  * @param logger the log structure or NULL if no log is desired
  */
-uint8_t SerialInterface(uint16_t baudUBRR, log_struct_t *logger)
+uint8_t SerialInterface(uint16_t baudUBRR, uint8_t doubleSpeed,
+    log_struct_t *logger)
 {
   char *buf;
   char *response = NULL;
+  char c;
+  line_buffer_t line;
 
   InitLCD();
   fprintf(stderr, "\n");
@@ -155,26 +172,19 @@ uint8_t SerialInterface(uint16_t baudUBRR, log_struct_t *logger)
   fprintf(stderr, "Set up  Serial\n");
   _delay_ms(500);
   power_usart1_enable();
-  _delay_ms(500);
-  InitUSART(baudUBRR);
+  InitUSART(baudUBRR, doubleSpeed);
+  ResetLineBuffer(&line);
+  sei();
 
   fprintf(stderr, "Serial  Ready\n");
-  _delay_ms(500);
 
   for (;;)
   {
-    // Not working yet => resolder RX/TX and then try to enable/disable CTS/RTS signals
-    fprintf(stderr, "Before  GetLine\n");
-    _delay_ms(500);
-    buf = GetLineUSART();
+    if(!PollCharUSART(&c))
+      continue;
+    buf = AddLineChar(&line, c);
     if(buf == NULL)
-    {
-      _delay_ms(100);
       continue;
-    }
-
-    fprintf(stderr, "Got:%s\n", buf);
-    _delay_ms(500);
 
     response = (char*)ProcessSerialData(buf, logger);
     free(buf);
@@ -223,18 +233,17 @@ void EraseEEPROM()
  */
 void ResetEEPROM()
 {
+  log_policy_t policy;
+
   EraseEEPROM();
 
-  eeprom_write_byte((uint8_t*)EEPROM_WARM_RESET, 0);
-  eeprom_write_dword((uint32_t*)EEPROM_TIMER_T2, 0);
   eeprom_write_dword((uint32_t*)EEPROM_TEMP_1, 0);
   eeprom_write_dword((uint32_t*)EEPROM_TEMP_2, 0);
-  eeprom_write_byte((uint8_t*)EEPROM_APPLICATION, 0);
-  eeprom_write_byte((uint8_t*)EEPROM_COUNTER, 0);
-  eeprom_write_byte(
-      (uint8_t*)EEPROM_TLOG_POINTER_HI, (EEPROM_TLOG_DATA >> 8) & 0xFF);
-  eeprom_write_byte(
-      (uint8_t*)EEPROM_TLOG_POINTER_LO, EEPROM_TLOG_DATA & 0xFF);
+  ResetSCDMeta();
+  scdMeta.logSink = GetLogSink();
+  CommitSCDMeta();
+  GetLogPolicy(&policy);
+  SetLogPolicy(&policy, 1);
 }
 
 /**
@@ -290,7 +299,8 @@ uint8_t TestDDA(uint8_t convention, uint8_t TC1)
 
   // Get transaction data
   offlineAuthData = (ByteArray*)malloc(sizeof(ByteArray));
-  tData = GetTransactionData(convention, TC1, appInfo, offlineAuthData, 0);
+  tData = GetTransactionData(
+      convention, TC1, appInfo, offlineAuthData, NULL, 0);
   if(tData == NULL)
   {
     fprintf(stderr, "Error\n");
@@ -357,6 +367,9 @@ uint8_t Terminal(log_struct_t *logger)
   ByteArray *lastAtcData = NULL;
   GENERATE_AC_PARAMS acParams;
   const TLV *cdol = NULL;
+  card_cache_entry_t cacheEntry;
+  ByteArray cachedAID;
+  uint32_t runStart, runTime;
 
   // Visual signal for this app
   Led1Off();
@@ -398,6 +411,7 @@ uint8_t Terminal(log_struct_t *logger)
   EnableWDT(4000);
 
   // Initialize card
+  runStart = GetCounter();
   error = ResetICC(0, &convention, &proto, &TC1, &TA3, &TB3, logger);
   if(error)
   {
@@ -414,6 +428,15 @@ uint8_t Terminal(log_struct_t *logger)
   }
   ResetWDT();
 
+  // Select first the AID used last time with this card, if the card cache
+  // (see scd_cardcache.h) has an entry for its ATR
+  if(LoadCardCache(&cacheEntry) == CARD_CACHE_HIT)
+  {
+    cachedAID.bytes = cacheEntry.aid;
+    cachedAID.len = cacheEntry.aidLen;
+    fci = SelectFromAID(convention, TC1, &cachedAID, logger);
+  }
+
   // Select application. You can use one of the following options:
   //
   // Option 1: use the PSE first. Use the line below:
@@ -426,7 +449,8 @@ uint8_t Terminal(log_struct_t *logger)
   //
   // Option 3: use a predefined list (see terminal.c) of AIDs. Use this line:
   // fci = SelectFromAID(convention, TC1, NULL, logger);
-  fci = SelectFromAID(convention, TC1, NULL, logger);
+  if(fci == NULL)
+    fci = SelectFromAID(convention, TC1, NULL, logger);
   if(fci == NULL)
   {
     error = RET_EMV_SELECT;
@@ -456,7 +480,8 @@ uint8_t Terminal(log_struct_t *logger)
   // the logger size (see scd_logger.h).
   // offlineAuthData = (ByteArray*)malloc(sizeof(ByteArray));
   offlineAuthData = NULL;
-  tData = GetTransactionData(convention, TC1, appInfo, offlineAuthData, logger);
+  tData = GetTransactionDataCached(convention, TC1, &cacheEntry, fci, appInfo,
+      offlineAuthData, logger);
   if(tData == NULL)
   {
     error = RET_EMV_READ_DATA;
@@ -466,6 +491,15 @@ uint8_t Terminal(log_struct_t *logger)
   }
   ResetWDT();
 
+  // Time to read the card data, with or without the card cache
+  runTime = GetCounter() - runStart;
+  if(logger)
+    LogByte4(logger, LOG_TIME_CARD_DATA,
+        (runTime & 0xFF),
+        ((runTime >> 8) & 0xFF),
+        ((runTime >> 16) & 0xFF),
+        ((runTime >> 24) & 0xFF));
+
   // Get ATC
   atcData = GetDataObject(convention, TC1, PDO_ATC, logger);
   ResetWDT();
@@ -600,7 +634,7 @@ endtransaction:
   {
     LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
     fprintf(stderr, "%s\n", strLog);
-    WriteLogEEPROM(logger);
+    WriteLog(logger);
     ResetLogger(logger);
   }
 
@@ -645,23 +679,31 @@ uint8_t FilterGenerateAC(log_struct_t *logger)
     return RET_ERROR;
   }
 
-  InitLCD();
-  fprintf(stderr, "\n");
-  fprintf(stderr, "Filter  Gen AC\n");
-  _delay_ms(1000);
+  // with fast boot the LCD is set up later, before showing the amount
+  if(!fastBoot)
+  {
+    InitLCD();
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Filter  Gen AC\n");
+    _delay_ms(1000);
+  }
 
   DisableWDT();
   DisableTerminalResetInterrupt();
   DisableICCInsertInterrupt();
 
   // Expect the card to be inserted first and then wait a for terminal reset
-  fprintf(stderr, "%s\n", strInsertCard);
+  if(!fastBoot)
+    fprintf(stderr, "%s\n", strInsertCard);
   while(IsICCInserted() == 0);
-  fprintf(stderr, "%s\n", strCardInserted);
+  if(!fastBoot)
+    fprintf(stderr, "%s\n", strCardInserted);
   if(logger)
     LogByte1(logger, LOG_ICC_INSERTED, 0);
+  BootReady(logger);
   while(GetTerminalResetLine() != 0);
-  fprintf(stderr, "%s\n", strTerminalReset);
+  if(!fastBoot)
+    fprintf(stderr, "%s\n", strTerminalReset);
   if(logger)
     LogByte1(logger, LOG_TERMINAL_RST_LOW, 0);
 
@@ -796,6 +838,9 @@ uint8_t FilterGenerateAC(log_struct_t *logger)
       // more time from terminal (byte 0x60) as the default maximum
       // allowed response time is 9600 ETUs
 
+      // the LCD set up (fast boot) takes much less than this
+      FinishBoot();
+
       while(1){
         fprintf(stderr, "%s\n", strScroll);
         do{
@@ -898,10 +943,11 @@ uint8_t FilterGenerateAC(log_struct_t *logger)
 enderror:
   DisableWDT();
   DeactivateICC();
+  FinishBoot();
   if(logger)
   {
     LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
-    WriteLogEEPROM(logger);
+    WriteLog(logger);
     fprintf(stderr, "%s\n", strLog);
     ResetLogger(logger);
   }
@@ -927,7 +973,8 @@ uint8_t DummyPIN(log_struct_t *logger)
   ByteArray *pin = NULL;
   uint8_t error;
 
-  if(lcdAvailable)
+  // with fast boot the LCD is set up after the transaction
+  if(lcdAvailable && !fastBoot)
   {
     InitLCD();
     fprintf(stderr, "\n");
@@ -940,15 +987,16 @@ uint8_t DummyPIN(log_struct_t *logger)
   DisableICCInsertInterrupt();
 
   // Expect the card to be inserted first and then wait a for terminal reset
-  if(lcdAvailable)
+  if(lcdAvailable && !fastBoot)
     fprintf(stderr, "%s\n", strInsertCard);
   while(IsICCInserted() == 0);
-  if(lcdAvailable)
+  if(lcdAvailable && !fastBoot)
     fprintf(stderr, "Connect terminal\n");
   if(logger)
     LogByte1(logger, LOG_ICC_INSERTED, 0);
+  BootReady(logger);
   while(GetTerminalResetLine() != 0);
-  if(lcdAvailable)
+  if(lcdAvailable && !fastBoot)
     fprintf(stderr, "Working ...\n");
   if(logger)
     LogByte1(logger, LOG_TERMINAL_RST_LOW, 0);
@@ -1048,6 +1096,7 @@ uint8_t DummyPIN(log_struct_t *logger)
 enderror:
   FreeByteArray(pin);
   DeactivateICC();
+  FinishBoot();
   if((error == RET_TERMINAL_TIME_OUT) || (error == RET_TERMINAL_NO_CLOCK))
   {
     // these errors are logged and used as a signal to stop
@@ -1058,47 +1107,196 @@ enderror:
     LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
     if(lcdAvailable)
       fprintf(stderr, "%s\n", strLog);
-    WriteLogEEPROM(logger);
+    WriteLog(logger);
     ResetLogger(logger);
   }
 
   return error;
 }
 
+/// ForwardTransaction mode: read the records given by the AFL in advance
+#define FORWARD_PREFETCH 0x01
+
+/// ForwardTransaction mode: answer repeated commands from a session cache
+#define FORWARD_SESSION_CACHE 0x02
+
 /**
- * This function initiates the communication between ICC and
- * terminal and then forwards the commands and responses
- * from terminal to ICC and back until the terminal sends
- * a reset signal. 
- * 
- * This method can handle several consecutive terminal resets and they will be
- * all logged as part of the same transaction as long as the delay between them
- * is not too large.
+ * This method exchanges a command-response pair between terminal and ICC,
+ * as ExchangeData with LOG_DIR_TERMINAL, but answers the commands from a
+ * record cache or a session cache when possible.
  *
- * The log will be stored in EEPROM and can be retrieved using any programmer,
- * but I recommend using the Python tools.
+ * When a record cache is given and the ICC returns the response to
+ * GET PROCESSING OPTS (possibly after a GET RESPONSE), the records given
+ * by the AFL are read from the ICC before the response is forwarded to
+ * the terminal, which is kept waiting with NULL bytes (see PrefetchRecords
+ * and StartTerminalKeepAlive).
+ *
+ * When a session cache is given the responses to SELECT, READ RECORD and
+ * GET DATA (static data) are kept and returned again if the terminal
+ * repeats the command, e.g. after a warm reset (see GetSessionResponse).
+ *
+ * @param tInverse different than 0 if inverse convention is to be used
+ * with the terminal
+ * @param cInverse different than 0 if inverse convention is to be used
+ * with the ICC
+ * @param tTC1 byte TC1 of ATR used with terminal
+ * @param cTC1 byte TC1 of ATR received from ICC
+ * @param cache the record cache or NULL if records are not read in advance
+ * @param session the session cache or NULL if it is not used
+ * @param afterGPO non-zero while the response to GET PROCESSING OPTS
+ * is expected. Updated by this method.
+ * @param timeSaved the ICC time of the records answered from the cache is
+ * added to this value (1.088 ms units)
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return the command and response pair if successful. If this method
+ * is not successful then it will return NULL
+ */
+static CRP* ExchangeCachedData(
+    uint8_t tInverse,
+    uint8_t cInverse,
+    uint8_t tTC1,
+    uint8_t cTC1,
+    RECORDCache *cache,
+    SESSIONCache *session,
+    uint8_t *afterGPO,
+    uint32_t *timeSaved,
+    log_struct_t *logger)
+{
+  CRP *data;
+  APPINFO *appInfo;
+  uint16_t time;
+  uint8_t ins, result;
+
+  data = (CRP*)malloc(sizeof(CRP));
+  if(data == NULL)
+  {
+    if(logger)
+      LogByte1(logger, LOG_ERROR_MEMORY, 0);
+    return NULL;
+  }
+  data->response = NULL;
+
+  data->cmd = ReceiveT0Command(tInverse, tTC1, logger);
+  if(data->cmd == NULL)
+  {
+    free(data);
+    return NULL;
+  }
+
+  ins = data->cmd->cmdHeader->ins;
+  data->response = GetSessionResponse(session, data->cmd);
+  if(data->response != NULL)
+  {
+    if(logger)
+      LogByte1(logger, LOG_SESSION_CACHE_HIT, ins);
+    goto sendresponse;
+  }
+
+  data->response = GetPrefetchedRecord(cache, data->cmd->cmdHeader, &time);
+  if(data->response != NULL)
+  {
+    *timeSaved += time;
+    if(logger)
+      LogByte2(logger, LOG_PREFETCH_HIT,
+          data->cmd->cmdHeader->p1, data->cmd->cmdHeader->p2);
+    goto sendresponse;
+  }
+
+  StartTerminalKeepAlive(tInverse);
+
+  // a SELECT command does not depend on the previous selection
+  if(ins != 0xA4)
+    SyncSessionICC(session, cInverse, cTC1, NULL);
+
+  if(SendT0Command(cInverse, cTC1, data->cmd, NULL))
+  {
+    StopTerminalKeepAlive(logger);
+    goto enderror;
+  }
+
+  if(ins == 0xA8)
+    *afterGPO = 1;
+  else if(ins != 0xC0)
+    *afterGPO = 0;
+
+  data->response = ReceiveT0Response(cInverse, data->cmd->cmdHeader, NULL);
+  if(data->response != NULL && cache != NULL && *afterGPO &&
+      data->response->repStatus->sw1 == 0x90 &&
+      data->response->repStatus->sw2 == 0)
+  {
+    *afterGPO = 0;
+    appInfo = ParseApplicationInfo(
+        data->response->repData, data->response->lenData);
+    if(appInfo != NULL)
+    {
+      PrefetchRecords(cache, appInfo, cInverse, cTC1, logger);
+      FreeAPPINFO(appInfo);
+    }
+  }
+  StopTerminalKeepAlive(logger);
+  if(data->response == NULL)
+    goto enderror;
+
+  result = AddSessionResponse(session, data->cmd, data->response);
+  if(logger && result == SESSION_MISS)
+    LogByte1(logger, LOG_SESSION_CACHE_MISS, ins);
+  else if(logger && result == SESSION_CLEARED)
+    LogByte1(logger, LOG_SESSION_CACHE_CLEAR, ins);
+
+sendresponse:
+  if(SendT0Response(tInverse, data->cmd->cmdHeader, data->response, logger))
+    goto enderror;
+
+  return data;
+
+enderror:
+  FreeCRP(data);
+  return NULL;
+}
+
+/**
+ * Implements ForwardData, ForwardDataPrefetch and ForwardDataCached
  *
+ * @param mode zero to forward all the commands or a combination of
+ * FORWARD_PREFETCH and FORWARD_SESSION_CACHE
  * @param logger the log structure or NULL if log is not desired
  * @return 0 if successful, non-zero otherwise. See scd_values.h for details.
  */
-uint8_t ForwardData(log_struct_t *logger)
+static uint8_t ForwardTransaction(uint8_t mode, log_struct_t *logger)
 {
   uint8_t t_inverse = 0, t_TC1 = 0, error = 0;
   uint8_t cInverse, cProto, cTC1, cTA3, cTB3;
+  uint8_t afterGPO = 0;
+  uint32_t timeSaved = 0;
+  RECORDCache cache;
+  SESSIONCache session;
+  txn_summary_state_t summary;
   CRP *crp = NULL;
 
+  cache.count = 0;
+  cache.bytes = 0;
+  session.count = 0;
+  session.bytes = 0;
+  ResetSessionContext(&session);
+
   // Visual signal for this app
   Led1On();
   Led2Off();
   Led3Off();
   Led4Off();
 
-  if(lcdAvailable)
+  // with fast boot the LCD is set up after the transaction
+  if(lcdAvailable && !fastBoot)
   {
     if(GetLCDState() == 0)
       InitLCD();
     fprintf(stderr, "\n");
-    fprintf(stderr, "Forward data\n");
+    if(mode & FORWARD_PREFETCH)
+      fprintf(stderr, "Forward prefetch\n");
+    else if(mode & FORWARD_SESSION_CACHE)
+      fprintf(stderr, "Forward cached\n");
+    else
+      fprintf(stderr, "Forward data\n");
     _delay_ms(500);
   }
 
@@ -1107,15 +1305,16 @@ uint8_t ForwardData(log_struct_t *logger)
   DisableICCInsertInterrupt();
 
   // Expect the card to be inserted first and then wait a for terminal reset
-  if(lcdAvailable)
+  if(lcdAvailable && !fastBoot)
     fprintf(stderr, "%s\n", strInsertCard);
   while(IsICCInserted() == 0);
-  if(lcdAvailable)
+  if(lcdAvailable && !fastBoot)
     fprintf(stderr, "Connect terminal\n");
   if(logger)
     LogByte1(logger, LOG_ICC_INSERTED, 0);
+  BootReady(logger);
   while(GetTerminalResetLine() != 0);
-  if(lcdAvailable)
+  if(lcdAvailable && !fastBoot)
     fprintf(stderr, "Working ...\n");
   if(logger)
     LogByte1(logger, LOG_TERMINAL_RST_LOW, 0);
@@ -1125,6 +1324,10 @@ uint8_t ForwardData(log_struct_t *logger)
   // communication several times (e.g. warm reset).
   while(1) // external while
   {
+    // the session ends when the card is removed
+    if(!IsICCInserted())
+      ClearSessionCache(&session);
+
     error = InitSCDTransaction(t_inverse, t_TC1, &cInverse,
         &cProto, &cTC1, &cTA3, &cTB3, logger);
     if(error)
@@ -1133,20 +1336,40 @@ uint8_t ForwardData(log_struct_t *logger)
     // update transaction counter
     nCounter++;
 
+    // the records read before the ICC reset are not valid anymore
+    ClearRecordCache(&cache);
+    afterGPO = 0;
+
+    // the session responses remain valid but the ICC has no selection
+    ResetSessionContext(&session);
+    StartTransactionSummary(&summary, logger);
+
     // Continually exchange commands until a terminal reset or timeout
     while(1) // internal while
     {
-      crp = ExchangeCompleteData(
-          t_inverse, cInverse, t_TC1, cTC1, LOG_DIR_TERMINAL, logger);
+      if(mode)
+        crp = ExchangeCachedData(t_inverse, cInverse, t_TC1, cTC1,
+            (mode & FORWARD_PREFETCH) ? &cache : NULL,
+            (mode & FORWARD_SESSION_CACHE) ? &session : NULL,
+            &afterGPO, &timeSaved, logger);
+      else
+        crp = ExchangeCompleteData(
+            t_inverse, cInverse, t_TC1, cTC1, LOG_DIR_TERMINAL, logger);
       if(crp == NULL)
         break;
+      UpdateTransactionSummary(&summary, crp);
       FreeCRP(crp);
     } // end internal while
+
+    LogTransactionSummary(&summary, logger);
   } // end external while
   error = 0;
 
 enderror:
   DeactivateICC();
+  ClearRecordCache(&cache);
+  ClearSessionCache(&session);
+  FinishBoot();
   if((error == RET_TERMINAL_TIME_OUT) || (error == RET_TERMINAL_NO_CLOCK))
   {
     // these errors are logged and used as a signal to stop
@@ -1154,10 +1377,16 @@ enderror:
   }
   if(logger)
   {
+    if(mode & FORWARD_PREFETCH)
+      LogByte4(logger, LOG_TIME_PREFETCH_SAVED,
+          (timeSaved & 0xFF),
+          ((timeSaved >> 8) & 0xFF),
+          ((timeSaved >> 16) & 0xFF),
+          ((timeSaved >> 24) & 0xFF));
     LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
     if(lcdAvailable)
       fprintf(stderr, "%s\n", strLog);
-    WriteLogEEPROM(logger);
+    WriteLog(logger);
     ResetLogger(logger);
   }
 
@@ -1166,7 +1395,72 @@ enderror:
 
 
 /**
- * This method writes to EEPROM the log of the last transaction.
+ * This function initiates the communication between ICC and
+ * terminal and then forwards the commands and responses
+ * from terminal to ICC and back until the terminal sends
+ * a reset signal. 
+ * 
+ * This method can handle several consecutive terminal resets and they will be
+ * all logged as part of the same transaction as long as the delay between them
+ * is not too large.
+ *
+ * The log will be stored in EEPROM and can be retrieved using any programmer,
+ * but I recommend using the Python tools.
+ *
+ * With the log policy LOG_POLICY_SUMMARY only a summary of each ICC session
+ * is logged (see scd_summary.h), taken from the commands and responses as
+ * they are forwarded.
+ *
+ * @param logger the log structure or NULL if log is not desired
+ * @return 0 if successful, non-zero otherwise. See scd_values.h for details.
+ */
+uint8_t ForwardData(log_struct_t *logger)
+{
+  return ForwardTransaction(0, logger);
+}
+
+/**
+ * This function is similar to ForwardData but the records given by the
+ * AFL are read from the ICC when it returns the response to GET PROCESSING
+ * OPTS, and the READ RECORD commands from the terminal are then answered
+ * without waiting for the ICC.
+ *
+ * The prefetched records and the times when they were read are logged,
+ * together with the total ICC time removed from the READ RECORD
+ * exchanges at the end of the transaction (LOG_TIME_PREFETCH_SAVED).
+ *
+ * @param logger the log structure or NULL if log is not desired
+ * @return 0 if successful, non-zero otherwise. See scd_values.h for details.
+ */
+uint8_t ForwardDataPrefetch(log_struct_t *logger)
+{
+  return ForwardTransaction(FORWARD_PREFETCH, logger);
+}
+
+/**
+ * This function is similar to ForwardData but the responses of the ICC to
+ * SELECT, READ RECORD and GET DATA (static data objects) are kept during
+ * the card session and returned to the terminal without sending the
+ * command to the ICC when the terminal repeats it, e.g. after a warm reset.
+ *
+ * The cache is emptied when the card is removed or when the terminal sends
+ * a command that may change the state of the ICC (e.g. GET PROCESSING
+ * OPTS, GENERATE AC, VERIFY). The cache hits, misses and clears are logged.
+ * Since the ICC does not see the repeated commands this mode is not
+ * suitable for forensic captures, and so it is not used by ForwardData.
+ *
+ * @param logger the log structure or NULL if log is not desired
+ * @return 0 if successful, non-zero otherwise. See scd_values.h for details.
+ */
+uint8_t ForwardDataCached(log_struct_t *logger)
+{
+  return ForwardTransaction(FORWARD_SESSION_CACHE, logger);
+}
+
+
+/**
+ * This method writes the log of the last transaction to the selected
+ * log storage (the EEPROM by default, see scd_logsink.h).
  * The log is done either while monitoring a card-terminal
  * transaction or by enabling logging while running  other application
  * (e.g. the Terminal() application).
@@ -1174,11 +1468,8 @@ enderror:
  * @param logger the log structure. If this is NULL the function
  * will exit promptly.
  */
-void WriteLogEEPROM(log_struct_t *logger)
+void WriteLog(log_struct_t *logger)
 {
-  uint16_t addrStream, write_size;
-  uint8_t addrHi, addrLo;
-
   if(logger == NULL)
     return;
 
@@ -1188,32 +1479,54 @@ void WriteLogEEPROM(log_struct_t *logger)
   Led3On();
   Led4Off();
 
-  // Update transaction counter in case it was modified
-  eeprom_write_byte((uint8_t*)EEPROM_COUNTER, nCounter);
+  // Update transaction counter in case it was modified. It is saved
+  // with the log pointer, or below if there is no log to save
+  scdMeta.counter = nCounter;
 
-  // Get current transaction log pointer
-  addrHi = eeprom_read_byte((uint8_t*)EEPROM_TLOG_POINTER_HI);
-  addrLo = eeprom_read_byte((uint8_t*)EEPROM_TLOG_POINTER_LO);
-  addrStream = ((addrHi << 8) | addrLo);
+  // copy all possible data from log structure to the log storage
+  SaveLog(logger);
+  CommitSCDMeta();
+
+  Led3Off();
+}
 
-  if(logger->position > 0 && addrStream < EEPROM_MAX_ADDRESS)
+/**
+ * USB log drive application
+ *
+ * The SCD enumerates as a read-only USB Mass Storage device containing
+ * the EEPROM image and one raw and one decoded file per log session
+ * (see scd_logvol.c), so the logs can be copied with any file manager.
+ *
+ * This function never returns, the SCD must be reset to leave this mode.
+ *
+ * @return this function does not return
+ */
+uint8_t LogDrive()
+{
+  if(lcdAvailable)
   {
-    // copy all possible data from log structure to EEPROM
-    if(EEPROM_MAX_ADDRESS - addrStream < logger->position)
-      write_size = EEPROM_MAX_ADDRESS - addrStream;
-    else
-      write_size = logger->position;
-    eeprom_write_block(logger->log_buffer, (void*)addrStream, write_size);
-    addrStream += write_size;
-
-    // update log address
-    addrHi = (uint8_t)((addrStream >> 8) & 0x00FF);
-    addrLo = (uint8_t)(addrStream & 0x00FF);
-    eeprom_write_byte((uint8_t*)EEPROM_TLOG_POINTER_HI, addrHi);
-    eeprom_write_byte((uint8_t*)EEPROM_TLOG_POINTER_LO, addrLo);
+    if(GetLCDState() == 0)
+      InitLCD();
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Set up  drive\n");
   }
 
-  Led3Off();
-}
+  InitLogVolume();
+  usbMassStorageMode = 1;
+  power_usb_enable();
+  SetupUSBHardware();
+  sei();
+
+  // Signal that the drive is ready
+  Led1On();
+  Led2On();
+  Led3On();
+  Led4On();
+  if(lcdAvailable)
+    fprintf(stderr, "Drive   ready\n");
 
+  for (;;)
+    MassStorage_Task();
 
+  return 0;
+}
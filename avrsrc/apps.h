@@ -62,9 +62,15 @@
 #define APP_DUMMY_PIN 0x05
 /// Erase EEPROM
 #define APP_ERASE_EEPROM 0x06
+/// Export the logs as a USB drive
+#define APP_LOG_DRIVE 0x07
+/// Forward data, reading the records in advance
+#define APP_FORWARD_PREFETCH 0x08
+/// Forward data, answering repeated commands from a session cache
+#define APP_FORWARD_CACHED 0x09
 
 /// Number of existing applications
-#define APPLICATION_COUNT 6
+#define APPLICATION_COUNT 9
 
 /// Application strings shown in the user menu
 // These should be in the order of their IDs
@@ -75,6 +81,9 @@ static char* appStrings[] = {
     "Terminal",
     "Dummy PIN",
     "Erase   EEPROM",
+    "USB log drive",
+    "Forward prefetch",
+    "Forward cached",
 };
 
 
@@ -86,13 +95,15 @@ extern uint8_t lcdAvailable;			        // non-zero if LCD is working
 extern uint8_t nCounter;			            // number of transactions
 extern uint8_t selected;                        // ID of application selected
 extern uint8_t bootkey;                         // used for bootloader jump
+extern uint8_t fastBoot;                        // non-zero until FinishBoot
 extern volatile uint32_t usCounter;			    // micro-second counter
 
 /// Virtual Serial Port (send/receive command strings)
 uint8_t VirtualSerial();
 
 /// Serial Port interface (send/receive command strings)
-uint8_t SerialInterface();
+uint8_t SerialInterface(uint16_t baudUBRR, uint8_t doubleSpeed,
+        log_struct_t *logger);
 
 /// Clears the contents of the EEPROM
 void EraseEEPROM();
@@ -103,9 +114,21 @@ void ResetEEPROM();
 /// Jump to bootloader
 void RunBootloader();
 
+/// Log the start up time, when the application is ready for the terminal
+void BootReady(log_struct_t *logger);
+
+/// Complete the start up deferred for the terminal applications
+void FinishBoot();
+
 /// Forward commands between terminal and ICC through the ICC
 uint8_t ForwardData(log_struct_t *logger);
 
+/// Forward commands, answering READ RECORD with records read in advance
+uint8_t ForwardDataPrefetch(log_struct_t *logger);
+
+/// Forward commands, answering repeated commands from a session cache
+uint8_t ForwardDataCached(log_struct_t *logger);
+
 /// Filter Generate AC command until user accepts or denies the transaction
 uint8_t FilterGenerateAC(log_struct_t *logger);
 
@@ -115,8 +138,11 @@ uint8_t DummyPIN(log_struct_t *logger);
 /// Run the terminal application
 uint8_t Terminal(log_struct_t *logger);
 
-/// Write the log of the last transaction to EEPROM
-void WriteLogEEPROM(log_struct_t *logger);
+/// Write the log of the last transaction to the log storage
+void WriteLog(log_struct_t *logger);
+
+/// Export the logs as a USB Mass Storage drive
+uint8_t LogDrive();
 
 #endif // _APPS_H_
 
@@ -45,11 +45,46 @@
 #include "emv_values.h"
 #include "scd_hal.h"
 #include "scd_io.h"
+#include "scd_profile.h"
 #include "scd_values.h"
 #include "utils.h"
 
 #define DEBUG 1   // Set DEBUG to 1 to enable debug code
 
+/* Terminal keep-alive state, see StartTerminalKeepAlive */
+static uint8_t keepAliveWI = EMV_DEFAULT_WI;  // WI announced to terminal
+static uint8_t keepAliveOn;                   // non-zero while active
+static uint8_t keepAliveInverse;              // terminal convention
+static uint32_t keepAliveEtus;                // ETUs since last byte
+static uint8_t keepAliveCount;                // NULL bytes sent
+
+/* ATR received at the last reset of the ICC, see GetICCATR */
+static uint8_t iccATR[ICC_ATR_MAX_LEN];
+static uint8_t iccATRLen;
+
+
+/**
+ * Keeps the ATR bytes returned by GetATRICC in the order they were
+ * received, for GetICCATR.
+ */
+static void KeepICCATR(uint8_t inverse_convention, uint8_t proto,
+    uint8_t icc_T0, uint16_t atr_selection, const uint8_t *atr_bytes,
+    uint8_t atr_tck)
+{
+  uint8_t i;
+
+  iccATRLen = 0;
+  iccATR[iccATRLen++] = inverse_convention ? 0x3F : 0x3B;
+  iccATR[iccATRLen++] = icc_T0;
+  for(i = 0; i < 16; i++)
+    if(atr_selection & (1 << (15 - i)))
+      iccATR[iccATRLen++] = atr_bytes[i];
+  for(i = 0; i < (icc_T0 & 0x0F); i++)
+    iccATR[iccATRLen++] = atr_bytes[16 + i];
+  if(proto != 0)
+    iccATR[iccATRLen++] = atr_tck;
+}
+
 
 /**
  * Starts activation sequence for ICC
@@ -79,6 +114,8 @@ uint8_t ResetICC(
   uint8_t icc_T0, icc_TS;
   uint8_t error;
 
+  iccATRLen = 0;
+
   // Activate the ICC
   error = ActivateICC(warm);
   if(error)
@@ -124,6 +161,9 @@ uint8_t ResetICC(
   *TA3 = atr_bytes[8];
   *TB3 = atr_bytes[9];
 
+  KeepICCATR(*inverse_convention, *proto, icc_T0, atr_selection,
+      atr_bytes, atr_tck);
+
   return 0;
 
 enderror:
@@ -135,6 +175,26 @@ enderror:
 }
 
 
+/**
+ * Returns the ATR received from the ICC at the last successful reset
+ * (see ResetICC and InitSCDTransaction), starting with TS. For inverse
+ * convention TS is given as 0x3F, as on the line, and the other bytes are
+ * decoded.
+ *
+ * @param atr a user supplied buffer of ICC_ATR_MAX_LEN bytes which will
+ * contain the ATR
+ * @return the length of the ATR or zero if the last reset failed
+ */
+uint8_t GetICCATR(uint8_t *atr)
+{
+  if(atr == NULL)
+    return 0;
+
+  memcpy(atr, iccATR, iccATRLen);
+  return iccATRLen;
+}
+
+
 /* T=0 protocol functions */
 /* All commands are received from the terminal and sent to the ICC */
 /* All responses are received from the ICC and sent to the terminal */
@@ -168,6 +228,9 @@ void SendT0ATRTerminal(
       LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, 0x3B);
   }
 
+  // this ATR has no TC2 so the default work waiting time applies
+  SetTerminalWorkWaitingIndex(EMV_DEFAULT_WI);
+
   LoopTerminalETU(250);
   SendByteTerminalNoParity(0x60, inverse_convention);
   if(logger)
@@ -183,6 +246,165 @@ void SendT0ATRTerminal(
   LoopTerminalETU(2);
 }
 
+/**
+ * Returns the work waiting time integer (WI) from the TC2 byte of an ATR.
+ *
+ * @param atr the ATR bytes, starting with the format byte T0 (i.e. without
+ * the initial character TS)
+ * @param len the number of bytes in atr
+ * @return the WI value given by TC2 or EMV_DEFAULT_WI if TC2 is not present
+ */
+uint8_t GetATRWorkWaitingIndex(const uint8_t *atr, uint8_t len)
+{
+  uint8_t pos, y;
+
+  if(atr == NULL || len == 0)
+    return EMV_DEFAULT_WI;
+
+  // skip TA1, TB1 and TC1 as given by T0
+  y = atr[0];
+  pos = 1;
+  if(y & 0x10) pos++;
+  if(y & 0x20) pos++;
+  if(y & 0x40) pos++;
+  if((y & 0x80) == 0 || pos >= len)
+    return EMV_DEFAULT_WI;
+
+  // skip TA2 and TB2 as given by TD1
+  y = atr[pos++];
+  if(y & 0x10) pos++;
+  if(y & 0x20) pos++;
+  if((y & 0x40) == 0 || pos >= len || atr[pos] == 0)
+    return EMV_DEFAULT_WI;
+
+  return atr[pos];
+}
+
+/**
+ * Sets the work waiting time integer (WI) announced to the terminal in
+ * the ATR. This is used by the terminal keep-alive to determine when
+ * to send the NULL procedure byte (0x60).
+ *
+ * @param WI the work waiting time integer (1 to 255)
+ */
+void SetTerminalWorkWaitingIndex(uint8_t WI)
+{
+  if(WI == 0)
+    WI = EMV_DEFAULT_WI;
+  keepAliveWI = WI;
+}
+
+/**
+ * Starts the terminal keep-alive. While active, PollTerminalKeepAlive
+ * sends the NULL procedure byte (0x60) to the terminal before its work
+ * waiting time (960 * WI ETUs) expires, so that slow responses from the
+ * ICC or the USB host do not cause a timeout in the terminal.
+ *
+ * Since the SCD may have already spent some time (e.g. sending the command
+ * to the ICC) when the keep-alive is started, the NULL byte is sent after
+ * half of the work waiting time (see EMV_KEEP_ALIVE_ETUS).
+ *
+ * @param tInverse different than 0 if inverse convention is to be used
+ * with the terminal
+ */
+void StartTerminalKeepAlive(uint8_t tInverse)
+{
+  keepAliveInverse = tInverse;
+  keepAliveEtus = 0;
+  keepAliveCount = 0;
+  keepAliveOn = 1;
+  StartTerminalETUCount();
+}
+
+/**
+ * Counts the elapsed terminal ETUs of the keep-alive
+ *
+ * @return non-zero if a NULL byte should be sent now, zero otherwise
+ */
+static uint8_t KeepAliveDue()
+{
+  if(!keepAliveOn || !TerminalETUElapsed())
+    return 0;
+
+  keepAliveEtus++;
+
+  return (keepAliveEtus >= EMV_KEEP_ALIVE_ETUS(keepAliveWI));
+}
+
+/**
+ * Counts the elapsed terminal ETUs and sends the NULL procedure byte to
+ * the terminal when needed. This method does not block, except while
+ * sending the NULL byte (about 12 ETUs). It must be called at least once
+ * every terminal ETU while waiting for the ICC or host.
+ *
+ * @return non-zero if a NULL byte was sent, zero otherwise
+ */
+uint8_t PollTerminalKeepAlive()
+{
+  if(!KeepAliveDue())
+    return 0;
+
+  SendTerminalKeepAlive();
+
+  return 1;
+}
+
+/**
+ * Sends a NULL byte to the terminal now if the terminal keep-alive is
+ * active. This should be used after long exchanges with the ICC, during
+ * which the terminal ETUs are not counted by PollTerminalKeepAlive.
+ */
+void SendTerminalKeepAlive()
+{
+  if(!keepAliveOn)
+    return;
+
+  SendByteTerminalNoParity(0x60, keepAliveInverse);
+  if(keepAliveCount < 0xFF)
+    keepAliveCount++;
+  keepAliveEtus = 0;
+  StartTerminalETUCount();
+}
+
+/**
+ * Stops the terminal keep-alive and logs the number of NULL bytes sent
+ * since StartTerminalKeepAlive, if any.
+ *
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return the number of NULL bytes sent to the terminal
+ */
+uint8_t StopTerminalKeepAlive(log_struct_t *logger)
+{
+  keepAliveOn = 0;
+  if(logger && keepAliveCount)
+    LogByte1(logger, LOG_TERMINAL_KEEP_ALIVE, keepAliveCount);
+
+  return keepAliveCount;
+}
+
+/**
+ * Waits for the ICC to start sending a byte while the terminal
+ * keep-alive is active. Returns immediately if the keep-alive is not
+ * active, in which case the following read from the ICC will block.
+ *
+ * The ICC line is checked just before each NULL byte, which is not sent
+ * if the ICC started its reply. The line is not watched while a NULL
+ * byte is sent (12 terminal ETUs, about 1.1 ms at 4 MHz), so a byte
+ * that the ICC starts in that time is received wrongly. This can only
+ * happen once every EMV_KEEP_ALIVE_ETUS terminal ETUs.
+ */
+static void WaitForICCKeepAlive()
+{
+  if(!keepAliveOn)
+    return;
+
+  while(GetICCIOLine() != 0)
+  {
+    if(KeepAliveDue() && GetICCIOLine() != 0)
+      SendTerminalKeepAlive();
+  }
+}
+
 /**
  * Receives the ATR from ICC after a successful activation
  * 
@@ -846,6 +1068,9 @@ enderror:
  * of the first byte (TS) which is dependent on the given parameter (t_inverse),
  * since this will be sent before retrieving the corresponding ICC value.
  *
+ * The work waiting time of the terminal keep-alive is set from the TC2
+ * byte of the ICC ATR (see SetTerminalWorkWaitingIndex).
+ *
  * If the function returs 0 (success) then both the terminal
  * and the ICC should be in a good state, where the terminal
  * is about to send the first command and the ICC is waiting
@@ -919,6 +1144,7 @@ uint8_t InitSCDTransaction(uint8_t t_inverse, uint8_t t_TC1,
 
   // Wait for ATR from ICC for a maximum of 42000 clock cycles + 40 ms
   // this number is based on the assembler of this function
+  iccATRLen = 0;
   if(WaitForICCData(50000))	
   {
     error = RET_ERROR; 				// May be changed with a warm reset
@@ -942,6 +1168,8 @@ uint8_t InitSCDTransaction(uint8_t t_inverse, uint8_t t_TC1,
   *TA3 = atr_bytes[8];
   *TB3 = atr_bytes[9];
   history = icc_T0 & 0x0F;
+  KeepICCATR(*inverse_convention, *proto, icc_T0, atr_selection,
+      atr_bytes, atr_tck);
 
   // Send the rest of the ATR to the terminal
   SendByteTerminalNoParity(icc_T0, t_inverse);
@@ -968,6 +1196,10 @@ uint8_t InitSCDTransaction(uint8_t t_inverse, uint8_t t_TC1,
     LoopTerminalETU(2);
   }
 
+  // the terminal now uses the work waiting time of the ICC ATR (TC2, zero
+  // if not present, i.e. the default), so the keep-alive must use it too
+  SetTerminalWorkWaitingIndex(atr_bytes[6]);
+
   error = 0;
 
 enderror:
@@ -1104,7 +1336,8 @@ EMVCommandHeader* ReceiveT0CmdHeader(
     uint8_t TC1,
     log_struct_t *logger)
 {
-  uint8_t tdelay, result;
+  uint8_t tdelay, result, i, k;
+  uint8_t header[5];
   EMVCommandHeader *cmdHeader;
 
   cmdHeader = (EMVCommandHeader*)malloc(sizeof(EMVCommandHeader));
@@ -1117,44 +1350,24 @@ EMVCommandHeader* ReceiveT0CmdHeader(
 
   tdelay = 1 + TC1;
 
-  result = GetByteTerminalParity(
-      inverse_convention, &(cmdHeader->cla), MAX_WAIT_TERMINAL_CMD);
-  if(result != 0)
-    goto enderror;
-  if(logger)
-    LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdHeader->cla);
-  LoopTerminalETU(tdelay);	
-
-  result = GetByteTerminalParity(
-      inverse_convention, &(cmdHeader->ins), MAX_WAIT_TERMINAL_CMD);
-  if(result != 0)
-    goto enderror;
-  if(logger)
-    LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdHeader->ins);
-  LoopTerminalETU(tdelay);	
-
-  result = GetByteTerminalParity(
-      inverse_convention, &(cmdHeader->p1), MAX_WAIT_TERMINAL_CMD);
-  if(result != 0)
-    goto enderror;
-  if(logger)
-    LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdHeader->p1);
-  LoopTerminalETU(tdelay);	
-
-  result = GetByteTerminalParity(
-      inverse_convention, &(cmdHeader->p2), MAX_WAIT_TERMINAL_CMD);
-  if(result != 0)
-    goto enderror;
-  if(logger)
-    LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdHeader->p2);
-  LoopTerminalETU(tdelay);	
+  for(i = 0; i < 5; i++)
+  {
+    if(i > 0)
+      LoopTerminalETU(tdelay);
+    result = GetByteTerminalParity(
+        inverse_convention, &header[i], MAX_WAIT_TERMINAL_CMD);
+    if(result != 0)
+      goto enderror;
+  }
 
-  result = GetByteTerminalParity(
-      inverse_convention, &(cmdHeader->p3), MAX_WAIT_TERMINAL_CMD);
-  if(result != 0)
-    goto enderror;
+  cmdHeader->cla = header[0];
+  cmdHeader->ins = header[1];
+  cmdHeader->p1 = header[2];
+  cmdHeader->p2 = header[3];
+  cmdHeader->p3 = header[4];
   if(logger)
-    LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdHeader->p3);
+    LogCommandHeader(logger, LOG_BYTE_FROM_TERMINAL, cmdHeader->cla,
+        cmdHeader->ins, cmdHeader->p1, cmdHeader->p2, cmdHeader->p3);
 
   return cmdHeader;
 
@@ -1162,6 +1375,10 @@ enderror:
   free(cmdHeader);
   if(logger)
   {
+    // the header is incomplete, so it is not given to LogCommandHeader,
+    // but the bytes received (e.g. before a terminal reset) are logged
+    for(k = 0; k < i; k++)
+      LogByte1(logger, LOG_BYTE_FROM_TERMINAL, header[k]);
     LogCurrentTime(logger);
 
     if(result == RET_TERMINAL_RESET_LOW)
@@ -1224,7 +1441,7 @@ uint8_t* ReceiveT0CmdData(
         inverse_convention, &(cmdData[i]), MAX_WAIT_TERMINAL_CMD);
     if(result != 0)
       goto enderror;
-    if(logger)
+    if(LogAPDU(logger, i + 1))
       LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdData[i]);
     LoopTerminalETU(tdelay);	
   }
@@ -1234,7 +1451,7 @@ uint8_t* ReceiveT0CmdData(
       inverse_convention, &(cmdData[i]), MAX_WAIT_TERMINAL_CMD);
   if(result != 0)
     goto enderror;
-  if(logger)
+  if(LogAPDU(logger, i + 1))
     LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdData[i]);
 
   return cmdData;	
@@ -1280,6 +1497,7 @@ CAPDU* ReceiveT0Command(
 {
   uint8_t tdelay, tmp;
   CAPDU *cmd;
+  PROFILE_FUNCTION(PROFILE_RECEIVE_T0_COMMAND);
 
   tdelay = 1 + TC1;
 
@@ -1323,7 +1541,7 @@ CAPDU* ReceiveT0Command(
       LogByte1(logger, LOG_TERMINAL_ERROR_SEND, 0);
     return NULL;
   }
-  if(logger)
+  if(LogAPDU(logger, 0))
     LogByte1(logger, LOG_BYTE_TO_TERMINAL, cmd->cmdHeader->ins);
 
   LoopTerminalETU(tdelay);	
@@ -1370,8 +1588,6 @@ uint8_t SendT0CmdHeader(
       LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
     return RET_ERROR;
   }
-  if(logger)
-    LogByte1(logger, LOG_BYTE_TO_ICC, cmdHeader->cla);
   LoopICCETU(tdelay);	
 
   if(SendByteICCParity(cmdHeader->ins, inverse_convention))
@@ -1380,8 +1596,6 @@ uint8_t SendT0CmdHeader(
       LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
     return RET_ERROR;
   }
-  if(logger)
-    LogByte1(logger, LOG_BYTE_TO_ICC, cmdHeader->ins);
   LoopICCETU(tdelay);	
 
   if(SendByteICCParity(cmdHeader->p1, inverse_convention))
@@ -1390,8 +1604,6 @@ uint8_t SendT0CmdHeader(
       LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
     return RET_ERROR;
   }
-  if(logger)
-    LogByte1(logger, LOG_BYTE_TO_ICC, cmdHeader->p1);
   LoopICCETU(tdelay);	
 
   if(SendByteICCParity(cmdHeader->p2, inverse_convention))
@@ -1400,8 +1612,6 @@ uint8_t SendT0CmdHeader(
       LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
     return RET_ERROR;
   }
-  if(logger)
-    LogByte1(logger, LOG_BYTE_TO_ICC, cmdHeader->p2);
   LoopICCETU(tdelay);	
 
   if(SendByteICCParity(cmdHeader->p3, inverse_convention))
@@ -1411,7 +1621,8 @@ uint8_t SendT0CmdHeader(
     return RET_ERROR;
   }
   if(logger)
-    LogByte1(logger, LOG_BYTE_TO_ICC, cmdHeader->p3);
+    LogCommandHeader(logger, LOG_BYTE_TO_ICC, cmdHeader->cla,
+        cmdHeader->ins, cmdHeader->p1, cmdHeader->p2, cmdHeader->p3);
 
   return 0;
 }
@@ -1449,7 +1660,7 @@ uint8_t SendT0CmdData(
         LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
       return RET_ERROR;	
     }
-    if(logger)
+    if(LogAPDU(logger, i + 1))
       LogByte1(logger, LOG_BYTE_TO_ICC, cmdData[i]);
     LoopICCETU(tdelay);	
   }
@@ -1461,7 +1672,7 @@ uint8_t SendT0CmdData(
       LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
     return RET_ERROR;	
   }
-  if(logger)
+  if(LogAPDU(logger, i + 1))
     LogByte1(logger, LOG_BYTE_TO_ICC, cmdData[i]);
 
   return 0;
@@ -1512,7 +1723,7 @@ uint8_t SendT0Command(
       LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
     return RET_ERROR;
   }
-  if(logger)
+  if(LogAPDU(logger, 0))
     LogByte1(logger, LOG_BYTE_FROM_ICC, tmp);
 
   while(tmp == SW1_MORE_TIME)
@@ -1524,13 +1735,13 @@ uint8_t SendT0Command(
         LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
       return RET_ERROR;
     }
-    if(logger)
+    if(LogAPDU(logger, 0))
       LogByte1(logger, LOG_BYTE_FROM_ICC, tmp);
   }
 
   // if we don't get INS or ~INS then
   // get another byte and then exit, operation unexpected
-  if((tmp != cmd->cmdHeader->ins) && (tmp != ~(cmd->cmdHeader->ins)))
+  if((tmp != cmd->cmdHeader->ins) && (tmp != (uint8_t)~(cmd->cmdHeader->ins)))
   {
     if(GetByteICCParity(inverse_convention, &tmp2))
     {
@@ -1538,7 +1749,7 @@ uint8_t SendT0Command(
         LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
       return RET_ERROR;
     }
-    if(logger)
+    if(LogAPDU(logger, 0))
       LogByte1(logger, LOG_BYTE_FROM_ICC, tmp2);
     return RET_ERR_CHECK; 
   }
@@ -1556,7 +1767,7 @@ uint8_t SendT0Command(
         LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
       return RET_ERROR;
     }
-    if(logger)
+    if(LogAPDU(logger, i))
       LogByte1(logger, LOG_BYTE_TO_ICC, cmd->cmdData[i-1]);
     if(i < cmd->lenData)
       LoopICCETU(6);
@@ -1571,7 +1782,7 @@ uint8_t SendT0Command(
         LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
       return RET_ERROR;
     }
-    if(logger)
+    if(LogAPDU(logger, 0))
       LogByte1(logger, LOG_BYTE_FROM_ICC, tmp);
     LoopICCETU(6);
 
@@ -1583,7 +1794,7 @@ uint8_t SendT0Command(
           LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
         return RET_ERROR;
       }
-      if(logger)
+      if(LogAPDU(logger, i))
         LogByte1(logger, LOG_BYTE_TO_ICC, cmd->cmdData[i-1]);
       if(i < cmd->lenData)
         LoopICCETU(6);
@@ -1599,7 +1810,7 @@ uint8_t SendT0Command(
         LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
       return RET_ERROR;
     }
-    if(logger)
+    if(LogAPDU(logger, i + 1))
       LogByte1(logger, LOG_BYTE_TO_ICC, cmd->cmdData[i]);
     LoopICCETU(tdelay);
   }
@@ -1611,7 +1822,7 @@ uint8_t SendT0Command(
         LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
       return RET_ERROR;
     }
-    if(logger)
+    if(LogAPDU(logger, i + 1))
       LogByte1(logger, LOG_BYTE_TO_ICC, cmd->cmdData[i]);
   }
 
@@ -1677,7 +1888,8 @@ CAPDU* ForwardCommand(
  */
 uint8_t* SerializeCommand(CAPDU *cmd, uint32_t *len)
 {
-  uint8_t *stream, i = 0;
+  uint8_t *stream;
+  uint16_t i = 0, j;
 
   if(cmd == NULL || len == NULL || cmd->cmdHeader == NULL) return NULL;
   if(cmd->lenData > 0 && cmd->cmdData == NULL) return NULL;
@@ -1696,164 +1908,173 @@ uint8_t* SerializeCommand(CAPDU *cmd, uint32_t *len)
   stream[i++] = cmd->cmdHeader->p2;
   stream[i++] = cmd->cmdHeader->p3;
 
-  while(i < cmd->lenData)
-  {
-    stream[i] = cmd->cmdData[i];
-    i++;
-  }
+  for(j = 0; j < cmd->lenData; j++)
+    stream[i++] = cmd->cmdData[j];
 
   return stream;
 }
 
 
 /**
- * This method receives a response from ICC for protocol T = 0.
- * If [SW1,SW2] != [0x90,0] then the response is not complete.
- * Either another command (e.g. get response) is expected, or
- * the previous command with different lc, or an error has occurred.
- * If [SW1,SW2] returned are '9000' then the command is successful and
- * it will also contain data if this was expected.
- * Different codes for the return codes can be found in EMV Book 1
- * and Book 3.
+ * This method receives a response from ICC for protocol T = 0,
+ * into buffers provided by the caller. See ReceiveT0Response for the
+ * meaning of the status bytes. Requests for more time (0x60) from
+ * the ICC are skipped.
  *
  * @param inverse_convention different than 0 if inverse
  * convention is to be used
  * @param cmdHeader the header of the command for which response is expected
+ * @param data the response data is stored here. This must have space for
+ * at least cmdHeader->p3 bytes for command cases 2 and 4, or be NULL if
+ * no data is expected, in which case data from the ICC is an error
+ * @param lenData the number of data bytes received is returned here
+ * @param status the status bytes are returned here
  * @param logger a pointer to a log structure or NULL if no log is desired
- * @return response APDU if the method is successful. In the case this
- * method is unsuccessful (unrelated to SW1, SW2) then it will return NULL 
+ * @return 0 if successful, non-zero otherwise (unrelated to SW1, SW2)
+ * @sa ReceiveT0Response
  */
-RAPDU* ReceiveT0Response(
+uint8_t ReceiveT0ResponseData(
     uint8_t inverse_convention,
     EMVCommandHeader *cmdHeader,
+    uint8_t *data,
+    uint8_t *lenData,
+    EMVStatus *status,
     log_struct_t *logger)
 {
-  uint8_t tmp, i, result;
-  RAPDU* rapdu;
+  uint8_t tmp, i, result, cmdCase;
 
-  if(cmdHeader == NULL) return NULL;
-
-  rapdu = (RAPDU*)malloc(sizeof(RAPDU));
-  if(rapdu == NULL)
-  {
-    result = RET_ERR_MEMORY;
-    goto enderror;
-  }
-  rapdu->repStatus = NULL;
-  rapdu->repData = NULL;
-  rapdu->lenData = 0;
-  result = GetCommandCase(cmdHeader->cla, cmdHeader->ins);		
-  if(result == 0)
+  *lenData = 0;
+  cmdCase = GetCommandCase(cmdHeader->cla, cmdHeader->ins);
+  if(cmdCase == 0)
   {
     result = RET_ERROR;
     goto enderror;
   }
 
+  // get the first byte, until the ICC stops requesting more time
+  do{
+    WaitForICCKeepAlive();
+    result = GetByteICCParity(inverse_convention, &tmp);
+    if(result != 0)
+      goto enderror;
+    if(LogAPDU(logger, 0))
+      LogByte1(logger, LOG_BYTE_FROM_ICC, tmp);
+  }while(tmp == SW1_MORE_TIME);
 
-  // for case 1 and case 3 there is no data expected, just status
-  if(tmp == 1 || tmp == 3)
+  // for case 2 and 4, we might get data based on first byte of response
+  if((cmdCase == 2 || cmdCase == 4) &&
+      (tmp == cmdHeader->ins || tmp == (uint8_t)~cmdHeader->ins))
   {
-    rapdu->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
-    if(rapdu->repStatus == NULL)
+    if(tmp == cmdHeader->ins)
+      *lenData = cmdHeader->p3;
+    else
+      *lenData = 1;
+
+    // the ICC sends more data than the caller has space for
+    if(*lenData > 0 && (data == NULL || *lenData > cmdHeader->p3))
     {
-      result = RET_ERR_MEMORY;
+      result = RET_ERROR;
       goto enderror;
     }
 
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw1));
-    if(result != 0)
-      goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw1);
-
-    if(rapdu->repStatus->sw1 == 0x60)
+    for(i = 0; i < *lenData; i++)
     {
-      // requested more time, recall
-      FreeRAPDU(rapdu);
-      return ReceiveT0Response(inverse_convention, cmdHeader, logger);
+      result = GetByteICCParity(inverse_convention, &(data[i]));
+      if(result != 0)
+        goto enderror;
+      if(LogAPDU(logger, i + 1))
+        LogByte1(logger, LOG_BYTE_FROM_ICC, data[i]);
     }
 
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw2));
+    result = GetByteICCParity(inverse_convention, &(status->sw1));
     if(result != 0)
       goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw2);
-
-    return rapdu;
+    if(LogAPDU(logger, 0))
+      LogByte1(logger, LOG_BYTE_FROM_ICC, status->sw1);
   }
+  else	// the first byte is SW1 (no data)
+    status->sw1 = tmp;
 
-  // for case 2 and 4, we might get data based on first byte of response	
-  result = GetByteICCParity(inverse_convention, &tmp);
+  result = GetByteICCParity(inverse_convention, &(status->sw2));
   if(result != 0)
     goto enderror;
-  if(logger)
-    LogByte1(logger, LOG_BYTE_FROM_ICC, tmp);
+  if(LogAPDU(logger, 0))
+    LogByte1(logger, LOG_BYTE_FROM_ICC, status->sw2);
 
-  if(tmp == 0x60)
-  {
-    // requested more time, recall
-    FreeRAPDU(rapdu);
-    return ReceiveT0Response(inverse_convention, cmdHeader, logger);
-  }
+  // time of the end of the response, see SendT0Command for the start
+  LogCurrentTime(logger);
+
+  return 0;
 
-  if(tmp == cmdHeader->ins || tmp == ~cmdHeader->ins)	// get data
+enderror:
+  *lenData = 0;
+  if(logger)
   {
-    if(tmp == cmdHeader->ins)
-      rapdu->lenData = cmdHeader->p3;
-    else
-      rapdu->lenData = 1;
+    LogCurrentTime(logger);
+    if(result == RET_ERROR)
+      LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
+  }
+  return result;
+}
 
-    rapdu->repData = (uint8_t*)malloc(rapdu->lenData*sizeof(uint8_t));
-    if(rapdu->repData == NULL)
-    {
-      result = RET_ERR_MEMORY;
-      goto enderror;
-    }
 
-    for(i = 0; i < rapdu->lenData; i++)
-    {
-      result = GetByteICCParity(inverse_convention, &(rapdu->repData[i]));
-      if(result != 0)
-        goto enderror;
-      if(logger)
-        LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repData[i]);
-    }		
+/**
+ * This method receives a response from ICC for protocol T = 0.
+ * If [SW1,SW2] != [0x90,0] then the response is not complete.
+ * Either another command (e.g. get response) is expected, or
+ * the previous command with different lc, or an error has occurred.
+ * If [SW1,SW2] returned are '9000' then the command is successful and
+ * it will also contain data if this was expected.
+ * Different codes for the return codes can be found in EMV Book 1
+ * and Book 3.
+ *
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param cmdHeader the header of the command for which response is expected
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return response APDU if the method is successful. In the case this
+ * method is unsuccessful (unrelated to SW1, SW2) then it will return NULL 
+ * @sa ReceiveT0ResponseData
+ */
+RAPDU* ReceiveT0Response(
+    uint8_t inverse_convention,
+    EMVCommandHeader *cmdHeader,
+    log_struct_t *logger)
+{
+  uint8_t cmdCase;
+  RAPDU* rapdu;
 
-    rapdu->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
-    if(rapdu->repStatus == NULL)
-    {
-      result = RET_ERR_MEMORY;
-      goto enderror;
-    }
+  if(cmdHeader == NULL) return NULL;
 
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw1));
-    if(result != 0)
-      goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw1);
+  rapdu = (RAPDU*)malloc(sizeof(RAPDU));
+  if(rapdu == NULL)
+    goto enderror;
+  rapdu->repData = NULL;
+  rapdu->lenData = 0;
+  rapdu->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
+  if(rapdu->repStatus == NULL)
+    goto enderror;
 
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw2));
-    if(result != 0)
+  // only case 2 and 4 commands may return data
+  cmdCase = GetCommandCase(cmdHeader->cla, cmdHeader->ins);
+  if((cmdCase == 2 || cmdCase == 4) && cmdHeader->p3 != 0)
+  {
+    rapdu->repData = (uint8_t*)malloc(cmdHeader->p3 * sizeof(uint8_t));
+    if(rapdu->repData == NULL)
       goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw2);
+  }
 
-  }	
-  else	// get second byte of response (no data)
+  if(ReceiveT0ResponseData(inverse_convention, cmdHeader, rapdu->repData,
+        &(rapdu->lenData), rapdu->repStatus, logger))
   {
-    rapdu->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
-    if(rapdu->repStatus == NULL)
-    {			
-      result = RET_ERR_MEMORY;
-      goto enderror;
-    }
+    FreeRAPDU(rapdu);
+    return NULL;
+  }
 
-    rapdu->repStatus->sw1 = tmp;
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw2));
-    if(result != 0)
-      goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw2);
+  if(rapdu->lenData == 0 && rapdu->repData != NULL)
+  {
+    free(rapdu->repData);
+    rapdu->repData = NULL;
   }
 
   return rapdu;
@@ -1863,15 +2084,7 @@ enderror:
   if(logger)
   {
     LogCurrentTime(logger);
-
-    if(result == RET_ERR_MEMORY)
-    {
-      LogByte1(logger, LOG_ERROR_MEMORY, 0);
-    }
-    else if(result == RET_ERROR)
-    {
-      LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
-    }
+    LogByte1(logger, LOG_ERROR_MEMORY, 0);
   }
   return NULL;
 }
@@ -1896,6 +2109,7 @@ uint8_t SendT0Response(
 {
   uint8_t i;	
   uint8_t result;
+  PROFILE_FUNCTION(PROFILE_SEND_T0_RESPONSE);
 
   if(cmdHeader == NULL || response == NULL || response->repStatus == NULL)
     return RET_ERR_PARAM;	
@@ -1912,7 +2126,7 @@ uint8_t SendT0Response(
       }
       goto enderror;
     }
-    if(logger)
+    if(LogAPDU(logger, 0))
       LogByte1(logger, LOG_BYTE_TO_TERMINAL, cmdHeader->ins);
     LoopTerminalETU(2);
 
@@ -1928,7 +2142,7 @@ uint8_t SendT0Response(
         }
         goto enderror;
       }
-      if(logger)
+      if(LogAPDU(logger, i + 1))
         LogByte1(logger, LOG_BYTE_TO_TERMINAL, response->repData[i]);
       LoopTerminalETU(2);
     }
@@ -1944,7 +2158,7 @@ uint8_t SendT0Response(
     }
     goto enderror;
   }
-  if(logger)
+  if(LogAPDU(logger, 0))
     LogByte1(logger, LOG_BYTE_TO_TERMINAL, response->repStatus->sw1);
   LoopTerminalETU(2);
 
@@ -1958,7 +2172,7 @@ uint8_t SendT0Response(
     }
     goto enderror;
   }
-  if(logger)
+  if(LogAPDU(logger, 0))
     LogByte1(logger, LOG_BYTE_TO_TERMINAL, response->repStatus->sw2);
   LoopTerminalETU(2);
 
@@ -1994,10 +2208,16 @@ RAPDU* ForwardResponse(
   if(cmdHeader == NULL)
     return NULL;
 
+  // keep the terminal waiting while the ICC processes the command
+  StartTerminalKeepAlive(tInverse);
   if((log_dir & LOG_DIR_ICC) > 0)
     response = ReceiveT0Response(cInverse, cmdHeader, logger);
   else
     response = ReceiveT0Response(cInverse, cmdHeader, NULL);
+  if((log_dir & LOG_DIR_TERMINAL) > 0)
+    StopTerminalKeepAlive(logger);
+  else
+    StopTerminalKeepAlive(NULL);
   if(response == NULL)
     return NULL;
 
@@ -2025,9 +2245,10 @@ RAPDU* ForwardResponse(
  * method will allocate the necessary space and will write into len
  * the length of the stream. The method returns NULL if unsuccessful. 
  */
-uint8_t* SerializeResponse(RAPDU *response, uint8_t *len)
+uint8_t* SerializeResponse(RAPDU *response, uint16_t *len)
 {
-  uint8_t *stream, i = 0;
+  uint8_t *stream;
+  uint16_t i = 0, j;
 
   if(response == NULL || len == NULL || response->repStatus == NULL)
     return NULL;
@@ -2044,11 +2265,8 @@ uint8_t* SerializeResponse(RAPDU *response, uint8_t *len)
   stream[i++] = response->repStatus->sw1;
   stream[i++] = response->repStatus->sw2;	
 
-  while(i < response->lenData)
-  {
-    stream[i] = response->repData[i];
-    i++;
-  }
+  for(j = 0; j < response->lenData; j++)
+    stream[i++] = response->repData[j];
 
   return stream;
 }
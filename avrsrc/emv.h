@@ -40,6 +40,16 @@
 #define EMV_MORE_TAGS_MASK 0x1F
 #define EMV_EXTRA_LENGTH_BYTE 0x81
 
+/// Work waiting time integer used when the ATR has no TC2 byte
+#define EMV_DEFAULT_WI 10
+
+/// ETUs after which the terminal keep-alive sends a NULL byte (WWT / 2)
+#define EMV_KEEP_ALIVE_ETUS(WI) (480UL * (WI))
+
+/// Maximum length of an ICC ATR: TS, T0, 16 interface bytes,
+/// 15 historical bytes and TCK (see GetICCATR)
+#define ICC_ATR_MAX_LEN 34
+
 //------------------------------------------------------------------------
 // EMV data structures
 
@@ -124,6 +134,9 @@ uint8_t ResetICC(
         uint8_t *TB3,
         log_struct_t *logger);
 
+/// Returns the ATR received from the ICC at the last reset
+uint8_t GetICCATR(uint8_t *atr);
+
 //------------------------------------------------------------------------
 // T=0 protocol functions
 
@@ -133,6 +146,24 @@ void SendT0ATRTerminal(
         uint8_t TC1,
         log_struct_t *logger);
 
+/// Returns the work waiting time integer (WI) given by TC2 in an ATR
+uint8_t GetATRWorkWaitingIndex(const uint8_t *atr, uint8_t len);
+
+/// Sets the work waiting time integer (WI) announced to the terminal
+void SetTerminalWorkWaitingIndex(uint8_t WI);
+
+/// Starts sending NULL bytes to the terminal before its waiting time expires
+void StartTerminalKeepAlive(uint8_t tInverse);
+
+/// Sends a NULL byte to the terminal if needed, without blocking
+uint8_t PollTerminalKeepAlive();
+
+/// Sends a NULL byte to the terminal now if the keep-alive is active
+void SendTerminalKeepAlive();
+
+/// Stops the terminal keep-alive and logs the number of NULL bytes sent
+uint8_t StopTerminalKeepAlive(log_struct_t *logger);
+
 /// Receives the ATR from ICC after a successful activation
 uint8_t GetATRICC(
         uint8_t *inverse_convention,
@@ -233,6 +264,15 @@ RAPDU* ReceiveT0Response(
         EMVCommandHeader *cmdHeader,
         log_struct_t *logger);
 
+/// Receive response from ICC for T=0 into buffers given by the caller
+uint8_t ReceiveT0ResponseData(
+        uint8_t inverse_convention,
+        EMVCommandHeader *cmdHeader,
+        uint8_t *data,
+        uint8_t *lenData,
+        EMVStatus *status,
+        log_struct_t *logger);
+
 /// Send a response to the terminal
 uint8_t SendT0Response(
         uint8_t inverse_convention,
@@ -249,7 +289,7 @@ RAPDU* ForwardResponse(
         log_struct_t *logger);
 
 /// Serialize a RAPDU structure
-uint8_t* SerializeResponse(RAPDU *response, uint8_t *len);
+uint8_t* SerializeResponse(RAPDU *response, uint16_t *len);
 
 /// Makes a command-response exchange between terminal and ICC
 CRP* ExchangeData(
@@ -0,0 +1,74 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2010.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+ * File modified for the Smart Card Detective by Omar Choudary
+ */
+
+/*
+  Copyright 2010  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaim all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Header file for MSDescriptors.c.
+ */
+
+#ifndef _MS_DESCRIPTORS_H_
+#define _MS_DESCRIPTORS_H_
+
+	/* Includes: */
+		#include <../LUFA/Drivers/USB/USB.h>
+
+		#include <avr/pgmspace.h>
+
+	/* Macros: */
+		/** Endpoint number of the Mass Storage device-to-host data IN endpoint. */
+		#define MASS_STORAGE_IN_EPNUM          1
+
+		/** Endpoint number of the Mass Storage host-to-device data OUT endpoint. */
+		#define MASS_STORAGE_OUT_EPNUM         2
+
+		/** Size in bytes of the Mass Storage data endpoints. */
+		#define MASS_STORAGE_IO_EPSIZE         64
+
+	/* Type Defines: */
+		/** Type define for the device configuration descriptor structure used in Mass Storage mode. */
+		typedef struct
+		{
+			USB_Descriptor_Configuration_Header_t Config;
+			USB_Descriptor_Interface_t            MS_Interface;
+			USB_Descriptor_Endpoint_t             MS_DataInEndpoint;
+			USB_Descriptor_Endpoint_t             MS_DataOutEndpoint;
+		} MS_Descriptor_Configuration_t;
+
+	/* Function Prototypes: */
+		uint16_t MS_GetDescriptor(const uint16_t wValue,
+		                          const uint8_t wIndex,
+		                          const void** const DescriptorAddress)
+		                          ATTR_WARN_UNUSED_RESULT ATTR_NON_NULL_PTR_ARG(3);
+
+#endif
@@ -0,0 +1,403 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2010.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+ * File modified for the Smart Card Detective by Omar Choudary
+ */
+
+/*
+  Copyright 2010  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaim all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Mass Storage Bulk-Only Transport and SCSI command handling used to export
+ *  the SCD logs as a read-only USB drive. This follows the low level LUFA
+ *  MassStorage demo, but all the sectors are produced by ReadLogVolume()
+ *  (see scd_logvol.c) and any write request is rejected.
+ */
+
+#include <string.h>
+
+#include "MassStorage.h"
+#include "../scd_logvol.h"
+
+/** Set while the Mass Storage mode is in use, see MassStorage.h */
+uint8_t usbMassStorageMode = 0;
+
+/** Structure to hold the latest Command Block Wrapper issued by the host. */
+static MS_CommandBlockWrapper_t CommandBlock;
+
+/** Structure to hold the latest Command Status Wrapper to return to the host. */
+static MS_CommandStatusWrapper_t CommandStatus = { .Signature = MS_CSW_SIGNATURE };
+
+/** Flag set by the control request handler when the host issues a Mass Storage Reset. */
+static volatile bool IsMassStoreReset = false;
+
+/** Sense data of the last SCSI command, returned on a REQUEST SENSE command. */
+static SCSI_Request_Sense_Response_t SenseData =
+{
+	.ResponseCode        = 0x70,
+	.AdditionalLength    = 0x0A,
+};
+
+/** Response to the SCSI INQUIRY command. */
+static const SCSI_Inquiry_Response_t InquiryData =
+{
+	.DeviceType          = 0,
+	.PeripheralQualifier = 0,
+
+	.Removable           = true,
+
+	.Version             = 0,
+
+	.ResponseDataFormat  = 2,
+	.NormACA             = false,
+	.TrmTsk              = false,
+	.AERC                = false,
+
+	.AdditionalLength    = 0x1F,
+
+	.SoftReset           = false,
+	.CmdQue              = false,
+	.Linked              = false,
+	.Sync                = false,
+	.WideBus16Bit        = false,
+	.WideBus32Bit        = false,
+	.RelAddr             = false,
+
+	.VendorID            = "SCD     ",
+	.ProductID           = "Log Drive       ",
+	.RevisionID          = {'0','.','0','1'},
+};
+
+/** Sets the sense data returned on the next REQUEST SENSE command. */
+static void SetSense(uint8_t Key, uint8_t Acode, uint8_t Aqual)
+{
+	SenseData.SenseKey                 = Key;
+	SenseData.AdditionalSenseCode      = Acode;
+	SenseData.AdditionalSenseQualifier = Aqual;
+}
+
+/** Writes a number of zero bytes to the IN endpoint, used to pad short responses. */
+static void WritePadding(uint16_t Length)
+{
+	while (Length--)
+	{
+		if (!(Endpoint_IsReadWriteAllowed()))
+		{
+			Endpoint_ClearIN();
+
+			if (Endpoint_WaitUntilReady())
+			  return;
+		}
+
+		Endpoint_Write_Byte(0);
+	}
+}
+
+/** Sends a short response (INQUIRY, REQUEST SENSE, etc.) limited to the allocation length of the command. */
+static void SendResponse(const void* Data, uint16_t Size, uint16_t AllocationLength)
+{
+	uint16_t BytesTransferred = (AllocationLength < Size) ? AllocationLength : Size;
+
+	Endpoint_Write_Stream_LE(Data, BytesTransferred);
+	WritePadding(AllocationLength - BytesTransferred);
+	Endpoint_ClearIN();
+
+	CommandBlock.DataTransferLength -= AllocationLength;
+}
+
+/** Handles the SCSI READ CAPACITY (10) command. */
+static void SCSI_ReadCapacity10(void)
+{
+	Endpoint_Write_DWord_BE(LOGVOL_TOTAL_SECTORS - 1);
+	Endpoint_Write_DWord_BE(LOGVOL_SECTOR_SIZE);
+	Endpoint_ClearIN();
+
+	CommandBlock.DataTransferLength -= 8;
+}
+
+/** Handles the SCSI MODE SENSE (6) command, reporting a write protected medium. */
+static void SCSI_ModeSense6(void)
+{
+	Endpoint_Write_Byte(0x03);
+	Endpoint_Write_Byte(0x00);
+	Endpoint_Write_Byte(0x80);
+	Endpoint_Write_Byte(0x00);
+	Endpoint_ClearIN();
+
+	CommandBlock.DataTransferLength -= 4;
+}
+
+/** Handles the SCSI READ (10) command, sending the requested sectors of the log volume.
+ *
+ *  \return Boolean true if the command completed, false otherwise
+ */
+static bool SCSI_Read10(void)
+{
+	uint8_t  Buffer[MASS_STORAGE_IO_EPSIZE];
+	uint32_t BlockAddress;
+	uint16_t TotalBlocks;
+	uint16_t Offset;
+
+	BlockAddress = ((uint32_t)CommandBlock.SCSICommandData[2] << 24) |
+	               ((uint32_t)CommandBlock.SCSICommandData[3] << 16) |
+	               ((uint32_t)CommandBlock.SCSICommandData[4] << 8)  |
+	               CommandBlock.SCSICommandData[5];
+	TotalBlocks  = ((uint16_t)CommandBlock.SCSICommandData[7] << 8) |
+	               CommandBlock.SCSICommandData[8];
+
+	if ((BlockAddress + TotalBlocks) > LOGVOL_TOTAL_SECTORS)
+	{
+		SetSense(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		         SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+		         SCSI_ASENSEQ_NO_QUALIFIER);
+		return false;
+	}
+
+	while (TotalBlocks)
+	{
+		for (Offset = 0; Offset < LOGVOL_SECTOR_SIZE; Offset += MASS_STORAGE_IO_EPSIZE)
+		{
+			ReadLogVolume(BlockAddress, Offset, Buffer, MASS_STORAGE_IO_EPSIZE);
+
+			if (Endpoint_WaitUntilReady() || IsMassStoreReset)
+			  return false;
+
+			Endpoint_Write_Stream_LE(Buffer, MASS_STORAGE_IO_EPSIZE);
+			Endpoint_ClearIN();
+		}
+
+		BlockAddress++;
+		TotalBlocks--;
+		CommandBlock.DataTransferLength -= LOGVOL_SECTOR_SIZE;
+	}
+
+	return true;
+}
+
+/** Decodes and runs the SCSI command in the current Command Block Wrapper.
+ *
+ *  \return Boolean true if the command completed successfully, false otherwise
+ */
+static bool SCSI_DecodeSCSICommand(void)
+{
+	bool CommandSuccess = false;
+
+	switch (CommandBlock.SCSICommandData[0])
+	{
+		case SCSI_CMD_INQUIRY:
+			SendResponse(&InquiryData, sizeof(InquiryData),
+			             ((uint16_t)CommandBlock.SCSICommandData[3] << 8) | CommandBlock.SCSICommandData[4]);
+			CommandSuccess = true;
+			break;
+		case SCSI_CMD_REQUEST_SENSE:
+			SendResponse(&SenseData, sizeof(SenseData), CommandBlock.SCSICommandData[4]);
+			CommandSuccess = true;
+			break;
+		case SCSI_CMD_READ_CAPACITY_10:
+			SCSI_ReadCapacity10();
+			CommandSuccess = true;
+			break;
+		case SCSI_CMD_MODE_SENSE_6:
+			SCSI_ModeSense6();
+			CommandSuccess = true;
+			break;
+		case SCSI_CMD_READ_10:
+			CommandSuccess = SCSI_Read10();
+			break;
+		case SCSI_CMD_WRITE_10:
+			SetSense(SCSI_SENSE_KEY_DATA_PROTECT,
+			         SCSI_ASENSE_WRITE_PROTECTED,
+			         SCSI_ASENSEQ_NO_QUALIFIER);
+			return false;
+		case SCSI_CMD_SEND_DIAGNOSTIC:
+		case SCSI_CMD_TEST_UNIT_READY:
+		case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+		case SCSI_CMD_VERIFY_10:
+			CommandSuccess = true;
+			CommandBlock.DataTransferLength = 0;
+			break;
+		default:
+			SetSense(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+			         SCSI_ASENSE_INVALID_COMMAND,
+			         SCSI_ASENSEQ_NO_QUALIFIER);
+			return false;
+	}
+
+	if (CommandSuccess)
+	{
+		SetSense(SCSI_SENSE_KEY_GOOD,
+		         SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+		         SCSI_ASENSEQ_NO_QUALIFIER);
+	}
+
+	return CommandSuccess;
+}
+
+/** Reads in a Command Block Wrapper from the host, if one is available.
+ *
+ *  \return Boolean true if a valid command block has been read in, false otherwise
+ */
+static bool ReadInCommandBlock(void)
+{
+	Endpoint_SelectEndpoint(MASS_STORAGE_OUT_EPNUM);
+
+	if (!(Endpoint_IsReadWriteAllowed()))
+	  return false;
+
+	if (Endpoint_Read_Stream_LE(&CommandBlock, (sizeof(CommandBlock) - sizeof(CommandBlock.SCSICommandData))))
+	  return false;
+
+	if ((CommandBlock.Signature         != MS_CBW_SIGNATURE)  ||
+	    (CommandBlock.LUN               >= TOTAL_LUNS)        ||
+	    (CommandBlock.Flags              & 0x1F)              ||
+	    (CommandBlock.SCSICommandLength == 0)                 ||
+	    (CommandBlock.SCSICommandLength >  sizeof(CommandBlock.SCSICommandData)))
+	{
+		Endpoint_StallTransaction();
+		Endpoint_SelectEndpoint(MASS_STORAGE_IN_EPNUM);
+		Endpoint_StallTransaction();
+
+		return false;
+	}
+
+	if (Endpoint_Read_Stream_LE(&CommandBlock.SCSICommandData, CommandBlock.SCSICommandLength))
+	  return false;
+
+	Endpoint_ClearOUT();
+
+	return true;
+}
+
+/** Returns the Command Status Wrapper of the last command to the host. */
+static void ReturnCommandStatus(void)
+{
+	Endpoint_SelectEndpoint(MASS_STORAGE_OUT_EPNUM);
+
+	while (Endpoint_IsStalled())
+	{
+		if (IsMassStoreReset)
+		  return;
+	}
+
+	Endpoint_SelectEndpoint(MASS_STORAGE_IN_EPNUM);
+
+	while (Endpoint_IsStalled())
+	{
+		if (IsMassStoreReset)
+		  return;
+	}
+
+	if (Endpoint_Write_Stream_LE(&CommandStatus, sizeof(CommandStatus)))
+	  return;
+
+	Endpoint_ClearIN();
+}
+
+/** Configures the Mass Storage endpoints. This is called from the USB
+ *  configuration changed event while usbMassStorageMode is set.
+ */
+void MassStorage_ConfigurationChanged(void)
+{
+	Endpoint_ConfigureEndpoint(MASS_STORAGE_IN_EPNUM, EP_TYPE_BULK, ENDPOINT_DIR_IN,
+	                           MASS_STORAGE_IO_EPSIZE, ENDPOINT_BANK_SINGLE);
+	Endpoint_ConfigureEndpoint(MASS_STORAGE_OUT_EPNUM, EP_TYPE_BULK, ENDPOINT_DIR_OUT,
+	                           MASS_STORAGE_IO_EPSIZE, ENDPOINT_BANK_SINGLE);
+
+	IsMassStoreReset = false;
+}
+
+/** Processes the Mass Storage class control requests. This is called from
+ *  the USB control request event while usbMassStorageMode is set.
+ */
+void MassStorage_ControlRequest(void)
+{
+	switch (USB_ControlRequest.bRequest)
+	{
+		case MS_REQ_MassStorageReset:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE))
+			{
+				Endpoint_ClearSETUP();
+				Endpoint_ClearStatusStage();
+
+				IsMassStoreReset = true;
+			}
+
+			break;
+		case MS_REQ_GetMaxLUN:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE))
+			{
+				Endpoint_ClearSETUP();
+				Endpoint_Write_Byte(TOTAL_LUNS - 1);
+				Endpoint_ClearIN();
+				Endpoint_ClearStatusStage();
+			}
+
+			break;
+	}
+}
+
+/** Processes the next Mass Storage command from the host, if any. This
+ *  should be called continuously while the Mass Storage mode is in use.
+ */
+void MassStorage_Task(void)
+{
+	if (USB_DeviceState != DEVICE_STATE_Configured)
+	  return;
+
+	if (ReadInCommandBlock())
+	{
+		if (CommandBlock.Flags & MS_COMMAND_DIR_DATA_IN)
+		  Endpoint_SelectEndpoint(MASS_STORAGE_IN_EPNUM);
+
+		CommandStatus.Status = SCSI_DecodeSCSICommand() ? MS_SCSI_COMMAND_Pass : MS_SCSI_COMMAND_Fail;
+		CommandStatus.Tag = CommandBlock.Tag;
+		CommandStatus.DataTransferResidue = CommandBlock.DataTransferLength;
+
+		// Stall the selected data pipe if the command failed with data still expected
+		if ((CommandStatus.Status == MS_SCSI_COMMAND_Fail) && (CommandStatus.DataTransferResidue))
+		  Endpoint_StallTransaction();
+
+		ReturnCommandStatus();
+	}
+
+	if (IsMassStoreReset)
+	{
+		Endpoint_ResetFIFO(MASS_STORAGE_OUT_EPNUM);
+		Endpoint_ResetFIFO(MASS_STORAGE_IN_EPNUM);
+
+		Endpoint_SelectEndpoint(MASS_STORAGE_OUT_EPNUM);
+		Endpoint_ClearStall();
+		Endpoint_ResetDataToggle();
+		Endpoint_SelectEndpoint(MASS_STORAGE_IN_EPNUM);
+		Endpoint_ClearStall();
+		Endpoint_ResetDataToggle();
+
+		IsMassStoreReset = false;
+	}
+}
@@ -0,0 +1,66 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2010.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+ * File modified for the Smart Card Detective by Omar Choudary
+ */
+
+/*
+  Copyright 2010  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaim all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Header file for MassStorage.c.
+ */
+
+#ifndef _MASS_STORAGE_H_
+#define _MASS_STORAGE_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <stdbool.h>
+
+		#include "MSDescriptors.h"
+
+		#include <../LUFA/Drivers/USB/USB.h>
+
+	/* Macros: */
+		/** Total number of logical drives within the device. */
+		#define TOTAL_LUNS                 1
+
+	/* Global Variables: */
+		/** Non-zero while the USB interface is used in Mass Storage mode instead of the
+		 *  Virtual Serial mode; checked by the shared USB event handlers.
+		 */
+		extern uint8_t usbMassStorageMode;
+
+	/* Function Prototypes: */
+		void MassStorage_Task(void);
+		void MassStorage_ConfigurationChanged(void);
+		void MassStorage_ControlRequest(void);
+
+#endif
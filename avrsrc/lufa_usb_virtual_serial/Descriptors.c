@@ -36,6 +36,7 @@
  */
 
 #include "Descriptors.h"
+#include "../lufa_usb_mass_storage/MassStorage.h"
 
 /* On some devices, there is a factory set internal serial number which can be automatically sent to the host as
  * the device's serial number when the Device Descriptor's .SerialNumStrIndex entry is set to USE_INTERNAL_SERIAL.
@@ -235,6 +236,10 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 	const void* Address = NULL;
 	uint16_t    Size    = NO_DESCRIPTOR;
 
+	/* Use the Mass Storage descriptors when exporting the logs as a drive */
+	if (usbMassStorageMode)
+	  return MS_GetDescriptor(wValue, wIndex, DescriptorAddress);
+
 	switch (DescriptorType)
 	{
 		case DTYPE_Device:
@@ -44,6 +44,8 @@
 
 #include "VirtualSerial.h"
 #include "../scd_io.h"
+#include "../scd_profile.h"
+#include "../lufa_usb_mass_storage/MassStorage.h"
 
 /** Contains the current baud rate and other settings of the virtual serial port. While this demo does not use
  *  the physical USART and thus does not use these settings, they must still be retained and returned to the host
@@ -114,6 +116,14 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 {
     bool ConfigSuccess = true;
 
+    /* The same USB stack is used when exporting the logs as a drive */
+    if (usbMassStorageMode)
+    {
+        MassStorage_ConfigurationChanged();
+        LEDs_SetAllLEDs(LEDMASK_USB_READY);
+        return;
+    }
+
     /* Setup CDC Data Endpoints */
     ConfigSuccess &= Endpoint_ConfigureEndpoint(CDC_NOTIFICATION_EPNUM, EP_TYPE_INTERRUPT, ENDPOINT_DIR_IN,
             CDC_NOTIFICATION_EPSIZE, ENDPOINT_BANK_SINGLE);
@@ -135,6 +145,12 @@ void EVENT_USB_Device_ConfigurationChanged(void)
  */
 void EVENT_USB_Device_ControlRequest(void)
 {
+    if (usbMassStorageMode)
+    {
+        MassStorage_ControlRequest();
+        return;
+    }
+
     /* Process CDC specific control requests */
     switch (USB_ControlRequest.bRequest)
     {
@@ -265,6 +281,37 @@ void CDC_Task(void)
     }
 }
 
+/**
+ * Receive one character from the USB host, without waiting
+ *
+ * This function is the USB counterpart of PollCharUSART and can be used
+ * together with AddLineChar to receive lines without blocking.
+ *
+ * @param data stores the received character, if any
+ * @return non-zero if a character was available, zero otherwise
+ */
+uint8_t PollHostChar(char *data)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured)
+        return 0;
+
+    Endpoint_SelectEndpoint(CDC_RX_EPNUM);
+    if (!Endpoint_IsOUTReceived())
+        return 0;
+
+    if (!Endpoint_BytesInEndpoint())
+    {
+        Endpoint_ClearOUT();
+        return 0;
+    }
+
+    *data = Endpoint_Read_Byte();
+    if (!Endpoint_BytesInEndpoint())
+        Endpoint_ClearOUT();
+
+    return 1;
+}
+
 /**
  * Receive a string data from the USB host
  *
@@ -282,6 +329,7 @@ char* GetHostData(uint16_t len)
     uint8_t pos = 0;
     uint8_t retval;
     char* buf;
+    PROFILE_FUNCTION(PROFILE_HOST_DATA);
 
     if (USB_DeviceState != DEVICE_STATE_Configured)
         return NULL;
@@ -344,6 +392,25 @@ char* GetHostData(uint16_t len)
  * @return zero if success, non-zero otherwise
  */
 uint8_t SendHostData(const char *data)
+{
+    if (data == NULL)
+        return 1;
+
+    return SendHostBytes((const uint8_t*)data, strlen(data));
+}
+
+/**
+ * Send binary data to the USB host
+ *
+ * This function will transmit the given bytes, which may include NUL
+ * characters, to the USB host (the SCD is the USB device)
+ *
+ * @param data the bytes to be transmitted
+ * @param len the number of bytes to be transmitted
+ *
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendHostBytes(const uint8_t *data, uint16_t len)
 {
     uint8_t full;
 
@@ -353,8 +420,8 @@ uint8_t SendHostData(const char *data)
     /* Select the Serial Tx Endpoint */
     Endpoint_SelectEndpoint(CDC_TX_EPNUM);
 
-    /* Write the String to the Endpoint */
-    Endpoint_Write_Stream_LE(data, strlen(data));
+    /* Write the data to the Endpoint */
+    Endpoint_Write_Stream_LE(data, len);
 
     /* Remember if the packet to send completely fills the endpoint */
     full = (Endpoint_BytesInEndpoint() == CDC_TXRX_EPSIZE);
@@ -72,7 +72,9 @@
 		void StopUSBHardware(void);
 		void CDC_Task(void);
         char* GetHostData(uint16_t len);
+        uint8_t PollHostChar(char *data);
         uint8_t SendHostData(const char *data);
+        uint8_t SendHostBytes(const uint8_t *data, uint16_t len);
 
 		void EVENT_USB_Device_Connect(void);
 		void EVENT_USB_Device_Disconnect(void);
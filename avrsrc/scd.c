@@ -57,6 +57,8 @@
 #include "scd_io.h"
 #include "scd.h"
 #include "scd_logger.h"
+#include "scd_logsink.h"
+#include "scd_meta.h"
 #include "utils.h"
 #include "emv_values.h"
 #include "scd_values.h"
@@ -97,6 +99,9 @@ uint8_t lcdAvailable;			        // non-zero if LCD is working
 uint8_t nCounter;			            // number of transactions
 uint8_t selected;			            // ID of application selected
 uint8_t bootkey;                        // used for bootloader jump
+uint8_t fastBoot;                       // non-zero until FinishBoot is called
+static uint32_t bootStart;              // start of InitSCD (GetCounterFine)
+static uint8_t bootLogged;              // non-zero after BootReady
 uint16_t revision = 0x24;               // current revision number, saved as BCD
 
 // Use the LCD as stderr (see main)
@@ -108,8 +113,6 @@ FILE lcd_str = FDEV_SETUP_STREAM(LcdPutchar, NULL, _FDEV_SETUP_WRITE);
  */
 int main(void)
 {
-  uint8_t sreg;
-
   // Init SCD
   InitSCD();
 
@@ -119,6 +122,7 @@ int main(void)
   // Select application if BB is pressed while restarting
   if(GetButtonB() == 0)
   {
+    FinishBoot();
     selected = SelectApplication();
 
     if(selected == APP_ERASE_EEPROM)
@@ -130,10 +134,8 @@ int main(void)
     }
     else
     {
-      sreg = SREG;
-      cli();
-      eeprom_write_byte((uint8_t*)EEPROM_APPLICATION, selected);
-      SREG = sreg;
+      scdMeta.application = selected;
+      CommitSCDMeta();
     }
 
     // restart micro-second counter every time we select an application
@@ -142,13 +144,6 @@ int main(void)
     // restart SCD so that LCD power is reduced (small trick)
     wdt_enable(WDTO_15MS);
   }
-  else
-  {
-    sreg = SREG;
-    cli();
-    selected = eeprom_read_byte((uint8_t*)EEPROM_APPLICATION);
-    SREG = sreg;
-  }
 
   // continuously run the selected application
   // add here any applications that can be selected from the user menu
@@ -176,9 +171,22 @@ int main(void)
         DummyPIN(&scd_logger);
         break;
 
+      case APP_LOG_DRIVE:
+        LogDrive();
+        break;
+
+      case APP_FORWARD_PREFETCH:
+        ForwardDataPrefetch(&scd_logger);
+        break;
+
+      case APP_FORWARD_CACHED:
+        ForwardDataCached(&scd_logger);
+        break;
+
       default:
         selected = APP_VIRTUAL_SERIAL_PORT;
-        eeprom_write_byte((uint8_t*)EEPROM_APPLICATION, selected);
+        scdMeta.application = selected;
+        CommitSCDMeta();
         VirtualSerial(&scd_logger);
     }
   }
@@ -248,6 +256,49 @@ uint8_t SelectApplication()
 }
 
 
+/**
+ * Logs the time from the start of InitSCD until the application is ready
+ * for the terminal reset, as a LOG_TIME_BOOT record (in microseconds).
+ * Only the first call after each start of the SCD is logged.
+ *
+ * @param logger the log structure or NULL if log is not desired
+ */
+void BootReady(log_struct_t *logger)
+{
+  uint32_t time;
+
+  if(bootLogged)
+    return;
+  bootLogged = 1;
+
+  time = (GetCounterFine() - bootStart) * COUNTER_FINE_US;
+  if(logger)
+    LogByte4(logger, LOG_TIME_BOOT,
+        (time & 0xFF),
+        ((time >> 8) & 0xFF),
+        ((time >> 16) & 0xFF),
+        ((time >> 24) & 0xFF));
+}
+
+/**
+ * Completes the start up left out by InitSCD for the applications that
+ * talk to a terminal (fast boot), i.e. sets up the LCD. The applications
+ * call this when the terminal is not waiting for the SCD, e.g. after the
+ * transaction. Nothing is done after the first call or without fast boot.
+ */
+void FinishBoot()
+{
+  if(!fastBoot)
+    return;
+  fastBoot = 0;
+
+  if(lcdAvailable)
+  {
+    InitLCD();
+    fprintf(stderr, "\n");
+  }
+}
+
 /**
  * This method should be called before any other operation. It sets
  * the I/O ports to a correct state and it also recovers any necessary
@@ -265,12 +316,36 @@ void InitSCD()
   // Disable WDT to keep safe operation
   DisableWDT();
 
-  // Reset log structure (the one in SRAM)
-  ResetLogger(&scd_logger);
+  // change CLK Prescaler value, before anything else so that the rest of
+  // the start up runs at full speed
+  clock_prescale_set(clock_div_1); 	
+
+  // Read the metadata saved in EEPROM, used below (see scd_meta.h)
+  LoadSCDMeta();
 
   // Read ms counter in order to continue from last value
   // We add the estimated startup time of 4 ms
-  SetCounter(eeprom_read_dword((uint32_t*)EEPROM_TIMER_T2) + 4);
+  SetCounter(scdMeta.timerT2 + 4);
+
+  // enable counter T2, also used to measure the start up (see BootReady)
+  StartTimerT2();
+  bootStart = GetCounterFine();
+
+  // Read the selected application. The applications that talk to a
+  // terminal are started without the LCD set up and delays, since the
+  // terminal may expect the ATR a few ms after powering the SCD. They
+  // complete the start up with FinishBoot when the terminal is not waiting.
+  selected = scdMeta.application;
+  fastBoot = (selected == APP_FORWARD || selected == APP_FORWARD_PREFETCH ||
+      selected == APP_FORWARD_CACHED || selected == APP_DUMMY_PIN ||
+      selected == APP_FILTER_GENERATEAC);
+
+  // Reset log structure (the one in SRAM)
+  ResetLogger(&scd_logger);
+
+  // Select the log storage and the log policy saved in EEPROM
+  LoadLogSink();
+  LoadLogPolicy();
 
   // Ports setup
   DDRB = 0x00;
@@ -286,12 +361,6 @@ void InitSCD()
   DDRF &= 0xF0;
   PORTF |= 0x0F; 		// enable pull-up for buttons	
 
-  // change CLK Prescaler value
-  clock_prescale_set(clock_div_1); 	
-
-  // enable counter T2
-  StartTimerT2();
-
   // light power led
   Led4On();	
 
@@ -300,10 +369,10 @@ void InitSCD()
   //#endif	
 
   // Read Warm byte info from EEPROM
-  warmResetByte = eeprom_read_byte((uint8_t*)EEPROM_WARM_RESET);
+  warmResetByte = scdMeta.warmReset;
 
   // Read number of transactions in EEPROM
-  nCounter = eeprom_read_byte((uint8_t*)EEPROM_COUNTER);	
+  nCounter = scdMeta.counter;
 
   // Check LCD status and use as stderr if status OK
   if(CheckLCD())
@@ -315,8 +384,9 @@ void InitSCD()
   {
     stderr = &lcd_str;
     lcdAvailable = 1;
-    // disable LCD power
-    LCDOff();
+    // disable LCD power, unless the LCD is set up later by FinishBoot
+    if(!fastBoot)
+      LCDOff();
   }
 
   // Disable most modules; they should be re-enabled when needed
@@ -350,43 +420,35 @@ ISR(INT0_vect)
   // disable INT0	
   DisableTerminalResetInterrupt();
 
-  // Log the event
-  LogByte1(&scd_logger, LOG_TERMINAL_RST_LOW, 0);
-
-  // Write the log to EEPROM and clear its contents
-  WriteLogEEPROM(&scd_logger);
-  ResetLogger(&scd_logger);
-
   // check for warm vs cold reset
   if(IsTerminalClock())
   {
     // warm reset
-    warmResetByte = eeprom_read_byte((uint8_t*)EEPROM_WARM_RESET);
-
-    if(warmResetByte == WARM_RESET_VALUE)
+    if(scdMeta.warmReset == WARM_RESET_VALUE)
     {
       // we already had a warm reset so go to initial state
-      eeprom_write_byte((uint8_t*)EEPROM_WARM_RESET, 0);
-      while(EECR & _BV(EEPE));
+      scdMeta.warmReset = 0;
     }
     else
     {
-      // set 0xAA in EEPROM meaning we have a warm reset
-      eeprom_write_byte((uint8_t*)EEPROM_WARM_RESET, WARM_RESET_VALUE);
-      while(EECR & _BV(EEPE));
+      // set 0xAA meaning we have a warm reset
+      scdMeta.warmReset = WARM_RESET_VALUE;
     }
   }
   else
-  {
-    eeprom_write_byte((uint8_t*)EEPROM_WARM_RESET, 0);
-    while(EECR & _BV(EEPE));
-  }
+    scdMeta.warmReset = 0;
+  scdMeta.counter = nCounter;
+  scdMeta.timerT2 = GetCounter();
+
+  // Log the event and save the log. The main context may be in the
+  // middle of an append so only the ISR-safe logger functions are used.
+  // The metadata above is saved with the log pointer, in one commit
+  LogByteISR(&scd_logger, LOG_TERMINAL_RST_LOW, 0);
+  SaveLogISR(&scd_logger);
+  CommitSCDMeta();
 
   // re-enable wdt to restart device
   wdt_enable(WDTO_15MS);
-
-  // Update timer value in EEPROM while we wait for restart
-  eeprom_update_dword((uint32_t*)EEPROM_TIMER_T2, GetCounter());
 }
 
 /**
@@ -412,12 +474,11 @@ ISR(INT1_vect)
  */
 ISR(WDT_vect)
 {
-  // Log the event
-  LogByte1(&scd_logger, LOG_WDT_RESET, 0);
-
-  // Write the log to EEPROM and clear its contents
-  WriteLogEEPROM(&scd_logger);
-  ResetLogger(&scd_logger);
+  // Log the event and save the log before the reset
+  LogByteISR(&scd_logger, LOG_WDT_RESET, 0);
+  scdMeta.counter = nCounter;
+  SaveLogISR(&scd_logger);
+  CommitSCDMeta();
 }
 
 
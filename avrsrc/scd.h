@@ -41,10 +41,11 @@
 /// Maximum number of command-response pairs recorded when logging
 #define MAX_EXCHANGES 50
 
-/// EEPROM address for byte used on warm reset
+/// EEPROM address for byte used on warm reset (older versions, see scd_meta.h)
 #define EEPROM_WARM_RESET 0x0
 
 /// EEPROM address for counter value from T2 - 4 bytes little endian
+/// (older versions, see scd_meta.h)
 #define EEPROM_TIMER_T2 0x4
 
 /// Temporary space 1 - use this for any purpose, 4 bytes
@@ -53,23 +54,60 @@
 /// Temporary space 2 - use this for any purpose, 4 bytes
 #define EEPROM_TEMP_2 0x12
 
-/// EEPROM address for selected application
+/// EEPROM address for selected application (older versions)
 #define EEPROM_APPLICATION 0x32
 
-/// EEPROM address for transaction counter
+/// EEPROM address for transaction counter (older versions)
 #define EEPROM_COUNTER 0x40	
 
-/// EEPROM address for log high address pointer 
+/// EEPROM address for log high address pointer (older versions)
 #define EEPROM_TLOG_POINTER_HI 0x48
 
-/// EEPROM address for log low address pointer 
+/// EEPROM address for log low address pointer (older versions)
 #define EEPROM_TLOG_POINTER_LO 0x49
 
+/// EEPROM address for the selected log storage backend (LOG_SINK_TYPE)
+/// (older versions)
+#define EEPROM_LOG_SINK 0x4A
+
+/// EEPROM address for external log pointer - 4 bytes little endian
+#define EEPROM_XLOG_POINTER 0x4C
+
+/// EEPROM address for the log policy (log_policy_t and a check byte)
+#define EEPROM_LOG_POLICY 0x50
+
+/// EEPROM address for the metadata of the SCD: two copies of
+/// SCD_META_COPY_SIZE bytes, see scd_meta.h
+#define EEPROM_SCD_META 0x60
+
 /// EEPROM address for transaction log data
 #define EEPROM_TLOG_DATA 0x80
 
-/// EEPROM maximum allowed address
-#define EEPROM_MAX_ADDRESS 0xFE0
+/// Set to 1 to build the card cache (see scd_cardcache.h)
+#ifndef CARD_CACHE_ENABLED
+#define CARD_CACHE_ENABLED 0
+#endif
+
+/// EEPROM space for the card cache, taken from the end of the transaction
+/// log when the card cache is built
+#if CARD_CACHE_ENABLED
+#define EEPROM_CARD_CACHE_SIZE 0x120
+#else
+#define EEPROM_CARD_CACHE_SIZE 0
+#endif
+
+/// EEPROM maximum allowed address for the transaction log
+#define EEPROM_MAX_ADDRESS (0xEE0 - EEPROM_CARD_CACHE_SIZE)
+
+/// EEPROM address for the card cache, after the transaction log
+#define EEPROM_CARD_CACHE EEPROM_MAX_ADDRESS
+
+/// EEPROM address for the EMV flow script: 2 bytes length (little endian)
+/// followed by the script, see scd_script.h
+#define EEPROM_SCRIPT 0xEE0
+
+/// EEPROM space for the script, including the length
+#define EEPROM_SCRIPT_SIZE 0x100
 
 // External definitions
 extern char* appStrings[];
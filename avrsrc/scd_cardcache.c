@@ -0,0 +1,439 @@
+/**
+ * \file
+ * \brief scd_cardcache.c source file
+ *
+ * This file implements the card cache of the terminal applications (see
+ * scd_cardcache.h).
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emv.h"
+#include "scd.h"
+#include "scd_cardcache.h"
+#include "scd_logger.h"
+#include "scd_values.h"
+#include "terminal.h"
+#include "utils.h"
+
+#if CARD_CACHE_ENABLED
+
+/// Bytes of the entry covered by its CRC32 (all but the CRC32)
+#define CARD_CACHE_ENTRY_CHECKED (sizeof(card_cache_entry_t) - sizeof(uint32_t))
+
+/// Largest length of the static data objects kept after the entry
+#define CARD_CACHE_MAX_DATA \
+  (EEPROM_CARD_CACHE_SIZE - sizeof(card_cache_entry_t))
+
+/// Static data objects of the records kept in the card cache (tag1, tag2),
+/// in order of priority since not all of them may fit
+static const uint8_t cachedTags[][2] PROGMEM = {
+  {0x8C, 0},        // CDOL1
+  {0x8D, 0},        // CDOL2
+  {0x8E, 0},        // CVM list
+  {0x9F, 0x49},     // DDOL
+  {0x5F, 0x24},     // application expiration date
+  {0x5F, 0x25},     // application effective date
+  {0x5F, 0x28},     // issuer country code
+  {0x5F, 0x34},     // PAN sequence number
+  {0x9F, 0x07},     // application usage control
+  {0x9F, 0x0D},     // issuer action code - default
+  {0x9F, 0x0E},     // issuer action code - denial
+  {0x9F, 0x0F},     // issuer action code - online
+  {0x9F, 0x42},     // application currency code
+};
+
+/// Number of entries in cachedTags
+#define CARD_CACHE_TAGS (sizeof(cachedTags) / sizeof(cachedTags[0]))
+
+
+/* Static functions */
+
+/**
+ * Returns the CRC32 of the ATR of the ICC that was reset last
+ */
+static uint32_t GetATRHash()
+{
+  uint8_t atr[ICC_ATR_MAX_LEN];
+  uint8_t len;
+
+  len = GetICCATR(atr);
+  return UpdateCRC32Bytes(CRC32_INIT, atr, len);
+}
+
+/**
+ * Updates a CRC32 with the data objects of a RECORD
+ */
+static uint32_t HashRECORD(uint32_t crc, const RECORD *rec)
+{
+  const TLV *tlv;
+  uint8_t i;
+
+  if(rec == NULL)
+    return crc;
+
+  for(i = 0; i < rec->count; i++)
+  {
+    tlv = rec->objects[i];
+    if(tlv == NULL)
+      continue;
+    crc = UpdateCRC32(crc, tlv->tag1);
+    crc = UpdateCRC32(crc, tlv->tag2);
+    crc = UpdateCRC32(crc, tlv->len);
+    if(tlv->value != NULL)
+      crc = UpdateCRC32Bytes(crc, tlv->value, tlv->len);
+  }
+
+  return crc;
+}
+
+/**
+ * Returns the CRC32 of a FCI Template, including the DF name (AID)
+ */
+static uint32_t HashFCI(const FCITemplate *fci)
+{
+  uint32_t crc = CRC32_INIT;
+
+  if(fci->dfName != NULL)
+    crc = UpdateCRC32Bytes(crc, fci->dfName, fci->lenDFName);
+
+  return HashRECORD(crc, fci->fciData);
+}
+
+/**
+ * Returns the CRC32 of the AIP and AFL returned by GET PROCESSING OPTS
+ */
+static uint32_t HashAppInfo(const APPINFO *appInfo)
+{
+  uint32_t crc;
+  uint8_t i;
+
+  crc = UpdateCRC32Bytes(CRC32_INIT, appInfo->aip, 2);
+  for(i = 0; i < appInfo->count; i++)
+    if(appInfo->aflList[i] != NULL)
+      crc = UpdateCRC32Bytes(crc,
+          (const uint8_t*)appInfo->aflList[i], sizeof(AFL));
+
+  return crc;
+}
+
+/**
+ * Returns the CRC32 of the PAN in a RECORD, or 0 if there is no PAN
+ */
+static uint32_t HashPAN(RECORD *rec)
+{
+  const TLV *pan;
+
+  pan = GetTLVFromRECORD(rec, 0x5A, 0);
+  if(pan == NULL || pan->value == NULL)
+    return 0;
+
+  return UpdateCRC32Bytes(CRC32_INIT, pan->value, pan->len);
+}
+
+/**
+ * Reads again the record holding the PAN and checks that it is the same
+ * as when the card cache entry was saved.
+ *
+ * @return the data objects of the record if it is the same, or NULL
+ * otherwise. The caller must free it with FreeRECORD.
+ */
+static RECORD* CheckFingerprint(
+    uint8_t convention,
+    uint8_t TC1,
+    const card_cache_entry_t *entry,
+    log_struct_t *logger)
+{
+  CAPDU *command;
+  RAPDU *response;
+  RECORD *rec = NULL;
+
+  command = MakeCommandC(CMD_READ_RECORD, NULL, 0);
+  if(command == NULL)
+    return NULL;
+  command->cmdHeader->p1 = entry->record.p1;
+  command->cmdHeader->p2 = entry->record.p2;
+  response = TerminalSendT0Command(command, convention, TC1, logger);
+  FreeCAPDU(command);
+  if(response == NULL)
+    return NULL;
+
+  if(response->repStatus->sw1 == 0x90 && response->repStatus->sw2 == 0 &&
+      response->repData != NULL &&
+      UpdateCRC32Bytes(CRC32_INIT, response->repData, response->lenData) ==
+      entry->record.crc)
+  {
+    rec = ParseRECORD(response->repData, response->lenData);
+    if(rec != NULL && HashPAN(rec) != entry->panHash)
+    {
+      FreeRECORD(rec);
+      rec = NULL;
+    }
+  }
+  FreeRAPDU(response);
+
+  return rec;
+}
+
+/**
+ * Adds the static data objects kept after the card cache entry to the
+ * data objects of the record holding the PAN, except those already there.
+ *
+ * @param entry the card cache entry
+ * @param rec the data objects returned by CheckFingerprint
+ * @return rec with the static data objects or NULL if an error occurs,
+ * in which case rec is freed
+ */
+static RECORD* LoadStaticData(const card_cache_entry_t *entry, RECORD *rec)
+{
+  RECORD *cached;
+  TLV **objects;
+  uint8_t *data;
+  uint8_t i;
+
+  if(entry->lenData == 0)
+    return rec;
+
+  data = (uint8_t*)malloc(entry->lenData);
+  if(data == NULL)
+    goto enderror;
+  eeprom_read_block(data,
+      (void*)(EEPROM_CARD_CACHE + sizeof(card_cache_entry_t)),
+      entry->lenData);
+  cached = ParseManyTLV(data, entry->lenData);
+  free(data);
+  if(cached == NULL)
+    goto enderror;
+
+  objects = (TLV**)realloc(rec->objects,
+      (rec->count + cached->count) * sizeof(TLV*));
+  if(objects == NULL)
+  {
+    FreeRECORD(cached);
+    goto enderror;
+  }
+  rec->objects = objects;
+
+  // move the objects to rec, leaving the duplicates to be freed
+  for(i = 0; i < cached->count; i++)
+  {
+    if(GetTLVFromRECORD(rec, cached->objects[i]->tag1,
+        cached->objects[i]->tag2) != NULL)
+      continue;
+    rec->objects[rec->count++] = cached->objects[i];
+    cached->objects[i] = NULL;
+  }
+  FreeRECORD(cached);
+
+  return rec;
+
+enderror:
+  FreeRECORD(rec);
+  return NULL;
+}
+
+/**
+ * Saves a new card cache entry for the card, replacing the previous one.
+ * Only the bytes that change are written (eeprom_update_block) and the
+ * entry is not valid while it is being written.
+ *
+ * @param fci the FCI Template returned by SELECT
+ * @param appInfo the AIP and AFL returned by GET PROCESSING OPTS
+ * @param tData the data objects read from the records
+ * @param fingerprint the record holding the PAN
+ */
+static void SaveCardCache(
+    const FCITemplate *fci,
+    const APPINFO *appInfo,
+    RECORD *tData,
+    const RECORDFingerprint *fingerprint)
+{
+  card_cache_entry_t entry;
+  const TLV *tlv;
+  ByteArray *stream;
+  uint8_t *data;
+  uint8_t k, len = 0;
+
+  if(fingerprint->p1 == 0 || fci->dfName == NULL ||
+      fci->lenDFName > CARD_CACHE_AID_LEN)
+    return;
+
+  data = (uint8_t*)malloc(CARD_CACHE_MAX_DATA);
+  if(data == NULL)
+    return;
+
+  for(k = 0; k < CARD_CACHE_TAGS; k++)
+  {
+    tlv = GetTLVFromRECORD(tData, pgm_read_byte(&cachedTags[k][0]),
+        pgm_read_byte(&cachedTags[k][1]));
+    if(tlv == NULL)
+      continue;
+    stream = SerializeTLV(tlv);
+    if(stream == NULL)
+      continue;
+    if(stream->len <= CARD_CACHE_MAX_DATA - len)
+    {
+      memcpy(&data[len], stream->bytes, stream->len);
+      len += stream->len;
+    }
+    FreeByteArray(stream);
+  }
+
+  memset(&entry, 0, sizeof(card_cache_entry_t));
+  entry.magic = CARD_CACHE_MAGIC;
+  entry.atrHash = GetATRHash();
+  entry.aidLen = fci->lenDFName;
+  memcpy(entry.aid, fci->dfName, fci->lenDFName);
+  entry.fciHash = HashFCI(fci);
+  entry.appInfoHash = HashAppInfo(appInfo);
+  entry.panHash = HashPAN(tData);
+  entry.record = *fingerprint;
+  entry.lenData = len;
+  entry.crc = UpdateCRC32Bytes(
+      UpdateCRC32Bytes(CRC32_INIT, (const uint8_t*)&entry,
+        CARD_CACHE_ENTRY_CHECKED), data, len);
+
+  eeprom_update_byte((uint8_t*)EEPROM_CARD_CACHE, 0);
+  eeprom_update_block(data,
+      (void*)(EEPROM_CARD_CACHE + sizeof(card_cache_entry_t)), len);
+  eeprom_update_block(&((const uint8_t*)&entry)[1],
+      (void*)(EEPROM_CARD_CACHE + 1), sizeof(card_cache_entry_t) - 1);
+  eeprom_update_byte((uint8_t*)EEPROM_CARD_CACHE, CARD_CACHE_MAGIC);
+
+  free(data);
+}
+
+
+/* Public functions */
+
+/**
+ * Loads the card cache entry and checks that it is valid and that it was
+ * saved for a card with the ATR of the ICC that was reset last. The
+ * entry must still be checked by GetTransactionDataCached.
+ *
+ * @param entry the entry is returned here
+ * @return CARD_CACHE_HIT if there is an entry for this ATR, with the AID
+ * to select, or CARD_CACHE_EMPTY otherwise
+ */
+uint8_t LoadCardCache(card_cache_entry_t *entry)
+{
+  uint32_t crc;
+  uint8_t k;
+
+  eeprom_read_block(entry, (void*)EEPROM_CARD_CACHE,
+      sizeof(card_cache_entry_t));
+  if(entry->magic != CARD_CACHE_MAGIC ||
+      entry->aidLen > CARD_CACHE_AID_LEN ||
+      entry->lenData > CARD_CACHE_MAX_DATA)
+    goto empty;
+
+  crc = UpdateCRC32Bytes(CRC32_INIT, (const uint8_t*)entry,
+      CARD_CACHE_ENTRY_CHECKED);
+  for(k = 0; k < entry->lenData; k++)
+    crc = UpdateCRC32(crc, eeprom_read_byte(
+          (uint8_t*)(EEPROM_CARD_CACHE + sizeof(card_cache_entry_t) + k)));
+  if(crc != entry->crc || entry->atrHash != GetATRHash())
+    goto empty;
+
+  return CARD_CACHE_HIT;
+
+empty:
+  entry->magic = 0;
+  return CARD_CACHE_EMPTY;
+}
+
+/**
+ * Returns the data objects of the card needed by the terminal. If the
+ * card cache entry matches this card (see scd_cardcache.h) they are
+ * taken from the cache, after reading only the record holding the PAN.
+ * Otherwise all the records are read (see GetTransactionData) and the
+ * entry is replaced. The result is logged with LOG_CARD_CACHE.
+ *
+ * The offline authentication data is not kept in the cache, so all the
+ * records are read if it is requested.
+ *
+ * @param convention parameter from ATR
+ * @param TC1 parameter from ATR
+ * @param entry the entry returned by LoadCardCache
+ * @param fci the FCI Template returned by SELECT
+ * @param appInfo the AIP and AFL returned by GET PROCESSING OPTS
+ * @param offlineAuthData see GetTransactionData
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return a RECORD structure containing the data objects or NULL if an
+ * error occurs. The caller must free it with FreeRECORD.
+ */
+RECORD* GetTransactionDataCached(
+    uint8_t convention,
+    uint8_t TC1,
+    const card_cache_entry_t *entry,
+    const FCITemplate *fci,
+    const APPINFO *appInfo,
+    ByteArray *offlineAuthData,
+    log_struct_t *logger)
+{
+  RECORDFingerprint fingerprint;
+  RECORD *data = NULL;
+  uint8_t result;
+
+  if(fci == NULL || appInfo == NULL)
+    return NULL;
+
+  if(offlineAuthData != NULL)
+    result = CARD_CACHE_OFFLINE_AUTH;
+  else if(entry == NULL || entry->magic != CARD_CACHE_MAGIC)
+    result = CARD_CACHE_EMPTY;
+  else if(entry->fciHash != HashFCI(fci) ||
+      entry->appInfoHash != HashAppInfo(appInfo))
+    result = CARD_CACHE_CHANGED;
+  else if((data = CheckFingerprint(convention, TC1, entry, logger)) == NULL)
+    result = CARD_CACHE_FINGERPRINT;
+  else
+  {
+    data = LoadStaticData(entry, data);
+    result = (data != NULL) ? CARD_CACHE_HIT : CARD_CACHE_EMPTY;
+  }
+
+  if(logger)
+    LogByte1(logger, LOG_CARD_CACHE, result);
+  if(data != NULL)
+    return data;
+
+  data = GetTransactionData(
+      convention, TC1, appInfo, offlineAuthData, &fingerprint, logger);
+  if(data != NULL && offlineAuthData == NULL)
+    SaveCardCache(fci, appInfo, data, &fingerprint);
+
+  return data;
+}
+
+#endif // CARD_CACHE_ENABLED
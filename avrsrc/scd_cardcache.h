@@ -0,0 +1,125 @@
+/**
+ * \file
+ * \brief scd_cardcache.h header file
+ *
+ * This file defines the card cache of the terminal applications. Each
+ * run of Terminal() reads the same static data from the card: the
+ * application selection tries the AIDs of the list until one is found
+ * and all the records given by the AFL are read, before the commands
+ * that are actually studied. The card cache keeps in EEPROM, for the
+ * last card used, the selected AID and the static data objects of the
+ * records needed later (e.g. CDOL1 and CDOL2, see the list in
+ * scd_cardcache.c), so the next run with the same card selects the AID
+ * directly, sends GET PROCESSING OPTS and reads only one record.
+ *
+ * The entry is keyed by the CRC32 of the ATR, the AID and the CRC32 of
+ * the PAN. Before the cached data is used, the FCI and the response to
+ * GET PROCESSING OPTS (AIP and AFL) must be the same as when the entry
+ * was saved, and the record holding the PAN is read again and must be
+ * the same as well. Otherwise all the records are read and the entry is
+ * replaced. The result (LOG_CARD_CACHE) and the time from the reset of
+ * the ICC until the card data was read (LOG_TIME_CARD_DATA) are logged,
+ * so runs with and without the cache can be compared.
+ *
+ * The cache is built only when CARD_CACHE_ENABLED is 1 (see the Makefile),
+ * and then takes EEPROM_CARD_CACHE_SIZE bytes from the end of the EEPROM
+ * log. Otherwise GetTransactionDataCached reads all the records.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_CARDCACHE_H_
+#define _SCD_CARDCACHE_H_
+
+#include <stdint.h>
+
+#include "emv.h"
+#include "scd.h"
+#include "scd_logger.h"
+#include "terminal.h"
+
+/// Largest AID kept in the card cache
+#define CARD_CACHE_AID_LEN 16
+
+/// Value of the first byte of a card cache entry (changes with the layout)
+#define CARD_CACHE_MAGIC 0xC1
+
+/**
+ * Result of the card cache for a run, logged with LOG_CARD_CACHE
+ */
+typedef enum {
+    CARD_CACHE_HIT = 0,             // the cached data was used
+    CARD_CACHE_EMPTY = 1,           // no entry for the ATR of this card
+    CARD_CACHE_CHANGED = 2,         // the FCI, AIP or AFL are different
+    CARD_CACHE_FINGERPRINT = 3,     // the record with the PAN is different
+    CARD_CACHE_OFFLINE_AUTH = 4,    // offline authentication data needed
+} CARD_CACHE_RESULT;
+
+/**
+ * Card cache entry, saved at EEPROM_CARD_CACHE and followed by lenData
+ * bytes of static data objects (BER-TLV)
+ */
+typedef struct {
+    uint8_t magic;                  // CARD_CACHE_MAGIC
+    uint32_t atrHash;               // CRC32 of the ATR
+    uint8_t aidLen;                 // length of the selected AID
+    uint8_t aid[CARD_CACHE_AID_LEN]; // selected AID (DF name of the FCI)
+    uint32_t fciHash;               // CRC32 of the FCI
+    uint32_t appInfoHash;           // CRC32 of the AIP and AFL
+    uint32_t panHash;               // CRC32 of the PAN (5A)
+    RECORDFingerprint record;       // the record holding the PAN
+    uint8_t lenData;                // length of the static data objects
+    uint32_t crc;                   // CRC32 of the entry and data (last)
+} card_cache_entry_t;
+
+#if CARD_CACHE_ENABLED
+
+/// Load the card cache entry for the ICC that was reset last
+uint8_t LoadCardCache(card_cache_entry_t *entry);
+
+/// Return the static data of the card from the card cache or the card
+RECORD* GetTransactionDataCached(
+        uint8_t convention,
+        uint8_t TC1,
+        const card_cache_entry_t *entry,
+        const FCITemplate *fci,
+        const APPINFO *appInfo,
+        ByteArray *offlineAuthData,
+        log_struct_t *logger);
+
+#else
+
+#define LoadCardCache(entry) CARD_CACHE_EMPTY
+
+#define GetTransactionDataCached(convention, TC1, entry, fci, appInfo, \
+    offlineAuthData, logger) \
+    GetTransactionData(convention, TC1, appInfo, offlineAuthData, NULL, logger)
+
+#endif // CARD_CACHE_ENABLED
+
+#endif // _SCD_CARDCACHE_H_
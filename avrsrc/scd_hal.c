@@ -36,6 +36,7 @@
 
 #include <avr/interrupt.h> 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <avr/wdt.h>
 #include <util/delay.h>
 
@@ -49,6 +50,158 @@
 /* Global Variables */
 volatile uint32_t syncCounter;      // counter updated regularly, e.g. by timer 2
 
+/* Line codec */
+
+/**
+ * Line codec of one convention. line holds the line levels of the data
+ * bits of each byte, in transmission order (bit 0 is sent first, 1 means
+ * high). parity holds the line level of the parity bit of each byte,
+ * packed one bit per byte.
+ */
+typedef struct {
+  uint8_t line[256];
+  uint8_t parity[32];
+} line_codec_t;
+
+/**
+ * Line codecs of the direct (0) and inverse (1) conventions. In direct
+ * convention the line levels are the byte itself. In inverse convention
+ * the byte is complemented and sent most significant bit first; this
+ * mapping is its own inverse, so the same table is used to encode and
+ * decode. Parity is even in both conventions, which means an even number
+ * of high levels in direct convention and an even number of low levels in
+ * inverse convention.
+ *
+ * The convention of each link is found from TS in the ATR and then only
+ * selects the codec (see GetLineCodec), so the send and receive functions
+ * run the same code in both conventions.
+ */
+static const line_codec_t lineCodecs[2] PROGMEM = {
+  {
+    {
+      0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+      0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+      0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+      0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
+      0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27,
+      0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+      0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+      0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+      0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+      0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+      0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
+      0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F,
+      0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+      0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+      0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+      0x78, 0x79, 0x7A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F,
+      0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+      0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x8D, 0x8E, 0x8F,
+      0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+      0x98, 0x99, 0x9A, 0x9B, 0x9C, 0x9D, 0x9E, 0x9F,
+      0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+      0xA8, 0xA9, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF,
+      0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7,
+      0xB8, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF,
+      0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7,
+      0xC8, 0xC9, 0xCA, 0xCB, 0xCC, 0xCD, 0xCE, 0xCF,
+      0xD0, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7,
+      0xD8, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF,
+      0xE0, 0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7,
+      0xE8, 0xE9, 0xEA, 0xEB, 0xEC, 0xED, 0xEE, 0xEF,
+      0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7,
+      0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF
+    },
+    {
+      0x96, 0x69, 0x69, 0x96, 0x69, 0x96, 0x96, 0x69,
+      0x69, 0x96, 0x96, 0x69, 0x96, 0x69, 0x69, 0x96,
+      0x69, 0x96, 0x96, 0x69, 0x96, 0x69, 0x69, 0x96,
+      0x96, 0x69, 0x69, 0x96, 0x69, 0x96, 0x96, 0x69
+    }
+  },
+  {
+    {
+      0xFF, 0x7F, 0xBF, 0x3F, 0xDF, 0x5F, 0x9F, 0x1F,
+      0xEF, 0x6F, 0xAF, 0x2F, 0xCF, 0x4F, 0x8F, 0x0F,
+      0xF7, 0x77, 0xB7, 0x37, 0xD7, 0x57, 0x97, 0x17,
+      0xE7, 0x67, 0xA7, 0x27, 0xC7, 0x47, 0x87, 0x07,
+      0xFB, 0x7B, 0xBB, 0x3B, 0xDB, 0x5B, 0x9B, 0x1B,
+      0xEB, 0x6B, 0xAB, 0x2B, 0xCB, 0x4B, 0x8B, 0x0B,
+      0xF3, 0x73, 0xB3, 0x33, 0xD3, 0x53, 0x93, 0x13,
+      0xE3, 0x63, 0xA3, 0x23, 0xC3, 0x43, 0x83, 0x03,
+      0xFD, 0x7D, 0xBD, 0x3D, 0xDD, 0x5D, 0x9D, 0x1D,
+      0xED, 0x6D, 0xAD, 0x2D, 0xCD, 0x4D, 0x8D, 0x0D,
+      0xF5, 0x75, 0xB5, 0x35, 0xD5, 0x55, 0x95, 0x15,
+      0xE5, 0x65, 0xA5, 0x25, 0xC5, 0x45, 0x85, 0x05,
+      0xF9, 0x79, 0xB9, 0x39, 0xD9, 0x59, 0x99, 0x19,
+      0xE9, 0x69, 0xA9, 0x29, 0xC9, 0x49, 0x89, 0x09,
+      0xF1, 0x71, 0xB1, 0x31, 0xD1, 0x51, 0x91, 0x11,
+      0xE1, 0x61, 0xA1, 0x21, 0xC1, 0x41, 0x81, 0x01,
+      0xFE, 0x7E, 0xBE, 0x3E, 0xDE, 0x5E, 0x9E, 0x1E,
+      0xEE, 0x6E, 0xAE, 0x2E, 0xCE, 0x4E, 0x8E, 0x0E,
+      0xF6, 0x76, 0xB6, 0x36, 0xD6, 0x56, 0x96, 0x16,
+      0xE6, 0x66, 0xA6, 0x26, 0xC6, 0x46, 0x86, 0x06,
+      0xFA, 0x7A, 0xBA, 0x3A, 0xDA, 0x5A, 0x9A, 0x1A,
+      0xEA, 0x6A, 0xAA, 0x2A, 0xCA, 0x4A, 0x8A, 0x0A,
+      0xF2, 0x72, 0xB2, 0x32, 0xD2, 0x52, 0x92, 0x12,
+      0xE2, 0x62, 0xA2, 0x22, 0xC2, 0x42, 0x82, 0x02,
+      0xFC, 0x7C, 0xBC, 0x3C, 0xDC, 0x5C, 0x9C, 0x1C,
+      0xEC, 0x6C, 0xAC, 0x2C, 0xCC, 0x4C, 0x8C, 0x0C,
+      0xF4, 0x74, 0xB4, 0x34, 0xD4, 0x54, 0x94, 0x14,
+      0xE4, 0x64, 0xA4, 0x24, 0xC4, 0x44, 0x84, 0x04,
+      0xF8, 0x78, 0xB8, 0x38, 0xD8, 0x58, 0x98, 0x18,
+      0xE8, 0x68, 0xA8, 0x28, 0xC8, 0x48, 0x88, 0x08,
+      0xF0, 0x70, 0xB0, 0x30, 0xD0, 0x50, 0x90, 0x10,
+      0xE0, 0x60, 0xA0, 0x20, 0xC0, 0x40, 0x80, 0x00
+    },
+    {
+      0x69, 0x96, 0x96, 0x69, 0x96, 0x69, 0x69, 0x96,
+      0x96, 0x69, 0x69, 0x96, 0x69, 0x96, 0x96, 0x69,
+      0x96, 0x69, 0x69, 0x96, 0x69, 0x96, 0x96, 0x69,
+      0x69, 0x96, 0x96, 0x69, 0x96, 0x69, 0x69, 0x96
+    }
+  }
+};
+
+/**
+ * Returns the line codec of a convention. The send and receive functions
+ * select it once, before the start bit, so the codec lookups only add
+ * the byte to the codec address.
+ *
+ * @param inverse_convention different than 0 for inverse convention
+ * @return the codec, in program memory
+ */
+static inline const line_codec_t* GetLineCodec(uint8_t inverse_convention)
+{
+  return inverse_convention ? &lineCodecs[1] : &lineCodecs[0];
+}
+
+/**
+ * Converts a byte to the line levels of its data bits or the line levels
+ * back to a byte. This is done outside the bit loops of the send and
+ * receive functions.
+ *
+ * @param byte the byte or line levels to be converted
+ * @param codec the line codec of the convention (see GetLineCodec)
+ * @return the converted value
+ */
+static inline uint8_t LineCodeByte(uint8_t byte, const line_codec_t *codec)
+{
+  return pgm_read_byte(&codec->line[byte]);
+}
+
+/**
+ * Returns the line level of the parity bit of a byte.
+ *
+ * @param byte the byte (not its line levels)
+ * @param codec the line codec of the convention (see GetLineCodec)
+ * @return 1 if the parity bit is high, 0 otherwise
+ */
+static inline uint8_t LineParityBit(uint8_t byte, const line_codec_t *codec)
+{
+  return (pgm_read_byte(&codec->parity[byte >> 3]) >> (byte & 0x07)) & 0x01;
+}
+
 /* SCD to Terminal functions */
 
 
@@ -302,23 +455,59 @@ uint8_t ReadTimerT2()
   return TCNT2;	
 }
 
+/**
+ * Returns the sync counter extended with the value of the timer T2, i.e.
+ * the time in units of T2 clocks (COUNTER_FINE_US).
+ *
+ * If T2 was cleared but the interrupt that increments the counter did not
+ * run yet (e.g. interrupts are disabled) the counter is incremented here.
+ *
+ * @return the sync counter times the T2 period plus the value of T2
+ * @sa StartTimerT2
+ */
+uint32_t GetCounterFine()
+{
+  uint8_t sreg, t;
+  uint32_t counter;
+
+  sreg = SREG;
+  cli();
+  counter = GetCounter();
+  t = TCNT2;
+  if((TIFR2 & _BV(OCF2A)) && t < (TIMER_T2_TOP + 1) / 2)
+    counter++;
+  SREG = sreg;
+
+  return counter * (TIMER_T2_TOP + 1) + t;
+}
+
 
 /**
  * Starts the timer T2 using the internal clock CLK_IO.
- * The current setup is for an interrupt frequency f_t2_int = 976.5625 Hz.
- * That means that each value of the udpated counter represents 1.024 ms.
+ * The current setup is for an interrupt frequency f_t2_int = 919.1 Hz
+ * (17 clocks of CLK_IO / 1024). That means that each value of the udpated
+ * counter represents 1.088 ms.
+ *
+ * With the profiler (PROFILE_ENABLED, see scd_profile.h) the timer counts
+ * 256 clocks of CLK_IO / 64 between interrupts instead, for an interrupt
+ * frequency of 976.5625 Hz (1.024 ms), so its value gives the time within
+ * each counter unit in steps of 4 us.
  * 
  * @sa ReadTimerT2
  */
 void StartTimerT2()
 {
   // We use this to generate an interrupt with the given frequency
-  OCR2A = 16;                     // interrupt every 16 timer clocks
+  OCR2A = TIMER_T2_TOP;           // interrupt every TIMER_T2_TOP + 1 clocks
   TIMSK2 |= _BV(OCIE2A);
 
   TCNT2 = 0;
   TCCR2A = _BV(WGM21);			// CTC mode, No toggle on OC2X pins, no PWM
+#if PROFILE_ENABLED
+  TCCR2B = _BV(CS22);           // F_CLK_T2 = F_CLK_IO / 64
+#else
   TCCR2B = _BV(CS22) | _BV(CS21) | _BV(CS20);  // F_CLK_T2 = F_CLK_IO / 1024
+#endif
 }
 
 /**
@@ -459,19 +648,50 @@ uint8_t LoopTerminalETU(uint32_t nEtus)
 }
 
 
+/**
+ * Restarts the count of terminal ETUs used by TerminalETUElapsed.
+ * The terminal clock counter must be started before calling this function
+ * and any transmission to the terminal restarts the count as well.
+ */
+void StartTerminalETUCount()
+{
+  Write16bitRegister(&OCR3A, ETU_TERMINAL);	// set ETU
+  Write16bitRegister(&TCNT3, 1);				// TCNT3 = 1	
+  TIFR3 |= _BV(OCF3A);						// Reset OCR3A compare flag		
+}
+
+/**
+ * Checks without blocking if one terminal ETU has elapsed since the last
+ * call or since StartTerminalETUCount was called. The caller must poll this
+ * at least once per ETU, otherwise some ETUs will not be counted.
+ *
+ * @return non-zero if one ETU has elapsed, zero otherwise
+ */
+uint8_t TerminalETUElapsed()
+{
+  if(bit_is_clear(TIFR3, OCF3A))
+    return 0;
+
+  TIFR3 |= _BV(OCF3A);
+  return 1;
+}
+
+
 /**
  * Sends a byte to the terminal without parity error retransmission
  * 
  * @param byte byte to be sent
- * @param inverse_convention different than 0 if inverse
- * convention is to be used
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used, 0 for direct convention
  * 
  * The terminal clock counter must be started before calling this function
  */
 void SendByteTerminalNoParity(uint8_t byte, uint8_t inverse_convention)
 {
-  uint8_t bitval, i, parity;
-  volatile uint8_t tmp;	
+  uint8_t i, line, parity;
+  const line_codec_t *codec;
+
+  codec = GetLineCodec(inverse_convention);
 
   // check we have clock from terminal to avoid damage
   // assuming the counter is started
@@ -494,47 +714,29 @@ void SendByteTerminalNoParity(uint8_t byte, uint8_t inverse_convention)
   // start bit
   TCCR3A = 0x08;
 
-  // while sending the start bit convert the byte if necessary
-  // to match inverse conversion	
-  if(inverse_convention)
-  {	
-    tmp = ~byte;	
-    byte = 0;	
-    for(i = 0; i < 8; i++)
-    {
-      bitval = tmp & _BV((7-i));
-      if(bitval) byte = byte | _BV(i);
-    }
-  }
-
+  // while sending the start bit get the line levels of the data
+  // and parity bits, so the loop below only needs to shift them out
+  line = LineCodeByte(byte, codec);
+  parity = LineParityBit(byte, codec);
 
   while(bit_is_clear(TIFR3, OCF3A));
   TIFR3 |= _BV(OCF3A);
 
   // byte value
-  parity = 0;
   for(i = 0; i < 8; i++)
   {
-    bitval = (uint8_t) (byte & (uint8_t)(1 << i));
-
-    if(bitval != 0)
-    {
+    if(line & 0x01)
       TCCR3A = 0x0C;
-      if(!inverse_convention) parity = parity ^ 1;
-    }
     else
-    {
-      TCCR3A = 0x08;		
-      if(inverse_convention) parity = parity ^ 1;
-    }
+      TCCR3A = 0x08;
+    line = line >> 1;
 
     while(bit_is_clear(TIFR3, OCF3A));
     TIFR3 |= _BV(OCF3A);
   }
 
   // parity bit
-  if((!inverse_convention && parity != 0) || 
-      (inverse_convention && parity == 0))
+  if(parity)
     TCCR3A = 0x0C;		
   else
     TCCR3A = 0x08;
@@ -550,14 +752,14 @@ void SendByteTerminalNoParity(uint8_t byte, uint8_t inverse_convention)
   TCCR3A = 0x0C;						// set OC3C to 1
   DDRC &= ~(_BV(PC4));
   PORTC |= _BV(PC4);		 
-}	
+}
 
 /**
  * Sends a byte to the terminal with parity error retransmission
  * 
  * @param byte byte to be sent
- * @param inverse_convention different than 0 if inverse
- * convention is to be used
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used, 0 for direct convention
  * @return 0 if successful, non-zero otherwise
  * 
  * As in the NoParity version, this function relies on counter started
@@ -631,8 +833,8 @@ uint8_t WaitForTerminalData(uint16_t max_cycles)
  * Receives a byte from the terminal without parity checking.
  * This function also checks if the terminal reset line is low.
  *  
- * @param inverse_convention different than 0 if inverse
- * convention is to be used
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used, 0 for direct convention
  * @param r_byte contains the byte read on return
  * @param max_wait the maximum number of cycles to wait for the reset or the
  * IO line to become low. Give 0 to wait indefinitely.
@@ -649,9 +851,12 @@ uint8_t GetByteTerminalNoParity(
 {
   volatile uint8_t bit;
   volatile uint8_t tio;
-  uint8_t i, byte, parity;
+  uint8_t i, line, parity;
+  const line_codec_t *codec;
   uint32_t cnt;
 
+  codec = GetLineCodec(inverse_convention);
+
   TCCR3A = 0x0C;										// set OC3C because of chip behavior
   DDRC &= ~(_BV(PC4));								// Set PC4 (OC3C) as input	
   PORTC |= _BV(PC4);									// enable pull-up	
@@ -691,32 +896,21 @@ uint8_t GetByteTerminalNoParity(
   bit = bit_is_set(PINC, PC4);	
   Write16bitRegister(&OCR3A, ETU_TERMINAL);			// OCR3A = 1 ETU => next bit at 1.5 ETU
   *r_byte = 0;
-  byte = 0;
-  parity = 0;	
+  line = 0;
   if(bit)
     return RET_ERROR;	
 
-  // read the byte in correct conversion mode
+  // read the line levels of the data bits, the conversion
+  // is done after the parity bit
   for(i = 0; i < 8; i++)
   {
     while(bit_is_clear(TIFR3, OCF3A));
     TIFR3 |= _BV(OCF3A);
-    bit = bit_is_set(PINC, PC4);
-
-    if(inverse_convention && bit == 0)
-    {
-      byte = byte | _BV(7-i);
-      parity = parity ^ 1;
-    }
-    else if(inverse_convention == 0 && bit != 0)
-    {
-      byte = byte | _BV(i);
-      parity = parity ^ 1;
-    }
+    line = line >> 1;
+    if(bit_is_set(PINC, PC4))
+      line = line | 0x80;
   }
 
-  *r_byte = byte;
-
 
   // read the parity bit
   while(bit_is_clear(TIFR3, OCF3A));
@@ -724,21 +918,15 @@ uint8_t GetByteTerminalNoParity(
   bit = bit_is_set(PINC, PC4);
 
   // wait 0.5 ETUs to for parity bit to be completely received
-  //Write16bitRegister(&OCR3A, 186);	
+  // and convert the byte in the meantime
   Write16bitRegister(&OCR3A, ETU_HALF(ETU_TERMINAL));	
+  *r_byte = LineCodeByte(line, codec);
+  parity = LineParityBit(*r_byte, codec);
   while(bit_is_clear(TIFR3, OCF3A));
   TIFR3 |= _BV(OCF3A);	
 
-  if(inverse_convention)
-  { 
-    if(parity && bit) return 1;
-    if(!parity && !bit) return 1;		
-  }
-  else
-  {
-    if(parity && !bit) return 1;
-    if(!parity && bit) return 1;		
-  }
+  if(parity != (bit ? 1 : 0))
+    return 1;
 
   return 0;	
 }
@@ -746,8 +934,8 @@ uint8_t GetByteTerminalNoParity(
 /**
  * Receives a byte from the terminal with parity checking
  *  
- * @param inverse_convention different than 0 if inverse
- * convention is to be used
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used, 0 for direct convention
  * @param r_byte contains the byte read on return
  * @param max_wait the maximum number of cycles to wait for the reset or the
  * IO line to become low. Give 0 to wait indefinitely.
@@ -900,11 +1088,21 @@ uint8_t WaitForICCData(uint32_t max_cycles)
   return result;	
 }
 
+/**
+ * Get the status of the ICC I/O line
+ *
+ * @return 1 if the line is high or 0 if low (e.g. start bit)
+ */
+uint8_t GetICCIOLine()
+{
+  return bit_is_set(PINB, PB6);
+}
+
 /**
  * Receives a byte from the ICC without parity checking
  * 
- * @param inverse_convention different than 0 if inverse
- * convention is to be used * 
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used, 0 for direct convention
  * @param r_byte contains the byte read on return
  * @return zero if read was successful, non-zero otherwise
  * 
@@ -913,7 +1111,10 @@ uint8_t WaitForICCData(uint32_t max_cycles)
 uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte)
 {
   volatile uint8_t bit;
-  uint8_t i, byte, parity;
+  uint8_t i, line, parity;
+  const line_codec_t *codec;
+
+  codec = GetLineCodec(inverse_convention);
 
   TCCR1A = 0x30;									// set OC1B to 1 on compare match
   DDRB &= ~(_BV(PB6));							// Set I/O (PB6) to reception mode
@@ -938,52 +1139,36 @@ uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte)
   bit = bit_is_set(PINB, PB6);	
   Write16bitRegister(&OCR1A, ETU_ICC);			// OCR1A = 1 ETU => next bit at 1.5 ETU
   *r_byte = 0;
-  byte = 0;
-  parity = 0;	
+  line = 0;
   if(bit)
     return RET_ERROR;	
 
-  // read the byte in correct conversion mode
+  // read the line levels of the data bits, the conversion
+  // is done after the parity bit
   for(i = 0; i < 8; i++)
   {
     while(bit_is_clear(TIFR1, OCF1A));
     TIFR1 |= _BV(OCF1A);
-    bit = bit_is_set(PINB, PB6);
-
-    if(inverse_convention && bit == 0)
-    {
-      byte = byte | _BV(7-i);
-      parity = parity ^ 1;
-    }
-    else if(inverse_convention == 0 && bit != 0)
-    {
-      byte = byte | _BV(i);
-      parity = parity ^ 1;
-    }
+    line = line >> 1;
+    if(bit_is_set(PINB, PB6))
+      line = line | 0x80;
   }
 
-  *r_byte = byte;
-
   // read the parity bit
   while(bit_is_clear(TIFR1, OCF1A));
   TIFR1 |= _BV(OCF1A);
   bit = bit_is_set(PINB, PB6);
 
   // wait 0.5 ETUs to for parity bit to be completely received
+  // and convert the byte in the meantime
   Write16bitRegister(&OCR1A, ETU_HALF(ETU_ICC));	
+  *r_byte = LineCodeByte(line, codec);
+  parity = LineParityBit(*r_byte, codec);
   while(bit_is_clear(TIFR1, OCF1A));
   TIFR1 |= _BV(OCF1A);		
 
-  if(inverse_convention)
-  { 
-    if(parity && bit) return RET_ERROR;
-    if(!parity && !bit) return RET_ERROR;		
-  }
-  else
-  {
-    if(parity && !bit) return RET_ERROR;
-    if(!parity && bit) return RET_ERROR;		
-  }
+  if(parity != (bit ? 1 : 0))
+    return RET_ERROR;
 
   return 0;	
 }
@@ -992,8 +1177,8 @@ uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte)
 /**
  * Receives a byte from the ICC with parity checking
  * 
- * @param inverse_convention different than 0 if inverse
- * convention is to be used * 
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used, 0 for direct convention
  * @param r_byte contains the byte read on return
  * @return zero if read was successful, non-zero otherwise
  * 
@@ -1043,15 +1228,17 @@ uint8_t GetByteICCParity(uint8_t inverse_convention, uint8_t *r_byte)
 /**
  * Sends a byte to the ICC without parity error retransmission
  * @param byte byte to be sent
- * @param inverse_convention different than 0 if inverse
- * convention is to be used
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used, 0 for direct convention
  * 
  * The ICC clock counter must be started before calling this function
  */
 void SendByteICCNoParity(uint8_t byte, uint8_t inverse_convention)
 {
-  uint8_t bitval, i, parity;
-  volatile uint8_t tmp;	
+  uint8_t i, line, parity;
+  const line_codec_t *codec;
+
+  codec = GetLineCodec(inverse_convention);
 
   if(!IsICCInserted())
     return;	
@@ -1071,47 +1258,29 @@ void SendByteICCNoParity(uint8_t byte, uint8_t inverse_convention)
   // start bit
   TCCR1A = 0x20;
 
-  // while sending the start bit convert the byte if necessary
-  // to match inverse conversion	
-  if(inverse_convention)
-  {	
-    tmp = ~byte;	
-    byte = 0;	
-    for(i = 0; i < 8; i++)
-    {
-      bitval = tmp & _BV((7-i));
-      if(bitval) byte = byte | _BV(i);
-    }
-  }
-
+  // while sending the start bit get the line levels of the data
+  // and parity bits, so the loop below only needs to shift them out
+  line = LineCodeByte(byte, codec);
+  parity = LineParityBit(byte, codec);
 
   while(bit_is_clear(TIFR1, OCF1A));
   TIFR1 |= _BV(OCF1A);
 
   // byte value
-  parity = 0;
   for(i = 0; i < 8; i++)
   {
-    bitval = (uint8_t) (byte & (uint8_t)(1 << i));
-
-    if(bitval != 0)
-    {
+    if(line & 0x01)
       TCCR1A = 0x30;
-      if(!inverse_convention) parity = parity ^ 1;
-    }
     else
-    {
-      TCCR1A = 0x20;		
-      if(inverse_convention) parity = parity ^ 1;
-    }
+      TCCR1A = 0x20;
+    line = line >> 1;
 
     while(bit_is_clear(TIFR1, OCF1A));
     TIFR1 |= _BV(OCF1A);
   }
 
   // parity bit
-  if((!inverse_convention && parity != 0) ||
-      (inverse_convention && parity == 0))
+  if(parity)
     TCCR1A = 0x30;		
   else
     TCCR1A = 0x20;
@@ -1127,14 +1296,14 @@ void SendByteICCNoParity(uint8_t byte, uint8_t inverse_convention)
   TCCR1A = 0x30;						
   DDRB &= ~(_BV(PB6));
   PORTB |= _BV(PB6);		 
-}	
+}
 
 /**
  * Sends a byte to the ICC with parity error retransmission
  * 
  * @param byte byte to be sent
- * @param inverse_convention different than 0 if inverse
- * convention is to be used
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used, 0 for direct convention
  * @return 0 if successful, non-zero otherwise
  * 
  * As in the No Parity version, this function relies on counter started
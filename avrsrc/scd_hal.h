@@ -106,6 +106,12 @@ void SetCounter();
 /// Resets to 0 the value of the sync counter
 void ResetCounter();
 
+/// Writes a word into the flash page buffer, using the bootloader
+void BootFlashFillWord(uint16_t offset, uint16_t word);
+
+/// Erases and programs a flash page, using the bootloader
+void BootFlashWritePage(uint32_t address);
+
 /// Enables the Watch Dog Timer
 void EnableWDT(uint16_t ms);
 
@@ -145,6 +151,25 @@ uint8_t WaitTerminalClock(uint32_t max_wait);
 /// Reads the value of the timer T2
 uint8_t ReadTimerT2();
 
+/// Setup of the timer T2 (see StartTimerT2). The profiler needs the finer
+/// steps of CLK_IO / 64, which change the counter unit from 1.088 ms to
+/// 1.024 ms, so the other builds keep the steps of CLK_IO / 1024.
+#if PROFILE_ENABLED
+/// Last value of the timer T2 before it is cleared
+#define TIMER_T2_TOP 255
+/// Microseconds in each unit of GetCounterFine (64 CPU cycles at 16 MHz)
+#define COUNTER_FINE_US 4
+#else
+#define TIMER_T2_TOP 16
+#define COUNTER_FINE_US 64
+#endif
+
+/// Microseconds in each unit of the sync counter (see GetCounter)
+#define COUNTER_US ((TIMER_T2_TOP + 1) * COUNTER_FINE_US)
+
+/// Retrieves the sync counter followed by the value of the timer T2
+uint32_t GetCounterFine();
+
 /// Starts the T2 timer
 void StartTimerT2();
 
@@ -187,6 +212,12 @@ uint8_t GetByteTerminalNoParity(
 /// Waits (loops) for a number of nEtus based on the Terminal clock
 uint8_t LoopTerminalETU(uint32_t nEtus);
 
+/// Restarts the count of terminal ETUs
+void StartTerminalETUCount();
+
+/// Checks if one terminal ETU has elapsed, without blocking
+uint8_t TerminalETUElapsed();
+
 
 /** SCD to ICC functions **/
 
@@ -208,6 +239,9 @@ void LoopICCETU(uint8_t nEtus);
 /// Loops for max_cycles or until the I/O line from ICC becomes low
 uint8_t WaitForICCData(uint32_t max_cycles);
 
+/// Returns the status of the ICC I/O line
+uint8_t GetICCIOLine();
+
 /// Receives a byte from the ICC without parity checking
 uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte);
 
@@ -46,12 +46,21 @@
 #include <stdlib.h>
 #include <avr/eeprom.h>
 
+#include "scd_hal.h"
 #include "scd_io.h"    
+#include "scd_profile.h"
 
 // static vars
 static uint8_t lcd_count; // used by LCD functions
 static uint8_t lcd_state; // 0 if LcdOff, non-zero otherwise
 
+// USART ring buffers, indices are only modified by one side each
+static char usartRxBuffer[USART_RX_BUFFER_SIZE];
+static char usartTxBuffer[USART_TX_BUFFER_SIZE];
+static volatile uint8_t usartRxHead, usartRxTail;
+static volatile uint8_t usartTxHead, usartTxTail;
+static volatile usart_stats_t usartStats;
+
 
 //---------------------------------------------------------------
 
@@ -289,6 +298,7 @@ void SetLCDState(uint8_t state)
 uint8_t SendLCDCommand(uint8_t RS, uint8_t RW, uint8_t data, uint16_t delay_us)
 {
   uint8_t result, busy;
+  PROFILE_FUNCTION(PROFILE_LCD_COMMAND);
 
   do{
     result = GetLCDStatus();
@@ -620,23 +630,39 @@ uint8_t* ReadBytesEEPROM(uint16_t addr, uint16_t len)
 
 
 /**
- * Initiualise the USART port
+ * Initialise the USART port. Reception and transmission are interrupt
+ * driven, using the ring buffers below, so the caller must enable the
+ * global interrupts (sei) for the transmission to proceed without
+ * blocking.
  *
  * @param baudUBRR the baud UBRR parameter as given in table 18-12 of
  * the datasheet, page 203. The formula is: baud = FCLK / (16 * (baudUBRR + 1)).
  * So for FCLK = 16 MHz and desired BAUD = 9600 bps => baudUBRR = 103.
+ * @param doubleSpeed set to non-zero to enable the double speed mode (U2X),
+ * in which case baud = FCLK / (8 * (baudUBRR + 1)). This is needed for
+ * high rates, e.g. 1 Mbps => baudUBRR = 1.
+ * @sa USART_UBRR, USART_UBRR_2X
  */
-void InitUSART(uint16_t baudUBRR)
+void InitUSART(uint16_t baudUBRR, uint8_t doubleSpeed)
 {
   uint8_t sreg = SREG;
   cli();
 
+  usartRxHead = usartRxTail = 0;
+  usartTxHead = usartTxTail = 0;
+  memset((void*)&usartStats, 0, sizeof(usartStats));
+  usartStats.start = GetCounter();
+
   // Set baud
   UBRR1H = (uint8_t) (baudUBRR >> 8);
   UBRR1L = (uint8_t) (baudUBRR & 0xFF);
+  if(doubleSpeed)
+    UCSR1A = (1 << U2X1);
+  else
+    UCSR1A = 0;
 
-  // Enable receiver and transmitter
-  UCSR1B = (1 << RXEN1) || (1 << TXEN1);
+  // Enable receiver, transmitter and the receive interrupt
+  UCSR1B = (1 << RXEN1) | (1 << TXEN1) | (1 << RXCIE1);
 
   // Set frame format: 8 data, 1 stop bit
   UCSR1C = (3 << UCSZ10);
@@ -652,30 +678,116 @@ void DisableUSART()
 }
 
 /**
- * Transmit a character throught the USART. Method as in the datasheet.
+ * Moves the next character from the transmit ring buffer into the USART
+ * data register, or disables the data register empty interrupt if there
+ * is nothing left to send. Must be called with interrupts disabled.
+ */
+static void TransmitNextUSART()
+{
+  if(usartTxHead == usartTxTail)
+  {
+    UCSR1B &= ~(1 << UDRIE1);
+    return;
+  }
+
+  UDR1 = usartTxBuffer[usartTxTail];
+  usartTxTail = (usartTxTail + 1) & (USART_TX_BUFFER_SIZE - 1);
+  usartStats.txBytes++;
+}
+
+/**
+ * USART receive interrupt. Stores the received character in the ring
+ * buffer and counts hardware overruns, frame errors and characters
+ * dropped because the ring buffer was full.
+ */
+ISR(USART1_RX_vect)
+{
+  uint8_t status, data, next;
+
+  status = UCSR1A;
+  data = UDR1;
+
+  if(status & (1 << DOR1))
+    usartStats.overruns++;
+  if(status & (1 << FE1))
+    usartStats.frameErrors++;
+
+  next = (usartRxHead + 1) & (USART_RX_BUFFER_SIZE - 1);
+  if(next == usartRxTail)
+  {
+    usartStats.dropped++;
+    return;
+  }
+
+  usartRxBuffer[usartRxHead] = data;
+  usartRxHead = next;
+  usartStats.rxBytes++;
+}
+
+/**
+ * USART data register empty interrupt, sends the next character
+ */
+ISR(USART1_UDRE_vect)
+{
+  TransmitNextUSART();
+}
+
+/**
+ * Transmit a character throught the USART. The character is placed in
+ * the transmit ring buffer and this method only waits if the buffer is
+ * full.
  *
  * @param data the character to be sent
  */
 void SendCharUSART(char data)
 {
-  // Wait for empty buffer
-  while(!(UCSR1A & (1 << UDRE1)));
+  uint8_t next, sreg;
+
+  next = (usartTxHead + 1) & (USART_TX_BUFFER_SIZE - 1);
+  while(next == usartTxTail)
+  {
+    // make progress if we are called with interrupts disabled
+    if(!(SREG & (1 << SREG_I)) && (UCSR1A & (1 << UDRE1)))
+      TransmitNextUSART();
+  }
+
+  usartTxBuffer[usartTxHead] = data;
 
-  // Put and send the data
-  UDR1 = data;
+  sreg = SREG;
+  cli();
+  usartTxHead = next;
+  UCSR1B |= (1 << UDRIE1);
+  SREG = sreg;
 }
 
 
 /**
- * Get a character from the USART. Method from the datasheet.
+ * Get a character from the USART receive buffer without waiting.
+ *
+ * @param data stores the received character, if any
+ * @return non-zero if a character was available, zero otherwise
+ */
+uint8_t PollCharUSART(char *data)
+{
+  if(usartRxHead == usartRxTail)
+    return 0;
+
+  *data = usartRxBuffer[usartRxTail];
+  usartRxTail = (usartRxTail + 1) & (USART_RX_BUFFER_SIZE - 1);
+
+  return 1;
+}
+
+/**
+ * Get a character from the USART, waiting until one is received.
  */
 char GetCharUSART(void)
 {
-  // wait for data to be received
-  while(!(UCSR1A & (1 << RXC1)));
+  char data;
+
+  while(!PollCharUSART(&data));
 
-  // return the character
-  return UDR1;
+  return data;
 }
 
 /**
@@ -683,12 +795,33 @@ char GetCharUSART(void)
  */
 void FlushUSART(void)
 {
-  char dummy;
-  while(UCSR1A & (1 << RXC1)) dummy = UDR1;
+  uint8_t sreg = SREG;
+  cli();
+  usartRxTail = usartRxHead;
+  SREG = sreg;
+}
+
+/**
+ * Returns a copy of the USART statistics, taken atomically
+ *
+ * @param stats the structure where the statistics are copied
+ */
+void GetUSARTStats(usart_stats_t *stats)
+{
+  uint8_t sreg;
+
+  if(stats == NULL)
+    return;
+
+  sreg = SREG;
+  cli();
+  memcpy(stats, (const void*)&usartStats, sizeof(usart_stats_t));
+  SREG = sreg;
 }
 
 /**
- * This method receives a line (ended CR LF) from the USART
+ * This method receives a line (ended CR LF) from the USART, waiting
+ * until the full line is received.
  *
  * @return the line contents, removing the trailing CR LF and
  * appending the NUL ('\0') character. The caller is responsible
@@ -697,17 +830,13 @@ void FlushUSART(void)
 char* GetLineUSART()
 {
   char buf[256];
-  uint8_t i = 0;
+  uint16_t i = 0;
 
   memset(buf, 0, 256);
 
-  while(i < 256)
+  while(i < 255)
   {
-    fprintf(stderr, "Getting char\n");
-    _delay_ms(200);
     buf[i] = GetCharUSART();
-    fprintf(stderr, "Char: %c\n", buf[i]);
-    _delay_ms(200);
 
     if(i == 0 && (buf[i] == '\n' || buf[i] == '\r'))
       continue;
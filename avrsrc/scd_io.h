@@ -40,6 +40,18 @@
 /// Delay of LCD commands
 #define LCD_COMMAND_DELAY 40
 
+/// Size of the USART receive ring buffer (power of 2, at most 256)
+#define USART_RX_BUFFER_SIZE 128
+
+/// Size of the USART transmit ring buffer (power of 2, at most 256)
+#define USART_TX_BUFFER_SIZE 64
+
+/// UBRR value for a given baud rate in normal mode
+#define USART_UBRR(baud) ((F_CPU + 8UL * (baud)) / (16UL * (baud)) - 1)
+
+/// UBRR value for a given baud rate in double speed (U2X) mode
+#define USART_UBRR_2X(baud) ((F_CPU + 4UL * (baud)) / (8UL * (baud)) - 1)
+
 /// value for Button A in result from GetButton function
 #define BUTTON_A 0x01
 
@@ -155,8 +167,22 @@ uint8_t* ReadBytesEEPROM(uint16_t addr, uint16_t len);
 /// Read multiple bytes from EEPROM
 uint16_t Read16bitRegister(volatile uint16_t *reg);
 
+/**
+ * Statistics of the USART since InitUSART. The throughput can be
+ * computed from the byte counts and the elapsed time since start,
+ * given by the T2 counter (see GetCounter).
+ */
+typedef struct usart_stats {
+    uint32_t rxBytes;           // bytes stored in the receive buffer
+    uint32_t txBytes;           // bytes transmitted
+    uint16_t overruns;          // hardware data overruns (DOR)
+    uint16_t frameErrors;       // frame errors (FE)
+    uint16_t dropped;           // bytes lost because the buffer was full
+    uint32_t start;             // T2 counter value at InitUSART
+} usart_stats_t;
+
 /// Initialise USART
-void InitUSART(uint16_t baudUBRR);
+void InitUSART(uint16_t baudUBRR, uint8_t doubleSpeed);
 
 /// Disable USART
 void DisableUSART();
@@ -167,6 +193,12 @@ void SendCharUSART(char data);
 // Get a character from the USART
 char GetCharUSART(void);
 
+// Get a character from the USART if one is available
+uint8_t PollCharUSART(char *data);
+
+// Get the USART statistics
+void GetUSARTStats(usart_stats_t *stats);
+
 // Flush the USART receive buffer
 void FlushUSART(void);
 
@@ -0,0 +1,384 @@
+/**
+ * \file
+ * \brief scd_logdedup.c source file
+ *
+ * This file implements the deduplication of the payloads saved in the
+ * log (see scd_logdedup.h).
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scd_logger.h"
+#include "scd_logsink.h"
+#include "scd_logdedup.h"
+#include "scd_logzip.h"
+#include "scd_values.h"
+#include "utils.h"
+
+/// Log length used when the table does not match the log sink
+#define LOG_DEDUP_INVALID 0xFFFFFFFFUL
+
+/// Number of bytes read at once when scanning the log sink
+#define LOG_DEDUP_CHUNK 16
+
+/**
+ * State used to find the payloads while walking the records of a session
+ */
+typedef struct {
+  uint32_t crc;         // CRC32 of the run so far
+  uint16_t start;       // position of the first record of the run
+  uint16_t count;       // number of records in the run
+  uint8_t type;         // type of the records in the run
+  uint8_t bounded;      // the run follows a record of another type
+  uint8_t previous;     // a record was found before the run
+} log_run_t;
+
+
+/* Static variables */
+static uint32_t dedupTable[LOG_DEDUP_ENTRIES];  // CRC32 of the payloads
+static uint8_t dedupCount = 0;                  // entries used
+static LOG_SINK_TYPE dedupSink;                 // log sink of the table
+static uint32_t dedupLength = LOG_DEDUP_INVALID;  // log scanned so far
+
+
+/* Static functions */
+
+/**
+ * Processes the next record of a session. A run of records ends at the
+ * first record of another type, so this is where a payload is found.
+ *
+ * @param run the state of the current run
+ * @param record the record (type and data bytes)
+ * @param pos the position of the record in the session
+ * @param found set to the payload that ends at this record, if any
+ * @param crc set to the CRC32 of the payload found
+ * @return non-zero if a payload was found
+ */
+static uint8_t NextRecord(log_run_t *run, const uint8_t *record,
+    uint16_t pos, log_dedup_ref_t *found, uint32_t *crc)
+{
+  uint8_t result = 0;
+
+  if(run->count > 0 && record[0] == run->type)
+  {
+    run->crc = UpdateCRC32(run->crc, record[1]);
+    run->count++;
+    return 0;
+  }
+
+  if(run->count >= LOG_DEDUP_MIN_RUN && run->bounded)
+  {
+    found->start = run->start;
+    found->end = pos;
+    *crc = ~run->crc;
+    result = 1;
+  }
+
+  run->count = 0;
+  if((record[0] & 0x03) == 0)
+  {
+    run->type = record[0];
+    run->start = pos;
+    run->count = 1;
+    run->bounded = run->previous;
+    run->crc = UpdateCRC32(UpdateCRC32(0xFFFFFFFFUL, record[0]), record[1]);
+  }
+  run->previous = 1;
+
+  return result;
+}
+
+/**
+ * Finds a payload in the table
+ *
+ * @param crc the CRC32 of the payload
+ * @return the entry of the payload or LOG_DEDUP_ENTRIES if not found
+ */
+static uint8_t FindEntry(uint32_t crc)
+{
+  uint8_t i;
+
+  for(i = 0; i < dedupCount; i++)
+    if(dedupTable[i] == crc)
+      return i;
+
+  return LOG_DEDUP_ENTRIES;
+}
+
+/**
+ * Adds a payload to the table. Once the table is full new payloads are
+ * ignored: the payloads that repeat are most likely those of the first
+ * sessions with the same card, so replacing them would only lose matches.
+ */
+static void AddEntry(uint32_t crc)
+{
+  if(dedupCount < LOG_DEDUP_ENTRIES && FindEntry(crc) == LOG_DEDUP_ENTRIES)
+    dedupTable[dedupCount++] = crc;
+}
+
+/**
+ * Adds the payloads in a record of a compressed session to the table
+ * (see LogSinkReadCompressed)
+ */
+static void ScanRecord(const uint8_t *record, void *arg)
+{
+  log_dedup_ref_t found;
+  uint32_t crc;
+
+  if(NextRecord((log_run_t*)arg, record, 0, &found, &crc))
+    AddEntry(crc);
+}
+
+/**
+ * Adds the payloads of the log sink between two positions to the table.
+ * The scan stops at the first incomplete record. Compressed sessions are
+ * decompressed while they are read.
+ *
+ * @param from the position of the first record
+ * @param to the length of the log
+ * @return zero if successful, non-zero otherwise
+ */
+static uint8_t ScanLogSink(uint32_t from, uint32_t to)
+{
+  uint8_t buf[LOG_DEDUP_CHUNK];
+  log_run_t run;
+  log_dedup_ref_t found;
+  uint32_t addr, crc;
+  uint16_t skip;
+  uint8_t i, n, size;
+
+  memset(&run, 0, sizeof(run));
+  addr = from;
+  while(addr < to)
+  {
+    n = (to - addr > LOG_DEDUP_CHUNK) ? LOG_DEDUP_CHUNK : to - addr;
+    if(LogSinkRead(addr, buf, n))
+      return RET_LOG_SINK_IO;
+
+    skip = 0;
+    for(i = 0; skip == 0; i += size)
+    {
+      size = (buf[i] & 0x03) + 2;
+      if(i + size > n)
+        break;
+
+      if(buf[i] == LOG_COMPRESSED_SESSION)
+      {
+        skip = buf[i + 3] | (buf[i + 4] << 8);
+        memset(&run, 0, sizeof(run));
+        if(LogSinkReadCompressed(addr + i + size, skip, ScanRecord, &run))
+          return RET_LOG_SINK_IO;
+        memset(&run, 0, sizeof(run));
+      }
+      else if(NextRecord(&run, &buf[i], 0, &found, &crc))
+        AddEntry(crc);
+    }
+
+    if(i == 0)
+      break;
+    addr += i + skip;
+  }
+
+  return 0;
+}
+
+/**
+ * Makes the table match the log currently in the log sink: the sessions
+ * appended since the last update are scanned, and the table is rebuilt
+ * if the log was erased or another log sink was selected.
+ */
+static void SyncTable()
+{
+  uint32_t len;
+
+  len = LogSinkLength();
+  if(dedupLength == LOG_DEDUP_INVALID || dedupSink != GetLogSink() ||
+      len < dedupLength)
+  {
+    dedupCount = 0;
+    dedupSink = GetLogSink();
+    dedupLength = (len > LOG_DEDUP_SCAN_MAX) ? len : 0;
+  }
+
+  if(len > dedupLength && ScanLogSink(dedupLength, len) != 0)
+    dedupCount = 0;
+  dedupLength = len;
+}
+
+
+/* Public functions */
+
+/**
+ * Finds the payloads of a session that are already in the log, or earlier
+ * in the same session, and adds the other payloads to the table. The log
+ * sink must be open (see LogSinkOpen) and LogDedupCommit must be called
+ * after the session is appended.
+ *
+ * @param data the log session (a sequence of log records)
+ * @param len the length of the session
+ * @param dedup set to the payloads to be replaced by references
+ * @return zero if successful, non-zero otherwise
+ */
+uint8_t LogDedupFind(const uint8_t *data, uint16_t len, log_dedup_t *dedup)
+{
+  log_run_t run;
+  log_dedup_ref_t found;
+  uint32_t crc;
+  uint16_t pos;
+  uint8_t entry;
+
+  if(data == NULL || dedup == NULL)
+    return RET_ERR_PARAM;
+
+  dedup->count = 0;
+  SyncTable();
+
+  memset(&run, 0, sizeof(run));
+  for(pos = 0; pos + 2 <= len; pos += (data[pos] & 0x03) + 2)
+  {
+    if(pos + (data[pos] & 0x03) + 2 > len)
+      break;
+    if(!NextRecord(&run, &data[pos], pos, &found, &crc))
+      continue;
+
+    entry = FindEntry(crc);
+    if(entry < LOG_DEDUP_ENTRIES && dedup->count < LOG_DEDUP_MAX_REFS)
+    {
+      found.entry = entry;
+      dedup->refs[dedup->count++] = found;
+    }
+    else
+      AddEntry(crc);
+  }
+
+  return 0;
+}
+
+/**
+ * Updates the table after the session given to LogDedupFind was appended.
+ * If some error ocurred the table is rebuilt for the next session, since
+ * some payloads in it may not have been saved.
+ *
+ * @param result the result of appending the session
+ */
+void LogDedupCommit(uint8_t result)
+{
+  if(result == 0)
+    dedupLength = LogSinkLength();
+  else
+    dedupLength = LOG_DEDUP_INVALID;
+}
+
+/**
+ * Returns the length of a session after its payloads are replaced
+ *
+ * @param len the length of the session
+ * @param dedup the payloads replaced, or NULL if none
+ * @return the new length of the session
+ */
+uint16_t LogDedupLength(uint16_t len, const log_dedup_t *dedup)
+{
+  uint8_t i;
+
+  if(dedup == NULL)
+    return len;
+
+  for(i = 0; i < dedup->count; i++)
+    len = len - (dedup->refs[i].end - dedup->refs[i].start) +
+      LOG_DEDUP_REF_SIZE;
+
+  return len;
+}
+
+/**
+ * Returns the LOG_PAYLOAD_REF record that replaces a payload
+ *
+ * @param ref the payload replaced
+ * @param record set to the record (LOG_DEDUP_REF_SIZE bytes)
+ */
+void LogDedupRecord(const log_dedup_ref_t *ref, uint8_t *record)
+{
+  uint32_t crc = dedupTable[ref->entry];
+
+  record[0] = LOG_PAYLOAD_REF;
+  record[1] = crc & 0xFF;
+  record[2] = (crc >> 8) & 0xFF;
+  record[3] = (crc >> 16) & 0xFF;
+  record[4] = (crc >> 24) & 0xFF;
+}
+
+/**
+ * Appends a session to the log sink, which must be open (see
+ * LogSinkOpen), replacing the payloads found by LogDedupFind with
+ * LOG_PAYLOAD_REF records.
+ *
+ * @param data the log session (a sequence of log records)
+ * @param len the length of the session
+ * @param dedup the payloads to be replaced, or NULL to append the session
+ * unchanged
+ * @return zero if all the data was saved or non-zero if some error
+ * ocurred (e.g. RET_LOG_SINK_FULL)
+ */
+uint8_t LogSinkAppendDedup(const uint8_t *data, uint16_t len,
+    const log_dedup_t *dedup)
+{
+  uint8_t record[LOG_DEDUP_REF_SIZE];
+  const log_dedup_ref_t *ref;
+  uint16_t pos = 0;
+  uint8_t i, result;
+
+  if(data == NULL)
+    return RET_ERR_PARAM;
+  if(dedup == NULL)
+    return LogSinkAppend(data, len);
+
+  for(i = 0; i < dedup->count; i++)
+  {
+    ref = &dedup->refs[i];
+    if(ref->start > pos)
+    {
+      result = LogSinkAppend(&data[pos], ref->start - pos);
+      if(result != 0)
+        return result;
+    }
+
+    LogDedupRecord(ref, record);
+    result = LogSinkAppend(record, LOG_DEDUP_REF_SIZE);
+    if(result != 0)
+      return result;
+    pos = ref->end;
+  }
+
+  if(pos < len)
+    return LogSinkAppend(&data[pos], len - pos);
+
+  return 0;
+}
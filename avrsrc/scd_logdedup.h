@@ -0,0 +1,109 @@
+/**
+ * \file
+ * \brief scd_logdedup.h header file
+ *
+ * This file defines the deduplication of the payloads saved in the log.
+ * Most responses from a card are the same in every transaction (e.g. the
+ * FCI or the static READ RECORD data), so a payload already saved in the
+ * log is replaced by a LOG_PAYLOAD_REF record holding its CRC32.
+ *
+ * A payload is a run of at least LOG_DEDUP_MIN_RUN consecutive records of
+ * the same type with one data byte, which follows and is followed by
+ * records of other types in the same session (so it is the whole run,
+ * e.g. the procedure byte, data and status bytes of a response). The CRC32
+ * (as in zlib) covers the record type followed by the data bytes.
+ *
+ * The CRC32 of the first LOG_DEDUP_ENTRIES payloads in the log are kept in
+ * RAM. After reset the table is rebuilt from the sessions already in the
+ * log sink, and it is cleared when the log is erased or another log sink
+ * is selected. A reader resolves a reference
+ * with the last payload before it in the log with the same CRC32.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_LOGDEDUP_H_
+#define _SCD_LOGDEDUP_H_
+
+#include <stdint.h>
+
+/// Set to 1 to replace the payloads already in the log with references
+#ifndef LOG_DEDUP_ENABLED
+#define LOG_DEDUP_ENABLED 0
+#endif
+
+/// Number of payload CRCs kept in RAM
+#define LOG_DEDUP_ENTRIES 32
+
+/// Maximum number of references in one session
+#define LOG_DEDUP_MAX_REFS 32
+
+/// Shortest run of records replaced by a reference
+#define LOG_DEDUP_MIN_RUN 8
+
+/// Size of the LOG_PAYLOAD_REF record (type and CRC32)
+#define LOG_DEDUP_REF_SIZE 5
+
+/// Logs longer than this are not scanned after reset, the table then
+/// starts empty (scanning a large DataFlash log would take too long)
+#define LOG_DEDUP_SCAN_MAX 4096
+
+/**
+ * A payload of the session replaced by a reference
+ */
+typedef struct {
+  uint16_t start;       // position of the first record of the payload
+  uint16_t end;         // position after the last record of the payload
+  uint8_t entry;        // entry of the table with the CRC32 of the payload
+} log_dedup_ref_t;
+
+/**
+ * The payloads of a session replaced by references, in log order
+ */
+typedef struct {
+  uint8_t count;
+  log_dedup_ref_t refs[LOG_DEDUP_MAX_REFS];
+} log_dedup_t;
+
+/// Find the payloads of a session that are already in the log
+uint8_t LogDedupFind(const uint8_t *data, uint16_t len, log_dedup_t *dedup);
+
+/// Update the table once the session was appended
+void LogDedupCommit(uint8_t result);
+
+/// Length of a session after its payloads are replaced
+uint16_t LogDedupLength(uint16_t len, const log_dedup_t *dedup);
+
+/// Get the LOG_PAYLOAD_REF record that replaces a payload
+void LogDedupRecord(const log_dedup_ref_t *ref, uint8_t *record);
+
+/// Append a session to the log sink replacing its payloads
+uint8_t LogSinkAppendDedup(const uint8_t *data, uint16_t len,
+    const log_dedup_t *dedup);
+
+#endif // _SCD_LOGDEDUP_H_
@@ -29,14 +29,200 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
 #include <string.h>
 
+#include "scd.h"
 #include "scd_logger.h"
+#include "scd_logsink.h"
+#include "scd_logdedup.h"
+#include "scd_logzip.h"
+#include "scd_profile.h"
 #include "scd_values.h"
 
+/// Prevents the compiler from moving memory accesses across this point
+#define LOG_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+/// Value combined with the policy bytes to check the policy in EEPROM
+#define LOG_POLICY_CHECK 0x5A
+
+/// Command table of a policy without commands using their own depth
+#define LOG_POLICY_NO_INS \
+  {LOG_POLICY_INS_NONE, LOG_POLICY_INS_NONE, \
+    LOG_POLICY_INS_NONE, LOG_POLICY_INS_NONE}, {0, 0, 0, 0}
+
+/// Predefined log policies, in the order of LOG_POLICY_PRESET
+static const log_policy_t policyPresets[LOG_POLICY_COUNT] PROGMEM = {
+  // LOG_POLICY_FULL
+  {LOG_CLASS_ALL, LOG_PAYLOAD_FULL, 0, LOG_POLICY_NO_INS},
+  // LOG_POLICY_SOAK: GET PROCESSING OPTIONS, GENERATE AC and VERIFY
+  {LOG_CLASS_ALL & ~LOG_CLASS_DEBUG, 0, 4,
+    {0xA8, 0xAE, 0x20, LOG_POLICY_INS_NONE},
+    {LOG_PAYLOAD_FULL, LOG_PAYLOAD_FULL, LOG_PAYLOAD_FULL, 0}},
+  // LOG_POLICY_HEADERS
+  {LOG_CLASS_ALL & ~LOG_CLASS_DEBUG, 0, 4, LOG_POLICY_NO_INS},
+  // LOG_POLICY_EVENTS
+  {LOG_CLASS_TERMINAL | LOG_CLASS_ICC | LOG_CLASS_TIME, 0, 0,
+    LOG_POLICY_NO_INS},
+  // LOG_POLICY_SUMMARY
+  {LOG_CLASS_SUMMARY, 0, 0, LOG_POLICY_NO_INS},
+};
+
+/// Log policy in use, logs everything until LoadLogPolicy is called
+static log_policy_t logPolicy = {
+  LOG_CLASS_ALL, LOG_PAYLOAD_FULL, 0, LOG_POLICY_NO_INS};
+
+
+/* Static functions */
+
+/**
+ * Returns the class of a log record type, or zero for the error events
+ * that are always logged.
+ */
+static uint8_t GetLogClass(SCD_LOG_BYTE type)
+{
+  uint8_t code = type >> 2;
+
+  if(code < (LOG_BYTE_TO_TERMINAL >> 2))
+    return LOG_CLASS_ATR;
+  if(code < (LOG_BYTE_ATR_FROM_USB >> 2))
+    return LOG_CLASS_APDU;
+  if(code < (LOG_TERMINAL_RST_HIGH >> 2))
+    return LOG_CLASS_USB;
+  if(code < (LOG_ICC_ACTIVATED >> 2))
+    return LOG_CLASS_TERMINAL;
+  if(code < (LOG_TIME_DATA_TO_ICC >> 2))
+    return LOG_CLASS_ICC;
+  if(type == LOG_ERROR_MEMORY || type == LOG_WDT_RESET)
+    return 0;
+  if(type == LOG_TRANSACTION_SUMMARY)
+    return LOG_CLASS_SUMMARY;
+  if(code >= (LOG_DEBUG_TEST1 >> 2) && code <= (LOG_DEBUG_TEST4 >> 2))
+    return LOG_CLASS_DEBUG;
+  return LOG_CLASS_TIME;
+}
+
+/// Non-zero if the records of this type are not logged by the policy
+#define LOG_FILTERED(type) (GetLogClass(type) & ~logPolicy.classes)
+
+/**
+ * Returns the check byte saved after the log policy in EEPROM. An erased
+ * EEPROM does not give a valid check byte.
+ */
+static uint8_t GetPolicyCheck(const log_policy_t *policy)
+{
+  const uint8_t *bytes = (const uint8_t*)policy;
+  uint8_t k, check = LOG_POLICY_CHECK;
+
+  for(k = 0; k < sizeof(log_policy_t); k++)
+    check ^= bytes[k];
+
+  return check;
+}
+
+/**
+ * Appends one record to the log buffer. The record bytes are written
+ * first and then position is updated, with updating set and the previous
+ * values saved in committed and committedTail, so an interrupt handler
+ * always finds a consistent log. Must only be called from the main context.
+ *
+ * @param logger the log structure
+ * @param record the record bytes (type and data)
+ * @param len the length of the record
+ * @param fromQueue non-zero if the record is the first event in the
+ * interrupt queue, which is then removed from the queue
+ * @return zero if success, RET_ERR_MEMORY if the log is full
+ */
+static uint8_t AppendRecord(log_struct_t *logger, const uint8_t *record,
+    uint8_t len, uint8_t fromQueue)
+{
+  uint16_t pos = logger->position;
+  uint8_t tail = logger->isrTail;
+
+  if(pos > LOG_BUFFER_SIZE - len)
+    return RET_ERR_MEMORY;
+
+  memcpy(&logger->log_buffer[pos], record, len);
+  LOG_BARRIER();
+
+  logger->committed = pos;
+  logger->committedTail = tail;
+  logger->updating = 1;
+  logger->position = pos + len;
+  if(fromQueue)
+    logger->isrTail = (tail + 1) & (LOG_ISR_QUEUE_SIZE - 1);
+  logger->updating = 0;
+
+  return 0;
+}
 
 /**
- * Function to reset the log structure
+ * Moves the events queued by interrupt handlers into the log buffer.
+ * Must only be called from the main context.
+ *
+ * @param logger the log structure
+ */
+static void DrainLogQueue(log_struct_t *logger)
+{
+  uint8_t tail;
+
+  while((tail = logger->isrTail) != logger->isrHead)
+  {
+    if(AppendRecord(logger, logger->isrQueue[tail], 2, 1))
+      break;
+  }
+}
+
+/**
+ * Builds a record from its type and data bytes and appends it to the
+ * log buffer, after any pending events from interrupt handlers.
+ */
+static uint8_t LogRecord(log_struct_t *logger, SCD_LOG_BYTE type,
+    uint8_t nbytes, uint8_t byte_a, uint8_t byte_b, uint8_t byte_c,
+    uint8_t byte_d)
+{
+  uint8_t record[5];
+
+  if(logger == NULL)
+    return RET_ERR_PARAM;
+  if((type & 0x03) != nbytes - 1)
+    return RET_ERR_PARAM;
+  if(LOG_FILTERED(type))
+    return 0;
+
+  DrainLogQueue(logger);
+
+  record[0] = type;
+  record[1] = byte_a;
+  record[2] = byte_b;
+  record[3] = byte_c;
+  record[4] = byte_d;
+
+  return AppendRecord(logger, record, nbytes + 1, 0);
+}
+
+/**
+ * Logs the number of commands not logged because of sampling, if any.
+ */
+static uint8_t LogSkippedCommands(log_struct_t *logger)
+{
+  uint8_t skipped = logger->apduSkipped;
+
+  if(skipped == 0)
+    return 0;
+  logger->apduSkipped = 0;
+
+  return LogRecord(logger, LOG_APDU_SKIPPED, 1, skipped, 0, 0, 0);
+}
+
+
+
+/* Public functions */
+
+/**
+ * Function to reset the log structure. Events queued by interrupt
+ * handlers are kept and will be added to the new log.
  *
  * @param logger the log structure
  */
@@ -45,12 +231,25 @@ void ResetLogger(log_struct_t *logger)
   if(logger == NULL)
     return;
 
-  memset(logger->log_buffer, 0, LOG_BUFFER_SIZE);
+  logger->committed = 0;
+  logger->committedTail = logger->isrTail;
+  logger->updating = 1;
   logger->position = 0;
+  logger->updating = 0;
+  logger->flushed = 0;
+
+  logger->apduLimit = LOG_APDU_ALL;
+  memset(logger->apduHeader, 0, sizeof(logger->apduHeader));
+  logger->apduRepeat = 0;
+  logger->apduSkipped = 0;
+  logger->apduPending = 0;
+
+  memset(logger->log_buffer, 0, LOG_BUFFER_SIZE);
 }
 
 /**
- * Function used to log one byte of data. 
+ * Function used to log one byte of data. This and the other LogByteX
+ * methods must not be used from interrupt handlers, see LogByteISR.
  *
  * @param logger the log structure
  * @param type the kind of data to be logged
@@ -60,17 +259,9 @@ void ResetLogger(log_struct_t *logger)
  */
 uint8_t LogByte1(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a)
 {
-  if(logger == NULL)
-    return RET_ERR_PARAM;
-  if((type & 0x03) != 0x00)
-    return RET_ERR_PARAM;
-  if(logger->position > LOG_BUFFER_SIZE - 2)
-    return RET_ERR_MEMORY;
+  PROFILE_FUNCTION(PROFILE_LOG_BYTE);
 
-  logger->log_buffer[logger->position++] = type;
-  logger->log_buffer[logger->position++] = byte_a;
-
-  return 0;
+  return LogRecord(logger, type, 1, byte_a, 0, 0, 0);
 }
 
 /**
@@ -86,18 +277,7 @@ uint8_t LogByte1(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a)
 uint8_t LogByte2(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
     uint8_t byte_b)
 {
-  if(logger == NULL)
-    return RET_ERR_PARAM;
-  if((type & 0x03) != 0x01)
-    return RET_ERR_PARAM;
-  if(logger->position > LOG_BUFFER_SIZE - 3)
-    return RET_ERR_MEMORY;
-
-  logger->log_buffer[logger->position++] = type;
-  logger->log_buffer[logger->position++] = byte_a;
-  logger->log_buffer[logger->position++] = byte_b;
-
-  return 0;
+  return LogRecord(logger, type, 2, byte_a, byte_b, 0, 0);
 }
 
 
@@ -115,19 +295,7 @@ uint8_t LogByte2(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
 uint8_t LogByte3(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
     uint8_t byte_b, uint8_t byte_c)
 {
-  if(logger == NULL)
-    return RET_ERR_PARAM;
-  if((type & 0x03) != 0x02)
-    return RET_ERR_PARAM;
-  if(logger->position > LOG_BUFFER_SIZE - 4)
-    return RET_ERR_MEMORY;
-
-  logger->log_buffer[logger->position++] = type;
-  logger->log_buffer[logger->position++] = byte_a;
-  logger->log_buffer[logger->position++] = byte_b;
-  logger->log_buffer[logger->position++] = byte_c;
-
-  return 0;
+  return LogRecord(logger, type, 3, byte_a, byte_b, byte_c, 0);
 }
 
 /**
@@ -145,19 +313,360 @@ uint8_t LogByte3(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
 uint8_t LogByte4(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
     uint8_t byte_b, uint8_t byte_c, uint8_t byte_d)
 {
-  if(logger == NULL)
+  return LogRecord(logger, type, 4, byte_a, byte_b, byte_c, byte_d);
+}
+
+/**
+ * Function used to log a block of data, such as a transaction summary,
+ * as consecutive records of the same type with four bytes each. The
+ * block is logged completely or not at all, and the events queued by
+ * interrupt handlers are not placed inside it.
+ *
+ * @param logger the log structure
+ * @param type the kind of data to be logged, using four data bytes
+ * @param data the bytes to be logged
+ * @param len the number of bytes, a multiple of 4
+ * @return zero if the logging was done or non-zero if error (e.g. the
+ * log is full)
+ */
+uint8_t LogBlock(log_struct_t *logger, SCD_LOG_BYTE type,
+    const uint8_t *data, uint8_t len)
+{
+  uint8_t record[5];
+  uint8_t k;
+
+  if(logger == NULL || data == NULL || (len & 0x03) != 0)
     return RET_ERR_PARAM;
   if((type & 0x03) != 0x03)
     return RET_ERR_PARAM;
-  if(logger->position > LOG_BUFFER_SIZE - 5)
+  if(LOG_FILTERED(type))
+    return 0;
+
+  DrainLogQueue(logger);
+  if(logger->position > LOG_BUFFER_SIZE - (len / 4) * 5)
+    return RET_ERR_MEMORY;
+
+  record[0] = type;
+  for(k = 0; k < len; k += 4)
+  {
+    memcpy(&record[1], &data[k], 4);
+    AppendRecord(logger, record, 5, 0);
+  }
+
+  return 0;
+}
+
+/**
+ * Checks if the records of a type are logged by the log policy in use,
+ * so the caller can avoid preparing data that would not be logged.
+ *
+ * @param type the kind of data
+ * @return non-zero if the records of this type are logged
+ */
+uint8_t IsLogged(SCD_LOG_BYTE type)
+{
+  return LOG_FILTERED(type) ? 0 : 1;
+}
+
+/**
+ * Function used to log one byte of data from an interrupt handler.
+ * The event is placed in a small queue that the main context moves into
+ * the log buffer on its next append, so this method never touches the
+ * log buffer and needs no locking. Interrupts do not nest, so the queue
+ * has a single producer (the interrupt context) and a single consumer
+ * (the main context).
+ *
+ * @param logger the log structure
+ * @param type the kind of data to be logged, using one data byte
+ * @param byte_a the byte to be logged
+ * @return zero if the event was queued or non-zero if error (e.g. the
+ * queue is full)
+ */
+uint8_t LogByteISR(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a)
+{
+  uint8_t head, next;
+
+  if(logger == NULL)
+    return RET_ERR_PARAM;
+  if((type & 0x03) != 0x00)
+    return RET_ERR_PARAM;
+  if(LOG_FILTERED(type))
+    return 0;
+
+  head = logger->isrHead;
+  next = (head + 1) & (LOG_ISR_QUEUE_SIZE - 1);
+  if(next == logger->isrTail)
     return RET_ERR_MEMORY;
 
-  logger->log_buffer[logger->position++] = type;
-  logger->log_buffer[logger->position++] = byte_a;
-  logger->log_buffer[logger->position++] = byte_b;
-  logger->log_buffer[logger->position++] = byte_c;
-  logger->log_buffer[logger->position++] = byte_d;
+  logger->isrQueue[head][0] = type;
+  logger->isrQueue[head][1] = byte_a;
+  LOG_BARRIER();
+  logger->isrHead = next;
 
   return 0;
 }
 
+/**
+ * Function used to save the log to the selected storage backend
+ * (see scd_logsink.h). The data is appended to the log already stored
+ * and, if the backend is full, only the data that fits is saved.
+ * Nothing is saved if the log was already saved by SaveLogISR.
+ * Depending on the build, the payloads already in the log are replaced
+ * by references (see scd_logdedup.h) and the session is compressed (see
+ * scd_logzip.h).
+ *
+ * @param logger the log structure
+ * @return zero if all the data was saved or non-zero if some error
+ * ocurred
+ */
+uint8_t SaveLog(log_struct_t *logger)
+{
+#if LOG_DEDUP_ENABLED
+  log_dedup_t dedup;
+#endif
+  const log_dedup_t *refs = NULL;
+  uint8_t result;
+  PROFILE_FUNCTION(PROFILE_SAVE_LOG);
+
+  if(logger == NULL)
+    return RET_ERR_PARAM;
+
+  DrainLogQueue(logger);
+  if(!logger->flushed)
+    LogSkippedCommands(logger);
+  if(logger->position == 0 || logger->flushed)
+    return 0;
+
+  result = LogSinkOpen();
+  if(result != 0)
+    return result;
+#if LOG_DEDUP_ENABLED
+  if(LogDedupFind(logger->log_buffer, logger->position, &dedup) == 0)
+    refs = &dedup;
+#endif
+#if LOG_COMPRESS_ENABLED
+  result = LogSinkAppendCompressed(logger->log_buffer, logger->position, refs);
+#else
+  result = LogSinkAppendDedup(logger->log_buffer, logger->position, refs);
+#endif
+#if LOG_DEDUP_ENABLED
+  LogDedupCommit(result);
+#endif
+  LogSinkCommit();
+
+  return result;
+}
+
+/**
+ * Function used to save the log from an interrupt handler, typically just
+ * before the SCD is reset (e.g. watchdog or terminal reset). The main
+ * context may be in the middle of an append, so this method saves the
+ * last consistent part of the log buffer followed by the events still in
+ * the interrupt queue, and then marks the log as flushed so that the main
+ * context does not save it again. The log buffer itself is not modified.
+ *
+ * If the main context is saving the log at the same time the storage is
+ * busy and this method fails with RET_ERR_CHECK.
+ *
+ * @param logger the log structure
+ * @return zero if all the data was saved or non-zero if some error
+ * ocurred
+ */
+uint8_t SaveLogISR(log_struct_t *logger)
+{
+  uint16_t len;
+  uint8_t tail, result;
+
+  if(logger == NULL)
+    return RET_ERR_PARAM;
+  if(logger->flushed)
+    return 0;
+
+  if(logger->updating)
+  {
+    len = logger->committed;
+    tail = logger->committedTail;
+  }
+  else
+  {
+    len = logger->position;
+    tail = logger->isrTail;
+  }
+
+  result = LogSinkOpen();
+  if(result != 0)
+    return result;
+  if(len > 0)
+    result = LogSinkAppend(logger->log_buffer, len);
+  while(result == 0 && tail != logger->isrHead)
+  {
+    result = LogSinkAppend(logger->isrQueue[tail], 2);
+    tail = (tail + 1) & (LOG_ISR_QUEUE_SIZE - 1);
+  }
+  LogSinkCommit();
+  logger->flushed = 1;
+
+  return result;
+}
+
+/**
+ * Function used to log the header of a command. It also selects, based
+ * on the log policy, which bytes of the command and of its response are
+ * logged (see LogAPDU), so it must be called before logging the command
+ * data. The header is logged once all its bytes have been transmitted.
+ *
+ * A command received from the terminal and then sent unchanged to the
+ * ICC is counted once, so that both sides of a forwarded command are
+ * logged or sampled together. GET RESPONSE uses the selection of the
+ * command it completes.
+ *
+ * @param logger the log structure
+ * @param type LOG_BYTE_FROM_TERMINAL or LOG_BYTE_TO_ICC
+ * @param cla the CLA byte of the command
+ * @param ins the INS byte of the command
+ * @param p1 the P1 byte of the command
+ * @param p2 the P2 byte of the command
+ * @param p3 the P3 byte of the command
+ * @return zero if the header was logged or filtered, non-zero if error
+ */
+uint8_t LogCommandHeader(log_struct_t *logger, SCD_LOG_BYTE type,
+    uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t p3)
+{
+  uint8_t header[5];
+  uint8_t k, depth, result;
+
+  if(logger == NULL)
+    return RET_ERR_PARAM;
+
+  header[0] = cla;
+  header[1] = ins;
+  header[2] = p1;
+  header[3] = p2;
+  header[4] = p3;
+
+  if(type == LOG_BYTE_TO_ICC && logger->apduPending &&
+      memcmp(header, logger->apduHeader, 5) == 0)
+  {
+    // the command from the terminal, now sent to the ICC
+    logger->apduPending = 0;
+  }
+  else if(cla != 0x00 || ins != 0xC0)
+  {
+    if(memcmp(header, logger->apduHeader, 5) == 0)
+    {
+      logger->apduRepeat++;
+    }
+    else
+    {
+      memcpy(logger->apduHeader, header, 5);
+      logger->apduRepeat = 0;
+    }
+    logger->apduPending = (type == LOG_BYTE_FROM_TERMINAL);
+
+    if(logPolicy.sample > 1 && (logger->apduRepeat % logPolicy.sample) != 0)
+    {
+      logger->apduLimit = 0;
+      if(logger->apduSkipped < 0xFF)
+        logger->apduSkipped++;
+      return 0;
+    }
+
+    depth = logPolicy.depth;
+    for(k = 0; k < LOG_POLICY_INS_COUNT; k++)
+    {
+      if(logPolicy.ins[k] == ins)
+      {
+        depth = logPolicy.insDepth[k];
+        break;
+      }
+    }
+    if(depth == LOG_PAYLOAD_FULL)
+      logger->apduLimit = LOG_APDU_ALL;
+    else
+      logger->apduLimit = depth + 1;
+  }
+
+  if(!LogAPDU(logger, 0))
+    return 0;
+
+  result = LogSkippedCommands(logger);
+  for(k = 0; k < 5 && result == 0; k++)
+    result = LogRecord(logger, type, 1, header[k], 0, 0, 0);
+
+  return result;
+}
+
+/**
+ * Sets the log policy used by the following log records. The policy can
+ * also be saved to EEPROM so that it is used after reset.
+ *
+ * @param policy the new log policy
+ * @param persist set to non-zero to save the policy in EEPROM
+ * @return zero if successful, non-zero otherwise
+ */
+uint8_t SetLogPolicy(const log_policy_t *policy, uint8_t persist)
+{
+  if(policy == NULL)
+    return RET_ERR_PARAM;
+
+  memcpy(&logPolicy, policy, sizeof(log_policy_t));
+  logPolicy.classes &= LOG_CLASS_ALL | LOG_CLASS_SUMMARY;
+  if(persist)
+  {
+    eeprom_update_block(&logPolicy, (void*)EEPROM_LOG_POLICY,
+        sizeof(log_policy_t));
+    eeprom_update_byte((uint8_t*)(EEPROM_LOG_POLICY + sizeof(log_policy_t)),
+        GetPolicyCheck(&logPolicy));
+  }
+
+  return 0;
+}
+
+/**
+ * Sets one of the predefined log policies.
+ *
+ * @param preset the predefined policy
+ * @param persist set to non-zero to save the policy in EEPROM
+ * @return zero if successful, RET_ERR_PARAM if the preset is unknown
+ * @sa SetLogPolicy
+ */
+uint8_t SelectLogPolicy(LOG_POLICY_PRESET preset, uint8_t persist)
+{
+  log_policy_t policy;
+
+  if(preset >= LOG_POLICY_COUNT)
+    return RET_ERR_PARAM;
+
+  memcpy_P(&policy, &policyPresets[preset], sizeof(log_policy_t));
+
+  return SetLogPolicy(&policy, persist);
+}
+
+/**
+ * Returns the log policy currently used
+ *
+ * @param policy the structure where the policy is copied
+ */
+void GetLogPolicy(log_policy_t *policy)
+{
+  if(policy != NULL)
+    memcpy(policy, &logPolicy, sizeof(log_policy_t));
+}
+
+/**
+ * Loads the log policy saved in EEPROM. If there is no valid policy
+ * (e.g. erased EEPROM) everything is logged (LOG_POLICY_FULL).
+ */
+void LoadLogPolicy()
+{
+  log_policy_t policy;
+  uint8_t check;
+
+  eeprom_read_block(&policy, (void*)EEPROM_LOG_POLICY, sizeof(log_policy_t));
+  check = eeprom_read_byte(
+      (uint8_t*)(EEPROM_LOG_POLICY + sizeof(log_policy_t)));
+  if(check == GetPolicyCheck(&policy))
+    SetLogPolicy(&policy, 0);
+  else
+    SelectLogPolicy(LOG_POLICY_FULL, 0);
+}
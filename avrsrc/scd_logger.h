@@ -42,13 +42,115 @@
 #define LOG_BUFFER_SIZE 3900    // static for simplicity
 // we are restricted here by the memory capacity
 
-/** Structure used to keep the log **/
+/// Number of events that interrupt handlers can queue (power of 2)
+#define LOG_ISR_QUEUE_SIZE 8
+
+/// Number of commands that can have their own payload depth in the policy
+#define LOG_POLICY_INS_COUNT 4
+
+/// Unused entry in the command table of the log policy
+#define LOG_POLICY_INS_NONE 0xFF
+
+/// Payload depth used to log the complete command and response data
+#define LOG_PAYLOAD_FULL 0xFF
+
+/// Value of apduLimit that logs all the bytes of an APDU
+#define LOG_APDU_ALL 0xFFFF
+
+/**
+ * Non-zero if a byte of the current APDU should be logged, according to
+ * the log policy. Use index 0 for the header, procedure and status bytes
+ * and n for the n-th byte (starting from 1) of the command or response
+ * data. This is the only check needed by the LogByteX call sites, the
+ * event classes are checked by the logger itself.
+ */
+#define LogAPDU(logger, index) \
+    ((logger) != NULL && (uint16_t)(index) < (logger)->apduLimit)
+
+/**
+ * Structure used to keep the log.
+ *
+ * The log buffer is only written by the main context (LogByteX methods).
+ * Interrupt handlers use LogByteISR, which only writes to the small event
+ * queue, and the main context moves these events into the log buffer on
+ * the next append or save. While position is being updated, updating is
+ * set and committed/committedTail hold the previous values, so that an
+ * interrupt handler can always read a consistent length (see SaveLogISR)
+ * without the main context disabling the interrupts.
+ **/
 struct log_struct {
     uint8_t log_buffer[LOG_BUFFER_SIZE];
-    uint32_t position;
+    volatile uint16_t position;         // written by main context only
+    volatile uint16_t committed;        // position before the last update
+    volatile uint8_t committedTail;     // isrTail before the last update
+    volatile uint8_t updating;          // non-zero while position changes
+    volatile uint8_t flushed;           // set when saved by SaveLogISR
+    uint8_t isrQueue[LOG_ISR_QUEUE_SIZE][2]; // events from interrupts
+    volatile uint8_t isrHead;           // written by interrupts only
+    volatile uint8_t isrTail;           // written by main context only
+    uint16_t apduLimit;                 // see LogAPDU
+    uint8_t apduHeader[5];              // last command header logged
+    uint8_t apduRepeat;                 // repetitions of apduHeader
+    uint8_t apduSkipped;                // commands not logged by sampling
+    uint8_t apduPending;                // header from terminal not yet sent
 };
 typedef struct log_struct log_struct_t;
 
+/**
+ * Event classes of the log policy. Each log record type belongs to one
+ * class, except the error events (LOG_ERROR_MEMORY, LOG_WDT_RESET) which
+ * are always logged.
+ */
+typedef enum {
+    LOG_CLASS_ATR = 0x01,           // ATR bytes
+    LOG_CLASS_APDU = 0x02,          // command and response bytes
+    LOG_CLASS_USB = 0x04,           // USB data and events
+    LOG_CLASS_TERMINAL = 0x08,      // terminal events
+    LOG_CLASS_ICC = 0x10,           // ICC events
+    LOG_CLASS_TIME = 0x20,          // time stamps
+    LOG_CLASS_DEBUG = 0x40,         // debug events
+    LOG_CLASS_ALL = 0x7F,           // all but the summaries
+    LOG_CLASS_SUMMARY = 0x80,       // transaction summaries (scd_summary.h)
+} LOG_CLASS;
+
+/**
+ * Structure defining what is logged. The payload depth is the number of
+ * data bytes logged from each command and response: 0 logs only the
+ * header, procedure and status bytes and LOG_PAYLOAD_FULL logs all the
+ * data. The commands in ins use the depth in insDepth, all the others
+ * the default depth. GET RESPONSE uses the same depth as the command it
+ * completes.
+ *
+ * If sample is greater than 1, then only one of every sample identical
+ * commands (same header) received in a row is logged. The number of
+ * commands that were not logged is saved in a LOG_APDU_SKIPPED record.
+ */
+typedef struct {
+    uint8_t classes;                        // LOG_CLASS bits to log
+    uint8_t depth;                          // default payload depth
+    uint8_t sample;                         // log 1 of sample repeats
+    uint8_t ins[LOG_POLICY_INS_COUNT];      // commands with own depth
+    uint8_t insDepth[LOG_POLICY_INS_COUNT]; // payload depth for ins
+} log_policy_t;
+
+/**
+ * Predefined log policies, selected with AT+CLPOL=<preset>.
+ * The number of transactions that fit in the EEPROM log (3680 bytes) is
+ * given for each preset, for a typical transaction of 14 commands logged
+ * by ForwardData (1591 bytes with LOG_POLICY_FULL), including the start
+ * and end time of each command. Only LOG_POLICY_SUMMARY logs the
+ * transaction summaries (80 bytes each, see scd_summary.h).
+ */
+typedef enum {
+    LOG_POLICY_FULL = 0,        // everything, as before (2 transactions)
+    LOG_POLICY_SOAK = 1,        // headers, status, events and time, with
+                                // GPO, GENERATE AC and VERIFY data (3)
+    LOG_POLICY_HEADERS = 2,     // headers, status, events and time (5)
+    LOG_POLICY_EVENTS = 3,      // terminal, ICC and time events only (12)
+    LOG_POLICY_SUMMARY = 4,     // transaction summaries only (45)
+    LOG_POLICY_COUNT = 5,
+} LOG_POLICY_PRESET;
+
 /**
   * Definition of log direction bits, used in some methods to select
   * which part of a transaction to log
@@ -76,6 +178,9 @@ typedef enum {
     LOG_BYTE_FROM_TERMINAL = (0x03 << 2 | 0x00),            // 0x0C
     LOG_BYTE_TO_ICC = (0x04 << 2 | 0x00),                   // 0x10
     LOG_BYTE_FROM_ICC = (0x05 << 2 | 0x00),                 // 0x14
+    LOG_APDU_SKIPPED = (0x06 << 2 | 0x00),                  // 0x18
+    // Compressed session, the data follows the record (see scd_logzip.h)
+    LOG_COMPRESSED_SESSION = (0x07 << 2 | 0x03),            // 0x1F
 
     // USB events
     LOG_BYTE_ATR_FROM_USB = (0x08 << 2 | 0x00),             // 0x20
@@ -84,6 +189,9 @@ typedef enum {
     LOG_BYTE_TO_USB = (0x0B << 2 | 0x00),                   // 0x2C
     LOG_USB_ERROR_RECEIVE = (0x0C << 2 | 0x00),             // 0x30
     LOG_USB_ERROR_SEND = (0x0D << 2 | 0x00),                // 0x34
+    // 0x0E is used inside compressed sessions (see scd_logzip.h)
+    // Payload already in the log, the data is its CRC32 (see scd_logdedup.h)
+    LOG_PAYLOAD_REF = (0x0F << 2 | 0x03),                   // 0x3F
 
     // Terminal events
     LOG_TERMINAL_RST_HIGH = (0x10 << 2 | 0x00),             // 0x40
@@ -93,6 +201,7 @@ typedef enum {
     LOG_TERMINAL_ERROR_SEND = (0x14 << 2 | 0x00),           // 0x50
     LOG_TERMINAL_NO_CLOCK = (0x15 << 2 | 0x00),             // 0x54
     LOG_TERMINAL_MORE_TIME = (0x16 << 2 | 0x00),            // 0x58
+    LOG_TERMINAL_KEEP_ALIVE = (0x17 << 2 | 0x00),           // 0x5C
 
     // ICC events
     LOG_ICC_ACTIVATED = (0x20 << 2 | 0x00),                 // 0x80
@@ -101,6 +210,12 @@ typedef enum {
     LOG_ICC_ERROR_RECEIVE = (0x23 << 2 | 0x00),             // 0x8C
     LOG_ICC_ERROR_SEND = (0x24 << 2 | 0x00),                // 0x90
     LOG_ICC_INSERTED = (0x25 << 2 | 0x00),                  // 0x94
+    LOG_PREFETCH_HIT = (0x26 << 2 | 0x01),                  // 0x99
+    LOG_SESSION_CACHE_HIT = (0x27 << 2 | 0x00),             // 0x9C
+    LOG_SESSION_CACHE_MISS = (0x28 << 2 | 0x00),            // 0xA0
+    LOG_SESSION_CACHE_CLEAR = (0x29 << 2 | 0x00),           // 0xA4
+    // Result of the card cache of Terminal(), see CARD_CACHE_RESULT
+    LOG_CARD_CACHE = (0x2A << 2 | 0x00),                    // 0xA8
 
     // General events
     // The time should be saved as little endian using 4 bytes
@@ -114,6 +229,17 @@ typedef enum {
     LOG_DEBUG_TEST2 = (0x35 << 2 | 0x00),                   // 0xD4
     LOG_DEBUG_TEST3 = (0x36 << 2 | 0x00),                   // 0xD8
     LOG_DEBUG_TEST4 = (0x37 << 2 | 0x00),                   // 0xDC
+    // ICC time saved by the READ RECORD prefetch, as LOG_TIME_GENERAL
+    LOG_TIME_PREFETCH_SAVED = (0x38 << 2 | 0x03),           // 0xE3
+    // Time from the start of the SCD until the application was ready for
+    // the terminal reset, in microseconds (see BootReady)
+    LOG_TIME_BOOT = (0x39 << 2 | 0x03),                     // 0xE7
+    // Summary of a transaction, as consecutive records holding the bytes
+    // of a txn_summary_t (see scd_summary.h)
+    LOG_TRANSACTION_SUMMARY = (0x3A << 2 | 0x03),           // 0xEB
+    // Time from the reset of the ICC until the card data was read by
+    // Terminal(), as LOG_TIME_GENERAL
+    LOG_TIME_CARD_DATA = (0x3B << 2 | 0x03),                // 0xEF
 
 }SCD_LOG_BYTE;
 
@@ -145,6 +271,38 @@ uint8_t LogByte3(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
 uint8_t LogByte4(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
         uint8_t byte_b, uint8_t byte_c, uint8_t byte_d);
 
+/// Log a block of data as consecutive records of four bytes
+uint8_t LogBlock(log_struct_t *logger, SCD_LOG_BYTE type,
+        const uint8_t *data, uint8_t len);
+
+/// Check if the records of a type are logged by the log policy
+uint8_t IsLogged(SCD_LOG_BYTE type);
+
+/// Log one byte of data from an interrupt handler
+uint8_t LogByteISR(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a);
+
+/// Save the log to the selected storage backend
+uint8_t SaveLog(log_struct_t *logger);
+
+/// Save the log from an interrupt handler
+uint8_t SaveLogISR(log_struct_t *logger);
+
+/// Log a command header and select what is logged from the APDU
+uint8_t LogCommandHeader(log_struct_t *logger, SCD_LOG_BYTE type,
+        uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t p3);
+
+/// Set the log policy
+uint8_t SetLogPolicy(const log_policy_t *policy, uint8_t persist);
+
+/// Set one of the predefined log policies
+uint8_t SelectLogPolicy(LOG_POLICY_PRESET preset, uint8_t persist);
+
+/// Get the log policy currently used
+void GetLogPolicy(log_policy_t *policy);
+
+/// Load the log policy saved in EEPROM
+void LoadLogPolicy();
+
 
 #endif // _SCD_LOGGER_H_
 
@@ -0,0 +1,769 @@
+/**
+ * \file
+ * \brief scd_logsink.c source file
+ *
+ * This file implements the storage backends (log sinks) for the
+ * transaction logs. The logger writes through a small interface (open,
+ * append, commit and read back) so the same applications and dump
+ * commands work with the internal EEPROM, an external SPI DataFlash or
+ * an external I2C FRAM.
+ *
+ * The write pointer of every backend is kept in EEPROM: the internal
+ * EEPROM log keeps its pointer in the metadata of the SCD (scdMeta, see
+ * scd_meta.h), with the selected backend, while the external backends use
+ * EEPROM_XLOG_POINTER.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scd.h"
+#include "scd_hal.h"
+#include "scd_logsink.h"
+#include "scd_meta.h"
+#include "scd_values.h"
+
+#if LOG_SINK_DATAFLASH_ENABLED
+#include "LUFA/Common/Common.h"
+#include "LUFA/Drivers/Peripheral/SPI.h"
+#endif
+
+#if LOG_SINK_FRAM_ENABLED
+#include "LUFA/Drivers/Peripheral/TWI.h"
+#endif
+
+/// AT45DB command opcodes
+#define DATAFLASH_CMD_STATUS 0xD7
+#define DATAFLASH_CMD_READ 0x03
+#define DATAFLASH_CMD_PAGE_TO_BUFFER 0x53
+#define DATAFLASH_CMD_BUFFER_WRITE 0x84
+#define DATAFLASH_CMD_BUFFER_TO_PAGE 0x83
+
+/// Timeout in ms for the FRAM to acknowledge its address
+#define FRAM_TIMEOUT_MS 10
+
+/// Start of the flash programming entries of the bootloader (see
+/// scd_hal.S), each a JMP instruction
+#define FLASH_BOOT_API 0x1FFE4UL
+#define FLASH_BOOT_API_JMP 0x940C
+
+/* Static variables */
+static LOG_SINK_TYPE sinkType = LOG_SINK_DEFAULT;
+static const log_sink_t *sink = NULL;   // backend of the open session
+static uint32_t sinkPosition;           // next free byte in the log
+
+
+/* Internal EEPROM backend */
+
+static uint8_t EEPROMSinkInit()
+{
+  return 0;
+}
+
+static void EEPROMSinkShutdown()
+{
+}
+
+static uint32_t EEPROMSinkCapacity()
+{
+  return EEPROM_MAX_ADDRESS - EEPROM_TLOG_DATA;
+}
+
+static uint8_t EEPROMSinkRead(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+  eeprom_read_block(buf, (void*)(uint16_t)(EEPROM_TLOG_DATA + addr), len);
+  return 0;
+}
+
+static uint8_t EEPROMSinkWrite(uint32_t addr, const uint8_t *buf,
+    uint16_t len)
+{
+  eeprom_write_block(buf, (void*)(uint16_t)(EEPROM_TLOG_DATA + addr), len);
+  return 0;
+}
+
+static const log_sink_t eepromSink = {
+  EEPROMSinkInit, EEPROMSinkShutdown, EEPROMSinkCapacity,
+  EEPROMSinkRead, EEPROMSinkWrite
+};
+
+
+/* SPI DataFlash backend */
+
+#if LOG_SINK_DATAFLASH_ENABLED
+static void DataflashSelect()
+{
+  PORTB &= ~(_BV(PB0));
+}
+
+static void DataflashDeselect()
+{
+  PORTB |= _BV(PB0);
+}
+
+/**
+ * Selects the DataFlash and sends a command followed by the
+ * page and byte address. The chip is left selected.
+ */
+static void DataflashCommand(uint8_t cmd, uint16_t page, uint16_t offset)
+{
+  uint32_t addr;
+
+  addr = ((uint32_t)page << LOG_DATAFLASH_PAGE_SHIFT) | offset;
+  DataflashSelect();
+  SPI_SendByte(cmd);
+  SPI_SendByte((addr >> 16) & 0xFF);
+  SPI_SendByte((addr >> 8) & 0xFF);
+  SPI_SendByte(addr & 0xFF);
+}
+
+static uint8_t DataflashStatus()
+{
+  uint8_t status;
+
+  DataflashSelect();
+  SPI_SendByte(DATAFLASH_CMD_STATUS);
+  status = SPI_ReceiveByte();
+  DataflashDeselect();
+
+  return status;
+}
+
+static void DataflashWaitReady()
+{
+  while((DataflashStatus() & 0x80) == 0);
+}
+
+static uint8_t DataflashSinkInit()
+{
+  uint8_t status;
+
+  SPI_Init(SPI_SPEED_FCPU_DIV_2 | SPI_ORDER_MSB_FIRST |
+      SPI_SCK_LEAD_FALLING | SPI_SAMPLE_TRAILING | SPI_MODE_MASTER);
+  PORTB |= _BV(PB0);
+  DDRB |= _BV(PB0);
+
+  // a missing chip reads as all ones or all zeros
+  status = DataflashStatus();
+  if(status == 0xFF || status == 0x00)
+    return RET_LOG_SINK_INIT;
+
+  return 0;
+}
+
+static void DataflashSinkShutdown()
+{
+  DataflashDeselect();
+  SPI_ShutDown();
+  DDRB &= ~(_BV(PB0));
+  PORTB &= ~(_BV(PB0));
+}
+
+static uint32_t DataflashSinkCapacity()
+{
+  return (uint32_t)LOG_DATAFLASH_PAGE_SIZE * LOG_DATAFLASH_PAGES;
+}
+
+static uint8_t DataflashSinkRead(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+  DataflashWaitReady();
+  DataflashCommand(DATAFLASH_CMD_READ, addr / LOG_DATAFLASH_PAGE_SIZE,
+      addr % LOG_DATAFLASH_PAGE_SIZE);
+  while(len--)
+    *buf++ = SPI_ReceiveByte();
+  DataflashDeselect();
+
+  return 0;
+}
+
+/**
+ * Writes data using the page buffer of the DataFlash: each page is first
+ * loaded into the buffer, then modified and written back with a built-in
+ * erase, so data already in the page is preserved.
+ */
+static uint8_t DataflashSinkWrite(uint32_t addr, const uint8_t *buf,
+    uint16_t len)
+{
+  uint16_t page, offset, n;
+
+  while(len > 0)
+  {
+    page = addr / LOG_DATAFLASH_PAGE_SIZE;
+    offset = addr % LOG_DATAFLASH_PAGE_SIZE;
+    n = LOG_DATAFLASH_PAGE_SIZE - offset;
+    if(n > len)
+      n = len;
+
+    DataflashWaitReady();
+    DataflashCommand(DATAFLASH_CMD_PAGE_TO_BUFFER, page, 0);
+    DataflashDeselect();
+    DataflashWaitReady();
+
+    DataflashCommand(DATAFLASH_CMD_BUFFER_WRITE, 0, offset);
+    addr += n;
+    len -= n;
+    while(n--)
+      SPI_SendByte(*buf++);
+    DataflashDeselect();
+
+    DataflashCommand(DATAFLASH_CMD_BUFFER_TO_PAGE, page, 0);
+    DataflashDeselect();
+  }
+  DataflashWaitReady();
+
+  return 0;
+}
+
+static const log_sink_t dataflashSink = {
+  DataflashSinkInit, DataflashSinkShutdown, DataflashSinkCapacity,
+  DataflashSinkRead, DataflashSinkWrite
+};
+#endif // LOG_SINK_DATAFLASH_ENABLED
+
+
+/* I2C FRAM backend */
+
+#if LOG_SINK_FRAM_ENABLED
+/**
+ * Starts a write transfer and sends the FRAM memory address.
+ *
+ * @return zero if the FRAM acknowledged, RET_LOG_SINK_IO otherwise
+ */
+static uint8_t FRAMAddress(uint16_t addr)
+{
+  if(!TWI_StartTransmission(LOG_FRAM_ADDRESS, FRAM_TIMEOUT_MS))
+    return RET_LOG_SINK_IO;
+  if(!TWI_SendByte((addr >> 8) & 0xFF) || !TWI_SendByte(addr & 0xFF))
+  {
+    TWI_StopTransmission();
+    return RET_LOG_SINK_IO;
+  }
+
+  return 0;
+}
+
+static uint8_t FRAMSinkInit()
+{
+  TWBR = 12;              // 400 kHz at 16 MHz
+  TWI_Init();
+
+  if(FRAMAddress(0))
+    return RET_LOG_SINK_INIT;
+  TWI_StopTransmission();
+
+  return 0;
+}
+
+static void FRAMSinkShutdown()
+{
+  TWI_ShutDown();
+  PORTD |= _BV(PD0) | _BV(PD1);   // restore pull-ups, see scd.c
+}
+
+static uint32_t FRAMSinkCapacity()
+{
+  return LOG_FRAM_SIZE;
+}
+
+static uint8_t FRAMSinkRead(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+  if(FRAMAddress(addr))
+    return RET_LOG_SINK_IO;
+  if(!TWI_StartTransmission(LOG_FRAM_ADDRESS | 0x01, FRAM_TIMEOUT_MS))
+    return RET_LOG_SINK_IO;
+  while(len--)
+    TWI_ReceiveByte(buf++, len == 0);
+  TWI_StopTransmission();
+
+  return 0;
+}
+
+static uint8_t FRAMSinkWrite(uint32_t addr, const uint8_t *buf,
+    uint16_t len)
+{
+  if(FRAMAddress(addr))
+    return RET_LOG_SINK_IO;
+  while(len--)
+  {
+    if(!TWI_SendByte(*buf++))
+    {
+      TWI_StopTransmission();
+      return RET_LOG_SINK_IO;
+    }
+  }
+  TWI_StopTransmission();
+
+  return 0;
+}
+
+static const log_sink_t framSink = {
+  FRAMSinkInit, FRAMSinkShutdown, FRAMSinkCapacity,
+  FRAMSinkRead, FRAMSinkWrite
+};
+#endif // LOG_SINK_FRAM_ENABLED
+
+
+/* Internal flash backend */
+
+#if LOG_SINK_FLASH_ENABLED
+// the page is not allocated, as the log can be saved from interrupts
+static uint8_t flashPage[LOG_FLASH_PAGE_SIZE];  // page being written
+static uint8_t flashPageValid;          // non-zero if flashPage is in use
+static uint32_t flashPageAddr;          // log address of that page
+
+/**
+ * Returns the flash address after the firmware (code and initial data
+ * of the variables), also above 64 KB
+ */
+static uint32_t FlashImageEnd()
+{
+  uint32_t addr;
+
+  __asm__ __volatile__ (
+      "ldi %A0, lo8(__data_load_end)" "\n\t"
+      "ldi %B0, hi8(__data_load_end)" "\n\t"
+      "ldi %C0, hh8(__data_load_end)" "\n\t"
+      "clr %D0" "\n\t"
+      : "=d" (addr));
+
+  return addr;
+}
+
+/**
+ * Programs the page kept in RAM into the flash. The bootloader erases
+ * the page before writing it, so data already in the page is preserved
+ * only through the copy in RAM.
+ */
+static void FlashProgramPage()
+{
+  uint16_t i;
+  uint8_t sreg;
+
+  // the page buffer is lost if the EEPROM is written in the meantime,
+  // and interrupts (in the RWW section) cannot run while programming
+  eeprom_busy_wait();
+  sreg = SREG;
+  cli();
+  for(i = 0; i < LOG_FLASH_PAGE_SIZE; i += 2)
+    BootFlashFillWord(i, flashPage[i] | ((uint16_t)flashPage[i + 1] << 8));
+  BootFlashWritePage(LOG_FLASH_START + flashPageAddr);
+  SREG = sreg;
+}
+
+static uint8_t FlashSinkInit()
+{
+  // the bootloader must provide the programming entries and the
+  // firmware must not use the log area
+  if(pgm_read_word_far(FLASH_BOOT_API) != FLASH_BOOT_API_JMP)
+    return RET_LOG_SINK_INIT;
+  if(FlashImageEnd() > LOG_FLASH_START)
+    return RET_LOG_SINK_INIT;
+
+  return 0;
+}
+
+/**
+ * Programs the last page written, if any
+ */
+static void FlashSinkShutdown()
+{
+  if(!flashPageValid)
+    return;
+
+  FlashProgramPage();
+  flashPageValid = 0;
+}
+
+static uint32_t FlashSinkCapacity()
+{
+  return LOG_FLASH_END - LOG_FLASH_START;
+}
+
+static uint8_t FlashSinkRead(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+  for(; len > 0; len--, addr++)
+  {
+    if(flashPageValid &&
+        (addr & ~(uint32_t)(LOG_FLASH_PAGE_SIZE - 1)) == flashPageAddr)
+      *buf++ = flashPage[addr & (LOG_FLASH_PAGE_SIZE - 1)];
+    else
+      *buf++ = pgm_read_byte_far(LOG_FLASH_START + addr);
+  }
+
+  return 0;
+}
+
+/**
+ * Writes data into a copy of the flash page kept in RAM. The page is
+ * programmed when data for another page is written or when the session
+ * is closed, so each page is erased and programmed once for many small
+ * appends.
+ */
+static uint8_t FlashSinkWrite(uint32_t addr, const uint8_t *buf,
+    uint16_t len)
+{
+  uint32_t page;
+  uint16_t offset, n, i;
+
+  while(len > 0)
+  {
+    page = addr & ~(uint32_t)(LOG_FLASH_PAGE_SIZE - 1);
+    offset = addr & (LOG_FLASH_PAGE_SIZE - 1);
+    if(!flashPageValid || page != flashPageAddr)
+    {
+      if(flashPageValid)
+        FlashProgramPage();
+
+      // keep the data already in the page
+      flashPageValid = 1;
+      flashPageAddr = page;
+      for(i = 0; i < LOG_FLASH_PAGE_SIZE; i++)
+        flashPage[i] = pgm_read_byte_far(LOG_FLASH_START + page + i);
+    }
+
+    n = LOG_FLASH_PAGE_SIZE - offset;
+    if(n > len)
+      n = len;
+    memcpy(&flashPage[offset], buf, n);
+    addr += n;
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static const log_sink_t flashSink = {
+  FlashSinkInit, FlashSinkShutdown, FlashSinkCapacity,
+  FlashSinkRead, FlashSinkWrite
+};
+#endif // LOG_SINK_FLASH_ENABLED
+
+
+/* Static functions */
+
+/**
+ * Returns the backend implementation for a given type
+ *
+ * @param type the backend type
+ * @return the backend or NULL if it was not built
+ */
+static const log_sink_t* GetSinkOps(LOG_SINK_TYPE type)
+{
+  switch(type)
+  {
+    case LOG_SINK_EEPROM:
+      return &eepromSink;
+#if LOG_SINK_DATAFLASH_ENABLED
+    case LOG_SINK_DATAFLASH:
+      return &dataflashSink;
+#endif
+#if LOG_SINK_FRAM_ENABLED
+    case LOG_SINK_FRAM:
+      return &framSink;
+#endif
+#if LOG_SINK_FLASH_ENABLED
+    case LOG_SINK_FLASH:
+      return &flashSink;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+/**
+ * Reads the write pointer of the selected backend from EEPROM.
+ * Invalid values (e.g. after the EEPROM was erased) mean an empty log.
+ */
+static uint32_t ReadSinkPointer(uint32_t capacity)
+{
+  uint32_t pos;
+
+  if(sinkType == LOG_SINK_EEPROM)
+  {
+    pos = scdMeta.tlogPointer;
+    if(pos < EEPROM_TLOG_DATA)
+      return 0;
+    pos = pos - EEPROM_TLOG_DATA;
+  }
+  else
+    pos = eeprom_read_dword((uint32_t*)EEPROM_XLOG_POINTER);
+
+  if(pos > capacity)
+    return 0;
+  return pos;
+}
+
+/**
+ * Saves the write pointer of the selected backend to EEPROM
+ */
+static void WriteSinkPointer(uint32_t pos)
+{
+  uint8_t sreg;
+
+  if(sinkType == LOG_SINK_EEPROM)
+  {
+    // the interrupt routines commit scdMeta, so the 16-bit pointer is
+    // changed with interrupts disabled
+    sreg = SREG;
+    cli();
+    scdMeta.tlogPointer = pos + EEPROM_TLOG_DATA;
+    SREG = sreg;
+    CommitSCDMeta();
+  }
+  else
+    eeprom_update_dword((uint32_t*)EEPROM_XLOG_POINTER, pos);
+}
+
+
+/* Public functions */
+
+/**
+ * Selects the backend used by the following log sessions. The selected
+ * backend can also be saved to EEPROM so that it is used after reset.
+ *
+ * @param type the log storage backend
+ * @param persist set to non-zero to save the selection in EEPROM
+ * @return zero if successful, RET_ERR_PARAM if the backend is unknown or
+ * not included in this build, RET_ERR_CHECK if a session is open
+ */
+uint8_t SelectLogSink(LOG_SINK_TYPE type, uint8_t persist)
+{
+  if(GetSinkOps(type) == NULL)
+    return RET_ERR_PARAM;
+  if(sink != NULL)
+    return RET_ERR_CHECK;
+
+  sinkType = type;
+  if(persist)
+  {
+    scdMeta.logSink = type;
+    CommitSCDMeta();
+  }
+
+  return 0;
+}
+
+/**
+ * Loads the backend saved in EEPROM, from the metadata read by LoadSCDMeta.
+ * If the saved value is not valid (e.g. erased EEPROM) the build default
+ * LOG_SINK_DEFAULT is used.
+ */
+void LoadLogSink()
+{
+  uint8_t type;
+
+  type = scdMeta.logSink;
+  if(GetSinkOps((LOG_SINK_TYPE)type) != NULL)
+    sinkType = (LOG_SINK_TYPE)type;
+  else
+    sinkType = LOG_SINK_DEFAULT;
+}
+
+/**
+ * Returns the log storage backend currently selected
+ *
+ * @return the backend type
+ */
+LOG_SINK_TYPE GetLogSink()
+{
+  return sinkType;
+}
+
+/**
+ * Opens a log session: initialises the selected backend and reads the
+ * current write pointer. Each session must be closed with LogSinkCommit.
+ *
+ * @return zero if successful, non-zero otherwise
+ */
+uint8_t LogSinkOpen()
+{
+  const log_sink_t *ops;
+
+  if(sink != NULL)
+    return RET_ERR_CHECK;
+
+  ops = GetSinkOps(sinkType);
+  if(ops == NULL)
+    return RET_ERR_PARAM;
+  if(ops->init())
+  {
+    ops->shutdown();
+    return RET_LOG_SINK_INIT;
+  }
+
+  sink = ops;
+  sinkPosition = ReadSinkPointer(sink->capacity());
+
+  return 0;
+}
+
+/**
+ * Appends data at the end of the log. If the backend is almost full
+ * only the data that fits is written and RET_LOG_SINK_FULL is returned.
+ *
+ * @param data the data to be written
+ * @param len the length of the data
+ * @return zero if all data was written, non-zero otherwise
+ */
+uint8_t LogSinkAppend(const uint8_t *data, uint16_t len)
+{
+  uint32_t space;
+  uint8_t result = 0;
+
+  if(sink == NULL || data == NULL)
+    return RET_ERR_PARAM;
+
+  space = sink->capacity() - sinkPosition;
+  if(space < len)
+  {
+    len = space;
+    result = RET_LOG_SINK_FULL;
+  }
+  if(len == 0)
+    return result;
+
+  if(sink->write(sinkPosition, data, len))
+    return RET_LOG_SINK_IO;
+  sinkPosition += len;
+
+  return result;
+}
+
+/**
+ * Overwrites data already appended in the current session, e.g. to
+ * complete a record header once the length of the data that follows it
+ * is known.
+ *
+ * @param addr the position within the log
+ * @param data the new data
+ * @param len the length of the data
+ * @return zero if successful, non-zero otherwise
+ */
+uint8_t LogSinkUpdate(uint32_t addr, const uint8_t *data, uint16_t len)
+{
+  if(sink == NULL || data == NULL || addr + len > sinkPosition)
+    return RET_ERR_PARAM;
+
+  if(sink->write(addr, data, len))
+    return RET_LOG_SINK_IO;
+
+  return 0;
+}
+
+/**
+ * Saves the write pointer and closes the current log session
+ *
+ * @return zero if successful, non-zero otherwise
+ */
+uint8_t LogSinkCommit()
+{
+  if(sink == NULL)
+    return RET_ERR_PARAM;
+
+  // the backend may complete its writes when shut down (e.g. the
+  // internal flash), so only then the new data is part of the log
+  sink->shutdown();
+  WriteSinkPointer(sinkPosition);
+  sink = NULL;
+
+  return 0;
+}
+
+/**
+ * Returns the number of log bytes stored in the selected backend
+ *
+ * @return the length of the log
+ */
+uint32_t LogSinkLength()
+{
+  const log_sink_t *ops;
+
+  if(sink != NULL)
+    return sinkPosition;
+  ops = GetSinkOps(sinkType);
+  if(ops == NULL)
+    return 0;
+  return ReadSinkPointer(ops->capacity());
+}
+
+/**
+ * Reads back log data from the selected backend. This can be used
+ * either within a session or on its own, in which case the backend is
+ * initialised and shut down by this function.
+ *
+ * @param addr the position within the log
+ * @param buf the destination buffer
+ * @param len the number of bytes to read
+ * @return zero if successful, non-zero otherwise
+ */
+uint8_t LogSinkRead(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+  const log_sink_t *ops;
+  uint8_t result;
+
+  if(buf == NULL)
+    return RET_ERR_PARAM;
+  if(sink != NULL)
+    return sink->read(addr, buf, len);
+
+  ops = GetSinkOps(sinkType);
+  if(ops == NULL)
+    return RET_ERR_PARAM;
+  if(ops->init())
+  {
+    ops->shutdown();
+    return RET_LOG_SINK_INIT;
+  }
+  result = ops->read(addr, buf, len);
+  ops->shutdown();
+
+  return result;
+}
+
+/**
+ * Discards the log of the selected backend by resetting its write
+ * pointer. The data itself is overwritten by the following sessions.
+ *
+ * @return zero if successful, non-zero otherwise
+ */
+uint8_t LogSinkErase()
+{
+  if(sink != NULL)
+    return RET_ERR_CHECK;
+
+  WriteSinkPointer(0);
+
+  return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * \file
+ * \brief scd_logsink.h header file
+ *
+ * This file defines the storage backends (log sinks) used to keep the
+ * transaction logs: the internal EEPROM, an external SPI DataFlash, an
+ * external I2C FRAM and the unused part of the internal flash.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_LOGSINK_H_
+#define _SCD_LOGSINK_H_
+
+#include <stdint.h>
+
+/// Set to 1 to build the SPI DataFlash backend (AT45DB, /CS on PB0)
+#ifndef LOG_SINK_DATAFLASH_ENABLED
+#define LOG_SINK_DATAFLASH_ENABLED 0
+#endif
+
+/// Set to 1 to build the I2C FRAM backend (FM24 series)
+/// Note: SCL/SDA are PD0/PD1, which the SCD also uses for the terminal
+/// reset and ICC switch lines, so the FRAM needs a separate board revision
+#ifndef LOG_SINK_FRAM_ENABLED
+#define LOG_SINK_FRAM_ENABLED 0
+#endif
+
+/// Set to 1 to build the internal flash backend. The flash is programmed
+/// through the DFU bootloader (see BootFlashWritePage), since SPM only
+/// works from the boot section
+#ifndef LOG_SINK_FLASH_ENABLED
+#define LOG_SINK_FLASH_ENABLED 0
+#endif
+
+/// Backend used when none has been selected at boot time
+#ifndef LOG_SINK_DEFAULT
+#define LOG_SINK_DEFAULT LOG_SINK_EEPROM
+#endif
+
+/// DataFlash page size in bytes and number of pages (AT45DB041D)
+#define LOG_DATAFLASH_PAGE_SIZE 264
+#define LOG_DATAFLASH_PAGES 2048
+
+/// Number of address bits used for the byte within a DataFlash page
+#define LOG_DATAFLASH_PAGE_SHIFT 9
+
+/// FRAM size in bytes and I2C bus address (FM24CL64)
+#define LOG_FRAM_SIZE 8192UL
+#define LOG_FRAM_ADDRESS 0xA0
+
+/// Internal flash log area: from 64 KB up to the boot section (8 KB boot
+/// section, see the fuses in the Makefile). The firmware must end below it
+#define LOG_FLASH_START 0x10000UL
+#define LOG_FLASH_END 0x1E000UL
+
+/// Internal flash page size in bytes (SPM_PAGESIZE)
+#define LOG_FLASH_PAGE_SIZE 256
+
+/**
+ * Available log storage backends. The value is stored in EEPROM
+ * (scdMeta.logSink, see scd_meta.h) to select the backend at boot time.
+ */
+typedef enum {
+    LOG_SINK_EEPROM = 0,
+    LOG_SINK_DATAFLASH = 1,
+    LOG_SINK_FRAM = 2,
+    LOG_SINK_FLASH = 3,
+    LOG_SINK_COUNT,
+} LOG_SINK_TYPE;
+
+/**
+ * Operations implemented by each log storage backend. All addresses are
+ * relative to the start of the log area of the backend.
+ */
+struct log_sink {
+    uint8_t (*init)();
+    void (*shutdown)();
+    uint32_t (*capacity)();
+    uint8_t (*read)(uint32_t addr, uint8_t *buf, uint16_t len);
+    uint8_t (*write)(uint32_t addr, const uint8_t *buf, uint16_t len);
+};
+typedef struct log_sink log_sink_t;
+
+/// Select the log storage backend
+uint8_t SelectLogSink(LOG_SINK_TYPE type, uint8_t persist);
+
+/// Load the backend selected in EEPROM
+void LoadLogSink();
+
+/// Return the selected log storage backend
+LOG_SINK_TYPE GetLogSink();
+
+/// Open a log session on the selected backend
+uint8_t LogSinkOpen();
+
+/// Append data to the log
+uint8_t LogSinkAppend(const uint8_t *data, uint16_t len);
+
+/// Overwrite data appended in the current session
+uint8_t LogSinkUpdate(uint32_t addr, const uint8_t *data, uint16_t len);
+
+/// Save the log pointer and close the session
+uint8_t LogSinkCommit();
+
+/// Return the number of log bytes stored
+uint32_t LogSinkLength();
+
+/// Read back log data
+uint8_t LogSinkRead(uint32_t addr, uint8_t *buf, uint16_t len);
+
+/// Discard all the data in the log
+uint8_t LogSinkErase();
+
+#endif // _SCD_LOGSINK_H_
@@ -0,0 +1,593 @@
+/**
+ * \file
+ * \brief	scd_logvol.c source file
+ *
+ * This file implements a read-only FAT12 volume generated on the fly
+ * from the transaction log stored in EEPROM. The volume contains the
+ * whole EEPROM image (EEPROM.BIN) plus, for each log session, the raw
+ * log bytes (LOGnn.BIN) and a decoded text summary (LOGnn.TXT).
+ *
+ * Nothing is buffered: each sector is rebuilt from EEPROM when the host
+ * reads it, so the volume only needs the small session table below.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scd.h"
+#include "scd_hal.h"
+#include "scd_logger.h"
+#include "scd_logsink.h"
+#include "scd_logvol.h"
+#include "scd_logzip.h"
+#include "scd_values.h"
+#include "serial.h"
+
+/// size of SCD's EEPROM
+#define EEPROM_SIZE 4096
+
+/// Volume layout: boot sector, FAT, root directory and then data
+#define LOGVOL_FAT_START 1
+#define LOGVOL_FAT_SECTORS 2
+#define LOGVOL_ROOT_START (LOGVOL_FAT_START + LOGVOL_FAT_SECTORS)
+#define LOGVOL_ROOT_ENTRIES 32
+#define LOGVOL_ROOT_SECTORS ((LOGVOL_ROOT_ENTRIES * 32) / LOGVOL_SECTOR_SIZE)
+#define LOGVOL_DATA_START (LOGVOL_ROOT_START + LOGVOL_ROOT_SECTORS)
+
+/// Number of bytes available for files in the data area
+#define LOGVOL_DATA_BYTES \
+  ((uint32_t)(LOGVOL_TOTAL_SECTORS - LOGVOL_DATA_START) * LOGVOL_SECTOR_SIZE)
+
+/// EEPROM.BIN followed by one .BIN and one .TXT file per session
+#define LOGVOL_MAX_FILES (1 + 2 * LOGVOL_MAX_SESSIONS)
+
+/// Fixed date used for all files (2013-01-01), FAT format
+#define LOGVOL_FAT_DATE 0x4221
+
+/// Width of the event name column in the text files
+#define LOGVOL_NAME_WIDTH 24
+
+/* Static variables */
+static const uint8_t bootSector[62] PROGMEM = {
+  0xEB, 0x3C, 0x90,                                 // jump instruction
+  'S', 'C', 'D', ' ', ' ', 'L', 'O', 'G',           // OEM name
+  (LOGVOL_SECTOR_SIZE & 0xFF), (LOGVOL_SECTOR_SIZE >> 8),
+  1,                                                // sectors per cluster
+  LOGVOL_FAT_START, 0,                              // reserved sectors
+  1,                                                // number of FATs
+  LOGVOL_ROOT_ENTRIES, 0,                           // root entries
+  (LOGVOL_TOTAL_SECTORS & 0xFF), (LOGVOL_TOTAL_SECTORS >> 8),
+  0xF8,                                             // media descriptor
+  LOGVOL_FAT_SECTORS, 0,                            // sectors per FAT
+  1, 0,                                             // sectors per track
+  1, 0,                                             // number of heads
+  0, 0, 0, 0,                                       // hidden sectors
+  0, 0, 0, 0,                                       // large sector count
+  0x80, 0, 0x29,                                    // drive, extended sig.
+  'S', 'C', 'D', '1',                               // serial number
+  'S', 'C', 'D', ' ', 'L', 'O', 'G', 'S', ' ', ' ', ' ',
+  'F', 'A', 'T', '1', '2', ' ', ' ', ' '
+};
+
+static uint8_t nSessions;                          // number of log sessions
+static uint32_t sessionStart[LOGVOL_MAX_SESSIONS]; // log sink address
+static uint32_t sessionLength[LOGVOL_MAX_SESSIONS];// length in bytes
+static uint16_t sessionRecords[LOGVOL_MAX_SESSIONS];// number of records
+static uint16_t fileCluster[LOGVOL_MAX_FILES];     // first cluster of file
+static uint32_t fileSize[LOGVOL_MAX_FILES];        // file size in bytes
+
+// cursor used to avoid rescanning the log for sequential text reads
+static uint8_t textSession = 0xFF;
+static uint16_t textLine;
+static uint32_t textAddress;
+
+
+/* Static functions */
+
+/**
+ * Returns the name of a log event, as shown in the text files.
+ *
+ * @param code the 6-bit type code of the log record
+ * @return pointer to a string in program memory
+ */
+static PGM_P LogEventName(uint8_t code)
+{
+  switch(code)
+  {
+    case 0x00: return PSTR("ATR byte from ICC");
+    case 0x01: return PSTR("ATR byte to terminal");
+    case 0x02: return PSTR("Byte to terminal");
+    case 0x03: return PSTR("Byte from terminal");
+    case 0x04: return PSTR("Byte to ICC");
+    case 0x05: return PSTR("Byte from ICC");
+    case 0x06: return PSTR("Commands not logged");
+    case 0x07: return PSTR("Compressed session");
+    case 0x08: return PSTR("ATR from USB");
+    case 0x09: return PSTR("CCEND from USB");
+    case 0x0A: return PSTR("Byte from USB");
+    case 0x0B: return PSTR("Byte to USB");
+    case 0x0C: return PSTR("USB receive error");
+    case 0x0D: return PSTR("USB send error");
+    case 0x0F: return PSTR("Repeated payload");
+    case 0x10: return PSTR("Terminal reset high");
+    case 0x11: return PSTR("Terminal reset low");
+    case 0x12: return PSTR("Terminal timed out");
+    case 0x13: return PSTR("Terminal receive error");
+    case 0x14: return PSTR("Terminal send error");
+    case 0x15: return PSTR("No terminal clock");
+    case 0x16: return PSTR("More time to terminal");
+    case 0x17: return PSTR("Keep-alives to terminal");
+    case 0x20: return PSTR("ICC activated");
+    case 0x21: return PSTR("ICC deactivated");
+    case 0x22: return PSTR("ICC reset high");
+    case 0x23: return PSTR("ICC receive error");
+    case 0x24: return PSTR("ICC send error");
+    case 0x25: return PSTR("ICC inserted");
+    case 0x26: return PSTR("Prefetched record used");
+    case 0x27: return PSTR("Session cache hit");
+    case 0x28: return PSTR("Session cache miss");
+    case 0x29: return PSTR("Session cache cleared");
+    case 0x2A: return PSTR("Card cache result");
+    case 0x30: return PSTR("Time data to ICC");
+    case 0x31: return PSTR("Time general event");
+    case 0x32: return PSTR("Memory error");
+    case 0x33: return PSTR("Watchdog reset");
+    case 0x34: return PSTR("Debug event 1");
+    case 0x35: return PSTR("Debug event 2");
+    case 0x36: return PSTR("Debug event 3");
+    case 0x37: return PSTR("Debug event 4");
+    case 0x38: return PSTR("Prefetch time saved");
+    case 0x39: return PSTR("Boot time");
+    case 0x3A: return PSTR("Transaction summary");
+    case 0x3B: return PSTR("Card data time");
+  }
+
+  return PSTR("Unknown event");
+}
+
+/**
+ * Returns the size of a log record, including the data that follows a
+ * LOG_COMPRESSED_SESSION record.
+ *
+ * @param addr the position of the record in the log sink
+ * @param type set to the record type
+ * @return the size of the record in bytes, or zero if the record could
+ * not be read
+ */
+static uint32_t GetRecordSize(uint32_t addr, uint8_t *type)
+{
+  uint8_t data[4];
+
+  if(LogSinkRead(addr, type, 1))
+    return 0;
+  if(*type != LOG_COMPRESSED_SESSION)
+    return (*type & 0x03) + 2;
+
+  if(LogSinkRead(addr + 1, data, 4))
+    return 0;
+  return LOGZIP_HEADER_SIZE + ((uint16_t)data[3] << 8 | data[2]);
+}
+
+/**
+ * Returns the number of clusters used by a file
+ *
+ * @param f the file index
+ * @return number of clusters
+ */
+static uint16_t FileClusters(uint8_t f)
+{
+  return (uint16_t)((fileSize[f] + LOGVOL_SECTOR_SIZE - 1) /
+      LOGVOL_SECTOR_SIZE);
+}
+
+/**
+ * Returns the FAT12 entry for a given cluster
+ *
+ * @param n the cluster number
+ * @return the 12-bit FAT entry
+ */
+static uint16_t FatEntry(uint16_t n)
+{
+  uint8_t f;
+  uint16_t last;
+
+  if(n == 0)
+    return 0xFF8;
+  if(n == 1)
+    return 0xFFF;
+
+  for(f = 0; f < 1 + 2 * nSessions; f++)
+  {
+    last = fileCluster[f] + FileClusters(f) - 1;
+    if(n >= fileCluster[f] && n <= last)
+      return (n == last) ? 0xFFF : (n + 1);
+  }
+
+  return 0;
+}
+
+/**
+ * Returns one byte of the FAT
+ *
+ * @param pos the byte position within the FAT
+ * @return the FAT byte
+ */
+static uint8_t FatByte(uint16_t pos)
+{
+  uint16_t e0, e1;
+
+  e0 = FatEntry((pos / 3) * 2);
+  e1 = FatEntry((pos / 3) * 2 + 1);
+
+  if(pos % 3 == 0)
+    return e0 & 0xFF;
+  else if(pos % 3 == 1)
+    return ((e0 >> 8) & 0x0F) | ((e1 & 0x0F) << 4);
+
+  return (e1 >> 4) & 0xFF;
+}
+
+/**
+ * Returns one byte of the root directory
+ *
+ * @param pos the byte position within the root directory
+ * @return the directory byte
+ */
+static uint8_t DirectoryByte(uint16_t pos)
+{
+  uint8_t entry, k, f, s;
+
+  entry = pos / 32;
+  k = pos % 32;
+
+  if(entry == 0)
+  {
+    // volume label
+    if(k < 11)
+      return pgm_read_byte(&bootSector[43 + k]);
+    if(k == 11)
+      return 0x08;
+    return 0;
+  }
+
+  f = entry - 1;
+  if(f >= 1 + 2 * nSessions)
+    return 0;
+
+  if(k < 8)
+  {
+    if(f == 0)
+      return pgm_read_byte(PSTR("EEPROM  ") + k);
+    s = (f - 1) / 2 + 1;
+    if(k < 3) return pgm_read_byte(PSTR("LOG") + k);
+    if(k == 3) return '0' + s / 10;
+    if(k == 4) return '0' + s % 10;
+    return ' ';
+  }
+  if(k < 11)
+  {
+    if(f == 0 || (f % 2) == 1)
+      return pgm_read_byte(PSTR("BIN") + k - 8);
+    return pgm_read_byte(PSTR("TXT") + k - 8);
+  }
+
+  switch(k)
+  {
+    case 11: return 0x01; // read-only
+    case 16: case 18: case 24: return LOGVOL_FAT_DATE & 0xFF;
+    case 17: case 19: case 25: return LOGVOL_FAT_DATE >> 8;
+    case 26: return fileCluster[f] & 0xFF;
+    case 27: return fileCluster[f] >> 8;
+    case 28: return fileSize[f] & 0xFF;
+    case 29: return (fileSize[f] >> 8) & 0xFF;
+    case 30: return (fileSize[f] >> 16) & 0xFF;
+    case 31: return (fileSize[f] >> 24) & 0xFF;
+  }
+
+  return 0;
+}
+
+/**
+ * Renders one line of a text file. Each log record is shown on a
+ * line of LOGVOL_TEXT_LINE characters: the event name followed by
+ * the record bytes in hex or, for time records, the time in ms.
+ *
+ * @param s the session index
+ * @param line the line number within the session
+ * @param out buffer of at least LOGVOL_TEXT_LINE characters
+ */
+static void RenderTextLine(uint8_t s, uint16_t line, char *out)
+{
+  uint8_t type, nbytes, i, k;
+  uint8_t data[4];
+  uint32_t ms;
+  char number[11];
+  PGM_P name;
+
+  if(textSession != s || line < textLine)
+  {
+    textSession = s;
+    textLine = 0;
+    textAddress = sessionStart[s];
+  }
+  while(textLine < line)
+  {
+    textAddress += GetRecordSize(textAddress, &type);
+    textLine++;
+  }
+
+  LogSinkRead(textAddress, &type, 1);
+  nbytes = (type & 0x03) + 1;
+  LogSinkRead(textAddress + 1, data, nbytes);
+
+  memset(out, ' ', LOGVOL_TEXT_LINE - 2);
+  out[LOGVOL_TEXT_LINE - 2] = '\r';
+  out[LOGVOL_TEXT_LINE - 1] = '\n';
+
+  name = LogEventName(type >> 2);
+  for(i = 0; i < LOGVOL_NAME_WIDTH; i++)
+  {
+    k = pgm_read_byte(name + i);
+    if(k == 0)
+      break;
+    out[i] = k;
+  }
+
+  k = LOGVOL_NAME_WIDTH + 1;
+  if(type == LOG_TIME_GENERAL || type == LOG_TIME_DATA_TO_ICC ||
+      type == LOG_TIME_PREFETCH_SAVED)
+  {
+    ms = ((uint32_t)data[3] << 24) | ((uint32_t)data[2] << 16) |
+      ((uint32_t)data[1] << 8) | data[0];
+    // ms = units * COUNTER_US / 1000, without overflow
+    ms = (ms / 1000) * COUNTER_US + ((ms % 1000) * COUNTER_US) / 1000;
+    ultoa(ms, number, 10);
+    i = strlen(number);
+    memcpy(&out[k], number, i);
+    memcpy(&out[k + i], " ms", 3);
+  }
+  else if(type == LOG_TIME_BOOT)
+  {
+    ms = ((uint32_t)data[3] << 24) | ((uint32_t)data[2] << 16) |
+      ((uint32_t)data[1] << 8) | data[0];
+    ultoa(ms, number, 10);
+    i = strlen(number);
+    memcpy(&out[k], number, i);
+    memcpy(&out[k + i], " us", 3);
+  }
+  else
+  {
+    for(i = 0; i < nbytes; i++)
+    {
+      out[k++] = nibbleToHexChar(data[i], 1);
+      out[k++] = nibbleToHexChar(data[i], 0);
+      k++;
+    }
+  }
+}
+
+/**
+ * Reads bytes from one of the files in the volume. Bytes past the end
+ * of the file are returned as zero.
+ *
+ * @param f the file index
+ * @param pos the position within the file
+ * @param buf the destination buffer
+ * @param len the number of bytes to read
+ */
+static void ReadLogFile(uint8_t f, uint32_t pos, uint8_t *buf, uint8_t len)
+{
+  uint8_t s, n, col;
+  char line[LOGVOL_TEXT_LINE];
+
+  memset(buf, 0, len);
+  if(pos >= fileSize[f])
+    return;
+  if(fileSize[f] - pos < len)
+    len = fileSize[f] - pos;
+
+  if(f == 0)
+  {
+    eeprom_read_block(buf, (void*)(uint16_t)pos, len);
+    return;
+  }
+
+  s = (f - 1) / 2;
+  if((f % 2) == 1)
+  {
+    LogSinkRead(sessionStart[s] + pos, buf, len);
+    return;
+  }
+
+  while(len > 0)
+  {
+    col = pos % LOGVOL_TEXT_LINE;
+    RenderTextLine(s, pos / LOGVOL_TEXT_LINE, line);
+    n = LOGVOL_TEXT_LINE - col;
+    if(n > len)
+      n = len;
+    memcpy(buf, &line[col], n);
+    buf += n;
+    pos += n;
+    len -= n;
+  }
+}
+
+
+/* Public functions */
+
+/**
+ * This function scans the log kept by the selected log sink (see
+ * scd_logsink.h) and builds the table of sessions and files exported by
+ * the volume. A session ends with an ICC deactivation or a watchdog
+ * reset record, which is how all the applications terminate their logs
+ * before WriteLog, or with a compressed session record, which holds a
+ * complete session and is shown as a single line. Any sessions above LOGVOL_MAX_SESSIONS are merged into
+ * the last one, and records that would not fit in the volume are left out.
+ *
+ * This function must be called before ReadLogVolume and again whenever
+ * the log changes.
+ *
+ * @return the number of sessions found
+ */
+uint8_t InitLogVolume()
+{
+  uint32_t addr, end, used, size;
+  uint16_t records;
+  uint8_t type, f;
+
+  nSessions = 0;
+  textSession = 0xFF;
+
+  end = LogSinkLength();
+  addr = 0;
+  sessionStart[0] = addr;
+  records = 0;
+  // space for EEPROM.BIN and the cluster slack of the first session files
+  used = EEPROM_SIZE + 2 * LOGVOL_SECTOR_SIZE;
+  while(addr < end)
+  {
+    size = GetRecordSize(addr, &type);
+    if(size == 0 || addr + size > end)
+      break;
+    used += size + LOGVOL_TEXT_LINE;
+    if(used > LOGVOL_DATA_BYTES)
+      break;
+    addr += size;
+    records++;
+
+    if((type == LOG_ICC_DEACTIVATED || type == LOG_WDT_RESET ||
+        type == LOG_COMPRESSED_SESSION) &&
+        nSessions < LOGVOL_MAX_SESSIONS - 1)
+    {
+      sessionLength[nSessions] = addr - sessionStart[nSessions];
+      sessionRecords[nSessions] = records;
+      nSessions++;
+      sessionStart[nSessions] = addr;
+      records = 0;
+      used += 2 * LOGVOL_SECTOR_SIZE;
+    }
+  }
+  if(records > 0)
+  {
+    sessionLength[nSessions] = addr - sessionStart[nSessions];
+    sessionRecords[nSessions] = records;
+    nSessions++;
+  }
+
+  // allocate clusters contiguously, starting with the EEPROM image
+  fileSize[0] = EEPROM_SIZE;
+  fileCluster[0] = 2;
+  for(f = 1; f < 1 + 2 * nSessions; f++)
+  {
+    if((f % 2) == 1)
+      fileSize[f] = sessionLength[(f - 1) / 2];
+    else
+      fileSize[f] = (uint32_t)sessionRecords[(f - 1) / 2] * LOGVOL_TEXT_LINE;
+    fileCluster[f] = fileCluster[f - 1] + FileClusters(f - 1);
+  }
+
+  return nSessions;
+}
+
+/**
+ * Returns the number of log sessions found by the last call
+ * to InitLogVolume
+ *
+ * @return number of sessions
+ */
+uint8_t GetLogVolumeSessions()
+{
+  return nSessions;
+}
+
+/**
+ * Reads part of a sector from the log volume. The sector contents are
+ * generated from the EEPROM and the log sink at each call.
+ *
+ * @param lba the logical block (sector) address
+ * @param offset the byte offset within the sector
+ * @param buf the destination buffer, of at least len bytes
+ * @param len the number of bytes to read
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t ReadLogVolume(uint32_t lba, uint16_t offset, uint8_t *buf,
+    uint8_t len)
+{
+  uint16_t cluster, i;
+  uint8_t f;
+
+  if(buf == NULL || lba >= LOGVOL_TOTAL_SECTORS ||
+      offset + len > LOGVOL_SECTOR_SIZE)
+    return RET_ERR_PARAM;
+
+  if(lba == 0)
+  {
+    for(i = 0; i < len; i++, offset++)
+    {
+      if(offset < sizeof(bootSector))
+        buf[i] = pgm_read_byte(&bootSector[offset]);
+      else if(offset == 510)
+        buf[i] = 0x55;
+      else if(offset == 511)
+        buf[i] = 0xAA;
+      else
+        buf[i] = 0;
+    }
+  }
+  else if(lba < LOGVOL_ROOT_START)
+  {
+    offset += (lba - LOGVOL_FAT_START) * LOGVOL_SECTOR_SIZE;
+    for(i = 0; i < len; i++)
+      buf[i] = FatByte(offset + i);
+  }
+  else if(lba < LOGVOL_DATA_START)
+  {
+    offset += (lba - LOGVOL_ROOT_START) * LOGVOL_SECTOR_SIZE;
+    for(i = 0; i < len; i++)
+      buf[i] = DirectoryByte(offset + i);
+  }
+  else
+  {
+    memset(buf, 0, len);
+    cluster = lba - LOGVOL_DATA_START + 2;
+    for(f = 0; f < 1 + 2 * nSessions; f++)
+    {
+      if(cluster >= fileCluster[f] &&
+          cluster < fileCluster[f] + FileClusters(f))
+      {
+        ReadLogFile(f, (uint32_t)(cluster - fileCluster[f]) *
+            LOGVOL_SECTOR_SIZE + offset, buf, len);
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
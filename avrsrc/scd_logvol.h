@@ -0,0 +1,64 @@
+/**
+ * \file
+ * \brief scd_logvol.h header file
+ *
+ * This file defines the functions used to present the transaction logs
+ * stored by the log sink as a small read-only FAT12 volume, which can then be
+ * exported over USB Mass Storage.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_LOGVOL_H_
+#define _SCD_LOGVOL_H_
+
+#include <stdint.h>
+
+/// Size of a volume sector in bytes
+#define LOGVOL_SECTOR_SIZE 512
+
+/// Total number of sectors in the volume (256 KB, FAT12)
+#define LOGVOL_TOTAL_SECTORS 512
+
+/// Maximum number of log sessions exported as separate files
+#define LOGVOL_MAX_SESSIONS 15
+
+/// Length of one line in the decoded text files (including CR LF)
+#define LOGVOL_TEXT_LINE 40
+
+/// Scan the log and build the volume layout
+uint8_t InitLogVolume();
+
+/// Number of log sessions found by InitLogVolume
+uint8_t GetLogVolumeSessions();
+
+/// Read part of a volume sector
+uint8_t ReadLogVolume(uint32_t lba, uint16_t offset, uint8_t *buf,
+        uint8_t len);
+
+#endif // _SCD_LOGVOL_H_
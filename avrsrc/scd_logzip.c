@@ -0,0 +1,481 @@
+/**
+ * \file
+ * \brief scd_logzip.c source file
+ *
+ * This file implements the streaming compressor used to save the log
+ * sessions to the log sink (see scd_logzip.h for the format).
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scd_logger.h"
+#include "scd_logsink.h"
+#include "scd_logdedup.h"
+#include "scd_logzip.h"
+#include "scd_values.h"
+
+/// Number of items (literals or matches) described by one flag byte
+#define LOGZIP_GROUP_ITEMS 8
+
+/// Size of the header that starts a run of records
+#define LOGZIP_RUN_HEADER 3
+
+/// Number of bytes read at once from the log sink when decompressing
+#define LOGZIP_READ_CHUNK 16
+
+/**
+ * Input of the compressor: reads the log session replacing the payloads
+ * found by LogDedupFind with references and the runs of records with one
+ * data byte (see LOGZIP_RUN)
+ */
+typedef struct {
+  const uint8_t *data;                  // the log session
+  uint16_t len;                         // length of the session
+  uint16_t pos;                         // next byte of the session
+  const log_dedup_t *dedup;             // payloads replaced, or NULL
+  uint8_t ref;                          // next payload replaced
+  uint8_t header[LOG_DEDUP_REF_SIZE];   // current run header or reference
+  uint8_t headerLen;                    // size of the header
+  uint8_t headerLeft;                   // header bytes not yet read
+  uint8_t runLeft;                      // records left in the current run
+  uint8_t recordLeft;                   // bytes left in the current record
+} logzip_in_t;
+
+/**
+ * State used to read a compressed session from the log sink
+ */
+typedef struct {
+  uint32_t addr;                        // next byte to read from the sink
+  uint32_t end;                         // end of the compressed data
+  uint8_t buf[LOGZIP_READ_CHUNK];       // bytes read from the sink
+  uint8_t bufLen;                       // number of bytes in buf
+  uint8_t bufPos;                       // next byte of buf
+  uint8_t window[LOGZIP_WINDOW];        // last bytes decompressed
+  uint8_t head;                         // where the next byte goes
+  uint8_t record[LOG_DEDUP_REF_SIZE];   // record being rebuilt
+  uint8_t recordLen;                    // bytes of the record so far
+  uint8_t runType;                      // type of the current run
+  uint8_t runLeft;                      // records left in the current run
+  logzip_record_fn fn;                  // function called with each record
+  void *arg;                            // argument of fn
+  uint8_t result;                       // first error of the sink
+} logzip_reader_t;
+
+/**
+ * Output of the compressor: the group being built, which is appended to
+ * the log sink once it has LOGZIP_GROUP_ITEMS items.
+ */
+typedef struct {
+  uint8_t group[1 + 2 * LOGZIP_GROUP_ITEMS];  // flag byte and items
+  uint8_t items;                              // items in the group
+  uint8_t len;                                // bytes in the group
+  uint8_t result;                             // first error of the sink
+} logzip_out_t;
+
+
+/* Static functions */
+
+/**
+ * Reads the next byte of the session, after replacing the payloads and
+ * the runs of records
+ *
+ * @param in the input of the compressor
+ * @param value set to the byte read
+ * @return non-zero if a byte was read or zero at the end of the session
+ */
+static uint8_t NextByte(logzip_in_t *in, uint8_t *value)
+{
+  const uint8_t *data = in->data;
+  const log_dedup_ref_t *ref;
+  uint16_t k;
+  uint8_t count;
+
+  if(in->headerLeft > 0)
+  {
+    *value = in->header[in->headerLen - in->headerLeft];
+    in->headerLeft--;
+    return 1;
+  }
+
+  if(in->runLeft > 0)
+  {
+    in->runLeft--;
+    *value = data[in->pos + 1];
+    in->pos += 2;
+    return 1;
+  }
+
+  if(in->pos >= in->len)
+    return 0;
+
+  if(in->recordLeft == 0)
+  {
+    ref = (in->dedup != NULL && in->ref < in->dedup->count) ?
+      &in->dedup->refs[in->ref] : NULL;
+    if(ref != NULL && ref->start == in->pos)
+    {
+      LogDedupRecord(ref, in->header);
+      in->headerLen = LOG_DEDUP_REF_SIZE;
+      in->headerLeft = LOG_DEDUP_REF_SIZE - 1;
+      in->pos = ref->end;
+      in->ref++;
+      *value = in->header[0];
+      return 1;
+    }
+
+    if((data[in->pos] & 0x03) == 0)
+    {
+      count = 0;
+      for(k = in->pos; k + 1 < in->len && data[k] == data[in->pos] &&
+          count < LOGZIP_MAX_RUN; k += 2)
+        count++;
+
+      if(count >= LOGZIP_MIN_RUN)
+      {
+        in->header[0] = LOGZIP_RUN;
+        in->header[1] = data[in->pos];
+        in->header[2] = count;
+        in->headerLen = LOGZIP_RUN_HEADER;
+        in->headerLeft = LOGZIP_RUN_HEADER - 1;
+        in->runLeft = count;
+        *value = LOGZIP_RUN;
+        return 1;
+      }
+    }
+    in->recordLeft = (data[in->pos] & 0x03) + 2;
+  }
+
+  in->recordLeft--;
+  *value = data[in->pos++];
+  return 1;
+}
+
+/**
+ * Appends the current group to the log sink and starts a new one
+ */
+static void FlushGroup(logzip_out_t *out)
+{
+  if(out->items > 0 && out->result == 0)
+    out->result = LogSinkAppend(out->group, out->len);
+
+  out->group[0] = 0;
+  out->items = 0;
+  out->len = 1;
+}
+
+/**
+ * Adds a literal byte to the output
+ */
+static void PutLiteral(logzip_out_t *out, uint8_t value)
+{
+  out->group[0] |= (1 << out->items);
+  out->group[out->len++] = value;
+  if(++out->items == LOGZIP_GROUP_ITEMS)
+    FlushGroup(out);
+}
+
+/**
+ * Adds a match to the output
+ */
+static void PutMatch(logzip_out_t *out, uint16_t distance, uint8_t length)
+{
+  out->group[out->len++] = distance - 1;
+  out->group[out->len++] = length - LOGZIP_MIN_MATCH;
+  if(++out->items == LOGZIP_GROUP_ITEMS)
+    FlushGroup(out);
+}
+
+/**
+ * Finds the longest sequence in the window that matches the bytes read
+ * ahead. A match may continue into the bytes read ahead, and the byte
+ * following the best match so far is checked first, since most
+ * candidates fail there.
+ *
+ * @param window the ring buffer with the last bytes of the input
+ * @param head the position in the window where the next byte goes
+ * @param filled the number of bytes in the window
+ * @param ahead the bytes read ahead
+ * @param aheadLen the number of bytes read ahead
+ * @param distance set to the distance of the match found
+ * @return the length of the match, or less than LOGZIP_MIN_MATCH if there
+ * is no useful match
+ */
+static uint8_t FindMatch(const uint8_t *window, uint8_t head, uint16_t filled,
+    const uint8_t *ahead, uint8_t aheadLen, uint16_t *distance)
+{
+  uint16_t d;
+  uint8_t n, best = 0, start, value;
+
+  if(aheadLen < LOGZIP_MIN_MATCH)
+    return 0;
+
+  for(d = 1; d <= filled; d++)
+  {
+    start = head - d;
+    value = (best < d) ? window[(uint8_t)(start + best)] : ahead[best - d];
+    if(value != ahead[best] || window[start] != ahead[0])
+      continue;
+
+    for(n = 1; n < aheadLen; n++)
+    {
+      value = (n < d) ? window[(uint8_t)(start + n)] : ahead[n - d];
+      if(value != ahead[n])
+        break;
+    }
+
+    if(n > best)
+    {
+      best = n;
+      *distance = d;
+      if(best == aheadLen)
+        break;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Reads the next byte of the compressed data from the log sink
+ *
+ * @param reader the state of the reader
+ * @param value set to the byte read
+ * @return non-zero if a byte was read or zero at the end of the data or
+ * if some error ocurred (then reader->result is set)
+ */
+static uint8_t ReadByte(logzip_reader_t *reader, uint8_t *value)
+{
+  uint16_t n;
+
+  if(reader->bufPos == reader->bufLen)
+  {
+    if(reader->addr == reader->end)
+      return 0;
+    n = reader->end - reader->addr;
+    if(n > LOGZIP_READ_CHUNK)
+      n = LOGZIP_READ_CHUNK;
+    reader->result = LogSinkRead(reader->addr, reader->buf, n);
+    if(reader->result != 0)
+      return 0;
+    reader->addr += n;
+    reader->bufLen = n;
+    reader->bufPos = 0;
+  }
+
+  *value = reader->buf[reader->bufPos++];
+  return 1;
+}
+
+/**
+ * Adds a decompressed byte to the window and rebuilds the log records,
+ * replacing the runs of records (see LOGZIP_RUN)
+ *
+ * @param reader the state of the reader
+ * @param value the byte decompressed
+ */
+static void PutByte(logzip_reader_t *reader, uint8_t value)
+{
+  uint8_t *record = reader->record;
+
+  reader->window[reader->head++] = value;
+
+  if(reader->runLeft > 0)
+  {
+    record[0] = reader->runType;
+    record[1] = value;
+    reader->runLeft--;
+    reader->fn(record, reader->arg);
+    return;
+  }
+
+  record[reader->recordLen++] = value;
+  if(record[0] == LOGZIP_RUN)
+  {
+    if(reader->recordLen == LOGZIP_RUN_HEADER)
+    {
+      reader->runType = record[1];
+      reader->runLeft = record[2];
+      reader->recordLen = 0;
+    }
+  }
+  else if(reader->recordLen == (record[0] & 0x03) + 2)
+  {
+    reader->fn(record, reader->arg);
+    reader->recordLen = 0;
+  }
+}
+
+
+/* Public functions */
+
+/**
+ * Compresses a log session and appends it to the log sink, which must
+ * be open (see LogSinkOpen). The LOG_COMPRESSED_SESSION record is written
+ * first and its compressed length is updated at the end, so the data is
+ * compressed and written in small groups. Besides the log buffer, this
+ * method uses about LOGZIP_WINDOW + LOGZIP_LOOKAHEAD bytes of stack.
+ * Sessions shorter than LOGZIP_MIN_INPUT are not compressed.
+ *
+ * If the log sink becomes full the compressed data is truncated and the
+ * record holds the length actually saved.
+ *
+ * @param data the log session (a sequence of log records)
+ * @param len the length of the session
+ * @param dedup the payloads to be replaced by references (see
+ * LogDedupFind), or NULL if none
+ * @return zero if all the data was saved or non-zero if some error
+ * ocurred (e.g. RET_LOG_SINK_FULL)
+ */
+uint8_t LogSinkAppendCompressed(const uint8_t *data, uint16_t len,
+    const log_dedup_t *dedup)
+{
+  logzip_in_t in;
+  logzip_out_t out;
+  uint8_t window[LOGZIP_WINDOW];
+  uint8_t ahead[LOGZIP_LOOKAHEAD];
+  uint8_t header[LOGZIP_HEADER_SIZE];
+  uint8_t head, aheadLen, length, i;
+  uint16_t filled, packed, distance = 0;
+  uint32_t start;
+  uint8_t result;
+
+  if(data == NULL)
+    return RET_ERR_PARAM;
+  if(len < LOGZIP_MIN_INPUT)
+    return LogSinkAppendDedup(data, len, dedup);
+
+  start = LogSinkLength();
+  packed = LogDedupLength(len, dedup);
+  header[0] = LOG_COMPRESSED_SESSION;
+  header[1] = packed & 0xFF;
+  header[2] = (packed >> 8) & 0xFF;
+  header[3] = 0;
+  header[4] = 0;
+  result = LogSinkAppend(header, LOGZIP_HEADER_SIZE);
+  if(result != 0)
+    return result;
+
+  memset(&in, 0, sizeof(in));
+  in.data = data;
+  in.len = len;
+  in.dedup = dedup;
+  out.group[0] = 0;
+  out.items = 0;
+  out.len = 1;
+  out.result = 0;
+  head = 0;
+  filled = 0;
+  for(aheadLen = 0; aheadLen < LOGZIP_LOOKAHEAD; aheadLen++)
+    if(!NextByte(&in, &ahead[aheadLen]))
+      break;
+
+  while(aheadLen > 0 && out.result == 0)
+  {
+    length = FindMatch(window, head, filled, ahead, aheadLen, &distance);
+    if(length >= LOGZIP_MIN_MATCH)
+      PutMatch(&out, distance, length);
+    else
+    {
+      PutLiteral(&out, ahead[0]);
+      length = 1;
+    }
+
+    // move the bytes used to the window and read ahead again
+    for(i = 0; i < length; i++)
+      window[head++] = ahead[i];
+    filled += length;
+    if(filled > LOGZIP_WINDOW)
+      filled = LOGZIP_WINDOW;
+    aheadLen -= length;
+    memmove(ahead, &ahead[length], aheadLen);
+    while(aheadLen < LOGZIP_LOOKAHEAD && NextByte(&in, &ahead[aheadLen]))
+      aheadLen++;
+  }
+  FlushGroup(&out);
+
+  // save the length of the compressed data actually written
+  packed = LogSinkLength() - start - LOGZIP_HEADER_SIZE;
+  header[3] = packed & 0xFF;
+  header[4] = (packed >> 8) & 0xFF;
+  result = LogSinkUpdate(start + 3, &header[3], 2);
+
+  return (out.result != 0) ? out.result : result;
+}
+
+/**
+ * Reads a compressed session from the log sink and passes each of its log
+ * records to a function, e.g. to find the payloads already in the log
+ * (see scd_logdedup.h). Besides the caller, this method uses about
+ * LOGZIP_WINDOW bytes of stack.
+ *
+ * @param addr the position of the compressed data, just after the
+ * LOG_COMPRESSED_SESSION record
+ * @param len the length of the compressed data
+ * @param fn the function called with each record (type and data bytes)
+ * @param arg passed to fn
+ * @return zero if successful, non-zero otherwise
+ */
+uint8_t LogSinkReadCompressed(uint32_t addr, uint16_t len,
+    logzip_record_fn fn, void *arg)
+{
+  logzip_reader_t reader;
+  uint8_t flags, k, distance, count;
+
+  if(fn == NULL)
+    return RET_ERR_PARAM;
+
+  memset(&reader, 0, sizeof(reader));
+  reader.addr = addr;
+  reader.end = addr + len;
+  reader.fn = fn;
+  reader.arg = arg;
+
+  while(ReadByte(&reader, &flags))
+  {
+    for(k = 0; k < LOGZIP_GROUP_ITEMS; k++)
+    {
+      if(flags & (1 << k))
+      {
+        if(!ReadByte(&reader, &count))
+          break;
+        PutByte(&reader, count);
+        continue;
+      }
+
+      if(!ReadByte(&reader, &distance) || !ReadByte(&reader, &count))
+        break;
+      for(count += LOGZIP_MIN_MATCH; count > 0; count--)
+        PutByte(&reader, reader.window[(uint8_t)(reader.head - distance - 1)]);
+    }
+  }
+
+  return reader.result;
+}
@@ -0,0 +1,111 @@
+/**
+ * \file
+ * \brief scd_logzip.h header file
+ *
+ * This file defines the streaming compressor used to save the log
+ * sessions to the log sink. It works in two stages, both done one byte
+ * at a time while the session is written, so the log buffer is not
+ * modified:
+ *
+ * 1. Runs of at least LOGZIP_MIN_RUN consecutive records of the same type
+ * with one data byte (e.g. the bytes of a command from the terminal) are
+ * replaced by a LOGZIP_RUN byte, the record type, the number of records
+ * and then only their data bytes. This removes the type byte that the log
+ * keeps before each data byte.
+ *
+ * 2. The result is compressed with a small LZ77 variant (LZSS) that finds
+ * repeated sequences in the last LOGZIP_WINDOW bytes, such as a command
+ * forwarded from the terminal to the card or the same READ RECORD
+ * repeated with another record number.
+ *
+ * A compressed session is stored as a LOG_COMPRESSED_SESSION record,
+ * whose 4 data bytes are the length of the session (after its payloads
+ * are replaced by references, see scd_logdedup.h) and the length of the
+ * compressed data (both 2 bytes little endian), followed by the
+ * compressed data. The record header is not compressed, so the
+ * sessions in the log can be found without decompressing them.
+ *
+ * The compressed data is a sequence of groups, each made of a flag byte
+ * followed by up to 8 items. Bit k of the flag byte (starting with the
+ * least significant bit) describes item k: 1 for a literal byte and 0 for
+ * a match of two bytes, the distance minus 1 and the length minus
+ * LOGZIP_MIN_MATCH. A match copies length bytes starting distance bytes
+ * before the current position, one byte at a time, so a match may
+ * overlap the bytes it produces (e.g. a run of 0xFF bytes).
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_LOGZIP_H_
+#define _SCD_LOGZIP_H_
+
+#include <stdint.h>
+
+#include "scd_logdedup.h"
+
+/// Set to 1 to compress the log sessions saved by SaveLog
+#ifndef LOG_COMPRESS_ENABLED
+#define LOG_COMPRESS_ENABLED 0
+#endif
+
+/// Number of bytes before the current position searched for matches,
+/// kept in a ring buffer indexed by a uint8_t
+#define LOGZIP_WINDOW 256
+
+/// Number of bytes read ahead, which is also the longest match
+#define LOGZIP_LOOKAHEAD 32
+
+/// Shortest match encoded
+#define LOGZIP_MIN_MATCH 3
+
+/// Marks a run of records in the compressed data. The log records do not
+/// use the code 0x0E (see SCD_LOG_BYTE in scd_logger.h)
+#define LOGZIP_RUN (0x0E << 2 | 0x01)
+
+/// Shortest and longest run of records replaced by LOGZIP_RUN
+#define LOGZIP_MIN_RUN 3
+#define LOGZIP_MAX_RUN 255
+
+/// Sessions shorter than this are saved without compression
+#define LOGZIP_MIN_INPUT 16
+
+/// Size of the LOG_COMPRESSED_SESSION record (type and 4 bytes)
+#define LOGZIP_HEADER_SIZE 5
+
+/// Function called with each record of a compressed session
+typedef void (*logzip_record_fn)(const uint8_t *record, void *arg);
+
+/// Append a compressed log session to the log sink
+uint8_t LogSinkAppendCompressed(const uint8_t *data, uint16_t len,
+    const log_dedup_t *dedup);
+
+/// Read the records of a compressed session from the log sink
+uint8_t LogSinkReadCompressed(uint32_t addr, uint16_t len,
+    logzip_record_fn fn, void *arg);
+
+#endif // _SCD_LOGZIP_H_
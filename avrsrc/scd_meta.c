@@ -0,0 +1,222 @@
+/**
+ * \file
+ * \brief scd_meta.c source file
+ *
+ * This file implements the metadata of the SCD kept in EEPROM (see
+ * scd_meta.h).
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <string.h>
+
+#include "scd.h"
+#include "scd_meta.h"
+#include "utils.h"
+
+/**
+ * Copy of the metadata saved in EEPROM
+ */
+typedef struct {
+    uint8_t version;                // SCD_META_VERSION
+    uint8_t sequence;               // incremented on each commit
+    scd_meta_t meta;                // the metadata
+    uint32_t crc;                   // CRC32 of the bytes above
+} scd_meta_copy_t;
+
+/// Bytes of a copy covered by its CRC32 (all but the CRC32)
+#define SCD_META_CHECKED (sizeof(scd_meta_copy_t) - sizeof(uint32_t))
+
+scd_meta_t scdMeta;                     // metadata in RAM
+static scd_meta_t committedMeta;        // metadata in the newest copy
+static uint8_t metaSequence;            // sequence of the newest copy
+static uint8_t metaSlot;                // index of the newest copy
+static volatile uint8_t metaCommitting; // main context writing a copy
+static volatile uint8_t metaOverwritten;// copy written by an interrupt
+
+
+/* Static functions */
+
+/**
+ * Returns the CRC32 of a metadata copy, as zlib (see scdtrace.py)
+ */
+static uint32_t GetCopyCRC(const scd_meta_copy_t *copy)
+{
+  return ~UpdateCRC32Bytes(CRC32_INIT, (const uint8_t*)copy,
+      SCD_META_CHECKED);
+}
+
+/**
+ * Reads a metadata copy from EEPROM
+ *
+ * @param slot the index of the copy
+ * @param copy the copy is returned here
+ * @return non-zero if the copy is valid, zero otherwise
+ */
+static uint8_t ReadCopy(uint8_t slot, scd_meta_copy_t *copy)
+{
+  eeprom_read_block(copy,
+      (void*)(EEPROM_SCD_META + slot * SCD_META_COPY_SIZE),
+      sizeof(scd_meta_copy_t));
+
+  return (copy->version == SCD_META_VERSION &&
+      copy->crc == GetCopyCRC(copy));
+}
+
+
+/* Public functions */
+
+/**
+ * Loads the newest valid metadata copy from EEPROM into scdMeta. This
+ * should be called once, at the start of the SCD. If there is no valid
+ * copy the fields saved by older versions are used.
+ */
+void LoadSCDMeta()
+{
+  scd_meta_copy_t copy[2];
+  uint8_t valid0, valid1;
+
+  valid0 = ReadCopy(0, &copy[0]);
+  valid1 = ReadCopy(1, &copy[1]);
+
+  if(valid0 || valid1)
+  {
+    if(valid0 && valid1)
+      metaSlot = ((int8_t)(copy[1].sequence - copy[0].sequence) > 0);
+    else
+      metaSlot = valid1;
+    metaSequence = copy[metaSlot].sequence;
+    memcpy(&scdMeta, &copy[metaSlot].meta, sizeof(scd_meta_t));
+    memcpy(&committedMeta, &scdMeta, sizeof(scd_meta_t));
+    return;
+  }
+
+  // No valid copy: take the fields of older versions, which are saved in
+  // the first commit
+  scdMeta.warmReset = eeprom_read_byte((uint8_t*)EEPROM_WARM_RESET);
+  scdMeta.application = eeprom_read_byte((uint8_t*)EEPROM_APPLICATION);
+  scdMeta.counter = eeprom_read_byte((uint8_t*)EEPROM_COUNTER);
+  scdMeta.logSink = eeprom_read_byte((uint8_t*)EEPROM_LOG_SINK);
+  scdMeta.tlogPointer =
+    ((uint16_t)eeprom_read_byte((uint8_t*)EEPROM_TLOG_POINTER_HI) << 8) |
+    eeprom_read_byte((uint8_t*)EEPROM_TLOG_POINTER_LO);
+  scdMeta.timerT2 = eeprom_read_dword((uint32_t*)EEPROM_TIMER_T2);
+  memset(&committedMeta, 0xFF, sizeof(scd_meta_t));
+  metaSequence = 0;
+  metaSlot = 1;
+}
+
+/**
+ * Sets the metadata to the defaults (no warm reset, counters cleared and
+ * empty EEPROM log). This is used after the EEPROM was erased, so the
+ * following CommitSCDMeta writes all the fields.
+ */
+void ResetSCDMeta()
+{
+  memset(&scdMeta, 0, sizeof(scd_meta_t));
+  scdMeta.tlogPointer = EEPROM_TLOG_DATA;
+  memset(&committedMeta, 0xFF, sizeof(scd_meta_t));
+  metaSequence = 0;
+  metaSlot = 1;
+}
+
+/**
+ * Saves scdMeta to EEPROM, if it changed since the last commit. The
+ * older copy is replaced, so the newest one stays valid if the SCD is
+ * reset while writing.
+ *
+ * The main context disables interrupts only to take a snapshot of
+ * scdMeta, which the interrupt routines also change, and writes the copy
+ * with interrupts enabled (up to 16 EEPROM writes, about 54 ms). The
+ * INT0 and WDT routines commit just before the SCD restarts, so they
+ * write their copy at once, with interrupts disabled. If they interrupt
+ * the write of the main context they write the same copy slot and the
+ * main context stops its write, so no commit is lost.
+ */
+void CommitSCDMeta()
+{
+  scd_meta_copy_t copy;
+  uint8_t *addr;
+  uint8_t sreg, k;
+
+  sreg = SREG;
+  cli();
+
+  if(metaCommitting)
+  {
+    // called by an interrupt routine during the write of the main context
+    copy.version = SCD_META_VERSION;
+    copy.sequence = metaSequence + 1;
+    memcpy(&copy.meta, &scdMeta, sizeof(scd_meta_t));
+    copy.crc = GetCopyCRC(&copy);
+    eeprom_update_block(&copy,
+        (void*)(EEPROM_SCD_META + (metaSlot ^ 1) * SCD_META_COPY_SIZE),
+        sizeof(scd_meta_copy_t));
+    eeprom_busy_wait();
+
+    metaSlot ^= 1;
+    metaSequence = copy.sequence;
+    memcpy(&committedMeta, &copy.meta, sizeof(scd_meta_t));
+    metaOverwritten = 1;
+    SREG = sreg;
+    return;
+  }
+  metaCommitting = 1;
+
+  while(memcmp(&scdMeta, &committedMeta, sizeof(scd_meta_t)) != 0)
+  {
+    memcpy(&copy.meta, &scdMeta, sizeof(scd_meta_t));
+    metaOverwritten = 0;
+    SREG = sreg;
+
+    copy.version = SCD_META_VERSION;
+    copy.sequence = metaSequence + 1;
+    copy.crc = GetCopyCRC(&copy);
+
+    // an interrupt routine writing the copy between the address set up
+    // and the write strobe of eeprom_update_byte only makes it write the
+    // last byte of the interrupt again, so the write stops on a byte
+    addr = (uint8_t*)(EEPROM_SCD_META + (metaSlot ^ 1) * SCD_META_COPY_SIZE);
+    for(k = 0; k < sizeof(scd_meta_copy_t) && !metaOverwritten; k++)
+      eeprom_update_byte(addr + k, ((const uint8_t*)&copy)[k]);
+
+    cli();
+    if(!metaOverwritten)
+    {
+      metaSlot ^= 1;
+      metaSequence = copy.sequence;
+      memcpy(&committedMeta, &copy.meta, sizeof(scd_meta_t));
+    }
+  }
+
+  metaCommitting = 0;
+  SREG = sreg;
+}
@@ -0,0 +1,91 @@
+/**
+ * \file
+ * \brief scd_meta.h header file
+ *
+ * This file defines the metadata of the SCD kept in EEPROM: the warm reset
+ * byte, the T2 counter, the selected application, the transaction counter,
+ * the EEPROM log pointer and the selected log storage backend.
+ *
+ * The metadata is read once by InitSCD into scdMeta and then changed only
+ * in RAM. CommitSCDMeta saves all the fields at once, as a versioned copy
+ * protected by a CRC32, alternating between two copies at EEPROM_SCD_META.
+ * If the SCD is reset while a copy is written that copy is not valid and
+ * the previous one is used, so the fields are always consistent. Only the
+ * bytes that changed are written (eeprom_update_block) and nothing is
+ * written if no field changed since the last commit.
+ *
+ * The metadata is committed at safe points: when the log is saved (with
+ * the new log pointer), when an application is selected and in the INT0
+ * and WDT interrupts just before the SCD restarts. The interrupts write
+ * the EEPROM (the log with SaveLogISR and the metadata) on purpose, since
+ * the SCD restarts right after them; the main context writes its copy
+ * with interrupts enabled.
+ *
+ * Older versions kept each field at its own address (EEPROM_WARM_RESET,
+ * etc.). These are read only if there is no valid copy, so the log is
+ * kept after an update of the firmware.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_META_H_
+#define _SCD_META_H_
+
+#include <stdint.h>
+
+/// Version of the metadata copies, changes with the layout of scd_meta_t
+#define SCD_META_VERSION 1
+
+/// Size of each copy of the metadata in EEPROM (see EEPROM_SCD_META)
+#define SCD_META_COPY_SIZE 16
+
+/**
+ * Metadata of the SCD, see scdMeta
+ */
+typedef struct {
+    uint8_t warmReset;              // WARM_RESET_VALUE after a warm reset
+    uint8_t application;            // selected application
+    uint8_t counter;                // number of transactions
+    uint8_t logSink;                // selected log backend (LOG_SINK_TYPE)
+    uint16_t tlogPointer;           // EEPROM log write pointer (address)
+    uint32_t timerT2;               // counter value from T2
+} scd_meta_t;
+
+/// Metadata in RAM, saved with CommitSCDMeta
+extern scd_meta_t scdMeta;
+
+/// Load the newest valid metadata copy from EEPROM
+void LoadSCDMeta();
+
+/// Set the metadata to the defaults, after the EEPROM was erased
+void ResetSCDMeta();
+
+/// Save the metadata to EEPROM if it changed
+void CommitSCDMeta();
+
+#endif // _SCD_META_H_
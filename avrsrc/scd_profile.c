@@ -0,0 +1,99 @@
+/**
+ * \file
+ * \brief scd_profile.c source file
+ *
+ * This file implements the profiler of the SCD (see scd_profile.h).
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "scd_hal.h"
+#include "scd_profile.h"
+
+#if PROFILE_ENABLED
+
+/// Counters of the profiled functions
+static profile_entry_t profile[PROFILE_COUNT];
+
+/// Profile time of the last ResetProfile
+static uint32_t profileStart;
+
+/**
+ * Returns the profile time, as the T2 counter followed by the value of T2
+ * (see GetCounterFine).
+ *
+ * @return the profile time in units of PROFILE_CYCLES CPU cycles
+ */
+uint32_t GetProfileTime()
+{
+  return GetCounterFine();
+}
+
+/**
+ * Adds the time since the start of a profiled function to its counters.
+ * This is called by the compiler when the function returns, see
+ * PROFILE_FUNCTION.
+ *
+ * @param scope the profiled function
+ */
+void ProfileExit(profile_scope_t *scope)
+{
+  uint32_t time;
+
+  time = GetProfileTime() - scope->start;
+  profile[scope->id].calls++;
+  profile[scope->id].total += time;
+  if(time > profile[scope->id].max)
+    profile[scope->id].max = time;
+}
+
+/**
+ * Returns the profile counters.
+ *
+ * @param elapsed the profile time since the last ResetProfile (or the
+ * start of the SCD) is returned here
+ * @return the PROFILE_COUNT counters, in the order of PROFILE_ID
+ */
+const profile_entry_t* GetProfile(uint32_t *elapsed)
+{
+  *elapsed = GetProfileTime() - profileStart;
+  return profile;
+}
+
+/**
+ * Clears the profile counters.
+ */
+void ResetProfile()
+{
+  memset(profile, 0, sizeof(profile));
+  profileStart = GetProfileTime();
+}
+
+#endif // PROFILE_ENABLED
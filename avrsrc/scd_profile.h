@@ -0,0 +1,121 @@
+/**
+ * \file
+ * \brief scd_profile.h header file
+ *
+ * This file defines the profiler of the SCD, which measures the time spent
+ * in some functions of the firmware (e.g. byte I/O, logging, TLV parsing
+ * or LCD output), so we can see where the time goes during a relay.
+ *
+ * A profiled function starts with PROFILE_FUNCTION(id), which reads the
+ * profile time on entry and, through the cleanup attribute of GCC, again
+ * on every return. The number of calls, the total and the maximum time of
+ * each function are accumulated in a table, returned with AT+CPROF (see
+ * clis.py --profile). To profile another function add an entry to
+ * PROFILE_ID and the macro at the start of the function.
+ *
+ * The profile time counts T2 clocks (64 CPU cycles, 4 us at 16 MHz),
+ * extending the T2 counter (see StartTimerT2), since the 16-bit timers
+ * are used for the ETU of the ICC and of the terminal. The time includes
+ * the profiled functions called inside and the interrupts.
+ *
+ * The profiler is built only when PROFILE_ENABLED is 1 (see the Makefile),
+ * otherwise PROFILE_FUNCTION is empty.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_PROFILE_H_
+#define _SCD_PROFILE_H_
+
+#include <stdint.h>
+
+/// Set to 1 to build the profiler
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED 0
+#endif
+
+/// CPU cycles in each unit of the profile time
+#define PROFILE_CYCLES 64
+
+/**
+ * The profiled functions. The order is used by clis.py to name them.
+ */
+typedef enum {
+    PROFILE_RECEIVE_T0_COMMAND = 0, // ReceiveT0Command
+    PROFILE_SEND_T0_RESPONSE = 1,   // SendT0Response
+    PROFILE_LOG_BYTE = 2,           // LogByte1
+    PROFILE_PARSE_TLV = 3,          // ParseManyTLV
+    PROFILE_LCD_COMMAND = 4,        // SendLCDCommand
+    PROFILE_HOST_DATA = 5,          // GetHostData
+    PROFILE_SAVE_LOG = 6,           // SaveLog
+    PROFILE_COUNT = 7,
+} PROFILE_ID;
+
+/**
+ * Counters of a profiled function, in profile time units
+ */
+typedef struct {
+    uint32_t calls;
+    uint32_t total;
+    uint32_t max;
+} profile_entry_t;
+
+#if PROFILE_ENABLED
+
+/**
+ * Profiled function being run, see PROFILE_FUNCTION
+ */
+typedef struct {
+    uint8_t id;
+    uint32_t start;
+} profile_scope_t;
+
+/// Start profiling the current function, until it returns
+#define PROFILE_FUNCTION(id) \
+    profile_scope_t profileScope __attribute__((cleanup(ProfileExit))) = \
+        {(id), GetProfileTime()}
+
+/// Return the profile time
+uint32_t GetProfileTime();
+
+/// Add the time of a profiled function to its counters
+void ProfileExit(profile_scope_t *scope);
+
+/// Return the profile counters and the time since they were reset
+const profile_entry_t* GetProfile(uint32_t *elapsed);
+
+/// Clear the profile counters
+void ResetProfile();
+
+#else
+
+#define PROFILE_FUNCTION(id)
+
+#endif // PROFILE_ENABLED
+
+#endif // _SCD_PROFILE_H_
@@ -0,0 +1,538 @@
+/**
+ * \file
+ * \brief scd_script.c source file
+ *
+ * This file implements the interpreter of EMV flow scripts, see
+ * scd_script.h for the instructions.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <avr/eeprom.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "apps.h"
+#include "emv.h"
+#include "terminal.h"
+#include "scd.h"
+#include "scd_hal.h"
+#include "scd_io.h"
+#include "scd_script.h"
+#include "scd_values.h"
+
+/// Maximum length of a script, without the 2 length bytes in EEPROM
+#define SCRIPT_MAX_SIZE (EEPROM_SCRIPT_SIZE - 2)
+
+/**
+ * Structure holding a script register
+ */
+typedef struct {
+  uint16_t tag;         // tag of the value, zero if not known
+  uint8_t len;          // length of the value
+  uint8_t *value;       // NULL if len is zero
+} script_reg_t;
+
+
+/* Static functions */
+
+/**
+ * Sets the value of a register
+ *
+ * @param reg the register
+ * @param tag the tag of the value
+ * @param value the value, copied into the register
+ * @param len the length of the value
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t SetRegister(script_reg_t *reg, uint16_t tag,
+    const uint8_t *value, uint8_t len)
+{
+  uint8_t *tmp = NULL;
+
+  if(len > 0)
+  {
+    tmp = (uint8_t*)malloc(len);
+    if(tmp == NULL)
+      return RET_ERR_MEMORY;
+    memcpy(tmp, value, len);
+  }
+
+  if(reg->value != NULL)
+    free(reg->value);
+  reg->tag = tag;
+  reg->len = len;
+  reg->value = tmp;
+
+  return 0;
+}
+
+/**
+ * Finds a tag in TLV encoded data, at any depth. Constructed tags are not
+ * skipped but their items are searched, as they follow their header.
+ *
+ * @param data the TLV encoded data
+ * @param len the length of the data
+ * @param tag the tag to find (one or two bytes)
+ * @param vlen stores the length of the value found
+ * @return a pointer to the value found or NULL if the tag is not found
+ */
+static const uint8_t* FindTag(const uint8_t *data, uint8_t len, uint16_t tag,
+    uint8_t *vlen)
+{
+  uint8_t pos = 0, constructed;
+  uint16_t t;
+  uint16_t l;
+
+  while(pos < len)
+  {
+    // 00 and FF may be used as padding between TLV objects
+    if(data[pos] == 0x00 || data[pos] == 0xFF)
+    {
+      pos++;
+      continue;
+    }
+
+    constructed = data[pos] & 0x20;
+    t = data[pos++];
+    if((t & 0x1F) == 0x1F)
+    {
+      if(pos >= len)
+        return NULL;
+      t = (t << 8) | data[pos++];
+    }
+
+    if(pos >= len)
+      return NULL;
+    l = data[pos++];
+    if(l == 0x81)
+    {
+      if(pos >= len)
+        return NULL;
+      l = data[pos++];
+    }
+    else if(l > 0x80)
+      return NULL;
+    if(pos + l > len)
+      return NULL;
+
+    if(t == tag)
+    {
+      *vlen = l;
+      return &data[pos];
+    }
+
+    if(!constructed)
+      pos += l;
+  }
+
+  return NULL;
+}
+
+/**
+ * Builds the data for a DOL (e.g. the CDOL1) from the registers, as in
+ * SendGenerateAC.
+ *
+ * @param dol the DOL, a list of tags and lengths
+ * @param len the length of the DOL
+ * @param regs the registers
+ * @param wrap the tag of the data if not zero (e.g. 0x83 for the PDOL)
+ * @param dest stores the data
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t MakeDOLData(const uint8_t *dol, uint8_t len,
+    const script_reg_t *regs, uint8_t wrap, script_reg_t *dest)
+{
+  uint8_t data[256];
+  uint8_t pos = 0, k, l, i;
+  uint16_t total = 0, tag;
+  const script_reg_t *reg;
+
+  if(wrap)
+    total = 2;
+
+  while(pos < len)
+  {
+    tag = dol[pos++];
+    if((tag & 0x1F) == 0x1F && pos < len)
+      tag = (tag << 8) | dol[pos++];
+    if(pos >= len)
+      return RET_SCRIPT_BAD_INSTRUCTION;
+    l = dol[pos++];
+    if(total + l > 255)
+      return RET_SCRIPT_BAD_INSTRUCTION;
+
+    reg = NULL;
+    for(k = 0; k < SCRIPT_REGISTERS; k++)
+    {
+      if(regs[k].tag == tag)
+      {
+        reg = &regs[k];
+        break;
+      }
+    }
+
+    for(i = 0; i < l; i++)
+    {
+      if(reg != NULL && i < reg->len)
+        data[total++] = reg->value[i];
+      else
+        data[total++] = 0;
+    }
+  }
+
+  if(wrap)
+  {
+    data[0] = wrap;
+    data[1] = total - 2;
+  }
+
+  return SetRegister(dest, wrap, data, total);
+}
+
+/**
+ * Sends a command to the ICC and replaces the last response
+ *
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t SendScriptCommand(uint8_t cla, uint8_t ins, uint8_t p1,
+    uint8_t p2, uint8_t p3, const uint8_t *data, uint8_t lenData,
+    uint8_t convention, uint8_t TC1, RAPDU **response,
+    script_result_t *result, log_struct_t *logger)
+{
+  CAPDU *command;
+
+  command = MakeCommand(cla, ins, p1, p2, p3, data, lenData);
+  if(command == NULL)
+    return RET_ERR_MEMORY;
+
+  if(*response != NULL)
+    FreeRAPDU(*response);
+  *response = TerminalSendT0Command(command, convention, TC1, logger);
+  FreeCAPDU(command);
+  if(*response == NULL)
+    return RET_ICC_GET_RESPONSE;
+
+  result->commands++;
+  result->sw1 = (*response)->repStatus->sw1;
+  result->sw2 = (*response)->repStatus->sw2;
+
+  return 0;
+}
+
+
+/* Public functions */
+
+/**
+ * Stores part of the script in EEPROM. The script is stored with its
+ * length first (2 bytes, little endian), so offset 0 is the length.
+ *
+ * @param offset the position of the data from EEPROM_SCRIPT
+ * @param data the data to store
+ * @param len the length of the data
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t WriteScript(uint16_t offset, const uint8_t *data, uint8_t len)
+{
+  if(data == NULL || offset + len > EEPROM_SCRIPT_SIZE)
+    return RET_ERR_PARAM;
+
+  eeprom_update_block(data, (void*)(EEPROM_SCRIPT + offset), len);
+
+  return 0;
+}
+
+/**
+ * Runs the script stored in EEPROM on the ICC, which must be inserted.
+ * The ICC is activated first and deactivated at the end.
+ *
+ * @param result stores the result of the script
+ * @param out stores the value of register 0 at the end, at least 255 bytes
+ * @param outLen stores the length of the value of register 0
+ * @param logger the log structure or NULL if no log is desired
+ * @return zero if the script ended with SCRIPT_END, non-zero otherwise
+ * (also stored in result->error)
+ */
+uint8_t RunScript(script_result_t *result, uint8_t *out, uint8_t *outLen,
+    log_struct_t *logger)
+{
+  uint8_t convention, proto, TC1, TA3, TB3;
+  uint8_t error = 0;
+  uint8_t *script = NULL;
+  uint16_t len, pc, steps, addr;
+  uint8_t op, k, vlen, match;
+  uint8_t aflReg = SCRIPT_NO_REGISTER, aflPos = 0;
+  uint16_t aflRecord = 0;
+  const uint8_t *value;
+  script_reg_t regs[SCRIPT_REGISTERS];
+  script_reg_t *reg;
+  RAPDU *response = NULL;
+  uint32_t start;
+
+  memset(result, 0, sizeof(script_result_t));
+  memset(regs, 0, sizeof(regs));
+  *outLen = 0;
+  start = GetCounter();
+
+  len = eeprom_read_word((uint16_t*)EEPROM_SCRIPT);
+  if(len == 0 || len > SCRIPT_MAX_SIZE)
+  {
+    result->error = RET_SCRIPT_EMPTY;
+    return result->error;
+  }
+  script = (uint8_t*)malloc(len);
+  if(script == NULL)
+  {
+    result->error = RET_ERR_MEMORY;
+    return result->error;
+  }
+  eeprom_read_block(script, (void*)(EEPROM_SCRIPT + 2), len);
+
+  if(!IsICCInserted())
+  {
+    error = RET_ICC_INIT_ACTIVATE;
+    goto endscript;
+  }
+  error = ResetICC(0, &convention, &proto, &TC1, &TA3, &TB3, logger);
+  if(error)
+    goto endicc;
+  if(proto != 0)
+  {
+    error = RET_ICC_BAD_PROTO;
+    goto endicc;
+  }
+
+  // Number of operand bytes needed by the current instruction
+#define SCRIPT_OPERANDS(n) \
+  if(pc + 1 + (n) > len) { error = RET_SCRIPT_BAD_INSTRUCTION; break; }
+  // Register given by an operand
+#define SCRIPT_REGISTER(r) \
+  if((r) >= SCRIPT_REGISTERS) { error = RET_SCRIPT_BAD_INSTRUCTION; break; }
+
+  pc = 0;
+  for(steps = 0; error == 0; steps++)
+  {
+    if(steps == SCRIPT_MAX_STEPS)
+    {
+      error = RET_SCRIPT_TOO_LONG;
+      break;
+    }
+    if(pc >= len)
+    {
+      error = RET_SCRIPT_BAD_INSTRUCTION;
+      break;
+    }
+
+    result->pc = pc;
+    op = script[pc];
+    if(op == SCRIPT_END)
+      break;
+
+    if(op == SCRIPT_SEND)
+    {
+      // cla ins p1 p2 le reg
+      SCRIPT_OPERANDS(6);
+      k = script[pc + 6];
+      if(k == SCRIPT_NO_REGISTER)
+        error = SendScriptCommand(script[pc + 1], script[pc + 2],
+            script[pc + 3], script[pc + 4], script[pc + 5], NULL, 0,
+            convention, TC1, &response, result, logger);
+      else
+      {
+        SCRIPT_REGISTER(k);
+        error = SendScriptCommand(script[pc + 1], script[pc + 2],
+            script[pc + 3], script[pc + 4], regs[k].len, regs[k].value,
+            regs[k].len, convention, TC1, &response, result, logger);
+      }
+      pc += 7;
+    }
+    else if(op == SCRIPT_SENDL)
+    {
+      // cla ins p1 p2 lc data[lc]
+      SCRIPT_OPERANDS(5);
+      k = script[pc + 5];
+      SCRIPT_OPERANDS(5 + k);
+      error = SendScriptCommand(script[pc + 1], script[pc + 2],
+          script[pc + 3], script[pc + 4], k, &script[pc + 6], k,
+          convention, TC1, &response, result, logger);
+      pc += 6 + k;
+    }
+    else if(op == SCRIPT_GET)
+    {
+      // tag(2) reg
+      SCRIPT_OPERANDS(3);
+      k = script[pc + 3];
+      SCRIPT_REGISTER(k);
+      addr = (script[pc + 1] << 8) | script[pc + 2];
+      if(response != NULL && response->lenData > 0)
+      {
+        value = FindTag(response->repData, response->lenData, addr, &vlen);
+        if(value != NULL)
+          error = SetRegister(&regs[k], addr, value, vlen);
+      }
+      pc += 4;
+    }
+    else if(op == SCRIPT_SET)
+    {
+      // reg tag(2) len data[len]
+      SCRIPT_OPERANDS(4);
+      k = script[pc + 1];
+      SCRIPT_REGISTER(k);
+      vlen = script[pc + 4];
+      SCRIPT_OPERANDS(4 + vlen);
+      error = SetRegister(&regs[k], (script[pc + 2] << 8) | script[pc + 3],
+          &script[pc + 5], vlen);
+      pc += 5 + vlen;
+    }
+    else if(op == SCRIPT_DOL)
+    {
+      // dol dest wrap
+      SCRIPT_OPERANDS(3);
+      SCRIPT_REGISTER(script[pc + 1]);
+      SCRIPT_REGISTER(script[pc + 2]);
+      reg = &regs[script[pc + 1]];
+      error = MakeDOLData(reg->value, reg->len, regs, script[pc + 3],
+          &regs[script[pc + 2]]);
+      pc += 4;
+    }
+    else if(op == SCRIPT_AFL)
+    {
+      // reg skip
+      SCRIPT_OPERANDS(2);
+      SCRIPT_REGISTER(script[pc + 1]);
+      aflReg = script[pc + 1];
+      aflPos = script[pc + 2];
+      aflRecord = 0;
+      pc += 3;
+    }
+    else if(op == SCRIPT_READ)
+    {
+      // addr(2)
+      SCRIPT_OPERANDS(2);
+      reg = (aflReg == SCRIPT_NO_REGISTER) ? NULL : &regs[aflReg];
+
+      // each AFL entry is SFI << 3, first record, last record and
+      // the number of records used for offline authentication
+      if(reg != NULL && aflRecord != 0 && aflPos + 4 <= reg->len &&
+          aflRecord > reg->value[aflPos + 2])
+      {
+        aflPos += 4;
+        aflRecord = 0;
+      }
+      if(reg == NULL || aflPos + 4 > reg->len)
+      {
+        pc = (script[pc + 1] << 8) | script[pc + 2];
+        continue;
+      }
+      if(aflRecord == 0)
+        aflRecord = reg->value[aflPos + 1];
+
+      error = SendScriptCommand(0x00, 0xB2, aflRecord,
+          (reg->value[aflPos] & 0xF8) | 0x04, 0, NULL, 0,
+          convention, TC1, &response, result, logger);
+      aflRecord++;
+      pc += 3;
+    }
+    else if(op == SCRIPT_JSW)
+    {
+      // sw1 sw2 mask addr(2)
+      SCRIPT_OPERANDS(5);
+      k = script[pc + 3];
+      match = (response != NULL);
+      if(match && (k & 0x01) && result->sw1 != script[pc + 1])
+        match = 0;
+      if(match && (k & 0x02) && result->sw2 != script[pc + 2])
+        match = 0;
+      if(k & 0x80)
+        match = !match;
+      if(match)
+        pc = (script[pc + 4] << 8) | script[pc + 5];
+      else
+        pc += 6;
+    }
+    else if(op == SCRIPT_JNB)
+    {
+      // reg index mask addr(2)
+      SCRIPT_OPERANDS(5);
+      SCRIPT_REGISTER(script[pc + 1]);
+      reg = &regs[script[pc + 1]];
+      k = script[pc + 2];
+      if(k >= reg->len ||
+          (script[pc + 3] != 0 && (reg->value[k] & script[pc + 3]) == 0))
+        pc = (script[pc + 4] << 8) | script[pc + 5];
+      else
+        pc += 6;
+    }
+    else if(op == SCRIPT_JMP)
+    {
+      // addr(2)
+      SCRIPT_OPERANDS(2);
+      pc = (script[pc + 1] << 8) | script[pc + 2];
+    }
+    else if(op == SCRIPT_FAIL)
+    {
+      // code
+      SCRIPT_OPERANDS(1);
+      result->code = script[pc + 1];
+      error = RET_SCRIPT_FAIL;
+    }
+    else
+      error = RET_SCRIPT_BAD_INSTRUCTION;
+  }
+
+#undef SCRIPT_OPERANDS
+#undef SCRIPT_REGISTER
+
+  if(regs[0].len > 0)
+  {
+    memcpy(out, regs[0].value, regs[0].len);
+    *outLen = regs[0].len;
+  }
+
+endicc:
+  DeactivateICC();
+  if(logger)
+  {
+    LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
+    WriteLog(logger);
+    ResetLogger(logger);
+  }
+
+endscript:
+  if(response != NULL)
+    FreeRAPDU(response);
+  for(k = 0; k < SCRIPT_REGISTERS; k++)
+    if(regs[k].value != NULL)
+      free(regs[k].value);
+  free(script);
+
+  result->error = error;
+  result->time = GetCounter() - start;
+
+  return error;
+}
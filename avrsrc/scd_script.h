@@ -0,0 +1,129 @@
+/**
+ * \file
+ * \brief scd_script.h header file
+ *
+ * This file defines the interpreter of EMV flow scripts, which lets the SCD
+ * run a terminal session described by a short bytecode program instead of
+ * the flow built into Terminal(). The script is stored in EEPROM (uploaded
+ * with AT+CSCRIPT) and run with AT+CSCRUN, so all the commands are sent at
+ * the speed of the card without a USB round trip for each command.
+ *
+ * The script works on SCRIPT_REGISTERS registers, each holding a tag and a
+ * value of up to 255 bytes, and on the last response received from the
+ * card. Each instruction is an opcode (SCRIPT_OPCODE) followed by its
+ * operands; addresses are 2 bytes (high byte first) from the start of the
+ * script. A register number of SCRIPT_NO_REGISTER means no register.
+ *
+ * SCRIPT_END                               stop, success
+ * SCRIPT_SEND cla ins p1 p2 le reg         send a command with the value of
+ *                                          reg as data (then le is not used)
+ * SCRIPT_SENDL cla ins p1 p2 lc data[lc]   send a command with literal data
+ * SCRIPT_GET tag(2) reg                    copy the TLV with this tag from
+ *                                          the last response (at any depth)
+ *                                          into reg, unchanged if not found
+ * SCRIPT_SET reg tag(2) len data[len]      set reg to a literal value
+ * SCRIPT_DOL dol dest wrap                 build the data for the DOL in
+ *                                          register dol from the registers
+ *                                          with these tags into dest, as a
+ *                                          TLV with tag wrap if not zero
+ * SCRIPT_AFL reg skip                      start reading the AFL in reg,
+ *                                          after skip bytes (e.g. the AIP)
+ * SCRIPT_READ addr(2)                      send READ RECORD for the next
+ *                                          record of the AFL, or jump to
+ *                                          addr if there are no more
+ * SCRIPT_JSW sw1 sw2 mask addr(2)          jump if SW1 (mask bit 0) and
+ *                                          SW2 (mask bit 1) of the last
+ *                                          response match (bit 7 negates)
+ * SCRIPT_JNB reg index mask addr(2)        jump if reg has no byte index or
+ *                                          all the mask bits are clear
+ * SCRIPT_JMP addr(2)                       jump
+ * SCRIPT_FAIL code                         stop with error RET_SCRIPT_FAIL
+ *
+ * A 2 byte tag has a zero high byte for one byte tags. The DOL data is
+ * built as in SendGenerateAC: each value is truncated or padded with zeros
+ * on the right to the length in the DOL, and is zero when no register has
+ * the tag.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_SCRIPT_H_
+#define _SCD_SCRIPT_H_
+
+#include <stdint.h>
+
+#include "scd_logger.h"
+
+/// Number of script registers
+#define SCRIPT_REGISTERS 8
+
+/// Register number used for no register
+#define SCRIPT_NO_REGISTER 0xFF
+
+/// Maximum number of instructions run, to stop scripts that never end
+#define SCRIPT_MAX_STEPS 2000
+
+/**
+ * Opcodes of the script instructions, see the description above
+ */
+typedef enum {
+    SCRIPT_END = 0x00,
+    SCRIPT_SEND = 0x01,
+    SCRIPT_SENDL = 0x02,
+    SCRIPT_GET = 0x03,
+    SCRIPT_SET = 0x04,
+    SCRIPT_DOL = 0x05,
+    SCRIPT_AFL = 0x06,
+    SCRIPT_READ = 0x07,
+    SCRIPT_JSW = 0x08,
+    SCRIPT_JNB = 0x09,
+    SCRIPT_JMP = 0x0A,
+    SCRIPT_FAIL = 0x0B,
+} SCRIPT_OPCODE;
+
+/**
+ * Result of a script, returned to the host by AT+CSCRUN
+ */
+typedef struct {
+    uint8_t error;          // zero or the RETURN_CODE of the error
+    uint8_t code;           // operand of SCRIPT_FAIL
+    uint16_t pc;            // address of the last instruction run
+    uint8_t commands;       // number of commands sent to the card
+    uint8_t sw1;            // status of the last response
+    uint8_t sw2;
+    uint32_t time;          // T2 counter ticks (1.088 ms) taken
+} script_result_t;
+
+/// Store part of the script in EEPROM
+uint8_t WriteScript(uint16_t offset, const uint8_t *data, uint8_t len);
+
+/// Run the script stored in EEPROM on the ICC
+uint8_t RunScript(script_result_t *result, uint8_t *out, uint8_t *outLen,
+        log_struct_t *logger);
+
+#endif // _SCD_SCRIPT_H_
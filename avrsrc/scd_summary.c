@@ -0,0 +1,419 @@
+/**
+ * \file
+ * \brief scd_summary.c source file
+ *
+ * This file implements the transaction summaries of the relay (see
+ * scd_summary.h).
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "emv.h"
+#include "scd_hal.h"
+#include "scd_logger.h"
+#include "scd_summary.h"
+#include "utils.h"
+
+
+/* Static functions */
+
+/**
+ * Finds a data object in BER-TLV data, looking also inside the
+ * constructed data objects. This works on the response bytes directly,
+ * as it must be fast (see UpdateTransactionSummary), so only tags of up
+ * to two bytes and lengths below 256 are supported, as used by EMV.
+ *
+ * @param data the TLV data
+ * @param len the length of data
+ * @param tag the tag to find (e.g. 0x5A or 0x9F36)
+ * @param lenValue set to the length of the value found
+ * @return a pointer to the value within data or NULL if not found
+ */
+static const uint8_t* FindTag(const uint8_t *data, uint8_t len,
+    uint16_t tag, uint8_t *lenValue)
+{
+  const uint8_t *value;
+  uint8_t pos = 0, first, lenTag;
+  uint16_t current;
+
+  while(pos < len)
+  {
+    // padding between data objects
+    first = data[pos++];
+    if(first == 0x00 || first == 0xFF)
+      continue;
+
+    current = first;
+    if((first & 0x1F) == 0x1F)
+    {
+      if(pos >= len)
+        break;
+      current = (current << 8) | data[pos++];
+    }
+
+    if(pos >= len)
+      break;
+    lenTag = data[pos++];
+    if(lenTag == EMV_EXTRA_LENGTH_BYTE)
+    {
+      if(pos >= len)
+        break;
+      lenTag = data[pos++];
+    }
+    else if(lenTag > 0x7F)
+      break;
+    if(lenTag > len - pos)
+      break;
+
+    if(current == tag)
+    {
+      *lenValue = lenTag;
+      return &data[pos];
+    }
+    if(first & 0x20)
+    {
+      value = FindTag(&data[pos], lenTag, tag, lenValue);
+      if(value != NULL)
+        return value;
+    }
+    pos += lenTag;
+  }
+
+  return NULL;
+}
+
+/**
+ * Finds the position in the CDOL data of the fields kept in the summary
+ *
+ * @param dol the CDOL (tag and length of each field)
+ * @param len the length of the CDOL
+ * @param fields set to the position of each TXN_CDOL_FIELD, or
+ * TXN_SUMMARY_NO_FIELD if the field is not in the CDOL
+ */
+static void FindCDOLFields(const uint8_t *dol, uint8_t len, uint8_t *fields)
+{
+  uint8_t pos = 0, offset = 0;
+  uint16_t tag;
+
+  memset(fields, TXN_SUMMARY_NO_FIELD, TXN_CDOL_FIELDS);
+  while(pos < len)
+  {
+    tag = dol[pos++];
+    if((tag & 0x1F) == 0x1F && pos < len)
+      tag = (tag << 8) | dol[pos++];
+    if(pos >= len)
+      break;
+
+    if(tag == 0x9F02 && dol[pos] == 6)
+      fields[TXN_CDOL_AMOUNT] = offset;
+    else if(tag == 0x5F2A && dol[pos] == 2)
+      fields[TXN_CDOL_CURRENCY] = offset;
+    else if(tag == 0x9F34 && dol[pos] == 3)
+      fields[TXN_CDOL_CVM] = offset;
+
+    if(dol[pos] >= TXN_SUMMARY_NO_FIELD - offset)
+      break;
+    offset += dol[pos++];
+  }
+}
+
+/**
+ * Copies a field of the CDOL data, if it is in the command data
+ *
+ * @return non-zero if the field was copied
+ */
+static uint8_t CopyCDOLField(uint8_t *dest, uint8_t size,
+    const CAPDU *cmd, uint8_t offset)
+{
+  if(offset == TXN_SUMMARY_NO_FIELD || cmd->cmdData == NULL ||
+      offset + size > cmd->lenData)
+    return 0;
+
+  memcpy(dest, &cmd->cmdData[offset], size);
+  return 1;
+}
+
+/**
+ * Takes the fields of the summary from the command data
+ */
+static void ParseCommand(txn_summary_state_t *state, const CAPDU *cmd)
+{
+  txn_summary_t *summary = &state->summary;
+  const uint8_t *fields;
+
+  if(state->ins == 0xA4)
+  {
+    // SELECT by name, the AID is kept if the ICC accepts it
+    state->selectLen = 0;
+    if(cmd->cmdHeader->p1 != 0x04 || cmd->cmdData == NULL)
+      return;
+    state->selectLen = cmd->lenData;
+    memset(state->select, 0, TXN_SUMMARY_AID_LEN);
+    memcpy(state->select, cmd->cmdData,
+        (cmd->lenData < TXN_SUMMARY_AID_LEN) ?
+        cmd->lenData : TXN_SUMMARY_AID_LEN);
+  }
+  else if(state->ins == 0xAE)
+  {
+    // GENERATE AC, the data follows the CDOL1 and then the CDOL2
+    fields = state->cdol[(state->nGenerateAC > 1) ? 1 : 0];
+    if(CopyCDOLField(summary->amount, 6, cmd, fields[TXN_CDOL_AMOUNT]) &&
+        CopyCDOLField(summary->currency, 2, cmd,
+          fields[TXN_CDOL_CURRENCY]))
+      summary->flags |= TXN_SUMMARY_AMOUNT;
+    if(CopyCDOLField(summary->cvmResults, 3, cmd, fields[TXN_CDOL_CVM]))
+      summary->flags |= TXN_SUMMARY_CVM;
+  }
+}
+
+/**
+ * Takes the fields of the summary from the response data, which may be
+ * returned by GET RESPONSE (see the ins field of txn_summary_state_t)
+ */
+static void ParseResponse(txn_summary_state_t *state, const RAPDU *response)
+{
+  txn_summary_t *summary = &state->summary;
+  const uint8_t *data = response->repData;
+  const uint8_t *value;
+  uint8_t len = response->lenData;
+  uint8_t lenValue;
+
+  if(data == NULL)
+    return;
+
+  if(state->ins == 0xA8)
+  {
+    // GET PROCESSING OPTS, format 1 (AIP followed by the AFL) or 2
+    value = FindTag(data, len, 0x80, &lenValue);
+    if(value != NULL && lenValue >= 2)
+    {
+      memcpy(summary->aip, value, 2);
+      summary->aflLen = lenValue - 2;
+      summary->aflHash =
+        UpdateCRC32Bytes(CRC32_INIT, value + 2, lenValue - 2);
+      summary->flags |= TXN_SUMMARY_GPO;
+    }
+    else if((value = FindTag(data, len, 0x82, &lenValue)) != NULL &&
+        lenValue == 2)
+    {
+      memcpy(summary->aip, value, 2);
+      value = FindTag(data, len, 0x94, &lenValue);
+      if(value == NULL)
+        lenValue = 0;
+      summary->aflLen = lenValue;
+      summary->aflHash = UpdateCRC32Bytes(CRC32_INIT, value, lenValue);
+      summary->flags |= TXN_SUMMARY_GPO;
+    }
+  }
+  else if(state->ins == 0xB2)
+  {
+    // READ RECORD, with the PAN and the CDOLs
+    value = FindTag(data, len, 0x5A, &lenValue);
+    if(value != NULL)
+    {
+      summary->panHash = UpdateCRC32Bytes(CRC32_INIT, value, lenValue);
+      summary->flags |= TXN_SUMMARY_PAN;
+    }
+    value = FindTag(data, len, 0x8C, &lenValue);
+    if(value != NULL)
+      FindCDOLFields(value, lenValue, state->cdol[0]);
+    value = FindTag(data, len, 0x8D, &lenValue);
+    if(value != NULL)
+      FindCDOLFields(value, lenValue, state->cdol[1]);
+  }
+  else if(state->ins == 0xCA)
+  {
+    // GET DATA, only the ATC is kept
+    value = FindTag(data, len, 0x9F36, &lenValue);
+    if(value != NULL && lenValue == 2)
+    {
+      memcpy(summary->atc, value, 2);
+      summary->flags |= TXN_SUMMARY_ATC;
+    }
+  }
+  else if(state->ins == 0xAE)
+  {
+    // GENERATE AC, format 1 (CID, ATC, AC and IAD) or 2
+    value = FindTag(data, len, 0x80, &lenValue);
+    if(value != NULL && lenValue >= 11)
+    {
+      summary->cid = value[0];
+      memcpy(summary->atc, &value[1], 2);
+      memcpy(summary->cryptogram, &value[3], 8);
+      summary->flags |= TXN_SUMMARY_ATC | TXN_SUMMARY_AC;
+      return;
+    }
+
+    value = FindTag(data, len, 0x9F27, &lenValue);
+    if(value == NULL || lenValue != 1)
+      return;
+    summary->cid = value[0];
+    value = FindTag(data, len, 0x9F26, &lenValue);
+    if(value == NULL || lenValue != 8)
+      return;
+    memcpy(summary->cryptogram, value, 8);
+    summary->flags |= TXN_SUMMARY_AC;
+    value = FindTag(data, len, 0x9F36, &lenValue);
+    if(value != NULL && lenValue == 2)
+    {
+      memcpy(summary->atc, value, 2);
+      summary->flags |= TXN_SUMMARY_ATC;
+    }
+  }
+}
+
+
+/* Public functions */
+
+/**
+ * Starts the summary of a transaction. This must be called after the ATR
+ * was sent to the terminal, and the summary is only built if the log
+ * policy logs LOG_TRANSACTION_SUMMARY records.
+ *
+ * @param state the summary state
+ * @param logger the log structure or NULL if log is not desired
+ */
+void StartTransactionSummary(txn_summary_state_t *state, log_struct_t *logger)
+{
+  uint8_t atr[ICC_ATR_MAX_LEN];
+  uint8_t len;
+
+  memset(state, 0, sizeof(txn_summary_state_t));
+  memset(state->cdol, TXN_SUMMARY_NO_FIELD, sizeof(state->cdol));
+  state->active = (logger != NULL && IsLogged(LOG_TRANSACTION_SUMMARY));
+  if(!state->active)
+    return;
+
+  state->start = GetCounter();
+  state->summary.version = TXN_SUMMARY_VERSION;
+  len = GetICCATR(atr);
+  state->summary.atrHash = UpdateCRC32Bytes(CRC32_INIT, atr, len);
+}
+
+/**
+ * Updates the summary with a command and its response. The response was
+ * already sent to the terminal, but the next command may follow within a
+ * few ETUs, so the data is not parsed into TLV objects, only scanned for
+ * the data objects needed (see FindTag).
+ *
+ * @param state the summary state
+ * @param crp the command and response exchanged
+ */
+void UpdateTransactionSummary(txn_summary_state_t *state, const CRP *crp)
+{
+  txn_summary_t *summary = &state->summary;
+  EMVStatus *status;
+  uint16_t time;
+  uint8_t ins;
+
+  if(!state->active || crp == NULL || crp->cmd == NULL ||
+      crp->response == NULL)
+    return;
+
+  time = (uint16_t)(GetCounter() - state->start);
+  status = crp->response->repStatus;
+  ins = crp->cmd->cmdHeader->ins;
+  if(ins != 0xC0)
+  {
+    state->ins = ins;
+    if(ins == 0xAE && state->nGenerateAC < 0xFF)
+      state->nGenerateAC++;
+    ParseCommand(state, crp->cmd);
+  }
+
+  if(summary->commands < 0xFF)
+    summary->commands++;
+  summary->lastSW[0] = status->sw1;
+  summary->lastSW[1] = status->sw2;
+  if(status->sw1 != 0x90 && status->sw1 != 0x61 && status->sw1 != 0x6C)
+  {
+    if(summary->errors < 0xFF)
+      summary->errors++;
+  }
+  else if(ins == 0xA4 && state->selectLen > 0)
+  {
+    summary->aidLen = state->selectLen;
+    memcpy(summary->aid, state->select, TXN_SUMMARY_AID_LEN);
+    summary->flags |= TXN_SUMMARY_AID;
+  }
+
+  if(state->ins == 0x20)
+  {
+    summary->verifySW[0] = status->sw1;
+    summary->verifySW[1] = status->sw2;
+    summary->flags |= TXN_SUMMARY_VERIFY;
+  }
+
+  ParseResponse(state, crp->response);
+
+  switch(state->ins)
+  {
+    case 0xA4:
+      summary->phaseEnd[TXN_PHASE_SELECT] = time;
+      break;
+    case 0xA8:
+      summary->phaseEnd[TXN_PHASE_GPO] = time;
+      break;
+    case 0xB2:
+      summary->phaseEnd[TXN_PHASE_RECORDS] = time;
+      break;
+    case 0xAE:
+      if(state->nGenerateAC > 1)
+        summary->phaseEnd[TXN_PHASE_SECOND_AC] = time;
+      else
+        summary->phaseEnd[TXN_PHASE_FIRST_AC] = time;
+      break;
+  }
+}
+
+/**
+ * Logs the summary of the transaction as a LOG_TRANSACTION_SUMMARY block,
+ * if the summary is active and any commands were received. The summary
+ * is then emptied, so it is logged only once.
+ *
+ * @param state the summary state
+ * @param logger the log structure or NULL if log is not desired
+ * @return zero if success or nothing to log, non-zero otherwise
+ */
+uint8_t LogTransactionSummary(txn_summary_state_t *state,
+    log_struct_t *logger)
+{
+  uint8_t error;
+
+  if(logger == NULL || !state->active || state->summary.commands == 0)
+    return 0;
+
+  error = LogBlock(logger, LOG_TRANSACTION_SUMMARY,
+      (const uint8_t*)&state->summary, sizeof(txn_summary_t));
+  state->summary.commands = 0;
+
+  return error;
+}
@@ -0,0 +1,158 @@
+/**
+ * \file
+ * \brief scd_summary.h header file
+ *
+ * This file defines the transaction summaries of the relay. While the
+ * commands are forwarded (see ForwardData), the fields that describe a
+ * transaction are taken from each command and response as they pass: the
+ * selected AID, the AIP and AFL, the PAN, the ATC, the amount and currency
+ * and the CVM results sent with GENERATE AC, the cryptogram returned by
+ * the card, the status words and the end time of each phase. At the end
+ * of each ICC session the summary is logged as a fixed record of
+ * TXN_SUMMARY_SIZE bytes (LOG_TRANSACTION_SUMMARY, see LogBlock), so with
+ * the log policy LOG_POLICY_SUMMARY the log holds many more transactions
+ * than with the full APDU trace. scdtrace.py --summary prints one line for
+ * each summary.
+ *
+ * The ATR, the AFL and the PAN are kept as their CRC32, which is enough to
+ * tell cards apart but does not protect the PAN from being recovered.
+ *
+ * These functions are not microcontroller dependent but they are intended
+ * for the AVR 8-bit architecture
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_SUMMARY_H_
+#define _SCD_SUMMARY_H_
+
+#include <stdint.h>
+
+#include "emv.h"
+#include "scd_logger.h"
+
+/// Version of the txn_summary_t layout, the first byte of the summary
+#define TXN_SUMMARY_VERSION 1
+
+/// Size of txn_summary_t, a multiple of 4 (see LogBlock)
+#define TXN_SUMMARY_SIZE 64
+
+/// Bytes of the selected AID kept in the summary
+#define TXN_SUMMARY_AID_LEN 8
+
+/// Position of a field not found in the CDOL
+#define TXN_SUMMARY_NO_FIELD 0xFF
+
+/**
+ * Fields of txn_summary_t that were found, given in its flags byte
+ */
+typedef enum {
+    TXN_SUMMARY_AID = 0x01,         // aidLen and aid
+    TXN_SUMMARY_GPO = 0x02,         // aip, aflLen and aflHash
+    TXN_SUMMARY_PAN = 0x04,         // panHash
+    TXN_SUMMARY_ATC = 0x08,         // atc
+    TXN_SUMMARY_AMOUNT = 0x10,      // amount and currency
+    TXN_SUMMARY_CVM = 0x20,         // cvmResults
+    TXN_SUMMARY_VERIFY = 0x40,      // verifySW
+    TXN_SUMMARY_AC = 0x80,          // cid and cryptogram
+} TXN_SUMMARY_FLAG;
+
+/**
+ * Phases of a transaction. The summary keeps the end of each phase, as
+ * the time of its last response since the ATR.
+ */
+typedef enum {
+    TXN_PHASE_SELECT = 0,           // SELECT
+    TXN_PHASE_GPO = 1,              // GET PROCESSING OPTS
+    TXN_PHASE_RECORDS = 2,          // READ RECORD
+    TXN_PHASE_FIRST_AC = 3,         // first GENERATE AC
+    TXN_PHASE_SECOND_AC = 4,        // second GENERATE AC
+    TXN_PHASE_COUNT = 5,
+} TXN_PHASE;
+
+/**
+ * Positions in the CDOL data of the fields kept in the summary
+ */
+typedef enum {
+    TXN_CDOL_AMOUNT = 0,            // 9F02 amount, authorised
+    TXN_CDOL_CURRENCY = 1,          // 5F2A transaction currency code
+    TXN_CDOL_CVM = 2,               // 9F34 CVM results
+    TXN_CDOL_FIELDS = 3,
+} TXN_CDOL_FIELD;
+
+/**
+ * The summary of a transaction, as logged. The values of the EMV data
+ * objects are kept as sent (BCD or binary, big endian), the other
+ * multi-byte values are little endian. The decoder in scdtrace.py must
+ * be updated if this layout changes (see TXN_SUMMARY_VERSION).
+ */
+typedef struct {
+    uint8_t version;                // TXN_SUMMARY_VERSION
+    uint8_t flags;                  // TXN_SUMMARY_FLAG bits
+    uint8_t commands;               // commands from the terminal
+    uint8_t errors;                 // responses with an error status
+    uint32_t atrHash;               // CRC32 of the ATR from the ICC
+    uint8_t aidLen;                 // length of the selected AID
+    uint8_t aid[TXN_SUMMARY_AID_LEN]; // selected AID (first bytes)
+    uint8_t aip[2];                 // 82 application interchange profile
+    uint8_t aflLen;                 // length of the AFL
+    uint32_t aflHash;               // CRC32 of the AFL
+    uint32_t panHash;               // CRC32 of the PAN (5A)
+    uint8_t atc[2];                 // 9F36 application transaction counter
+    uint8_t amount[6];              // 9F02 from the GENERATE AC data
+    uint8_t currency[2];            // 5F2A from the GENERATE AC data
+    uint8_t cvmResults[3];          // 9F34 from the GENERATE AC data
+    uint8_t verifySW[2];            // status of the last VERIFY
+    uint8_t cid;                    // 9F27 of the last GENERATE AC
+    uint8_t cryptogram[8];          // 9F26 of the last GENERATE AC
+    uint8_t lastSW[2];              // status of the last command
+    uint16_t phaseEnd[TXN_PHASE_COUNT]; // end of each phase (1.088 ms)
+} txn_summary_t;
+
+/**
+ * The summary of the current transaction and the state needed to build it
+ */
+typedef struct {
+    txn_summary_t summary;
+    uint8_t active;                 // non-zero if the summary is logged
+    uint8_t ins;                    // last command other than GET RESPONSE
+    uint8_t selectLen;              // length of the AID being selected
+    uint8_t select[TXN_SUMMARY_AID_LEN]; // AID being selected
+    uint8_t nGenerateAC;            // GENERATE AC commands received
+    uint8_t cdol[2][TXN_CDOL_FIELDS]; // fields in the CDOL1 and CDOL2 data
+    uint32_t start;                 // time of the ATR
+} txn_summary_state_t;
+
+/// Start the summary of a transaction, after the ATR
+void StartTransactionSummary(txn_summary_state_t *state, log_struct_t *logger);
+
+/// Update the summary with a command and its response
+void UpdateTransactionSummary(txn_summary_state_t *state, const CRP *crp);
+
+/// Log the summary of the transaction, if any commands were received
+uint8_t LogTransactionSummary(txn_summary_state_t *state,
+        log_struct_t *logger);
+
+#endif // _SCD_SUMMARY_H_
@@ -80,6 +80,17 @@ typedef enum retstat{
     // USB errors
     RET_USB_ERR_RECEIVE =                0x40,
     RET_USB_ERR_SEND =                   0x41,
+
+    // Log storage errors
+    RET_LOG_SINK_INIT =                  0x50,
+    RET_LOG_SINK_IO =                    0x51,
+    RET_LOG_SINK_FULL =                  0x52,
+
+    // Script errors
+    RET_SCRIPT_EMPTY =                   0x60,
+    RET_SCRIPT_BAD_INSTRUCTION =         0x61,
+    RET_SCRIPT_FAIL =                    0x62,
+    RET_SCRIPT_TOO_LONG =                0x63,
 } RETURN_CODE;
 
 #endif // _SCD_VALUES_H_
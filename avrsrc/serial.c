@@ -47,6 +47,9 @@
 #include "scd_hal.h"
 #include "serial.h"
 #include "scd_io.h"
+#include "scd_logsink.h"
+#include "scd_profile.h"
+#include "scd_script.h"
 #include "scd_values.h"
 #include "utils.h"
 #include "VirtualSerial.h"
@@ -69,6 +72,16 @@ static const char strAT_CCAPDU[] = "AT+CCAPDU";
 static const char strAT_UDATA[] = "AT+UDATA";
 static const char strAT_CCEND[] = "AT+CCEND";
 static const char strAT_CTWAIT[] = "AT+CTWAIT";
+static const char strAT_CLDRV[] = "AT+CLDRV";
+static const char strAT_CGLOG[] = "AT+CGLOG";
+static const char strAT_CLSINK[] = "AT+CLSINK";
+static const char strAT_CUSTAT[] = "AT+CUSTAT";
+static const char strAT_CRELAY[] = "AT+CRELAY";
+static const char strAT_CLPOL[] = "AT+CLPOL";
+static const char strAT_CREADER[] = "AT+CREADER";
+static const char strAT_CSCRIPT[] = "AT+CSCRIPT";
+static const char strAT_CSCRUN[] = "AT+CSCRUN";
+static const char strAT_CPROF[] = "AT+CPROF";
 static const char strAT_RBAD[] = "AT BAD\r\n";
 static const char strAT_ROK[] = "AT OK\r\n";
 static const char strAT_RTRESET[] = "AT TRESET\r\n";
@@ -94,8 +107,17 @@ char* ProcessSerialData(const char* data, log_struct_t *logger)
 {   
   char *atparams = NULL;
   AT_CMD atcmd;
-  uint8_t result = 0;
+  uint8_t result = 0, k;
   char *str_ret = NULL;
+  usart_stats_t stats;
+  log_policy_t policy;
+  script_result_t script;
+  uint8_t *sdata, i;
+  uint16_t offset;
+#if PROFILE_ENABLED
+  const profile_entry_t *profile;
+  uint32_t elapsed;
+#endif
 
   result = ParseATCommand(data, &atcmd, &atparams);
   if(result != 0)
@@ -126,7 +148,14 @@ char* ProcessSerialData(const char* data, log_struct_t *logger)
   }
   else if(atcmd == AT_CLET)
   {
-    result = ForwardData(logger);
+    // AT+CLET=1 reads the records in advance (see ForwardDataPrefetch)
+    // AT+CLET=2 uses the session cache (see ForwardDataCached)
+    if(atparams != NULL && atoi(atparams) == 1)
+      result = ForwardDataPrefetch(logger);
+    else if(atparams != NULL && atoi(atparams) == 2)
+      result = ForwardDataCached(logger);
+    else
+      result = ForwardData(logger);
     if (result == 0)
       str_ret = strdup(strAT_ROK);
     else
@@ -164,6 +193,182 @@ char* ProcessSerialData(const char* data, log_struct_t *logger)
     else
       str_ret = strdup(strAT_RBAD);
   }
+  else if(atcmd == AT_CLDRV)
+  {
+    // Acknowledge and then re-enumerate as a USB drive (does not return)
+    SendHostData(strAT_ROK);
+    _delay_ms(100);
+    StopUSBHardware();
+    LogDrive();
+  }
+  else if(atcmd == AT_CGLOG)
+  {
+    // Return the log contents in Intel HEX format
+    if(SendLogHexVSerial() == 0)
+      str_ret = strdup(strAT_ROK);
+    else
+      str_ret = strdup(strAT_RBAD);
+  }
+  else if(atcmd == AT_CLSINK)
+  {
+    // Select the log storage (e.g. AT+CLSINK=1) and keep it after reset
+    if(atparams != NULL &&
+        SelectLogSink((LOG_SINK_TYPE)atoi(atparams), 1) == 0)
+      str_ret = strdup(strAT_ROK);
+    else
+      str_ret = strdup(strAT_RBAD);
+  }
+  else if(atcmd == AT_CUSTAT)
+  {
+    // Return the USART statistics as
+    // AT+CUSTAT=rx bytes,tx bytes,overruns,frame errors,dropped,time
+    // where the time is given in T2 counter units (1.088 ms)
+    GetUSARTStats(&stats);
+    str_ret = (char*)malloc(64);
+    if(str_ret != NULL)
+      snprintf(str_ret, 64, "%s=%lu,%lu,%u,%u,%u,%lu\r\n", strAT_CUSTAT,
+          stats.rxBytes, stats.txBytes, stats.overruns, stats.frameErrors,
+          stats.dropped, GetCounter() - stats.start);
+  }
+  else if(atcmd == AT_CRELAY)
+  {
+    // AT+CRELAY=T for the terminal side, AT+CRELAY=C for the ICC side
+    if(atparams != NULL && atparams[0] == 'T')
+      result = RelayTerminalUSB(logger);
+    else if(atparams != NULL && atparams[0] == 'C')
+      result = RelayICCUSB(logger);
+    else
+      result = RET_ERR_PARAM;
+    if (result == 0)
+      str_ret = strdup(strAT_ROK);
+    else
+      str_ret = strdup(strAT_RBAD);
+  }
+  else if(atcmd == AT_CREADER)
+  {
+    result = ReaderUSB(logger);
+    if (result == 0)
+      str_ret = strdup(strAT_ROK);
+    else
+      str_ret = strdup(strAT_RBAD);
+  }
+  else if(atcmd == AT_CSCRIPT)
+  {
+    // AT+CSCRIPT=<offset>,<hex> stores the bytes at offset of the script
+    // area in EEPROM, which starts with the script length (see scd_script.h)
+    str_ret = strdup(strAT_RBAD);
+    sdata = (uint8_t*)malloc(LINE_BUFFER_SIZE / 2);
+    if(atparams != NULL && sdata != NULL && strchr(atparams, ',') != NULL)
+    {
+      offset = atoi(atparams);
+      atparams = strchr(atparams, ',') + 1;
+      k = strlen(atparams);
+      if(k > 0 && (k % 2) == 0)
+      {
+        k = k / 2;
+        for(i = 0; i < k; i++)
+          sdata[i] = hexCharsToByte(atparams[2 * i], atparams[2 * i + 1]);
+        if(WriteScript(offset, sdata, k) == 0)
+        {
+          free(str_ret);
+          str_ret = strdup(strAT_ROK);
+        }
+      }
+    }
+    if(sdata != NULL)
+      free(sdata);
+  }
+  else if(atcmd == AT_CSCRUN)
+  {
+    // AT+CSCRUN runs the script and returns
+    // AT+CSCRUN=error,fail code,pc,commands,SW1SW2,time,register 0 in hex
+    // where the time is given in T2 counter units (1.088 ms)
+    sdata = (uint8_t*)malloc(256);
+    str_ret = (char*)malloc(96 + 2 * 256);
+    if(sdata != NULL && str_ret != NULL)
+    {
+      RunScript(&script, sdata, &k, logger);
+      snprintf(str_ret, 96, "%s=%u,%u,%u,%u,%02X%02X,%lu,", strAT_CSCRUN,
+          script.error, script.code, script.pc, script.commands,
+          script.sw1, script.sw2, script.time);
+      offset = strlen(str_ret);
+      BytesToHexChars(&str_ret[offset], sdata, k);
+      strcpy(&str_ret[offset + 2 * k], "\r\n");
+    }
+    else if(str_ret != NULL)
+    {
+      free(str_ret);
+      str_ret = strdup(strAT_RBAD);
+    }
+    if(sdata != NULL)
+      free(sdata);
+  }
+  else if(atcmd == AT_CPROF)
+  {
+#if PROFILE_ENABLED
+    // AT+CPROF=0 clears the profile counters, AT+CPROF returns
+    // AT+CPROF=cycles,time,calls,total,max,... with the calls, total and
+    // maximum time of each function in PROFILE_ID, where the times are
+    // given in units of the given number of CPU cycles
+    if(atparams != NULL && atparams[0] == '0')
+    {
+      ResetProfile();
+      str_ret = strdup(strAT_ROK);
+    }
+    else
+    {
+      profile = GetProfile(&elapsed);
+      str_ret = (char*)malloc(32 + PROFILE_COUNT * 33);
+      if(str_ret != NULL)
+      {
+        offset = sprintf(str_ret, "%s=%u,%lu", strAT_CPROF, PROFILE_CYCLES,
+            elapsed);
+        for(k = 0; k < PROFILE_COUNT; k++)
+          offset += sprintf(&str_ret[offset], ",%lu,%lu,%lu",
+              profile[k].calls, profile[k].total, profile[k].max);
+        strcpy(&str_ret[offset], "\r\n");
+      }
+    }
+#else
+    str_ret = strdup(strAT_RBAD);
+#endif
+  }
+  else if(atcmd == AT_CLPOL)
+  {
+    // AT+CLPOL returns the log policy as AT+CLPOL=<log_policy_t in hex>,
+    // AT+CLPOL=<hex> sets it and AT+CLPOL=<n> selects a predefined one
+    // (LOG_POLICY_PRESET). The policy is kept after reset
+    if(atparams == NULL)
+    {
+      GetLogPolicy(&policy);
+      str_ret = (char*)malloc(
+          strlen(strAT_CLPOL) + 2 * sizeof(log_policy_t) + 4);
+      if(str_ret != NULL)
+      {
+        strcpy(str_ret, strAT_CLPOL);
+        k = strlen(str_ret);
+        str_ret[k++] = '=';
+        BytesToHexChars(&str_ret[k], (uint8_t*)&policy, sizeof(log_policy_t));
+        strcat(str_ret, "\r\n");
+      }
+    }
+    else
+    {
+      if(strlen(atparams) == 2 * sizeof(log_policy_t))
+      {
+        for(k = 0; k < sizeof(log_policy_t); k++)
+          ((uint8_t*)&policy)[k] =
+            hexCharsToByte(atparams[2 * k], atparams[2 * k + 1]);
+        result = SetLogPolicy(&policy, 1);
+      }
+      else
+        result = SelectLogPolicy((LOG_POLICY_PRESET)atoi(atparams), 1);
+      if (result == 0)
+        str_ret = strdup(strAT_ROK);
+      else
+        str_ret = strdup(strAT_RBAD);
+    }
+  }
   else
   {
     str_ret = strdup(strAT_RBAD);
@@ -218,6 +423,9 @@ uint8_t ParseATCommand(const char *data, AT_CMD *atcmd, char **atparams)
     else if(strstr(data, strAT_CLET) == data)
     {
       *atcmd = AT_CLET;
+      pos = strlen(strAT_CLET);
+      if((strlen(data) > pos + 1) && data[pos] == '=')
+        *atparams = &data[pos + 1];
       return 0;
     }
     else if(strstr(data, strAT_CDPIN) == data)
@@ -271,6 +479,71 @@ uint8_t ParseATCommand(const char *data, AT_CMD *atcmd, char **atparams)
       *atcmd = AT_CTWAIT;
       return 0;
     }
+    else if(strstr(data, strAT_CLDRV) == data)
+    {
+      *atcmd = AT_CLDRV;
+      return 0;
+    }
+    else if(strstr(data, strAT_CGLOG) == data)
+    {
+      *atcmd = AT_CGLOG;
+      return 0;
+    }
+    else if(strstr(data, strAT_CUSTAT) == data)
+    {
+      *atcmd = AT_CUSTAT;
+      return 0;
+    }
+    else if(strstr(data, strAT_CREADER) == data)
+    {
+      *atcmd = AT_CREADER;
+      return 0;
+    }
+    else if(strstr(data, strAT_CSCRIPT) == data)
+    {
+      *atcmd = AT_CSCRIPT;
+      pos = strlen(strAT_CSCRIPT);
+      if((strlen(data) > pos + 1) && data[pos] == '=')
+        *atparams = &data[pos + 1];
+      return 0;
+    }
+    else if(strstr(data, strAT_CSCRUN) == data)
+    {
+      *atcmd = AT_CSCRUN;
+      return 0;
+    }
+    else if(strstr(data, strAT_CPROF) == data)
+    {
+      *atcmd = AT_CPROF;
+      pos = strlen(strAT_CPROF);
+      if((strlen(data) > pos + 1) && data[pos] == '=')
+        *atparams = &data[pos + 1];
+      return 0;
+    }
+    else if(strstr(data, strAT_CLSINK) == data)
+    {
+      *atcmd = AT_CLSINK;
+      pos = strlen(strAT_CLSINK);
+      if((strlen(data) > pos + 1) && data[pos] == '=')
+        *atparams = &data[pos + 1];
+      return 0;
+    }
+    else if(strstr(data, strAT_CRELAY) == data)
+    {
+      *atcmd = AT_CRELAY;
+      pos = strlen(strAT_CRELAY);
+      if((strlen(data) > pos + 1) && data[pos] == '=')
+        *atparams = &data[pos + 1];
+      return 0;
+    }
+    else if(strstr(data, strAT_CLPOL) == data)
+    {
+      *atcmd = AT_CLPOL;
+      pos = strlen(strAT_CLPOL);
+      if((strlen(data) > pos + 1) && data[pos] == '=')
+        *atparams = &data[pos + 1];
+      return 0;
+    }
   }
 
   return 0;
@@ -356,6 +629,97 @@ uint8_t SendEEPROMHexVSerial()
   return 0;
 }
 
+/**
+ * This method sends one Intel Hex record to the Virtual Serial port.
+ *
+ * @param type the record type (0 data, 1 end of file, 4 extended address)
+ * @param addr the 16-bit address field of the record
+ * @param data the record data
+ * @param len the length of the data, at most 32 bytes
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t SendHexRecordVSerial(uint8_t type, uint16_t addr,
+    const uint8_t *data, uint8_t len)
+{
+  char str[78];
+  uint8_t header[4];
+  uint8_t sum = 0;
+  uint8_t i, k = 1;
+
+  header[0] = len;
+  header[1] = (addr >> 8) & 0xFF;
+  header[2] = addr & 0xFF;
+  header[3] = type;
+
+  str[0] = ':';
+  for(i = 0; i < 4 + len; i++)
+  {
+    if(i < 4)
+      sum = sum + header[i];
+    else
+      sum = sum + data[i - 4];
+    str[k++] = nibbleToHexChar((i < 4) ? header[i] : data[i - 4], 1);
+    str[k++] = nibbleToHexChar((i < 4) ? header[i] : data[i - 4], 0);
+  }
+  sum = (uint8_t)((sum ^ 0xFF) + 1);
+  str[k++] = nibbleToHexChar(sum, 1);
+  str[k++] = nibbleToHexChar(sum, 0);
+  str[k++] = '\r';
+  str[k++] = '\n';
+  str[k] = 0;
+
+  return SendHostData(str);
+}
+
+/**
+ * This method reads the log from the selected log storage (see
+ * scd_logsink.h) and transmits it in Intel Hex format to the Virtual
+ * Serial port. Unlike SendEEPROMHexVSerial, the output contains only the
+ * log records, starting at address zero, and uses extended linear address
+ * records for logs above 64 KB. It is the responsibility of the caller to
+ * make sure the virtual serial port is availble.
+ *
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendLogHexVSerial()
+{
+  uint8_t data[32];
+  uint32_t addr, length;
+  uint8_t len, result = 0;
+
+  if(LogSinkOpen())
+    return RET_ERROR;
+
+  length = LogSinkLength();
+  for(addr = 0; addr < length; addr += len)
+  {
+    if(addr > 0 && (addr & 0xFFFF) == 0)
+    {
+      data[0] = (addr >> 24) & 0xFF;
+      data[1] = (addr >> 16) & 0xFF;
+      if(SendHexRecordVSerial(0x04, 0, data, 2))
+      {
+        result = RET_ERROR;
+        break;
+      }
+    }
+
+    len = (length - addr < 32) ? (length - addr) : 32;
+    if(LogSinkRead(addr, data, len) ||
+        SendHexRecordVSerial(0x00, addr & 0xFFFF, data, len))
+    {
+      result = RET_ERROR;
+      break;
+    }
+  }
+  LogSinkCommit();
+
+  if(result == 0)
+    result = SendHexRecordVSerial(0x01, 0, data, 0);
+
+  return result;
+}
+
 /***
  * Method to convert data bytes into hex characters
  *
@@ -394,6 +758,52 @@ void BytesToHexChars(char* dest, uint8_t *data, uint32_t len)
   return 0;
   }*/
 
+/**
+ * Receives a string data from the USB host, as GetHostData, while keeping
+ * the terminal alive with NULL bytes (see PollTerminalKeepAlive).
+ *
+ * @param len the maximum length of the string to be received
+ * @return the NUL('\0') terminated string if success, NULL if error (e.g.
+ * the USB host was disconnected or did not reply before
+ * HOST_MAX_KEEP_ALIVE NULL bytes were sent). The caller is responsible
+ * for eliberating the returned memory.
+ */
+static char* GetHostDataKeepAlive(uint16_t len)
+{
+  char *buf;
+  char c;
+  uint16_t pos = 0;
+  uint8_t keepAlives = 0;
+
+  buf = (char*)malloc(len * sizeof(char));
+  if(buf == NULL)
+    return NULL;
+
+  while(USB_DeviceState == DEVICE_STATE_Configured)
+  {
+    if(!PollHostChar(&c))
+    {
+      if(PollTerminalKeepAlive() && ++keepAlives > HOST_MAX_KEEP_ALIVE)
+        break;
+      continue;
+    }
+
+    if(c == '\r' || c == '\n')
+    {
+      if(pos == 0)
+        continue;
+      buf[pos] = 0;
+      return buf;
+    }
+
+    if(pos < len - 1)
+      buf[pos++] = c;
+  }
+
+  free(buf);
+  return NULL;
+}
+
 /**
  * This method implements communication between USB and Terminal, which can be
  * used to emulate a card with data from a host PC.
@@ -411,9 +821,10 @@ uint8_t TerminalUSB(log_struct_t *logger)
   //uint8_t convention, proto, TC1, TA3, TB3;
   uint8_t t_inverse = 0, t_TC1 = 0;
   uint8_t tmp, i, lparams, error;
+  uint8_t atr[32];
   char *buf = NULL;
   char *atparams = NULL;
-  char reply[USB_BUF_SIZE];
+  char reply[2 * (5 + 255) + 3];     // hex command, CR, LF and NUL
   uint8_t *data;
   uint32_t len;
   AT_CMD atcmd;
@@ -483,10 +894,16 @@ uint8_t TerminalUSB(log_struct_t *logger)
       SendByteTerminalNoParity(tmp, t_inverse);
       if(logger)
         LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, tmp);
+      if(i < sizeof(atr))
+        atr[i] = tmp;
       LoopTerminalETU(2);
     }
     free(buf); buf = NULL;
 
+    // the work waiting time given by the host ATR is used by the keep-alive
+    SetTerminalWorkWaitingIndex(GetATRWorkWaitingIndex(atr,
+          (len/2 < sizeof(atr)) ? len/2 : sizeof(atr)));
+
     // update transaction counter
     nCounter++;
 
@@ -506,6 +923,9 @@ uint8_t TerminalUSB(log_struct_t *logger)
         break;
       }
 
+      // keep the terminal waiting while the USB host prepares the response
+      StartTerminalKeepAlive(t_inverse);
+
       // send command to USB host
       data = SerializeCommand(command, &len);
       FreeCAPDU(command);
@@ -520,7 +940,8 @@ uint8_t TerminalUSB(log_struct_t *logger)
 
 askhost:
       // receive response from USB
-      buf = GetHostData(USB_BUF_SIZE);
+      buf = GetHostDataKeepAlive(USB_BUF_SIZE);
+      StopTerminalKeepAlive(logger);
       if(buf == NULL)
       {
         error = RET_USB_ERR_RECEIVE;
@@ -548,6 +969,7 @@ askhost:
         if(logger)
           LogByte1(logger, LOG_TERMINAL_MORE_TIME, 0x60);
         free(buf); buf = NULL;
+        StartTerminalKeepAlive(t_inverse);
         goto askhost;
       }
       else if(atcmd != AT_UDATA)
@@ -570,7 +992,8 @@ askhost:
           }
           goto enderror;
         }
-        if(logger)
+        // the first byte is a procedure byte or SW1, the last two the status
+        if(LogAPDU(logger, (i == 0 || i + 2 >= lparams / 2) ? 0 : i))
           LogByte1(logger, LOG_BYTE_TO_TERMINAL, tmp);
         LoopTerminalETU(2);
       }
@@ -594,7 +1017,7 @@ enderror:
     LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
     if(lcdAvailable)
       fprintf(stderr, "Writing Log\n");
-    WriteLogEEPROM(logger);
+    WriteLog(logger);
     ResetLogger(logger);
   }
 
@@ -618,7 +1041,7 @@ uint8_t TerminalVSerial(log_struct_t *logger)
   uint8_t convention, proto, TC1, TA3, TB3;
   uint8_t tmp, i, lparams, ldata, result;
   char *buf, *atparams = NULL;
-  char reply[512];
+  char reply[4 + 2 * 256 + 3];
   uint8_t data[256];
   AT_CMD atcmd;
   RAPDU *response = NULL;
@@ -697,12 +1120,11 @@ uint8_t TerminalVSerial(log_struct_t *logger)
     FreeCAPDU(command);
     if(response == NULL)
     {
-      FreeCAPDU(command);
       SendHostData(strAT_RBAD);
       continue;
     }
 
-    memset(reply, 0, 512);
+    memset(reply, 0, sizeof(reply));
     reply[0] = nibbleToHexChar(response->repStatus->sw1, 1);
     reply[1] = nibbleToHexChar(response->repStatus->sw1, 0);
     reply[2] = nibbleToHexChar(response->repStatus->sw2, 1);
@@ -712,8 +1134,8 @@ uint8_t TerminalVSerial(log_struct_t *logger)
       reply[4 + i*2] = nibbleToHexChar(response->repData[i], 1);
       reply[5 + i*2] = nibbleToHexChar(response->repData[i], 0);
     }
-    reply[4 + i] = '\r';
-    reply[5 + i] = '\n';
+    reply[4 + 2 * i] = '\r';
+    reply[5 + 2 * i] = '\n';
     FreeRAPDU(response);
     SendHostData(reply);
   } // end while(1)
@@ -725,7 +1147,7 @@ enderror:
     LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
     if(lcdAvailable)
       fprintf(stderr, "Writing Log\n");
-    WriteLogEEPROM(logger);
+    WriteLog(logger);
     ResetLogger(logger);
   }
 
@@ -733,6 +1155,635 @@ enderror:
 }
 
 
+/**
+ * Sends a relay frame to the USB host. Each frame has the format
+ * [RELAY_FRAME_SYNC, type, length (2 bytes), time (4 bytes), payload], where
+ * the length of the payload and the time are little endian. The time is the
+ * value of the T2 counter (1.088 ms units, see GetCounter) when the event
+ * described by the frame happened.
+ *
+ * @param type the frame type, see RELAY_FRAME
+ * @param payload the frame payload or NULL if len is zero
+ * @param len the length of the payload, at most RELAY_MAX_PAYLOAD
+ * @param time the time of the event
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t SendRelayFrame(
+    uint8_t type,
+    const uint8_t *payload,
+    uint16_t len,
+    uint32_t time)
+{
+  uint8_t *frame;
+  uint8_t result;
+
+  if(len > RELAY_MAX_PAYLOAD || (len > 0 && payload == NULL))
+    return RET_ERR_PARAM;
+
+  // the frame is sent in one go to avoid an extra USB packet
+  frame = (uint8_t*)malloc(RELAY_HEADER_SIZE + len);
+  if(frame == NULL)
+    return RET_ERR_MEMORY;
+
+  frame[0] = RELAY_FRAME_SYNC;
+  frame[1] = type;
+  frame[2] = len & 0xFF;
+  frame[3] = (len >> 8) & 0xFF;
+  frame[4] = time & 0xFF;
+  frame[5] = (time >> 8) & 0xFF;
+  frame[6] = (time >> 16) & 0xFF;
+  frame[7] = (time >> 24) & 0xFF;
+  if(len > 0)
+    memcpy(&frame[RELAY_HEADER_SIZE], payload, len);
+
+  result = SendHostBytes(frame, RELAY_HEADER_SIZE + len);
+  free(frame);
+
+  return result;
+}
+
+/**
+ * Receives a relay frame from the USB host (see SendRelayFrame). The time
+ * in the frames from the host is not used. Any bytes received before a
+ * RELAY_FRAME_SYNC byte are ignored.
+ *
+ * While waiting for the frame the terminal keep-alive is polled, so that
+ * the terminal is kept waiting with NULL bytes (see PollTerminalKeepAlive).
+ * The wait ends with an error if the USB host is disconnected or, while
+ * the keep-alive is active, after HOST_MAX_KEEP_ALIVE NULL bytes.
+ *
+ * @param type stores the type of the frame received
+ * @param payload stores the frame payload. The caller must provide
+ * RELAY_MAX_PAYLOAD bytes.
+ * @param len stores the length of the payload
+ * @return zero if success, RET_USB_ERR_RECEIVE if the host was lost or
+ * non-zero otherwise
+ */
+static uint8_t ReceiveRelayFrame(uint8_t *type, uint8_t *payload,
+    uint16_t *len)
+{
+  uint8_t header[RELAY_HEADER_SIZE];
+  uint16_t pos = 0, total = RELAY_HEADER_SIZE;
+  uint8_t keepAlives = 0;
+  char c;
+
+  while(pos < total)
+  {
+    if(USB_DeviceState != DEVICE_STATE_Configured)
+      return RET_USB_ERR_RECEIVE;
+
+    if(!PollHostChar(&c))
+    {
+      if(PollTerminalKeepAlive() && ++keepAlives > HOST_MAX_KEEP_ALIVE)
+        return RET_USB_ERR_RECEIVE;
+      continue;
+    }
+
+    if(pos == 0 && (uint8_t)c != RELAY_FRAME_SYNC)
+      continue;
+
+    if(pos < RELAY_HEADER_SIZE)
+    {
+      header[pos++] = (uint8_t)c;
+      if(pos == RELAY_HEADER_SIZE)
+      {
+        *len = header[2] | ((uint16_t)header[3] << 8);
+        if(*len > RELAY_MAX_PAYLOAD)
+          return RET_ERR_PARAM;
+        total += *len;
+      }
+      continue;
+    }
+
+    payload[pos - RELAY_HEADER_SIZE] = (uint8_t)c;
+    pos++;
+  }
+
+  *type = header[1];
+  return 0;
+}
+
+/**
+ * Creates a response from the payload of a RELAY_FRAME_RAPDU frame
+ *
+ * @param data the status bytes (SW1, SW2) followed by the response data
+ * @param len the length of data, at least 2
+ * @return the response if successful or NULL otherwise. The caller is
+ * responsible for eliberating the returned RAPDU.
+ */
+static RAPDU* MakeRelayResponse(const uint8_t *data, uint16_t len)
+{
+  RAPDU *response;
+
+  if(len < 2 || len > 257)
+    return NULL;
+
+  response = (RAPDU*)malloc(sizeof(RAPDU));
+  if(response == NULL)
+    return NULL;
+  response->repData = NULL;
+  response->lenData = len - 2;
+  response->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
+  if(response->repStatus == NULL)
+    goto enderror;
+  response->repStatus->sw1 = data[0];
+  response->repStatus->sw2 = data[1];
+
+  if(response->lenData > 0)
+  {
+    response->repData = (uint8_t*)malloc(response->lenData);
+    if(response->repData == NULL)
+      goto enderror;
+    memcpy(response->repData, &data[2], response->lenData);
+  }
+
+  return response;
+
+enderror:
+  FreeRAPDU(response);
+  return NULL;
+}
+
+/**
+ * This method implements the terminal side of a relay between two SCDs,
+ * connected through a USB host (see tools/pytools/relay.py). The SCD acts
+ * as a card for the terminal, as in TerminalUSB, while the ICC side is
+ * handled by another SCD running RelayICCUSB.
+ *
+ * Unlike TerminalUSB, the host link uses binary frames (see SendRelayFrame).
+ * Every command from the terminal is forwarded as soon as it is received
+ * and the terminal is kept waiting with NULL bytes until the response
+ * arrives from the host. After the response is sent to the terminal a
+ * RELAY_FRAME_SENT frame gives the time when this happened, so the host
+ * can compute the latency added by the relay.
+ *
+ * The terminal receives the default ATR of the SCD (see SendT0ATRTerminal)
+ * immediately after every reset, and a RELAY_FRAME_RESET frame asks the
+ * ICC side to reset the card for all but the first reset.
+ *
+ * This method should be called upon receiving the AT+CRELAY=T command.
+ *
+ * @param logger the log structure or NULL if a log is not desired
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t RelayTerminalUSB(log_struct_t *logger)
+{
+  uint8_t t_inverse = 0, t_TC1 = 0, first = 1;
+  uint8_t type, count, error;
+  uint8_t *payload = NULL, *data;
+  uint16_t len;
+  uint32_t dlen;
+  CAPDU *command = NULL;
+  RAPDU *response = NULL;
+
+  payload = (uint8_t*)malloc(RELAY_MAX_PAYLOAD);
+  if(payload == NULL)
+    return RET_ERR_MEMORY;
+
+  // From now on the host must use relay frames
+  SendHostData(strAT_ROK);
+
+  // Now wait for start of transaction from Terminal
+  if(lcdAvailable)
+    fprintf(stderr, "Connect terminal\n");
+  while(GetTerminalResetLine() != 0);
+  if(logger)
+    LogByte1(logger, LOG_TERMINAL_RST_LOW, 0);
+  if(lcdAvailable)
+    fprintf(stderr, "Relay ...\n");
+
+  // Loop until there is no clock from terminal or a timeout occurs.
+  while(1) // external loop
+  {
+    error = InitEMVTerminal(logger);
+    if(error)
+      goto enderror;
+
+    SendT0ATRTerminal(t_inverse, t_TC1, logger);
+    if(!first)
+      SendRelayFrame(RELAY_FRAME_RESET, NULL, 0, GetCounter());
+    first = 0;
+
+    // update transaction counter
+    nCounter++;
+
+    while(1) // internal loop
+    {
+      command = ReceiveT0Command(t_inverse, t_TC1, logger);
+      if(command == NULL)
+        break;
+
+      // forward the command immediately and keep the terminal waiting
+      StartTerminalKeepAlive(t_inverse);
+      data = SerializeCommand(command, &dlen);
+      if(data == NULL)
+      {
+        error = RET_ERR_MEMORY;
+        goto enderror;
+      }
+      error = SendRelayFrame(RELAY_FRAME_CAPDU, data, dlen, GetCounter());
+      free(data);
+      if(error)
+        goto enderror;
+
+      error = ReceiveRelayFrame(&type, payload, &len);
+      count = StopTerminalKeepAlive(logger);
+      if(error)
+        goto enderror;
+      if(type == RELAY_FRAME_END)
+        goto endgood;
+      if(type != RELAY_FRAME_RAPDU || len < 4)
+      {
+        error = RET_ERROR;
+        goto enderror;
+      }
+
+      // skip the ICC time, which is only used by the host
+      response = MakeRelayResponse(&payload[2], len - 2);
+      if(response == NULL)
+      {
+        error = RET_ERR_MEMORY;
+        goto enderror;
+      }
+
+      error = SendT0Response(t_inverse, command->cmdHeader, response, logger);
+      if(error)
+        goto enderror;
+      SendRelayFrame(RELAY_FRAME_SENT, &count, 1, GetCounter());
+
+      FreeCAPDU(command); command = NULL;
+      FreeRAPDU(response); response = NULL;
+    } // end internal loop
+  } // end external loop
+
+endgood:
+  error = 0;
+
+enderror:
+  StopTerminalKeepAlive(NULL);
+  FreeCAPDU(command);
+  FreeRAPDU(response);
+  free(payload);
+  if((error == RET_TERMINAL_TIME_OUT) || (error == RET_TERMINAL_NO_CLOCK))
+  {
+    // these errors are logged and used as a signal to stop
+    error = 0;
+  }
+  SendRelayFrame(RELAY_FRAME_END, &error, 1, GetCounter());
+  if(logger)
+  {
+    if(lcdAvailable)
+      fprintf(stderr, "Writing Log\n");
+    WriteLog(logger);
+    ResetLogger(logger);
+  }
+
+  return error;
+}
+
+/**
+ * This method implements the ICC side of a relay between two SCDs, connected
+ * through a USB host (see RelayTerminalUSB). The SCD acts as a terminal for
+ * the card, as in TerminalVSerial, and forwards to the card every command
+ * received in a RELAY_FRAME_CAPDU frame, without handling the GET RESPONSE
+ * or wrong length status, which are relayed to the terminal.
+ *
+ * Each response is returned in a RELAY_FRAME_RAPDU frame together with the
+ * time taken by the ICC (1.088 ms units), so the host can separate the ICC
+ * time from the time added by the relay.
+ *
+ * This method should be called upon receiving the AT+CRELAY=C command.
+ *
+ * @param logger the log structure or NULL if a log is not desired
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t RelayICCUSB(log_struct_t *logger)
+{
+  uint8_t cInverse, cProto, cTC1, cTA3, cTB3;
+  uint8_t type, error, atr[3];
+  uint8_t *payload = NULL, *data;
+  uint16_t len, rlen, time;
+  uint32_t start;
+  CAPDU *command = NULL;
+  RAPDU *response = NULL;
+
+  payload = (uint8_t*)malloc(RELAY_MAX_PAYLOAD);
+  if(payload == NULL)
+    return RET_ERR_MEMORY;
+
+  if(lcdAvailable)
+    fprintf(stderr, "Insert  ICC...\n");
+  while(!IsICCInserted());
+  if(lcdAvailable)
+    fprintf(stderr, "Relay ...\n");
+
+  error = ResetICC(0, &cInverse, &cProto, &cTC1, &cTA3, &cTB3, logger);
+  if(error)
+    goto enderror;
+  if(cProto != 0)
+  {
+    error = RET_ICC_BAD_PROTO;
+    goto enderror;
+  }
+
+  // From now on the host must use relay frames
+  SendHostData(strAT_ROK);
+  atr[0] = cInverse;
+  atr[1] = cProto;
+  atr[2] = cTC1;
+  SendRelayFrame(RELAY_FRAME_ATR, atr, 3, GetCounter());
+
+  while(1)
+  {
+    error = ReceiveRelayFrame(&type, payload, &len);
+    if(error)
+      goto enderror;
+
+    if(type == RELAY_FRAME_END)
+      break;
+
+    if(type == RELAY_FRAME_RESET)
+    {
+      error = ResetICC(1, &cInverse, &cProto, &cTC1, &cTA3, &cTB3, logger);
+      if(error)
+        goto enderror;
+      atr[0] = cInverse;
+      atr[1] = cProto;
+      atr[2] = cTC1;
+      SendRelayFrame(RELAY_FRAME_ATR, atr, 3, GetCounter());
+      continue;
+    }
+
+    if(type != RELAY_FRAME_CAPDU || len < 5)
+      continue;
+
+    command = MakeCommand(payload[0], payload[1], payload[2], payload[3],
+        payload[4], &payload[5], len - 5);
+    if(command == NULL)
+    {
+      error = RET_ERR_MEMORY;
+      goto enderror;
+    }
+
+    start = GetCounter();
+    error = SendT0Command(cInverse, cTC1, command, logger);
+    if(error)
+      goto enderror;
+    response = ReceiveT0Response(cInverse, command->cmdHeader, logger);
+    time = (uint16_t)(GetCounter() - start);
+    if(response == NULL)
+    {
+      error = RET_ICC_GET_RESPONSE;
+      goto enderror;
+    }
+
+    data = SerializeResponse(response, &rlen);
+    if(data == NULL)
+    {
+      error = RET_ERR_MEMORY;
+      goto enderror;
+    }
+    payload[0] = time & 0xFF;
+    payload[1] = (time >> 8) & 0xFF;
+    memcpy(&payload[2], data, rlen);
+    free(data);
+    SendRelayFrame(RELAY_FRAME_RAPDU, payload, rlen + 2, GetCounter());
+
+    FreeCAPDU(command); command = NULL;
+    FreeRAPDU(response); response = NULL;
+  }
+  error = 0;
+
+enderror:
+  FreeCAPDU(command);
+  FreeRAPDU(response);
+  free(payload);
+  DeactivateICC();
+  SendRelayFrame(RELAY_FRAME_END, &error, 1, GetCounter());
+  if(logger)
+  {
+    LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
+    if(lcdAvailable)
+      fprintf(stderr, "Writing Log\n");
+    WriteLog(logger);
+    ResetLogger(logger);
+  }
+
+  return error;
+}
+
+/**
+ * Deactivates the ICC in reader mode (see ReaderUSB)
+ *
+ * @param logger the log structure or NULL if a log is not desired
+ */
+static void DeactivateReaderICC(log_struct_t *logger)
+{
+  DeactivateICC();
+  if(logger)
+    LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
+}
+
+/**
+ * Sends a RELAY_FRAME_STATUS frame to the USB host in reader mode, with
+ * the payload [error, flags], where flags is a combination of
+ * RELAY_STATUS_INSERTED and RELAY_STATUS_POWERED.
+ *
+ * @param error the error code of the last request or zero
+ * @param powered non-zero if the ICC is powered
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t SendReaderStatus(uint8_t error, uint8_t powered)
+{
+  uint8_t status[2];
+
+  status[0] = error;
+  status[1] = 0;
+  if(IsICCInserted())
+    status[1] |= RELAY_STATUS_INSERTED;
+  if(powered)
+    status[1] |= RELAY_STATUS_POWERED;
+
+  return SendRelayFrame(RELAY_FRAME_STATUS, status, 2, GetCounter());
+}
+
+/**
+ * This method implements a card reader for the USB host, such as the PC/SC
+ * IFD handler in tools/ifdscd. The SCD acts as a terminal for the card, as
+ * in TerminalVSerial, but the host uses the binary relay frames (see
+ * SendRelayFrame) instead of AT commands with hex data:
+ *
+ * - RELAY_FRAME_POWER_ON activates the ICC (RELAY_FRAME_RESET does a warm
+ *   reset if the ICC is powered) and the reply is a RELAY_FRAME_ATR frame
+ *   with the convention, protocol, TC1 and then the ATR bytes.
+ * - RELAY_FRAME_POWER_OFF deactivates the ICC.
+ * - RELAY_FRAME_CAPDU sends a command to the ICC and the reply is a
+ *   RELAY_FRAME_RAPDU frame. GET RESPONSE (61xx) and wrong length (6Cxx)
+ *   are handled by the SCD, as in TerminalSendT0Command, which saves a
+ *   round trip to the host for each of them.
+ * - RELAY_FRAME_STATUS asks if the ICC is inserted and powered.
+ * - RELAY_FRAME_END ends the reader mode.
+ *
+ * When a request fails, or the ICC is not powered, the reply is a
+ * RELAY_FRAME_STATUS frame with the error code. Unlike the other
+ * applications this mode can be started without an ICC.
+ *
+ * This method should be called upon receiving the AT+CREADER command.
+ *
+ * @param logger the log structure or NULL if a log is not desired
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t ReaderUSB(log_struct_t *logger)
+{
+  uint8_t cInverse = 0, cProto = 0, cTC1 = 0, cTA3, cTB3;
+  uint8_t type, error, powered = 0;
+  uint8_t *payload = NULL;
+  uint16_t len, time;
+  uint32_t start;
+  CAPDU *command = NULL;
+  RAPDU *response = NULL;
+
+  payload = (uint8_t*)malloc(RELAY_MAX_PAYLOAD);
+  if(payload == NULL)
+    return RET_ERR_MEMORY;
+
+  if(lcdAvailable)
+    fprintf(stderr, "Reader mode\n");
+
+  // From now on the host must use relay frames
+  SendHostData(strAT_ROK);
+
+  while(1)
+  {
+    error = ReceiveRelayFrame(&type, payload, &len);
+    if(error)
+      goto enderror;
+
+    if(type == RELAY_FRAME_END)
+      break;
+
+    // the ICC may have been removed since the last frame
+    if(powered && !IsICCInserted())
+    {
+      DeactivateReaderICC(logger);
+      powered = 0;
+    }
+
+    if(type == RELAY_FRAME_POWER_ON || type == RELAY_FRAME_RESET)
+    {
+      if(!IsICCInserted())
+      {
+        SendReaderStatus(RET_ICC_INIT_ACTIVATE, 0);
+        continue;
+      }
+
+      // ResetICC deactivates the ICC if it fails
+      error = ResetICC(powered && type == RELAY_FRAME_RESET,
+          &cInverse, &cProto, &cTC1, &cTA3, &cTB3, logger);
+      if(error == 0 && cProto != 0)
+      {
+        DeactivateReaderICC(logger);
+        error = RET_ICC_BAD_PROTO;
+      }
+      if(error)
+      {
+        powered = 0;
+        SendReaderStatus(error, powered);
+        continue;
+      }
+      powered = 1;
+
+      payload[0] = cInverse;
+      payload[1] = cProto;
+      payload[2] = cTC1;
+      len = 3 + GetICCATR(&payload[3]);
+      SendRelayFrame(RELAY_FRAME_ATR, payload, len, GetCounter());
+    }
+    else if(type == RELAY_FRAME_POWER_OFF)
+    {
+      if(powered)
+        DeactivateReaderICC(logger);
+      powered = 0;
+      SendReaderStatus(0, powered);
+    }
+    else if(type == RELAY_FRAME_CAPDU)
+    {
+      if(!powered)
+      {
+        SendReaderStatus(RET_ICC_INIT_ACTIVATE, powered);
+        continue;
+      }
+      if(len < 5 || len > 260)
+      {
+        SendReaderStatus(RET_ERR_PARAM, powered);
+        continue;
+      }
+
+      command = MakeCommand(payload[0], payload[1], payload[2], payload[3],
+          payload[4], &payload[5], len - 5);
+      if(command == NULL)
+      {
+        SendReaderStatus(RET_ERR_MEMORY, powered);
+        continue;
+      }
+
+      start = GetCounter();
+      response = TerminalSendT0Command(command, cInverse, cTC1, logger);
+      time = (uint16_t)(GetCounter() - start);
+      FreeCAPDU(command);
+      command = NULL;
+      if(response == NULL)
+      {
+        // the state of the ICC is unknown, so the host must reset it
+        DeactivateReaderICC(logger);
+        powered = 0;
+        SendReaderStatus(RET_ICC_GET_RESPONSE, powered);
+        continue;
+      }
+
+      // the response may have 256 data bytes, so it is not serialized
+      // with SerializeResponse
+      payload[0] = time & 0xFF;
+      payload[1] = (time >> 8) & 0xFF;
+      payload[2] = response->repStatus->sw1;
+      payload[3] = response->repStatus->sw2;
+      len = 4;
+      if(response->lenData > 0)
+      {
+        memcpy(&payload[4], response->repData, response->lenData);
+        len += response->lenData;
+      }
+      FreeRAPDU(response);
+      response = NULL;
+      SendRelayFrame(RELAY_FRAME_RAPDU, payload, len, GetCounter());
+    }
+    else
+    {
+      // RELAY_FRAME_STATUS and any other request
+      SendReaderStatus(0, powered);
+    }
+  }
+  error = 0;
+
+enderror:
+  FreeCAPDU(command);
+  FreeRAPDU(response);
+  free(payload);
+  if(powered)
+    DeactivateReaderICC(logger);
+  SendRelayFrame(RELAY_FRAME_END, &error, 1, GetCounter());
+  if(logger)
+  {
+    if(lcdAvailable)
+      fprintf(stderr, "Writing Log\n");
+    WriteLog(logger);
+    ResetLogger(logger);
+  }
+
+  return error;
+}
+
+
 /**
  * Convert 2 hexadecimal characters ('0' to '9', 'A' to 'F') into its
  * binary/hexa representation
@@ -793,4 +1844,48 @@ char nibbleToHexChar(uint8_t b, uint8_t high)
   return result;
 }
 
+/**
+ * Resets a line buffer, discarding any partial line
+ *
+ * @param line the line buffer
+ */
+void ResetLineBuffer(line_buffer_t *line)
+{
+  if(line == NULL)
+    return;
+
+  line->len = 0;
+}
+
+/**
+ * Adds a character received from the host (USART or USB) to a line
+ * buffer. This method never blocks, so the caller can poll for
+ * characters (e.g. with PollCharUSART or PollHostChar) and do other work
+ * while a line is being received. Empty lines are ignored and lines
+ * longer than LINE_BUFFER_SIZE - 1 characters are truncated.
+ *
+ * @param line the line buffer
+ * @param c the received character
+ * @return the complete line, without the trailing CR or LF, when c ends
+ * a line, NULL otherwise. The caller is responsible for eliberating the
+ * returned memory.
+ */
+char* AddLineChar(line_buffer_t *line, char c)
+{
+  if(line == NULL)
+    return NULL;
 
+  if(c == '\r' || c == '\n')
+  {
+    if(line->len == 0)
+      return NULL;
+    line->data[line->len] = 0;
+    line->len = 0;
+    return strdup(line->data);
+  }
+
+  if(line->len < LINE_BUFFER_SIZE - 1)
+    line->data[line->len++] = c;
+
+  return NULL;
+}
@@ -65,25 +65,99 @@ typedef enum {
     AT_CCAPDU,      // Send raw terminal CAPDU
     AT_CCEND,       // Ends the current card transaction
     AT_UDATA,       // Send USB data to SCD
+    AT_CLDRV,       // Export the logs as a USB drive
+    AT_CGLOG,       // Get the log from the selected log storage
+    AT_CLSINK,      // Select the log storage backend
+    AT_CUSTAT,      // Get the USART statistics
+    AT_CRELAY,      // Start the binary relay mode (terminal or ICC side)
+    AT_CLPOL,       // Get or set the log policy
+    AT_CREADER,     // Start the binary reader mode (e.g. for PC/SC)
+    AT_CSCRIPT,     // Store part of the EMV flow script
+    AT_CSCRUN,      // Run the EMV flow script
+    AT_CPROF,       // Get or clear the profile counters
     AT_DUMMY
 }AT_CMD;
 
 
+/// Maximum length of a line received from the host, including the NUL
+#define LINE_BUFFER_SIZE 256
+
+/** Structure used to assemble the lines received from the host **/
+struct line_buffer {
+    char data[LINE_BUFFER_SIZE];
+    uint16_t len;
+};
+typedef struct line_buffer line_buffer_t;
+
+/// Sync byte at the start of every relay frame
+#define RELAY_FRAME_SYNC 0xA5
+
+/// Length of the relay frame header: sync, type, length (2), time (4)
+#define RELAY_HEADER_SIZE 8
+
+/// Maximum length of the relay frame payload
+#define RELAY_MAX_PAYLOAD 264
+
+/// Maximum number of NULL bytes sent to the terminal while waiting for the
+/// USB host, after which the host is considered lost (about 30 s with the
+/// default WI and a 4 MHz terminal clock)
+#define HOST_MAX_KEEP_ALIVE 64
+
+/**
+ * Enum defining the relay frame types (see RelayTerminalUSB), which are
+ * also used by the reader mode (see ReaderUSB)
+ */
+typedef enum {
+    RELAY_FRAME_ATR = 0x01,     // ICC reset, payload: convention, proto, TC1
+                                // and, in reader mode, the ATR bytes
+    RELAY_FRAME_CAPDU = 0x02,   // command from terminal: header and data
+    RELAY_FRAME_RAPDU = 0x03,   // ICC time (2 bytes), SW1, SW2 and data
+    RELAY_FRAME_RESET = 0x04,   // terminal reset, the ICC must be reset
+    RELAY_FRAME_SENT = 0x05,    // response sent, payload: NULL bytes sent
+    RELAY_FRAME_END = 0x06,     // end of relay, payload: error code
+    RELAY_FRAME_POWER_ON = 0x07,  // reader mode: activate the ICC
+    RELAY_FRAME_POWER_OFF = 0x08, // reader mode: deactivate the ICC
+    RELAY_FRAME_STATUS = 0x09,  // reader mode: request or reply with the
+                                // error code and RELAY_STATUS flags
+}RELAY_FRAME;
+
+/// Flags of the RELAY_FRAME_STATUS reply
+#define RELAY_STATUS_INSERTED 0x01
+#define RELAY_STATUS_POWERED 0x02
+
 /// Process serial data received from the host
 char* ProcessSerialData(const char* data, log_struct_t *logger);
 
 /// Parse an AT command received from the host
 uint8_t ParseATCommand(const char *data, AT_CMD *command, char **atparams);
 
+/// Reset a line buffer
+void ResetLineBuffer(line_buffer_t *line);
+
+/// Add a received character to a line buffer
+char* AddLineChar(line_buffer_t *line, char c);
+
 /// Send EEPROM content as Intel Hex format to the virtual serial port
 uint8_t SendEEPROMHexVSerial();
 
+/// Send the log as Intel Hex format to the virtual serial port
+uint8_t SendLogHexVSerial();
+
 /// Virtual Serial Terminal application
 uint8_t TerminalVSerial(log_struct_t *logger);
 
 /// USB to Terminal communication
 uint8_t TerminalUSB(log_struct_t *logger);
 
+/// Terminal side of a relay between two SCDs, using binary frames
+uint8_t RelayTerminalUSB(log_struct_t *logger);
+
+/// ICC side of a relay between two SCDs, using binary frames
+uint8_t RelayICCUSB(log_struct_t *logger);
+
+/// Card reader for the host (e.g. PC/SC), using binary frames
+uint8_t ReaderUSB(log_struct_t *logger);
+
 /// Convert bytes to hex chars
 void BytesToHexChars(char* dest, uint8_t *data, uint32_t len);
 
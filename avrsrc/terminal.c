@@ -39,6 +39,8 @@
 #include "emv_values.h"
 #include "scd_values.h"
 #include "scd_io.h"
+#include "scd_profile.h"
+#include "utils.h"
 
 /// Set this to 1 to enable debug code
 #define DEBUG 1
@@ -46,10 +48,18 @@
 /// Set this to enable trigger signals, e.g. to use with oscilloscope
 #define TRIGGER 1
 
+/// ICC ETUs to wait after a response before a GET RESPONSE (or a command
+/// sent again). The reception of SW2 ends 10 ETUs after its start bit and
+/// ISO 7816-3 requires 16 ETUs between characters in opposite directions
+#define T0_TURNAROUND_ETU 6
+
 // ------------------------------------------------
 // Static declarations
-static RAPDU* TerminalSendT0CommandR(CAPDU* tmpCommand, RAPDU *tmpResponse,
-    uint8_t inverse_convention, uint8_t TC1, log_struct_t *logger);
+static RAPDU* CopyResponseLe(const RAPDU *response, uint8_t le);
+static uint8_t IsSessionCommand(const EMVCommandHeader *cmdHeader);
+static uint8_t IsReadOnlyCommand(const EMVCommandHeader *cmdHeader);
+static uint8_t IsSelectSuccessful(const RAPDU *response);
+static uint8_t FindSessionEntry(const SESSIONCache *cache, const CAPDU *cmd);
 
 //--------------------------------------------------------------------
 // Constants
@@ -76,18 +86,27 @@ static const uint8_t bAIDList[42] = {
 /**
  * This function handles the process of sending a command for
  * the protocol T=0, including the intermediate GET_RESPONSE
- * for the different command classes. Because of the
- * recursivity of this method, it introduces an initial
- * delay of 16 ICC ETUs to allow the card to be ready for
- * a new command
- * 
- * @param cmd Command APDU to be sent
+ * for the different command classes (SW1 = 61, 62 or 63) and the
+ * resend of the command with the length given by the card (SW1 = 6C).
+ *
+ * The data of all the responses is received into a single buffer, which
+ * grows when the length of the data is known, i.e. from P3 of a case 2
+ * command (the GET RESPONSE after SW1 = 61 or a command resent after
+ * SW1 = 6C). For case 4 P3 is the length of the command data, so the ICC
+ * is not expected to send data in reply to that command. The same command header is reused for the
+ * following commands.
+ * There is an initial delay of 16 ICC ETUs to allow the card to be
+ * ready for a new command, and T0_TURNAROUND_ETU before each of the
+ * following commands.
+ *
+ * @param cmd Command APDU to be sent. The command is not modified
  * @param inverse_convention different than 0 if inverse convention
  * is to be used
  * @param TC1 byte returned in the ATR
  * @param logger a pointer to a log structure or NULL if no log is desired
  * @return the RAPDU created from the card reply, or NULL
- * if a response APDU cannot be constructed
+ * if a response APDU cannot be constructed. The status is the one
+ * of the last response from the card.
  */
 RAPDU* TerminalSendT0Command(
     CAPDU* cmd,
@@ -95,141 +114,133 @@ RAPDU* TerminalSendT0Command(
     uint8_t TC1,
     log_struct_t *logger)
 {
-  CAPDU *tmpCommand;
-
-  tmpCommand = CopyCAPDU(cmd);
-  if(tmpCommand == NULL) return NULL;
+  EMVCommandHeader header;
+  CAPDU command;
+  RAPDU *response;
+  uint8_t *data;
+  uint8_t cmdCase, len, wait, size;
 
-  return TerminalSendT0CommandR(
-      tmpCommand, NULL, inverse_convention, TC1, logger);
-}
+  if(cmd == NULL || cmd->cmdHeader == NULL)
+    return NULL;
 
+  // the header is changed below, so use a copy and keep the data
+  header = *(cmd->cmdHeader);
+  command.cmdHeader = &header;
+  command.cmdData = cmd->cmdData;
+  command.lenData = cmd->lenData;
 
-/**
- * This function handles the process of sending a command for
- * the protocol T=0, including the intermediate GET_RESPONSE
- * for the different command classes. This function should
- * should only be used by TerminalSendT0Command
- * 
- * @param cmd Command APDU to be sent
- * @param tmpResponse temporary response data used by this method
- * @param inverse_convention different than 0 if inverse convention
- * is to be used
- * @param TC1 byte returned in the ATR
- * @param logger a pointer to a log structure or NULL if no log is desired
- * @return the RAPDU created from the card reply, or NULL
- * if a response APDU cannot be constructed
- * @sa TerminalSendT0Command
- */
-static RAPDU* TerminalSendT0CommandR(
-    CAPDU *tmpCommand,
-    RAPDU *tmpResponse,
-    uint8_t inverse_convention,
-    uint8_t TC1,
-    log_struct_t *logger)
-{
-  RAPDU *response, *tmp;
+  response = (RAPDU*)malloc(sizeof(RAPDU));
+  if(response == NULL)
+    return NULL;
+  response->lenData = 0;
+  response->repData = NULL;
+  response->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
+  if(response->repStatus == NULL)
+    goto enderror;
+
+  size = 0;
+  wait = 16; // wait for card to be ready to receive new command
+  while(1)
+  {
+    // make space for the data of this response after the previous data
+    cmdCase = GetCommandCase(header.cla, header.ins);
+    if(cmdCase == 2 && (uint16_t)response->lenData + header.p3 > size)
+    {
+      if((uint16_t)response->lenData + header.p3 > 0xFF)
+        goto enderror;
+      size = response->lenData + header.p3;
+      data = (uint8_t*)realloc(response->repData, size * sizeof(uint8_t));
+      if(data == NULL)
+        goto enderror;
+      response->repData = data;
+    }
 
 #if TRIGGER
-  // Make sure the trigger signals are low so we can watch them going high
-  JTAG_P1_Low();
-  JTAG_P3_Low();
+    // Make sure the trigger signals are low so we can watch them going high
+    JTAG_P1_Low();
+    JTAG_P3_Low();
 #endif
 
-  LoopICCETU(16); // wait for card to be ready to receive new command
+    LoopICCETU(wait);
 
-  if(SendT0Command(inverse_convention, TC1, tmpCommand, logger))
-  {
-    FreeRAPDU(tmpResponse);
-    FreeCAPDU(tmpCommand);
-    return NULL;
-  }
+    if(SendT0Command(inverse_convention, TC1, &command, logger))
+      goto enderror;
 
 #if TRIGGER
-  /* Code below used to create a trigger signal */
-  if(TC1 > 0)
-  {
-    asm volatile("nop\n\t"::);
-    JTAG_P1_High();
-    if(TC1 == 2) JTAG_P3_High();
-    _delay_ms(1);
+    /* Code below used to create a trigger signal */
+    if(TC1 > 0)
+    {
+      asm volatile("nop\n\t"::);
+      JTAG_P1_High();
+      if(TC1 == 2) JTAG_P3_High();
+      _delay_ms(1);
 
-    JTAG_P1_Low();
-    if(TC1 == 2) JTAG_P3_Low();
-  }
+      JTAG_P1_Low();
+      if(TC1 == 2) JTAG_P3_Low();
+    }
 #endif
 
-  tmp = ReceiveT0Response(inverse_convention, tmpCommand->cmdHeader, logger);
-
-  if(tmp == NULL || tmp->repStatus == NULL)
-  {
-    FreeRAPDU(tmpResponse);
-    FreeCAPDU(tmpCommand);
-    return NULL;
-  }
-
-  response = CopyRAPDU(tmp);
-  if(response == NULL)
-  {
-    FreeRAPDU(tmpResponse);
-    FreeRAPDU(tmp);
-    FreeCAPDU(tmpCommand);
-    return NULL;
-  }
-
-  // If there was already some data from an early response keep it.
-  // else just keep the last response. In case this last response
-  // is bad this will be seen in the status bytes
-  if(tmpResponse != NULL && tmpResponse->repData != NULL &&
-      tmpResponse->lenData != 0)
-  {
-    response->lenData = tmpResponse->lenData + tmp->lenData;
-    response->repData = (uint8_t*)realloc(response->repData,
-        (response->lenData) * sizeof(uint8_t));
-    if(response->repData == NULL)
+    // If there was already some data from an early response keep it.
+    // In case this last response is bad this will be seen in the
+    // status bytes
+    if(ReceiveT0ResponseData(inverse_convention, &header,
+          (cmdCase == 2 && header.p3 > 0) ?
+          &(response->repData[response->lenData]) : NULL,
+          &len, response->repStatus, logger))
+      goto enderror;
+    response->lenData += len;
+
+    if(response->repStatus->sw1 == (uint8_t)SW1_MORE_DATA ||
+        response->repStatus->sw1 == (uint8_t)SW1_WARNING1 ||
+        response->repStatus->sw1 == (uint8_t)SW1_WARNING2)
     {
-      FreeRAPDU(tmpResponse);
-      FreeRAPDU(tmp);
-      FreeRAPDU(response);
-      FreeCAPDU(tmpCommand);
-      return NULL;
+      // GET RESPONSE, with the length given by the card for SW1 = 61
+      header.cla = 0;
+      header.ins = 0xC0;
+      header.p1 = 0;
+      header.p2 = 0;
+      if(response->repStatus->sw1 == (uint8_t)SW1_MORE_DATA)
+        header.p3 = response->repStatus->sw2;
+      else
+        header.p3 = 0;
+      command.cmdData = NULL;
+      command.lenData = 0;
     }
-    memcpy(response->repData, tmpResponse->repData, tmpResponse->lenData);
-    memcpy(&(response->repData[tmpResponse->lenData]), tmp->repData, tmp->lenData);
-  }
-  FreeRAPDU(tmp);
-  FreeRAPDU(tmpResponse);
-
-  if(response->repStatus->sw1 == (uint8_t)SW1_MORE_DATA ||
-      response->repStatus->sw1 == (uint8_t)SW1_WARNING1 ||
-      response->repStatus->sw1 == (uint8_t)SW1_WARNING2)
-  {
-    FreeCAPDU(tmpCommand);
-    CAPDU *cmdGet = MakeCommandC(CMD_GET_RESPONSE, NULL, 0);
-    if(cmdGet == NULL)
+    else if(response->repStatus->sw1 == (uint8_t)SW1_WRONG_LENGTH)
     {
-      FreeRAPDU(response);
-      return NULL;
+      // send the last command again with the length given by the card
+      header.p3 = response->repStatus->sw2;
     }
+    else
+      break;
 
-    if(response->repStatus->sw1 == (uint8_t)SW1_MORE_DATA)
-      cmdGet->cmdHeader->p3 = response->repStatus->sw2;
+    wait = T0_TURNAROUND_ETU;
+  }
 
-    return TerminalSendT0CommandR(
-        cmdGet, response, inverse_convention, TC1, logger);
+  // For any other result we return the APDU, which could be either success
+  // or not. Give back the space not used by the data (realloc shrinks the
+  // buffer in place)
+  if(response->lenData == 0)
+  {
+    free(response->repData);
+    response->repData = NULL;
   }
-  else if(response->repStatus->sw1 == (uint8_t)SW1_WRONG_LENGTH)
+  else if(response->lenData < size)
   {
-    tmpCommand->cmdHeader->p3 = response->repStatus->sw2;
-    return TerminalSendT0CommandR(
-        tmpCommand, response, inverse_convention, TC1, logger);
+    data = (uint8_t*)realloc(response->repData,
+        response->lenData * sizeof(uint8_t));
+    if(data != NULL)
+      response->repData = data;
   }
 
-  // For any other result we return the APDU, which could be either success or not
-  FreeCAPDU(tmpCommand);
   return response;
+
+enderror:
+  FreeRAPDU(response);
+  return NULL;
 }
 
+
 /**
  * This function handles the application selection process,
  * where the first choice is the PSE selection and then
@@ -346,6 +357,8 @@ APPINFO* InitializeTransaction(
  * @param offlineAuthData array of bytes representing the offline authentication
  * data. The user should send an empty but initialized ByteArray if this data
  * is required. This method will ignore any previous contents.
+ * @param fingerprint if not NULL the first record holding the PAN (tag 5A)
+ * is given here, or p1 is 0 if there is none (see scd_cardcache.h)
  * @param logger a pointer to a log structure or NULL if no log is desired
  * @return a RECORD structure containing all the data objects read or NULL
  * if there are no objects to read or an error ocurrs
@@ -355,6 +368,7 @@ RECORD* GetTransactionData(
     uint8_t TC1,
     const APPINFO* appInfo,
     ByteArray *offlineAuthData,
+    RECORDFingerprint *fingerprint,
     log_struct_t *logger)
 {
   RECORD *data, *tmp;
@@ -373,6 +387,8 @@ RECORD* GetTransactionData(
     offlineAuthData->len = 0;
     offlineAuthData->bytes = NULL;
   }
+  if(fingerprint != NULL)
+    fingerprint->p1 = 0;
 
   command = MakeCommandC(CMD_READ_RECORD, NULL, 0);
   if(command == NULL)
@@ -441,6 +457,14 @@ RECORD* GetTransactionData(
       } // end if(offlineAuthData != NULL ...)
 
       tmp = ParseRECORD(response->repData, response->lenData);
+      if(fingerprint != NULL && fingerprint->p1 == 0 &&
+          GetTLVFromRECORD(tmp, 0x5A, 0) != NULL)
+      {
+        fingerprint->p1 = j;
+        fingerprint->p2 = (uint8_t)(afl->sfi | 4);
+        fingerprint->crc = UpdateCRC32Bytes(
+            CRC32_INIT, response->repData, response->lenData);
+      }
       FreeRAPDU(response);
       if(AddRECORD(data, tmp))
       {
@@ -456,6 +480,429 @@ RECORD* GetTransactionData(
   return data;
 }
 
+/**
+ * This method sends in advance the READ RECORD commands for the records
+ * given in the AFL and keeps the successful responses in a record cache,
+ * so that the corresponding commands from the terminal can be answered
+ * without waiting for the ICC (see GetPrefetchedRecord). The time taken
+ * by the ICC for each record is kept as well.
+ *
+ * The records are read in the order given by the AFL until the cache is
+ * full or an error occurs. If the terminal keep-alive is active, a NULL
+ * byte is sent to the terminal after each record (see SendTerminalKeepAlive).
+ *
+ * @param cache the record cache where the responses are added
+ * @param appInfo the APPINFO structure that specifies which files to read
+ * @param convention parameter from ATR
+ * @param TC1 parameter from ATR
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return the number of records in the cache
+ */
+uint8_t PrefetchRecords(
+    RECORDCache *cache,
+    const APPINFO* appInfo,
+    uint8_t convention,
+    uint8_t TC1,
+    log_struct_t *logger)
+{
+  CAPDU *command;
+  RAPDU *response;
+  AFL* afl;
+  uint32_t start;
+  uint8_t i, j;
+
+  if(cache == NULL) return 0;
+  if(appInfo == NULL || appInfo->aflList == NULL) return cache->count;
+
+  command = MakeCommandC(CMD_READ_RECORD, NULL, 0);
+  if(command == NULL) return cache->count;
+
+  for(i = 0; i < appInfo->count; i++)
+  {
+    afl = appInfo->aflList[i];
+    if(afl == NULL) continue;
+
+    // j != 0 stops the loop if recordEnd is 255
+    for(j = afl->recordStart; j <= afl->recordEnd && j != 0; j++)
+    {
+      if(cache->count == PREFETCH_MAX_RECORDS)
+        goto endfull;
+
+      command->cmdHeader->p1 = j;
+      command->cmdHeader->p2 = (uint8_t)(afl->sfi | 4);
+      command->cmdHeader->p3 = 0;
+      if(logger)
+        LogCurrentTime(logger);
+      start = GetCounter();
+      response = TerminalSendT0Command(command, convention, TC1, logger);
+      if(response == NULL)
+        goto endfull;
+
+      // the terminal ETUs are not counted while the record is received
+      SendTerminalKeepAlive();
+
+      if(response->repStatus->sw1 != 0x90 || response->repStatus->sw2 != 0 ||
+          cache->bytes + response->lenData > PREFETCH_MAX_BYTES)
+      {
+        FreeRAPDU(response);
+        continue;
+      }
+
+      cache->p1[cache->count] = command->cmdHeader->p1;
+      cache->p2[cache->count] = command->cmdHeader->p2;
+      cache->time[cache->count] = (uint16_t)(GetCounter() - start);
+      cache->responses[cache->count] = response;
+      cache->bytes += response->lenData;
+      cache->count++;
+    }
+  }
+
+endfull:
+  FreeCAPDU(command);
+  return cache->count;
+}
+
+/**
+ * This method returns the response to a READ RECORD command from a record
+ * cache filled by PrefetchRecords. If the expected length (P3) given by the
+ * terminal does not match the record length the response is a wrong length
+ * status (6C XX), as the ICC would return.
+ *
+ * @param cache the record cache
+ * @param cmdHeader the header of the command received from the terminal
+ * @param time if not NULL, it will contain the time that the ICC took to
+ * return the record (1.088 ms units), or 0 for a wrong length status
+ * @return a copy of the response or NULL if the command is not a READ
+ * RECORD or the record is not in the cache. The caller is responsible for
+ * eliberating the returned RAPDU.
+ */
+RAPDU* GetPrefetchedRecord(
+    const RECORDCache *cache,
+    const EMVCommandHeader *cmdHeader,
+    uint16_t *time)
+{
+  uint8_t i;
+
+  if(cache == NULL || cmdHeader == NULL) return NULL;
+  if(cmdHeader->cla != 0x00 || cmdHeader->ins != 0xB2) return NULL;
+
+  for(i = 0; i < cache->count; i++)
+  {
+    if(cache->p1[i] != cmdHeader->p1 || cache->p2[i] != cmdHeader->p2)
+      continue;
+
+    if(time)
+    {
+      if(cmdHeader->p3 == cache->responses[i]->lenData)
+        *time = cache->time[i];
+      else
+        *time = 0;
+    }
+    return CopyResponseLe(cache->responses[i], cmdHeader->p3);
+  }
+
+  return NULL;
+}
+
+/**
+ * Returns a copy of a response stored in a cache. If the expected length
+ * (P3) given by the terminal does not match the response length the copy
+ * is a wrong length status (6C XX), as the ICC would return.
+ *
+ * @param response the stored response
+ * @param le the expected length (P3) given by the terminal
+ * @return a copy of the response or NULL if there is not enough memory
+ */
+static RAPDU* CopyResponseLe(const RAPDU *response, uint8_t le)
+{
+  RAPDU *copy;
+
+  copy = CopyRAPDU((RAPDU*)response);
+  if(copy == NULL || copy->lenData == le) return copy;
+
+  copy->repStatus->sw1 = (uint8_t)SW1_WRONG_LENGTH;
+  copy->repStatus->sw2 = copy->lenData;
+  if(copy->repData != NULL)
+    free(copy->repData);
+  copy->repData = NULL;
+  copy->lenData = 0;
+  return copy;
+}
+
+/**
+ * Returns non-zero if the response of the ICC to the given command does
+ * not change during a card session, as long as the ICC state is not
+ * changed by other commands. Only the Log Format is accepted for
+ * GET DATA, as the other data objects (e.g. ATC, PIN Try Counter)
+ * change during a transaction.
+ */
+static uint8_t IsSessionCommand(const EMVCommandHeader *cmdHeader)
+{
+  if(cmdHeader->cla == 0x00 &&
+      (cmdHeader->ins == 0xA4 || cmdHeader->ins == 0xB2))
+    return 1;
+  if(cmdHeader->cla == 0x80 && cmdHeader->ins == 0xCA &&
+      cmdHeader->p1 == 0x9F && cmdHeader->p2 == 0x4F)
+    return 1;
+  return 0;
+}
+
+/**
+ * Returns non-zero for the commands that do not change the ICC state
+ * (GET RESPONSE, GET CHALLENGE, INTERNAL AUTHENTICATE, GET DATA).
+ * Any other command that is not a session command empties the
+ * session cache.
+ */
+static uint8_t IsReadOnlyCommand(const EMVCommandHeader *cmdHeader)
+{
+  return (cmdHeader->ins == 0xC0 || cmdHeader->ins == 0x84 ||
+      cmdHeader->ins == 0x88 || cmdHeader->ins == 0xCA);
+}
+
+/**
+ * Returns non-zero if the response of a SELECT command shows that
+ * the file was selected (90 00 or 61 XX)
+ */
+static uint8_t IsSelectSuccessful(const RAPDU *response)
+{
+  return (response->repStatus->sw1 == SW1_MORE_DATA ||
+      (response->repStatus->sw1 == SW1_COMPLETED &&
+       response->repStatus->sw2 == 0));
+}
+
+/**
+ * Returns the entry of a session cache that matches the given command
+ * in the current selection context of the terminal, or SESSION_ENTRY_NONE
+ */
+static uint8_t FindSessionEntry(const SESSIONCache *cache, const CAPDU *cmd)
+{
+  const CAPDU *entry;
+  uint8_t i;
+
+  for(i = 0; i < cache->count; i++)
+  {
+    entry = cache->commands[i];
+    if(memcmp(entry->cmdHeader, cmd->cmdHeader, sizeof(EMVCommandHeader)) ||
+        entry->lenData != cmd->lenData ||
+        (cmd->lenData && memcmp(entry->cmdData, cmd->cmdData, cmd->lenData)))
+      continue;
+
+    // SELECT does not depend on the current selection
+    if(cmd->cmdHeader->ins == 0xA4 || cache->context[i] == cache->termContext)
+      return i;
+  }
+
+  return SESSION_ENTRY_NONE;
+}
+
+/**
+ * This method returns the response to a command from a session cache
+ * filled by AddSessionResponse, so that the command does not need to be
+ * sent to the ICC. A SELECT command answered from the cache changes only
+ * the selection context of the terminal; the ICC is updated by
+ * SyncSessionICC when the next command must be sent to it.
+ *
+ * A response with status 61 XX is only returned if the response to the
+ * following GET RESPONSE command is in the cache as well.
+ *
+ * @param cache the session cache
+ * @param cmd the command received from the terminal
+ * @return a copy of the response or NULL if the command is not in the
+ * cache. The caller is responsible for eliberating the returned RAPDU.
+ */
+RAPDU* GetSessionResponse(SESSIONCache *cache, const CAPDU *cmd)
+{
+  RAPDU *response;
+  uint8_t i;
+
+  if(cache == NULL || cmd == NULL || cmd->cmdHeader == NULL) return NULL;
+
+  if(cmd->cmdHeader->cla == 0x00 && cmd->cmdHeader->ins == 0xC0)
+  {
+    i = cache->pending;
+    if(i == SESSION_ENTRY_NONE || cache->moreData[i] == NULL) return NULL;
+
+    // keep the entry if the terminal must repeat the command with
+    // the right length
+    if(cache->moreData[i]->lenData == cmd->cmdHeader->p3)
+      cache->pending = SESSION_ENTRY_NONE;
+    return CopyResponseLe(cache->moreData[i], cmd->cmdHeader->p3);
+  }
+
+  cache->pending = SESSION_ENTRY_NONE;
+  if(!IsSessionCommand(cmd->cmdHeader)) return NULL;
+  if(cmd->cmdHeader->ins != 0xA4 &&
+      cache->termContext == SESSION_CTX_UNKNOWN) return NULL;
+
+  i = FindSessionEntry(cache, cmd);
+  if(i == SESSION_ENTRY_NONE) return NULL;
+
+  response = cache->responses[i];
+  if(response->repStatus->sw1 == SW1_MORE_DATA)
+  {
+    if(cache->moreData[i] == NULL) return NULL;
+    cache->pending = i;
+  }
+  if(cmd->cmdHeader->ins == 0xA4 && IsSelectSuccessful(response))
+    cache->termContext = i;
+
+  return CopyRAPDU(response);
+}
+
+/**
+ * This method updates a session cache with the response of the ICC to a
+ * command received from the terminal. Session commands (see
+ * GetSessionResponse) are added to the cache, while commands that may
+ * change the ICC state (e.g. GET PROCESSING OPTS, GENERATE AC, VERIFY)
+ * empty the cache.
+ *
+ * @param cache the session cache
+ * @param cmd the command sent to the ICC
+ * @param response the response of the ICC
+ * @return SESSION_MISS for a session command, SESSION_CLEARED if the
+ * cache was emptied or SESSION_NOT_CACHED otherwise
+ */
+uint8_t AddSessionResponse(
+    SESSIONCache *cache,
+    const CAPDU *cmd,
+    const RAPDU *response)
+{
+  uint8_t i, select;
+  uint16_t bytes;
+
+  if(cache == NULL || cmd == NULL || cmd->cmdHeader == NULL ||
+      response == NULL)
+    return SESSION_NOT_CACHED;
+
+  if(cmd->cmdHeader->cla == 0x00 && cmd->cmdHeader->ins == 0xC0)
+  {
+    i = cache->pending;
+    cache->pending = SESSION_ENTRY_NONE;
+    if(i == SESSION_ENTRY_NONE || cache->moreData[i] != NULL ||
+        response->repStatus->sw1 != SW1_COMPLETED ||
+        response->repStatus->sw2 != 0 ||
+        cache->bytes + response->lenData > SESSION_CACHE_MAX_BYTES)
+      return SESSION_NOT_CACHED;
+
+    cache->moreData[i] = CopyRAPDU((RAPDU*)response);
+    if(cache->moreData[i] != NULL)
+      cache->bytes += response->lenData;
+    return SESSION_NOT_CACHED;
+  }
+
+  cache->pending = SESSION_ENTRY_NONE;
+  if(!IsSessionCommand(cmd->cmdHeader))
+  {
+    if(IsReadOnlyCommand(cmd->cmdHeader))
+      return SESSION_NOT_CACHED;
+
+    ClearSessionCache(cache);
+    cache->termContext = SESSION_CTX_UNKNOWN;
+    cache->iccContext = SESSION_CTX_UNKNOWN;
+    return SESSION_CLEARED;
+  }
+
+  select = (cmd->cmdHeader->ins == 0xA4);
+  if(!select && cache->termContext == SESSION_CTX_UNKNOWN)
+    return SESSION_MISS;
+
+  // the entry may be present if it was waiting for a GET RESPONSE
+  i = FindSessionEntry(cache, cmd);
+  bytes = cmd->lenData + response->lenData;
+  if(i == SESSION_ENTRY_NONE &&
+      cache->count < SESSION_CACHE_MAX_ENTRIES &&
+      cache->bytes + bytes <= SESSION_CACHE_MAX_BYTES)
+  {
+    i = cache->count;
+    cache->commands[i] = CopyCAPDU((CAPDU*)cmd);
+    cache->responses[i] = CopyRAPDU((RAPDU*)response);
+    if(cache->commands[i] == NULL || cache->responses[i] == NULL)
+    {
+      FreeCAPDU(cache->commands[i]);
+      FreeRAPDU(cache->responses[i]);
+      i = SESSION_ENTRY_NONE;
+    }
+    else
+    {
+      cache->context[i] = cache->termContext;
+      cache->moreData[i] = NULL;
+      cache->bytes += bytes;
+      cache->count++;
+    }
+  }
+
+  if(i != SESSION_ENTRY_NONE && response->repStatus->sw1 == SW1_MORE_DATA)
+    cache->pending = i;
+
+  if(select && IsSelectSuccessful(response))
+  {
+    // the new selection is unknown if the cache is full
+    if(i == SESSION_ENTRY_NONE)
+      i = SESSION_CTX_UNKNOWN;
+    cache->termContext = i;
+    cache->iccContext = i;
+  }
+
+  return SESSION_MISS;
+}
+
+/**
+ * This method sends again to the ICC the SELECT command of the current
+ * selection context of the terminal, if the terminal selected an
+ * application from the session cache (see GetSessionResponse). This must
+ * be called before sending to the ICC a command from the terminal.
+ *
+ * @param cache the session cache
+ * @param convention parameter from ATR
+ * @param TC1 parameter from ATR
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return 0 if successful, non-zero otherwise. See scd_values.h for details.
+ */
+uint8_t SyncSessionICC(
+    SESSIONCache *cache,
+    uint8_t convention,
+    uint8_t TC1,
+    log_struct_t *logger)
+{
+  RAPDU *response;
+  uint8_t ok;
+
+  if(cache == NULL || cache->termContext == cache->iccContext) return 0;
+  if(cache->termContext >= cache->count) return RET_ERROR;
+
+  response = TerminalSendT0Command(
+      cache->commands[cache->termContext], convention, TC1, logger);
+  if(response == NULL)
+    ok = 0;
+  else
+    ok = IsSelectSuccessful(response);
+  FreeRAPDU(response);
+
+  if(!ok)
+  {
+    cache->iccContext = SESSION_CTX_UNKNOWN;
+    return RET_ERROR;
+  }
+
+  cache->iccContext = cache->termContext;
+  return 0;
+}
+
+/**
+ * Sets the selection context of a session cache after the ICC was reset,
+ * e.g. by a warm reset from the terminal. The cached responses are kept.
+ *
+ * @param cache the session cache
+ */
+void ResetSessionContext(SESSIONCache *cache)
+{
+  if(cache == NULL) return;
+
+  cache->termContext = SESSION_CTX_RESET;
+  cache->iccContext = SESSION_CTX_RESET;
+  cache->pending = SESSION_ENTRY_NONE;
+}
+
 
 /**
  * This function handles the application selection by AID.
@@ -1501,6 +1948,7 @@ RECORD* ParseManyTLV(const uint8_t *data, uint8_t lenData)
   RECORD *rec;
   TLV *obj;
   uint8_t i;
+  PROFILE_FUNCTION(PROFILE_PARSE_TLV);
 
   if(data == NULL || lenData == 0)
     return NULL;
@@ -1756,3 +2204,51 @@ void FreeAPPINFO(APPINFO *data)
   free(data);
 }
 
+/**
+ * Eliberates the responses stored in a RECORDCache structure and
+ * empties the cache. The structure itself is not eliberated.
+ *
+ * @param cache the RECORDCache structure to be emptied
+ */
+void ClearRecordCache(RECORDCache *cache)
+{
+  uint8_t i;
+
+  if(cache == NULL) return;
+
+  for(i = 0; i < cache->count; i++)
+  {
+    FreeRAPDU(cache->responses[i]);
+    cache->responses[i] = NULL;
+  }
+  cache->count = 0;
+  cache->bytes = 0;
+}
+
+/**
+ * Eliberates the commands and responses stored in a SESSIONCache
+ * structure and empties the cache. The selection context is not changed.
+ * The structure itself is not eliberated.
+ *
+ * @param cache the SESSIONCache structure to be emptied
+ */
+void ClearSessionCache(SESSIONCache *cache)
+{
+  uint8_t i;
+
+  if(cache == NULL) return;
+
+  for(i = 0; i < cache->count; i++)
+  {
+    FreeCAPDU(cache->commands[i]);
+    FreeRAPDU(cache->responses[i]);
+    FreeRAPDU(cache->moreData[i]);
+    cache->commands[i] = NULL;
+    cache->responses[i] = NULL;
+    cache->moreData[i] = NULL;
+  }
+  cache->count = 0;
+  cache->bytes = 0;
+  cache->pending = SESSION_ENTRY_NONE;
+}
+
@@ -127,6 +127,81 @@ typedef struct {
     AFL** aflList;
 } APPINFO;
 
+/**
+ * Structure identifying the record that holds the PAN (tag 5A), used as a
+ * cheap fingerprint of the card data (see GetTransactionData)
+ */
+typedef struct {
+    uint8_t p1;             // record number, 0 if not found
+    uint8_t p2;             // SFI and READ RECORD reference control
+    uint32_t crc;           // CRC32 of the record
+} RECORDFingerprint;
+
+/// Maximum number of records kept by PrefetchRecords
+#define PREFETCH_MAX_RECORDS 10
+
+/// Maximum number of response bytes kept by PrefetchRecords
+#define PREFETCH_MAX_BYTES 1024
+
+/**
+ * Structure holding the responses to the READ RECORD commands sent
+ * in advance to the ICC, as given by the AFL (see PrefetchRecords)
+ */
+typedef struct {
+    uint8_t count;
+    uint16_t bytes;
+    uint8_t p1[PREFETCH_MAX_RECORDS];
+    uint8_t p2[PREFETCH_MAX_RECORDS];
+    uint16_t time[PREFETCH_MAX_RECORDS];    // ICC time (1.088 ms units)
+    RAPDU* responses[PREFETCH_MAX_RECORDS];
+} RECORDCache;
+
+/// Maximum number of commands kept in a SESSIONCache
+#define SESSION_CACHE_MAX_ENTRIES 12
+
+/// Maximum number of command and response bytes kept in a SESSIONCache
+#define SESSION_CACHE_MAX_BYTES 768
+
+/// Value used for no entry in a SESSIONCache
+#define SESSION_ENTRY_NONE 0xFF
+
+/// Selection context of the ICC after a reset
+#define SESSION_CTX_RESET 0xFF
+
+/// Selection context of the ICC when it is not in the SESSIONCache
+#define SESSION_CTX_UNKNOWN 0xFE
+
+/// AddSessionResponse: the command is not kept in the cache
+#define SESSION_NOT_CACHED 0
+
+/// AddSessionResponse: the command was not in the cache
+#define SESSION_MISS 1
+
+/// AddSessionResponse: the command changed the ICC state, cache emptied
+#define SESSION_CLEARED 2
+
+/**
+ * Structure holding the responses of the ICC to the commands whose
+ * response does not change during a card session (SELECT, READ RECORD and
+ * GET DATA for static data objects), so they can be returned again to the
+ * terminal, e.g. after a warm reset (see GetSessionResponse).
+ *
+ * The selection context is the entry of the last successful SELECT command.
+ * READ RECORD and GET DATA responses are only valid in the context where
+ * they were received.
+ */
+typedef struct {
+    uint8_t count;
+    uint16_t bytes;
+    uint8_t termContext;    // context seen by the terminal
+    uint8_t iccContext;     // context of the ICC
+    uint8_t pending;        // entry waiting for a GET RESPONSE command
+    uint8_t context[SESSION_CACHE_MAX_ENTRIES];
+    CAPDU* commands[SESSION_CACHE_MAX_ENTRIES];
+    RAPDU* responses[SESSION_CACHE_MAX_ENTRIES];
+    RAPDU* moreData[SESSION_CACHE_MAX_ENTRIES]; // response to GET RESPONSE
+} SESSIONCache;
+
 /**
  * Structure used to transmit data to a GENERATE AC
  * command (based on CDOL1 and CDOL2).
@@ -184,8 +259,42 @@ RECORD* GetTransactionData(
         uint8_t TC1,
         const APPINFO* appInfo,
         ByteArray *offlineAuthData,
+        RECORDFingerprint *fingerprint,
+        log_struct_t *logger);
+
+/// Reads in advance the records given by the AFL
+uint8_t PrefetchRecords(
+        RECORDCache *cache,
+        const APPINFO* appInfo,
+        uint8_t convention,
+        uint8_t TC1,
         log_struct_t *logger);
 
+/// Returns the response to a READ RECORD command from a record cache
+RAPDU* GetPrefetchedRecord(
+        const RECORDCache *cache,
+        const EMVCommandHeader *cmdHeader,
+        uint16_t *time);
+
+/// Returns the response to a command from a session cache
+RAPDU* GetSessionResponse(SESSIONCache *cache, const CAPDU *cmd);
+
+/// Adds the response of the ICC to a command to a session cache
+uint8_t AddSessionResponse(
+        SESSIONCache *cache,
+        const CAPDU *cmd,
+        const RAPDU *response);
+
+/// Selects on the ICC the application selected by the terminal
+uint8_t SyncSessionICC(
+        SESSIONCache *cache,
+        uint8_t convention,
+        uint8_t TC1,
+        log_struct_t *logger);
+
+/// Sets the selection context of a session cache after an ICC reset
+void ResetSessionContext(SESSIONCache *cache);
+
 /// Selects application based on AID list
 FCITemplate* SelectFromAID(
         uint8_t convention,
@@ -291,5 +400,11 @@ void FreeFCIList(FCIList *data);
 /// Eliberates the memory used by an APPINFO structure
 void FreeAPPINFO(APPINFO *data);
 
+/// Eliberates the responses stored in a RECORDCache structure
+void ClearRecordCache(RECORDCache *cache);
+
+/// Eliberates the responses stored in a SESSIONCache structure
+void ClearSessionCache(SESSIONCache *cache);
+
 #endif // _TERMINAL_H_
 
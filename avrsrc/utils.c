@@ -166,4 +166,46 @@ uint8_t LogCurrentTime(log_struct_t *logger)
   return 0;
 }
 
+/**
+ * Updates a CRC32 (as in zlib, without the final inversion) with one byte
+ *
+ * @param crc the CRC32 so far, CRC32_INIT for the first byte
+ * @param value the next byte
+ * @return the updated CRC32
+ */
+uint32_t UpdateCRC32(uint32_t crc, uint8_t value)
+{
+  uint8_t i;
+
+  crc ^= value;
+  for(i = 0; i < 8; i++)
+  {
+    if(crc & 1)
+      crc = (crc >> 1) ^ 0xEDB88320UL;
+    else
+      crc = crc >> 1;
+  }
+
+  return crc;
+}
+
+/**
+ * Updates a CRC32 with a string of bytes
+ *
+ * @param crc the CRC32 so far, CRC32_INIT for the first bytes
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return the updated CRC32
+ * @sa UpdateCRC32
+ */
+uint32_t UpdateCRC32Bytes(uint32_t crc, const uint8_t *data, uint8_t len)
+{
+  uint8_t k;
+
+  for(k = 0; k < len; k++)
+    crc = UpdateCRC32(crc, data[k]);
+
+  return crc;
+}
+
 
@@ -56,5 +56,14 @@ void SleepUntilCardInserted();
 /// Retrieve relative time value and writes it to log
 uint8_t LogCurrentTime(log_struct_t *logger);
 
+/// Initial value of a CRC32, see UpdateCRC32
+#define CRC32_INIT 0xFFFFFFFFUL
+
+/// Update a CRC32 with one byte
+uint32_t UpdateCRC32(uint32_t crc, uint8_t value);
+
+/// Update a CRC32 with a string of bytes
+uint32_t UpdateCRC32Bytes(uint32_t crc, const uint8_t *data, uint8_t len);
+
 #endif // _UTILS_H_
 
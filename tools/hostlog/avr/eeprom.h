@@ -0,0 +1,45 @@
+/*
+ * Host stub of <avr/eeprom.h>: the EEPROM is an array in RAM
+ * (hostEEPROM, defined in logsink_host.c).
+ */
+#ifndef _HOST_AVR_EEPROM_H_
+#define _HOST_AVR_EEPROM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define HOST_EEPROM_SIZE 4096
+
+extern uint8_t hostEEPROM[HOST_EEPROM_SIZE];
+
+static inline uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+  return hostEEPROM[(uintptr_t)addr];
+}
+
+static inline void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+  hostEEPROM[(uintptr_t)addr] = value;
+}
+
+static inline void eeprom_write_byte(uint8_t *addr, uint8_t value)
+{
+  hostEEPROM[(uintptr_t)addr] = value;
+}
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t len)
+{
+  memcpy(dst, &hostEEPROM[(uintptr_t)src], len);
+}
+
+static inline void eeprom_update_block(const void *src, void *dst, size_t len)
+{
+  memcpy(&hostEEPROM[(uintptr_t)dst], src, len);
+}
+
+static inline void eeprom_write_block(const void *src, void *dst, size_t len)
+{
+  memcpy(&hostEEPROM[(uintptr_t)dst], src, len);
+}
+
+#endif // _HOST_AVR_EEPROM_H_
@@ -0,0 +1,16 @@
+/*
+ * Host stub of <avr/pgmspace.h>: program memory is ordinary memory.
+ */
+#ifndef _HOST_AVR_PGMSPACE_H_
+#define _HOST_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define memcpy_P memcpy
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+
+#endif // _HOST_AVR_PGMSPACE_H_
@@ -0,0 +1,195 @@
+/*
+ * Host implementation of the log sink layer (avrsrc/scd_logsink.h), used
+ * to test the logger on Linux. Each backend is an array in RAM with the
+ * capacity of the real part, and the session semantics are the same as
+ * in scd_logsink.c: one open session at a time, the data that does not
+ * fit is dropped with RET_LOG_SINK_FULL and the log length only changes
+ * on LogSinkCommit.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <avr/eeprom.h>
+
+#include "scd.h"
+#include "scd_logsink.h"
+#include "scd_logdedup.h"
+#include "scd_values.h"
+
+#include "logsink_host.h"
+
+uint8_t hostEEPROM[HOST_EEPROM_SIZE];
+
+/// Capacity of each backend, in the order of LOG_SINK_TYPE
+static const uint32_t sinkCapacity[LOG_SINK_COUNT] = {
+  EEPROM_MAX_ADDRESS - EEPROM_TLOG_DATA,
+  (uint32_t)LOG_DATAFLASH_PAGE_SIZE * LOG_DATAFLASH_PAGES,
+  LOG_FRAM_SIZE,
+  LOG_FLASH_END - LOG_FLASH_START,
+};
+
+static uint8_t dataflashData[LOG_DATAFLASH_PAGE_SIZE * LOG_DATAFLASH_PAGES];
+static uint8_t framData[LOG_FRAM_SIZE];
+static uint8_t flashData[LOG_FLASH_END - LOG_FLASH_START];
+
+static LOG_SINK_TYPE sinkType = LOG_SINK_DEFAULT;
+static uint8_t sinkOpen;                        // non-zero during a session
+static uint32_t sinkPosition;                   // next free byte in the log
+static uint32_t sinkLength[LOG_SINK_COUNT];     // committed log lengths
+static uint32_t sinkCommits;                    // see HostSinkCommits
+
+static uint8_t* SinkData(LOG_SINK_TYPE type)
+{
+  switch(type)
+  {
+    case LOG_SINK_EEPROM:
+      return &hostEEPROM[EEPROM_TLOG_DATA];
+    case LOG_SINK_DATAFLASH:
+      return dataflashData;
+    case LOG_SINK_FRAM:
+      return framData;
+    case LOG_SINK_FLASH:
+      return flashData;
+    default:
+      return NULL;
+  }
+}
+
+uint8_t SelectLogSink(LOG_SINK_TYPE type, uint8_t persist)
+{
+  (void)persist;
+
+  if(type >= LOG_SINK_COUNT)
+    return RET_ERR_PARAM;
+  if(sinkOpen)
+    return RET_ERR_CHECK;
+
+  sinkType = type;
+
+  return 0;
+}
+
+void LoadLogSink()
+{
+  sinkType = LOG_SINK_DEFAULT;
+}
+
+LOG_SINK_TYPE GetLogSink()
+{
+  return sinkType;
+}
+
+uint8_t LogSinkOpen()
+{
+  if(sinkOpen)
+    return RET_ERR_CHECK;
+
+  sinkOpen = 1;
+  sinkPosition = sinkLength[sinkType];
+
+  return 0;
+}
+
+uint8_t LogSinkAppend(const uint8_t *data, uint16_t len)
+{
+  uint32_t space;
+  uint8_t result = 0;
+
+  if(!sinkOpen || data == NULL)
+    return RET_ERR_PARAM;
+
+  space = sinkCapacity[sinkType] - sinkPosition;
+  if(space < len)
+  {
+    len = space;
+    result = RET_LOG_SINK_FULL;
+  }
+
+  memcpy(SinkData(sinkType) + sinkPosition, data, len);
+  sinkPosition += len;
+
+  return result;
+}
+
+uint8_t LogSinkUpdate(uint32_t addr, const uint8_t *data, uint16_t len)
+{
+  if(!sinkOpen || data == NULL || addr + len > sinkPosition)
+    return RET_ERR_PARAM;
+
+  memcpy(SinkData(sinkType) + addr, data, len);
+
+  return 0;
+}
+
+uint8_t LogSinkCommit()
+{
+  if(!sinkOpen)
+    return RET_ERR_PARAM;
+
+  sinkLength[sinkType] = sinkPosition;
+  sinkOpen = 0;
+  sinkCommits++;
+
+  return 0;
+}
+
+uint32_t LogSinkLength()
+{
+  if(sinkOpen)
+    return sinkPosition;
+
+  return sinkLength[sinkType];
+}
+
+uint8_t LogSinkRead(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+  if(buf == NULL || addr + len > sinkCapacity[sinkType])
+    return RET_ERR_PARAM;
+
+  memcpy(buf, SinkData(sinkType) + addr, len);
+
+  return 0;
+}
+
+uint8_t LogSinkErase()
+{
+  if(sinkOpen)
+    return RET_ERR_CHECK;
+
+  sinkLength[sinkType] = 0;
+
+  return 0;
+}
+
+/*
+ * Only sessions without references are saved on the host (the logger is
+ * built with LOG_DEDUP_ENABLED = 0), see scd_logdedup.c for the real one.
+ */
+uint8_t LogSinkAppendDedup(const uint8_t *data, uint16_t len,
+    const log_dedup_t *dedup)
+{
+  if(data == NULL || dedup != NULL)
+    return RET_ERR_PARAM;
+
+  return LogSinkAppend(data, len);
+}
+
+uint32_t HostSinkCapacity(LOG_SINK_TYPE type)
+{
+  return type < LOG_SINK_COUNT ? sinkCapacity[type] : 0;
+}
+
+uint32_t HostSinkCommits()
+{
+  return sinkCommits;
+}
+
+void HostSinkReset()
+{
+  memset(hostEEPROM, 0xFF, sizeof(hostEEPROM));
+  memset(sinkLength, 0, sizeof(sinkLength));
+  sinkType = LOG_SINK_DEFAULT;
+  sinkOpen = 0;
+  sinkCommits = 0;
+}
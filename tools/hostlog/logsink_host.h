@@ -0,0 +1,20 @@
+/*
+ * Helpers of the host log sink (logsink_host.c) used by the tests.
+ */
+#ifndef _LOGSINK_HOST_H_
+#define _LOGSINK_HOST_H_
+
+#include <stdint.h>
+
+#include "scd_logsink.h"
+
+/// Return the capacity of a backend in bytes
+uint32_t HostSinkCapacity(LOG_SINK_TYPE type);
+
+/// Return the number of sessions committed since HostSinkReset
+uint32_t HostSinkCommits();
+
+/// Erase all the backends and the EEPROM and select the default backend
+void HostSinkReset();
+
+#endif // _LOGSINK_HOST_H_
@@ -0,0 +1,268 @@
+/*
+ * Stress test of the logger against interrupt handlers (see LogByteISR
+ * and SaveLogISR in avrsrc/scd_logger.c). Run "make stress".
+ *
+ * The main context appends numbered records with the trap flag set, so
+ * the CPU raises SIGTRAP after every instruction of the append. The
+ * signal handler plays the part of the interrupt handlers: after each
+ * instruction it may queue a numbered event with LogByteISR, and at
+ * random instructions it saves the log with SaveLogISR and checks that
+ * the saved log is consistent:
+ * - it only has complete, known records
+ * - the records of the main context are consecutive and end with the
+ *   last record appended, or the one being appended
+ * - the queued events are consecutive, each appears once and the last
+ *   one queued is there (unless the log was reset after it was drained)
+ * Like an interrupt, the handler cannot be interrupted itself.
+ *
+ * Only x86-64 Linux is supported, since the trap flag is set directly.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scd_logger.h"
+#include "scd_logsink.h"
+#include "scd_values.h"
+
+#include "logsink_host.h"
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "logstress needs x86-64 Linux"
+#endif
+
+/// Number of records appended by the main context
+#define STRESS_RECORDS 4000
+
+/// One of this many instructions queues an event
+#define STRESS_EVENT_RATE 64
+
+/// Type of the events queued by the interrupt handler
+#define STRESS_EVENT LOG_TERMINAL_RST_LOW
+
+static log_struct_t logger;
+
+// main context state, read by the handler
+static volatile uint32_t mainDone;      // records appended so far
+static volatile uint32_t resetEpoch;    // completed ResetLogger calls
+static volatile uint8_t resetting;      // non-zero during ResetLogger
+
+// handler state
+static uint32_t rng = 0x12345678;
+static uint32_t steps, snapshots, eventsQueued, eventsDropped;
+static uint8_t eventSeq;                // next event number
+static uint8_t eventValid;              // an event was queued
+static uint32_t eventEpoch;             // resetEpoch of the last event
+static int failures;
+static char failure[256];
+
+/// Turn on the trap flag (the 128 bytes skip the red zone)
+static inline void StepOn()
+{
+  __asm__ __volatile__(
+      "sub $128, %%rsp\n\t"
+      "pushfq\n\t"
+      "orq $0x100, (%%rsp)\n\t"
+      "popfq\n\t"
+      "add $128, %%rsp" ::: "memory", "cc");
+}
+
+static inline void StepOff()
+{
+  __asm__ __volatile__(
+      "sub $128, %%rsp\n\t"
+      "pushfq\n\t"
+      "andq $~0x100, (%%rsp)\n\t"
+      "popfq\n\t"
+      "add $128, %%rsp" ::: "memory", "cc");
+}
+
+static uint32_t Random()
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+static void Fail(const char *what, uint32_t a, uint32_t b)
+{
+  if(failures++ == 0)
+    snprintf(failure, sizeof(failure),
+        "%s (%u, %u) after %u records, %u steps",
+        what, a, b, mainDone, steps);
+}
+
+/**
+ * Checks a saved log. All the records of the main context are
+ * LOG_TIME_GENERAL with their 32-bit number or LOG_BYTE_FROM_ICC with
+ * the low byte of their number, so only the low bytes are compared.
+ *
+ * @param final non-zero if the main context has finished
+ */
+static void CheckLog(const uint8_t *log, uint32_t len, uint8_t final)
+{
+  uint32_t pos = 0, rlen;
+  uint32_t seq = 0, mainCount = 0, eventCount = 0;
+  uint8_t event = 0;
+  uint8_t type;
+
+  while(pos < len)
+  {
+    type = log[pos];
+    rlen = (type & 0x03) + 2;
+    if(pos + rlen > len)
+    {
+      Fail("incomplete record", pos, len);
+      return;
+    }
+
+    if(type == LOG_TIME_GENERAL)
+    {
+      uint32_t n = log[pos + 1] | (log[pos + 2] << 8) |
+        (log[pos + 3] << 16) | ((uint32_t)log[pos + 4] << 24);
+      if(mainCount && (n & 0xFF) != ((seq + 1) & 0xFF))
+        Fail("main records not consecutive", seq, n);
+      seq = n;
+      mainCount++;
+    }
+    else if(type == LOG_BYTE_FROM_ICC)
+    {
+      if(mainCount && log[pos + 1] != ((seq + 1) & 0xFF))
+        Fail("main records not consecutive", seq, log[pos + 1]);
+      seq = mainCount ? seq + 1 : log[pos + 1];
+      mainCount++;
+    }
+    else if(type == STRESS_EVENT)
+    {
+      if(eventCount && log[pos + 1] != (uint8_t)(event + 1))
+        Fail("events not consecutive", event, log[pos + 1]);
+      event = log[pos + 1];
+      eventCount++;
+    }
+    else
+    {
+      Fail("unknown record", pos, type);
+      return;
+    }
+    pos += rlen;
+  }
+
+  // the last record must be the last one appended or the one in progress
+  if(mainCount && (seq & 0xFF) != ((mainDone - 1) & 0xFF) &&
+      (final || (seq & 0xFF) != (mainDone & 0xFF)))
+    Fail("main record lost or repeated", seq, mainDone);
+
+  if(eventValid && !resetting && eventEpoch == resetEpoch &&
+      (eventCount == 0 || event != (uint8_t)(eventSeq - 1)))
+    Fail("event lost", eventCount ? event : 0xFFFF, (uint8_t)(eventSeq - 1));
+}
+
+static void Snapshot(uint8_t final)
+{
+  static uint8_t log[LOG_BUFFER_SIZE + 2 * LOG_ISR_QUEUE_SIZE];
+  uint32_t len;
+  uint8_t result;
+
+  LogSinkErase();
+  result = SaveLogISR(&logger);
+  if(result != 0)
+    Fail("SaveLogISR failed", result, 0);
+  len = LogSinkLength();
+  if(len > sizeof(log) || LogSinkRead(0, log, len) != 0)
+  {
+    Fail("log too long", len, 0);
+    return;
+  }
+  CheckLog(log, len, final);
+  logger.flushed = 0;
+  snapshots++;
+}
+
+/// The interrupt handler, run after every instruction of the main context
+static void OnStep(int sig, siginfo_t *info, void *context)
+{
+  uint32_t r = Random();
+
+  (void)sig;
+  (void)info;
+  (void)context;
+  steps++;
+
+  if(r % STRESS_EVENT_RATE == 0)
+  {
+    if(LogByteISR(&logger, STRESS_EVENT, eventSeq) == 0)
+    {
+      eventSeq++;
+      eventValid = 1;
+      eventEpoch = resetEpoch;
+      eventsQueued++;
+    }
+    else
+      eventsDropped++;
+  }
+  else if(r & 0x100)
+  {
+    Snapshot(0);
+  }
+}
+
+int main()
+{
+  struct sigaction sa;
+  uint32_t k;
+
+  // the EEPROM is smaller than the log buffer
+  HostSinkReset();
+  SelectLogSink(LOG_SINK_DATAFLASH, 0);
+  SelectLogPolicy(LOG_POLICY_FULL, 0);
+  ResetLogger(&logger);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = OnStep;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTRAP, &sa, NULL);
+
+  for(k = 0; k < STRESS_RECORDS; k++)
+  {
+    if(logger.position > LOG_BUFFER_SIZE - 2 * LOG_ISR_QUEUE_SIZE - 5)
+    {
+      resetting = 1;
+      StepOn();
+      ResetLogger(&logger);
+      StepOff();
+      resetEpoch++;
+      resetting = 0;
+    }
+
+    StepOn();
+    if(k & 1)
+      LogByte1(&logger, LOG_BYTE_FROM_ICC, k & 0xFF);
+    else
+      LogByte4(&logger, LOG_TIME_GENERAL, k & 0xFF, (k >> 8) & 0xFF,
+          (k >> 16) & 0xFF, (k >> 24) & 0xFF);
+    StepOff();
+    mainDone = k + 1;
+  }
+
+  // the final log, saved from an interrupt and then from the main context
+  Snapshot(1);
+  LogSinkErase();
+  if(SaveLog(&logger) != 0)
+    Fail("SaveLog failed", 0, 0);
+
+  printf("logstress: %u records, %u steps, %u snapshots, "
+      "%u events queued, %u dropped (queue full)\n",
+      mainDone, steps, snapshots, eventsQueued, eventsDropped);
+  if(failures)
+  {
+    printf("logstress: %d failures, first: %s\n", failures, failure);
+    return 1;
+  }
+  printf("logstress: all checks passed\n");
+  return 0;
+}
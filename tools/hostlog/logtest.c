@@ -0,0 +1,223 @@
+/*
+ * Tests of the logger (avrsrc/scd_logger.c) on the host, using the RAM
+ * log sinks of logsink_host.c. Run "make test".
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "scd_logger.h"
+#include "scd_logsink.h"
+#include "scd_values.h"
+
+#include "logsink_host.h"
+
+static int failures;
+
+#define CHECK(cond) \
+  do { \
+    if(!(cond)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while(0)
+
+static log_struct_t logger;
+
+/// Read the whole log of the selected backend into buf
+static uint32_t ReadLog(uint8_t *buf, uint32_t size)
+{
+  uint32_t len = LogSinkLength();
+
+  if(len > size)
+    len = size;
+  if(len > 0 && LogSinkRead(0, buf, len) != 0)
+    return 0;
+  return len;
+}
+
+static void Setup(LOG_SINK_TYPE type)
+{
+  HostSinkReset();
+  CHECK(SelectLogSink(type, 0) == 0);
+  SelectLogPolicy(LOG_POLICY_FULL, 0);
+  memset(&logger, 0, sizeof(logger));
+  ResetLogger(&logger);
+}
+
+static void TestRecords()
+{
+  static const uint8_t expected[] = {
+    LOG_ICC_INSERTED, 0x00,
+    LOG_BYTE_ATR_FROM_ICC, 0x3B,
+    LOG_TIME_GENERAL, 0x01, 0x02, 0x03, 0x04,
+  };
+  uint8_t buf[64];
+
+  Setup(LOG_SINK_EEPROM);
+  CHECK(LogByte1(&logger, LOG_ICC_INSERTED, 0) == 0);
+  CHECK(LogByte1(&logger, LOG_BYTE_ATR_FROM_ICC, 0x3B) == 0);
+  CHECK(LogByte4(&logger, LOG_TIME_GENERAL, 1, 2, 3, 4) == 0);
+  // wrong number of bytes for the type
+  CHECK(LogByte2(&logger, LOG_TIME_GENERAL, 1, 2) == RET_ERR_PARAM);
+  CHECK(logger.position == sizeof(expected));
+  CHECK(memcmp(logger.log_buffer, expected, sizeof(expected)) == 0);
+
+  CHECK(SaveLog(&logger) == 0);
+  CHECK(ReadLog(buf, sizeof(buf)) == sizeof(expected));
+  CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+
+  // the next session is appended to the first one
+  CHECK(SaveLog(&logger) == 0);
+  CHECK(ReadLog(buf, sizeof(buf)) == 2 * sizeof(expected));
+  CHECK(memcmp(&buf[sizeof(expected)], expected, sizeof(expected)) == 0);
+
+  CHECK(LogSinkErase() == 0);
+  CHECK(LogSinkLength() == 0);
+}
+
+static void TestBufferFull()
+{
+  uint16_t k;
+
+  Setup(LOG_SINK_EEPROM);
+  for(k = 0; k < LOG_BUFFER_SIZE / 5; k++)
+    CHECK(LogByte4(&logger, LOG_TIME_GENERAL, k, k >> 8, 0, 0) == 0);
+  CHECK(LogByte4(&logger, LOG_TIME_GENERAL, 0, 0, 0, 0) == RET_ERR_MEMORY);
+  CHECK(logger.position == (LOG_BUFFER_SIZE / 5) * 5);
+}
+
+static void TestSinkFull(LOG_SINK_TYPE type)
+{
+  uint32_t capacity = HostSinkCapacity(type);
+  uint32_t saved = 0;
+  uint8_t result = 0;
+  uint16_t k;
+
+  Setup(type);
+  for(k = 0; k < 100; k++)
+    LogByte4(&logger, LOG_TIME_GENERAL, k, 0, 0, 0);
+
+  while(result == 0)
+  {
+    result = SaveLog(&logger);
+    saved += logger.position;
+  }
+  CHECK(result == RET_LOG_SINK_FULL);
+  CHECK(saved >= capacity);
+  CHECK(LogSinkLength() == capacity);
+  CHECK(SaveLog(&logger) == RET_LOG_SINK_FULL);
+  CHECK(LogSinkLength() == capacity);
+}
+
+static void TestPolicy()
+{
+  uint8_t k;
+
+  Setup(LOG_SINK_EEPROM);
+  SelectLogPolicy(LOG_POLICY_EVENTS, 0);
+  CHECK(LogByte1(&logger, LOG_BYTE_FROM_ICC, 0x90) == 0);
+  CHECK(logger.position == 0);
+  CHECK(LogByte1(&logger, LOG_ICC_INSERTED, 0) == 0);
+  CHECK(logger.position == 2);
+
+  // headers only, one of every 4 identical commands
+  ResetLogger(&logger);
+  SelectLogPolicy(LOG_POLICY_HEADERS, 0);
+  for(k = 0; k < 6; k++)
+  {
+    CHECK(LogCommandHeader(&logger, LOG_BYTE_FROM_TERMINAL,
+          0x00, 0xB2, 0x01, 0x0C, 0x00) == 0);
+    CHECK(LogAPDU(&logger, 0) == (k % 4 == 0));
+    CHECK(!LogAPDU(&logger, 1));
+  }
+  // 2 headers logged and the 3 skipped commands reported before the second
+  CHECK(logger.position == 2 * 5 * 2 + 2);
+  CHECK(logger.log_buffer[10] == LOG_APDU_SKIPPED);
+  CHECK(logger.log_buffer[11] == 3);
+
+  // the policy is only kept after reset if persisted
+  LoadLogPolicy();
+  CHECK(IsLogged(LOG_BYTE_FROM_ICC));
+  SelectLogPolicy(LOG_POLICY_EVENTS, 1);
+  SelectLogPolicy(LOG_POLICY_FULL, 0);
+  LoadLogPolicy();
+  CHECK(!IsLogged(LOG_BYTE_FROM_ICC));
+  CHECK(IsLogged(LOG_ICC_INSERTED));
+}
+
+static void TestSummary()
+{
+  static const uint8_t summary[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  uint8_t buf[64];
+
+  // only the summary is logged, as LOG_TRANSACTION_SUMMARY records
+  Setup(LOG_SINK_EEPROM);
+  SelectLogPolicy(LOG_POLICY_SUMMARY, 0);
+  CHECK(IsLogged(LOG_TRANSACTION_SUMMARY));
+  CHECK(!IsLogged(LOG_BYTE_FROM_ICC));
+  CHECK(LogByte1(&logger, LOG_BYTE_FROM_ICC, 0x90) == 0);
+  CHECK(LogBlock(&logger, LOG_TRANSACTION_SUMMARY,
+        summary, sizeof(summary)) == 0);
+  CHECK(SaveLog(&logger) == 0);
+  CHECK(ReadLog(buf, sizeof(buf)) == 10);
+  CHECK(buf[0] == LOG_TRANSACTION_SUMMARY && buf[5] == 0xEB);
+  CHECK(memcmp(&buf[1], &summary[0], 4) == 0);
+  CHECK(memcmp(&buf[6], &summary[4], 4) == 0);
+
+  // and the full policy leaves it out
+  SelectLogPolicy(LOG_POLICY_FULL, 0);
+  CHECK(!IsLogged(LOG_TRANSACTION_SUMMARY));
+}
+
+static void TestISR()
+{
+  uint8_t buf[64];
+  uint8_t k;
+
+  Setup(LOG_SINK_FRAM);
+  CHECK(LogByte1(&logger, LOG_ICC_INSERTED, 0) == 0);
+  CHECK(LogByteISR(&logger, LOG_TERMINAL_RST_LOW, 1) == 0);
+  CHECK(LogByteISR(&logger, LOG_TIME_GENERAL, 1) == RET_ERR_PARAM);
+  CHECK(logger.position == 2);
+
+  // queued events go into the log before the next record
+  CHECK(LogByte1(&logger, LOG_ICC_DEACTIVATED, 0) == 0);
+  CHECK(logger.position == 6);
+  CHECK(logger.log_buffer[2] == LOG_TERMINAL_RST_LOW);
+  CHECK(logger.log_buffer[4] == LOG_ICC_DEACTIVATED);
+
+  // the queue keeps LOG_ISR_QUEUE_SIZE - 1 events
+  for(k = 0; k < LOG_ISR_QUEUE_SIZE - 1; k++)
+    CHECK(LogByteISR(&logger, LOG_TERMINAL_RST_LOW, k) == 0);
+  CHECK(LogByteISR(&logger, LOG_TERMINAL_RST_LOW, k) == RET_ERR_MEMORY);
+
+  // saved from the interrupt with the queued events, then not saved again
+  CHECK(SaveLogISR(&logger) == 0);
+  CHECK(logger.flushed);
+  CHECK(ReadLog(buf, sizeof(buf)) == 6 + 2 * (LOG_ISR_QUEUE_SIZE - 1));
+  CHECK(SaveLog(&logger) == 0);
+  CHECK(HostSinkCommits() == 1);
+}
+
+int main()
+{
+  LOG_SINK_TYPE type;
+
+  TestRecords();
+  TestBufferFull();
+  for(type = LOG_SINK_EEPROM; type < LOG_SINK_COUNT; type++)
+    TestSinkFull(type);
+  TestPolicy();
+  TestSummary();
+  TestISR();
+
+  if(failures)
+  {
+    printf("logtest: %d checks failed\n", failures);
+    return 1;
+  }
+  printf("logtest: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,702 @@
+/**
+ * \file
+ * \brief ifdhandler.c source file
+ *
+ * This file implements a PC/SC IFD handler (driver) for pcsc-lite, so the
+ * SCD can be used as a standard card reader. The SCD must run the reader
+ * mode (AT+CREADER, see ReaderUSB in avrsrc/serial.c), in which the
+ * commands and responses are sent as binary relay frames over the virtual
+ * serial port instead of AT commands with hex data.
+ *
+ * Only the protocol T=0 is supported, as by the SCD. The SCD handles the
+ * GET RESPONSE (61xx) and wrong length (6Cxx) cases, so each APDU takes a
+ * single round trip over USB.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ifdhandler.h>
+#include <reader.h>
+
+/// Number of SCDs handled by the driver
+#define SCD_MAX_READERS 4
+
+/// Device used by IFDHCreateChannel, with the channel number
+#define SCD_DEVICE_FORMAT "/dev/ttyACM%d"
+
+/// Time to wait for the replies of the SCD, in ms
+#define SCD_TIMEOUT_MS 3000
+
+/// Time to wait for the response of a command, in ms. Some commands (e.g.
+/// GENERATE AC) can take seconds and the SCD waits as long as the card.
+#define SCD_COMMAND_TIMEOUT_MS 60000
+
+// Relay frames, see RELAY_FRAME in avrsrc/serial.h
+#define RELAY_FRAME_SYNC 0xA5
+#define RELAY_HEADER_SIZE 8
+#define RELAY_MAX_PAYLOAD 264
+#define RELAY_FRAME_ATR 0x01
+#define RELAY_FRAME_CAPDU 0x02
+#define RELAY_FRAME_RAPDU 0x03
+#define RELAY_FRAME_RESET 0x04
+#define RELAY_FRAME_END 0x06
+#define RELAY_FRAME_POWER_ON 0x07
+#define RELAY_FRAME_POWER_OFF 0x08
+#define RELAY_FRAME_STATUS 0x09
+#define RELAY_STATUS_INSERTED 0x01
+#define RELAY_STATUS_POWERED 0x02
+
+// Bytes before the ATR in the RELAY_FRAME_ATR payload and before the
+// response in the RELAY_FRAME_RAPDU payload
+#define ATR_PREFIX 3
+#define RAPDU_PREFIX 2
+
+/**
+ * Structure holding the state of one SCD
+ */
+typedef struct {
+  int fd;                                 // serial port or -1 if closed
+  UCHAR atr[MAX_ATR_SIZE];                // ATR of the powered card
+  DWORD atrLen;                           // zero if the card is not powered
+  uint8_t rx[2 * (RELAY_HEADER_SIZE + RELAY_MAX_PAYLOAD)];
+  size_t rxLen;                           // bytes received in rx
+} scd_reader_t;
+
+static scd_reader_t readers[SCD_MAX_READERS] = {
+  {-1}, {-1}, {-1}, {-1}
+};
+
+
+/**
+ * Returns the SCD used for a logical unit number
+ *
+ * @param Lun the logical unit number given by pcscd
+ * @return the reader or NULL if Lun is not valid
+ */
+static scd_reader_t* GetReader(DWORD Lun)
+{
+  DWORD index = (Lun >> 16) & 0xFFFF;
+
+  if(index >= SCD_MAX_READERS)
+    return NULL;
+  return &readers[index];
+}
+
+/**
+ * Returns the time in ms from a monotonic clock
+ */
+static long NowMs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/**
+ * Reads the bytes available from the SCD into the receive buffer
+ *
+ * @param reader the SCD
+ * @param deadline the time (see NowMs) until which to wait for data
+ * @return zero if some bytes were received, non-zero otherwise
+ */
+static int ReadMore(scd_reader_t *reader, long deadline)
+{
+  struct pollfd pfd;
+  long wait;
+  ssize_t n;
+
+  if(reader->rxLen == sizeof(reader->rx))
+    reader->rxLen = 0;
+
+  while(1)
+  {
+    wait = deadline - NowMs();
+    if(wait < 0)
+      return -1;
+
+    pfd.fd = reader->fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, (int)wait) < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    if((pfd.revents & POLLIN) == 0)
+    {
+      if(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+        return -1;
+      continue;
+    }
+
+    n = read(reader->fd, reader->rx + reader->rxLen,
+        sizeof(reader->rx) - reader->rxLen);
+    if(n < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if(n <= 0)
+      return -1;
+    reader->rxLen += n;
+    return 0;
+  }
+}
+
+/**
+ * Removes bytes from the start of the receive buffer
+ */
+static void Consume(scd_reader_t *reader, size_t len)
+{
+  memmove(reader->rx, reader->rx + len, reader->rxLen - len);
+  reader->rxLen -= len;
+}
+
+/**
+ * Sends a relay frame to the SCD (see SendRelayFrame in avrsrc/serial.c).
+ * The time field is not used by the SCD and is set to zero.
+ *
+ * @param reader the SCD
+ * @param type the frame type
+ * @param payload the frame payload or NULL if len is zero
+ * @param len the length of the payload, at most RELAY_MAX_PAYLOAD
+ * @return zero if success, non-zero otherwise
+ */
+static int SendFrame(scd_reader_t *reader, uint8_t type,
+    const uint8_t *payload, uint16_t len)
+{
+  uint8_t frame[RELAY_HEADER_SIZE + RELAY_MAX_PAYLOAD];
+  size_t pos = 0, total = RELAY_HEADER_SIZE + len;
+  ssize_t n;
+
+  if(len > RELAY_MAX_PAYLOAD)
+    return -1;
+
+  // the frame is sent in one go to avoid an extra USB packet
+  memset(frame, 0, RELAY_HEADER_SIZE);
+  frame[0] = RELAY_FRAME_SYNC;
+  frame[1] = type;
+  frame[2] = len & 0xFF;
+  frame[3] = (len >> 8) & 0xFF;
+  if(len > 0)
+    memcpy(&frame[RELAY_HEADER_SIZE], payload, len);
+
+  while(pos < total)
+  {
+    n = write(reader->fd, frame + pos, total - pos);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return -1;
+    pos += n;
+  }
+
+  return 0;
+}
+
+/**
+ * Receives a relay frame from the SCD. Any bytes received before a
+ * RELAY_FRAME_SYNC byte are ignored.
+ *
+ * @param reader the SCD
+ * @param type stores the type of the frame received
+ * @param payload stores the frame payload, of RELAY_MAX_PAYLOAD bytes
+ * @param len stores the length of the payload
+ * @param timeout the time to wait for the frame, in ms
+ * @return zero if success, non-zero otherwise
+ */
+static int ReceiveFrame(scd_reader_t *reader, uint8_t *type,
+    uint8_t *payload, uint16_t *len, long timeout)
+{
+  long deadline = NowMs() + timeout;
+  uint8_t *sync;
+  uint16_t plen;
+
+  while(1)
+  {
+    sync = memchr(reader->rx, RELAY_FRAME_SYNC, reader->rxLen);
+    if(sync == NULL)
+      reader->rxLen = 0;
+    else if(sync != reader->rx)
+      Consume(reader, sync - reader->rx);
+
+    if(reader->rxLen >= RELAY_HEADER_SIZE)
+    {
+      plen = reader->rx[2] | ((uint16_t)reader->rx[3] << 8);
+      if(plen > RELAY_MAX_PAYLOAD)
+      {
+        // not a frame, look for the next sync byte
+        Consume(reader, 1);
+        continue;
+      }
+      if(reader->rxLen >= (size_t)RELAY_HEADER_SIZE + plen)
+      {
+        *type = reader->rx[1];
+        *len = plen;
+        memcpy(payload, reader->rx + RELAY_HEADER_SIZE, plen);
+        Consume(reader, RELAY_HEADER_SIZE + plen);
+        return 0;
+      }
+    }
+
+    if(ReadMore(reader, deadline))
+      return -1;
+  }
+}
+
+/**
+ * Sends a request frame to the SCD and receives the reply
+ *
+ * @param reader the SCD
+ * @param type the type of the request
+ * @param data the payload of the request or NULL if len is zero
+ * @param len the length of the request payload
+ * @param rtype stores the type of the reply
+ * @param reply stores the payload of the reply, of RELAY_MAX_PAYLOAD bytes
+ * @param rlen stores the length of the reply payload
+ * @param timeout the time to wait for the reply, in ms
+ * @return zero if success, non-zero otherwise
+ */
+static int Request(scd_reader_t *reader, uint8_t type, const uint8_t *data,
+    uint16_t len, uint8_t *rtype, uint8_t *reply, uint16_t *rlen,
+    long timeout)
+{
+  if(reader->fd < 0)
+    return -1;
+  if(SendFrame(reader, type, data, len))
+    return -1;
+  return ReceiveFrame(reader, rtype, reply, rlen, timeout);
+}
+
+/**
+ * Waits for a line starting with "AT " (the reply to an AT command)
+ *
+ * @param reader the SCD
+ * @param timeout the time to wait for the line, in ms
+ * @return 1 for "AT OK", 0 for any other reply, -1 if no reply
+ */
+static int ReceiveATReply(scd_reader_t *reader, long timeout)
+{
+  long deadline = NowMs() + timeout;
+  uint8_t *end;
+  size_t len;
+  int ok;
+
+  while(1)
+  {
+    while((end = memchr(reader->rx, '\n', reader->rxLen)) != NULL)
+    {
+      len = end - reader->rx + 1;
+      if(len >= 3 && memcmp(reader->rx, "AT ", 3) == 0)
+      {
+        ok = (len >= 5 && memcmp(reader->rx, "AT OK", 5) == 0);
+        Consume(reader, len);
+        return ok;
+      }
+      Consume(reader, len);
+    }
+
+    if(ReadMore(reader, deadline))
+      return -1;
+  }
+}
+
+/**
+ * Starts the reader mode of the SCD with AT+CREADER. If the SCD is still in
+ * reader mode (e.g. pcscd was stopped without closing the channel) the
+ * reader mode is ended first.
+ *
+ * @param reader the SCD, with the serial port open
+ * @return zero if success, non-zero otherwise
+ */
+static int StartReaderMode(scd_reader_t *reader)
+{
+  static const char cmd[] = "AT+CREADER\r\n";
+  int attempt;
+
+  for(attempt = 0; attempt < 2; attempt++)
+  {
+    tcflush(reader->fd, TCIOFLUSH);
+    reader->rxLen = 0;
+    if(write(reader->fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+      return -1;
+    if(ReceiveATReply(reader, SCD_TIMEOUT_MS) == 1)
+      return 0;
+
+    // end a previous reader mode and clear any partial AT command
+    SendFrame(reader, RELAY_FRAME_END, NULL, 0);
+    usleep(100000);
+    if(write(reader->fd, "\r\n", 2) != 2)
+      return -1;
+    usleep(100000);
+  }
+
+  return -1;
+}
+
+/**
+ * Opens the serial port of an SCD and starts the reader mode
+ *
+ * @param Lun the logical unit number given by pcscd
+ * @param DeviceName the serial port, e.g. /dev/ttyACM0
+ * @return IFD_SUCCESS or IFD_COMMUNICATION_ERROR
+ */
+RESPONSECODE IFDHCreateChannelByName(DWORD Lun, LPSTR DeviceName)
+{
+  scd_reader_t *reader = GetReader(Lun);
+  struct termios tio;
+
+  if(reader == NULL || DeviceName == NULL)
+    return IFD_COMMUNICATION_ERROR;
+  if(reader->fd >= 0)
+    IFDHCloseChannel(Lun);
+
+  reader->fd = open(DeviceName, O_RDWR | O_NOCTTY);
+  if(reader->fd < 0)
+  {
+    fprintf(stderr, "ifdscd: cannot open %s: %s\n", DeviceName,
+        strerror(errno));
+    return IFD_COMMUNICATION_ERROR;
+  }
+
+  // raw mode, so the frames are not changed by the line discipline
+  if(tcgetattr(reader->fd, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    tcsetattr(reader->fd, TCSANOW, &tio);
+  }
+
+  reader->atrLen = 0;
+  reader->rxLen = 0;
+  if(StartReaderMode(reader))
+  {
+    fprintf(stderr, "ifdscd: no reply to AT+CREADER from %s\n",
+        DeviceName);
+    close(reader->fd);
+    reader->fd = -1;
+    return IFD_COMMUNICATION_ERROR;
+  }
+
+  return IFD_SUCCESS;
+}
+
+/**
+ * Opens the SCD on the serial port /dev/ttyACM<Channel>
+ *
+ * @param Lun the logical unit number given by pcscd
+ * @param Channel the CHANNELID of reader.conf
+ * @return IFD_SUCCESS or IFD_COMMUNICATION_ERROR
+ */
+RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
+{
+  char name[32];
+
+  snprintf(name, sizeof(name), SCD_DEVICE_FORMAT, (int)Channel);
+  return IFDHCreateChannelByName(Lun, name);
+}
+
+/**
+ * Ends the reader mode, which deactivates the card, and closes the port
+ *
+ * @param Lun the logical unit number given by pcscd
+ * @return IFD_SUCCESS or IFD_COMMUNICATION_ERROR
+ */
+RESPONSECODE IFDHCloseChannel(DWORD Lun)
+{
+  scd_reader_t *reader = GetReader(Lun);
+  uint8_t type, payload[RELAY_MAX_PAYLOAD];
+  uint16_t len;
+
+  if(reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
+  if(reader->fd < 0)
+    return IFD_SUCCESS;
+
+  // the SCD replies with RELAY_FRAME_END and then "AT OK"
+  if(Request(reader, RELAY_FRAME_END, NULL, 0, &type, payload, &len,
+        SCD_TIMEOUT_MS) == 0 && type == RELAY_FRAME_END)
+    ReceiveATReply(reader, SCD_TIMEOUT_MS);
+
+  close(reader->fd);
+  reader->fd = -1;
+  reader->atrLen = 0;
+
+  return IFD_SUCCESS;
+}
+
+/**
+ * Returns the capabilities of the reader and the ATR of the card
+ */
+RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length,
+    PUCHAR Value)
+{
+  scd_reader_t *reader = GetReader(Lun);
+
+  if(reader == NULL || Length == NULL || Value == NULL)
+    return IFD_COMMUNICATION_ERROR;
+
+  switch(Tag)
+  {
+    case TAG_IFD_ATR:
+    case SCARD_ATTR_ATR_STRING:
+      if(*Length < reader->atrLen)
+        return IFD_ERROR_TAG;
+      memcpy(Value, reader->atr, reader->atrLen);
+      *Length = reader->atrLen;
+      break;
+
+    case TAG_IFD_SIMULTANEOUS_ACCESS:
+      if(*Length < 1)
+        return IFD_ERROR_TAG;
+      Value[0] = SCD_MAX_READERS;
+      *Length = 1;
+      break;
+
+    case TAG_IFD_SLOTS_NUMBER:
+      if(*Length < 1)
+        return IFD_ERROR_TAG;
+      Value[0] = 1;
+      *Length = 1;
+      break;
+
+    case TAG_IFD_THREAD_SAFE:
+    case TAG_IFD_SLOT_THREAD_SAFE:
+      // the readers share the state of this driver
+      if(*Length < 1)
+        return IFD_ERROR_TAG;
+      Value[0] = 0;
+      *Length = 1;
+      break;
+
+    default:
+      return IFD_ERROR_TAG;
+  }
+
+  return IFD_SUCCESS;
+}
+
+/**
+ * No capabilities can be changed
+ */
+RESPONSECODE IFDHSetCapabilities(DWORD Lun, DWORD Tag, DWORD Length,
+    PUCHAR Value)
+{
+  return IFD_NOT_SUPPORTED;
+}
+
+/**
+ * Only T=0 is supported, without PTS
+ */
+RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
+    UCHAR Flags, UCHAR PTS1, UCHAR PTS2, UCHAR PTS3)
+{
+  if(Protocol != SCARD_PROTOCOL_T0)
+    return IFD_PROTOCOL_NOT_SUPPORTED;
+  return IFD_SUCCESS;
+}
+
+/**
+ * Activates (cold or warm reset) or deactivates the card
+ *
+ * @param Lun the logical unit number given by pcscd
+ * @param Action IFD_POWER_UP, IFD_POWER_DOWN or IFD_RESET
+ * @param Atr stores the ATR of the card
+ * @param AtrLength stores the length of the ATR
+ * @return IFD_SUCCESS, IFD_ERROR_POWER_ACTION or IFD_COMMUNICATION_ERROR
+ */
+RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr,
+    PDWORD AtrLength)
+{
+  scd_reader_t *reader = GetReader(Lun);
+  uint8_t type, payload[RELAY_MAX_PAYLOAD];
+  uint16_t len;
+
+  if(reader == NULL || AtrLength == NULL)
+    return IFD_COMMUNICATION_ERROR;
+
+  if(Action == IFD_POWER_DOWN)
+  {
+    reader->atrLen = 0;
+    *AtrLength = 0;
+    if(Request(reader, RELAY_FRAME_POWER_OFF, NULL, 0, &type, payload, &len,
+          SCD_TIMEOUT_MS))
+      return IFD_COMMUNICATION_ERROR;
+    return IFD_SUCCESS;
+  }
+
+  if(Action != IFD_POWER_UP && Action != IFD_RESET)
+    return IFD_NOT_SUPPORTED;
+
+  reader->atrLen = 0;
+  *AtrLength = 0;
+  if(Request(reader,
+        (Action == IFD_RESET) ? RELAY_FRAME_RESET : RELAY_FRAME_POWER_ON,
+        NULL, 0, &type, payload, &len, SCD_TIMEOUT_MS))
+    return IFD_COMMUNICATION_ERROR;
+  if(type != RELAY_FRAME_ATR || len <= ATR_PREFIX ||
+      len - ATR_PREFIX > MAX_ATR_SIZE)
+    return IFD_ERROR_POWER_ACTION;
+
+  reader->atrLen = len - ATR_PREFIX;
+  memcpy(reader->atr, &payload[ATR_PREFIX], reader->atrLen);
+  if(Atr != NULL)
+    memcpy(Atr, reader->atr, reader->atrLen);
+  *AtrLength = reader->atrLen;
+
+  return IFD_SUCCESS;
+}
+
+/**
+ * Sends an APDU to the card and returns the response. The APDU is mapped
+ * to a T=0 command as in ISO 7816-3: a case 1 command gets P3 = 0 and the
+ * Le byte of a case 4 command is removed (the SCD then gets the response
+ * data with GET RESPONSE). Extended length APDUs are not supported.
+ */
+RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
+    PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength,
+    PSCARD_IO_HEADER RecvPci)
+{
+  scd_reader_t *reader = GetReader(Lun);
+  uint8_t type, command[RELAY_MAX_PAYLOAD], payload[RELAY_MAX_PAYLOAD];
+  uint16_t len, clen;
+  DWORD lc;
+
+  if(reader == NULL || TxBuffer == NULL || RxBuffer == NULL ||
+      RxLength == NULL)
+    return IFD_COMMUNICATION_ERROR;
+  if(reader->atrLen == 0)
+    return IFD_ICC_NOT_PRESENT;
+
+  if(TxLength < 4)
+    return IFD_COMMUNICATION_ERROR;
+  memcpy(command, TxBuffer, 4);
+  if(TxLength == 4)
+  {
+    // case 1
+    command[4] = 0;
+    clen = 5;
+  }
+  else if(TxLength == 5)
+  {
+    // case 2
+    command[4] = TxBuffer[4];
+    clen = 5;
+  }
+  else
+  {
+    // case 3 or case 4
+    lc = TxBuffer[4];
+    if(lc == 0 || (TxLength != 5 + lc && TxLength != 6 + lc))
+      return IFD_COMMUNICATION_ERROR;
+    memcpy(&command[4], &TxBuffer[4], 1 + lc);
+    clen = 5 + lc;
+  }
+
+  if(Request(reader, RELAY_FRAME_CAPDU, command, clen, &type, payload, &len,
+        SCD_COMMAND_TIMEOUT_MS))
+  {
+    *RxLength = 0;
+    return IFD_COMMUNICATION_ERROR;
+  }
+  if(type != RELAY_FRAME_RAPDU || len < RAPDU_PREFIX + 2)
+  {
+    // a RELAY_FRAME_STATUS reply: the card was removed or failed
+    reader->atrLen = 0;
+    *RxLength = 0;
+    return IFD_COMMUNICATION_ERROR;
+  }
+
+  // the payload has the ICC time, SW1, SW2 and the data, while PC/SC
+  // expects the data followed by SW1 SW2
+  len -= RAPDU_PREFIX;
+  if(*RxLength < len)
+  {
+    *RxLength = 0;
+#ifdef IFD_ERROR_INSUFFICIENT_BUFFER
+    return IFD_ERROR_INSUFFICIENT_BUFFER;
+#else
+    return IFD_COMMUNICATION_ERROR;
+#endif
+  }
+  memcpy(RxBuffer, &payload[RAPDU_PREFIX + 2], len - 2);
+  RxBuffer[len - 2] = payload[RAPDU_PREFIX];
+  RxBuffer[len - 1] = payload[RAPDU_PREFIX + 1];
+  *RxLength = len;
+  if(RecvPci != NULL)
+  {
+    RecvPci->Protocol = SCARD_PROTOCOL_T0;
+    RecvPci->Length = sizeof(SCARD_IO_HEADER);
+  }
+
+  return IFD_SUCCESS;
+}
+
+/**
+ * No control codes are supported
+ */
+RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer,
+    DWORD TxLength, PUCHAR RxBuffer, DWORD RxLength,
+    LPDWORD pdwBytesReturned)
+{
+  if(pdwBytesReturned != NULL)
+    *pdwBytesReturned = 0;
+  return IFD_ERROR_NOT_SUPPORTED;
+}
+
+/**
+ * Returns whether a card is inserted in the SCD
+ *
+ * @param Lun the logical unit number given by pcscd
+ * @return IFD_ICC_PRESENT, IFD_ICC_NOT_PRESENT or IFD_COMMUNICATION_ERROR
+ */
+RESPONSECODE IFDHICCPresence(DWORD Lun)
+{
+  scd_reader_t *reader = GetReader(Lun);
+  uint8_t type, payload[RELAY_MAX_PAYLOAD];
+  uint16_t len;
+
+  if(reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
+  if(Request(reader, RELAY_FRAME_STATUS, NULL, 0, &type, payload, &len,
+        SCD_TIMEOUT_MS) || type != RELAY_FRAME_STATUS || len < 2)
+    return IFD_COMMUNICATION_ERROR;
+
+  if((payload[1] & RELAY_STATUS_POWERED) == 0)
+    reader->atrLen = 0;
+  if(payload[1] & RELAY_STATUS_INSERTED)
+    return IFD_ICC_PRESENT;
+  return IFD_ICC_NOT_PRESENT;
+}
@@ -0,0 +1,192 @@
+/**
+ * \file
+ * \brief scdbench.c source file
+ *
+ * This file implements a small PC/SC benchmark: it sends the same APDU
+ * many times to a card through pcscd and prints the number of APDUs per
+ * second and the distribution of the latency. It can be used with any
+ * reader, so the SCD can be compared with other readers.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <winscard.h>
+
+/// Default APDU: SELECT 1PAY.SYS.DDF01
+#define DEFAULT_APDU "00A404000E315041592E5359532E444446303100"
+
+#define MAX_APDU_SIZE 261
+
+static void Usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-r reader] [-n count] [-a apdu]\n", name);
+  fprintf(stderr, "  -r reader  the reader name (default the first one)\n");
+  fprintf(stderr, "  -n count   the number of APDUs to send (default 1000)\n");
+  fprintf(stderr, "  -a apdu    the APDU in hex (default SELECT PSE)\n");
+}
+
+/**
+ * Converts a hex string into bytes
+ *
+ * @return the number of bytes or -1 if the string is not valid
+ */
+static int ParseHex(const char *hex, unsigned char *out, int max)
+{
+  int len = 0;
+  unsigned int byte;
+
+  if(strlen(hex) % 2)
+    return -1;
+  while(*hex)
+  {
+    if(len == max || sscanf(hex, "%2x", &byte) != 1)
+      return -1;
+    out[len++] = byte;
+    hex += 2;
+  }
+
+  return len;
+}
+
+static double NowSeconds()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int CompareDouble(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+  SCARDCONTEXT context;
+  SCARDHANDLE card;
+  DWORD protocol, readersLen = SCARD_AUTOALLOCATE, rxLen;
+  LPSTR readers = NULL;
+  const char *reader = NULL;
+  const char *hex = DEFAULT_APDU;
+  unsigned char apdu[MAX_APDU_SIZE], response[MAX_BUFFER_SIZE];
+  double *times, start, total;
+  int apduLen, count = 1000, i, opt;
+  LONG rv;
+
+  while((opt = getopt(argc, argv, "r:n:a:h")) != -1)
+  {
+    switch(opt)
+    {
+      case 'r': reader = optarg; break;
+      case 'n': count = atoi(optarg); break;
+      case 'a': hex = optarg; break;
+      default: Usage(argv[0]); return 1;
+    }
+  }
+
+  apduLen = ParseHex(hex, apdu, MAX_APDU_SIZE);
+  if(apduLen < 4 || count < 1)
+  {
+    Usage(argv[0]);
+    return 1;
+  }
+  times = malloc(count * sizeof(double));
+  if(times == NULL)
+    return 1;
+
+  rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &context);
+  if(rv != SCARD_S_SUCCESS)
+  {
+    fprintf(stderr, "SCardEstablishContext: %s\n", pcsc_stringify_error(rv));
+    return 1;
+  }
+
+  if(reader == NULL)
+  {
+    rv = SCardListReaders(context, NULL, (LPSTR)&readers, &readersLen);
+    if(rv != SCARD_S_SUCCESS)
+    {
+      fprintf(stderr, "SCardListReaders: %s\n", pcsc_stringify_error(rv));
+      goto enderror;
+    }
+    reader = readers;
+  }
+
+  rv = SCardConnect(context, reader, SCARD_SHARE_EXCLUSIVE,
+      SCARD_PROTOCOL_T0, &card, &protocol);
+  if(rv != SCARD_S_SUCCESS)
+  {
+    fprintf(stderr, "SCardConnect(%s): %s\n", reader,
+        pcsc_stringify_error(rv));
+    goto enderror;
+  }
+
+  start = NowSeconds();
+  for(i = 0; i < count; i++)
+  {
+    times[i] = NowSeconds();
+    rxLen = sizeof(response);
+    rv = SCardTransmit(card, SCARD_PCI_T0, apdu, apduLen, NULL,
+        response, &rxLen);
+    if(rv != SCARD_S_SUCCESS)
+    {
+      fprintf(stderr, "SCardTransmit: %s\n", pcsc_stringify_error(rv));
+      SCardDisconnect(card, SCARD_UNPOWER_CARD);
+      goto enderror;
+    }
+    times[i] = (NowSeconds() - times[i]) * 1000;
+  }
+  total = NowSeconds() - start;
+  SCardDisconnect(card, SCARD_LEAVE_CARD);
+
+  qsort(times, count, sizeof(double), CompareDouble);
+  printf("reader: %s\n", reader);
+  printf("APDUs: %d in %.3f s, %.1f APDU/s\n", count, total, count / total);
+  printf("latency (ms): min %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+      times[0], times[count / 2], times[count * 9 / 10],
+      times[count * 99 / 100], times[count - 1]);
+
+  if(readers != NULL)
+    SCardFreeMemory(context, readers);
+  SCardReleaseContext(context);
+  free(times);
+  return 0;
+
+enderror:
+  if(readers != NULL)
+    SCardFreeMemory(context, readers);
+  SCardReleaseContext(context);
+  free(times);
+  return 1;
+}
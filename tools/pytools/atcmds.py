@@ -6,6 +6,8 @@ class AT_CMD:
     AT_CTERM = 'AT+CTERM\r\n'
     AT_CTUSB = 'AT+CTUSB\r\n'
     AT_CLET = 'AT+CLET\r\n'
+    AT_CLETP = 'AT+CLET=1\r\n'
+    AT_CLETC = 'AT+CLET=2\r\n'
     AT_CDPIN = 'AT+CDPIN\r\n'
     AT_CGEE = 'AT+CGEE\r\n'
     AT_CEEE = 'AT+CEEE\r\n'
@@ -15,4 +17,16 @@ class AT_CMD:
     AT_CTWAIT = 'AT+CTWAIT\r\n'
     AT_CUDATA = 'AT+UDATA\r\n'
     AT_CCEND = 'AT+CCEND\r\n'
+    AT_CLDRV = 'AT+CLDRV\r\n'
+    AT_CGLOG = 'AT+CGLOG\r\n'
+    AT_CLSINK = 'AT+CLSINK=%d\r\n'
+    AT_CUSTAT = 'AT+CUSTAT\r\n'
+    AT_CRELAYT = 'AT+CRELAY=T\r\n'
+    AT_CRELAYC = 'AT+CRELAY=C\r\n'
+    AT_CLPOL = 'AT+CLPOL=%d\r\n'
+    AT_CREADER = 'AT+CREADER\r\n'
+    AT_CSCRIPT = 'AT+CSCRIPT=%d,%s\r\n'
+    AT_CSCRUN = 'AT+CSCRUN\r\n'
+    AT_CPROF = 'AT+CPROF\r\n'
+    AT_CPROFR = 'AT+CPROF=0\r\n'
 
@@ -0,0 +1,638 @@
+# This file implements a dynamic EMV card emulator that answers the commands
+# forwarded by the SCD in the TerminalUSB application (AT+CTUSB).
+#
+# Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# - Redistributions of source code must retain the above copyright notice, this
+# list of conditions and the following disclaimer.
+#
+# - Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation
+# and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+import hashlib
+import hmac
+import json
+import os
+import struct
+import sys
+import time
+import argparse # you need Python v2.7 or later
+from binascii import b2a_hex, a2b_hex
+from atcmds import *
+from emv_commands import command_name
+from relay import make_frame, FrameReader, COUNTER_RES, FRAME_ATR, \
+    FRAME_CAPDU, FRAME_RAPDU, FRAME_RESET, FRAME_END, FRAME_POWER_ON, \
+    FRAME_POWER_OFF, FRAME_STATUS, STATUS_INSERTED, STATUS_POWERED
+
+PSE_NAME = '1PAY.SYS.DDF01'
+
+SW_OK = '\x90\x00'
+SW_FILE_NOT_FOUND = '\x6A\x82'
+SW_RECORD_NOT_FOUND = '\x6A\x83'
+SW_CONDITIONS = '\x69\x85'
+SW_PIN_BLOCKED = '\x69\x83'
+SW_WRONG_P1P2 = '\x6A\x86'
+SW_INS_NOT_SUPPORTED = '\x6D\x00'
+
+# Cryptogram types in P1 of GENERATE AC and in the CID
+AC_AAC = 0x00
+AC_TC = 0x40
+AC_ARQC = 0x80
+
+ac_names = {'aac': AC_AAC, 'tc': AC_TC, 'arqc': AC_ARQC}
+
+# Order of the cryptogram types, a card never returns a higher type
+# than the one requested by the terminal
+ac_rank = {AC_AAC: 0, AC_ARQC: 1, AC_TC: 2}
+
+
+def command_case(cla, ins):
+  """Returns the ISO 7816-4 case of a command, see GetCommandCase in emv.c"""
+  if cla == 0x00:
+    return {0xC0: 2, 0xB2: 2, 0xA4: 4, 0x82: 3, 0x84: 2, 0x88: 4,
+        0x20: 3}.get(ins, 0)
+  if cla in (0x8C, 0x84):
+    return {0x1E: 3, 0x18: 3, 0x16: 3, 0x24: 3}.get(ins, 0)
+  if cla == 0x80:
+    return {0xAE: 4, 0xCA: 2, 0xA8: 4}.get(ins, 0)
+  return 0
+
+
+def tlv(tag, value):
+  """Encodes a BER-TLV object, tag given in hex"""
+  length = len(value)
+  if length < 0x80:
+    encoded = chr(length)
+  elif length < 0x100:
+    encoded = '\x81' + chr(length)
+  else:
+    encoded = '\x82' + struct.pack('>H', length)
+  return a2b_hex(tag) + encoded + value
+
+
+def from_hex(value):
+  """Converts a hex string from the profile, which may contain spaces"""
+  return a2b_hex(value.replace(' ', ''))
+
+
+class CardApplication:
+  """
+  One EMV application of a card profile. The static responses are built
+  when the profile is loaded, and the state that changes during a
+  transaction (ATC, PIN tries) is kept here.
+  """
+
+  def __init__(self, desc, index):
+    self.index = index
+    self.aid = from_hex(desc['aid'])
+    self.label = str(desc.get('label', 'EMULATED'))
+    self.priority = int(desc.get('priority', index + 1))
+    self.pdol = from_hex(desc.get('pdol', ''))
+    self.aip = from_hex(desc.get('aip', '1800'))
+    self.afl = from_hex(desc.get('afl', ''))
+    self.atc = int(desc.get('atc', 1))
+    self.last_online_atc = int(desc.get('last_online_atc', 0))
+    self.pin = str(desc.get('pin', ''))
+    self.pin_tries_max = int(desc.get('pin_tries', 3))
+    self.pin_tries = self.pin_tries_max
+    self.ac_key = from_hex(desc.get('ac_key', '00' * 16))
+    self.iad = from_hex(desc.get('iad', '06010A03A00000'))
+    self.first_ac = ac_names[desc.get('first_ac', 'arqc').lower()]
+    self.second_ac = ac_names[desc.get('second_ac', 'tc').lower()]
+    self.ac_format = int(desc.get('ac_format', 1))
+
+    if 'fci' in desc:
+      self.fci = from_hex(desc['fci'])
+    else:
+      proprietary = tlv('50', self.label) + tlv('87', chr(self.priority))
+      if self.pdol:
+        proprietary += tlv('9F38', self.pdol)
+      self.fci = tlv('6F', tlv('84', self.aid) + tlv('A5', proprietary))
+
+    # records are given as "SFI:record" with either the hex of the full
+    # record or a dictionary of tags, which is put into a '70' template
+    self.records = {}
+    for key, value in desc.get('records', {}).items():
+      sfi, number = [int(x, 16) for x in key.split(':')]
+      if isinstance(value, dict):
+        body = ''.join(tlv(tag, from_hex(v)) for tag, v in sorted(value.items()))
+        record = tlv('70', body)
+      else:
+        record = from_hex(value)
+      self.records[(sfi, number)] = record
+
+    # static data objects for GET DATA, e.g. the Log Format (9F4F)
+    self.data = {}
+    for tag, value in desc.get('data', {}).items():
+      self.data[int(tag, 16)] = from_hex(value)
+
+    self.gpo = tlv('80', self.aip + self.afl)
+
+
+class CardProfile:
+  """
+  A card profile loaded from a JSON file, with the ATR (without TS, as
+  for clis.py --usercard), the applications and their behaviour rules.
+  See cardprofile.json for an example.
+  """
+
+  def __init__(self, filename):
+    fid = open(filename, 'r')
+    desc = json.load(fid)
+    fid.close()
+    self.atr = from_hex(desc['atr'])
+    self.pse = desc.get('pse', True)
+    self.apps = [CardApplication(app, i)
+        for i, app in enumerate(desc['applications'])]
+
+
+class CommandTiming:
+  """Time taken to compute the response to one command"""
+
+  def __init__(self, capdu, kind, seconds):
+    self.capdu = capdu
+    self.kind = kind          # 'static', 'dynamic' or 'error'
+    self.seconds = seconds
+
+
+class CardEmulator:
+  """
+  Computes the responses of an emulated card. The responses that do not
+  change (SELECT, READ RECORD, static GET DATA) are computed when the
+  profile is loaded and found with a dictionary lookup. The responses
+  that change (GET PROCESSING OPTIONS, GENERATE AC, VERIFY, GET DATA for
+  the ATC and PIN Try Counter) are computed by handlers with a fixed
+  amount of work per command.
+
+  The responses are returned as the bytes sent to the terminal for the
+  protocol T=0, i.e. including the procedure byte or the 61 XX and 6C XX
+  status words, as expected by TerminalUSB.
+  """
+
+  def __init__(self, profile):
+    self.profile = profile
+    self.static = {}
+    self.dynamic = {
+        (0x80, 0xA8): self.get_processing_options,
+        (0x80, 0xAE): self.generate_ac,
+        (0x80, 0xCA): self.get_data,
+        (0x00, 0x20): self.verify,
+        (0x00, 0x84): self.get_challenge,
+        }
+    self.timings = []
+    self.build_static()
+    self.reset()
+
+  def build_static(self):
+    """Precomputes the static responses, keyed by selection and command"""
+    apps = self.profile.apps
+    if self.profile.pse and apps:
+      fci = tlv('6F', tlv('84', PSE_NAME) +
+          tlv('A5', tlv('88', '\x01') + tlv('5F2D', 'en')))
+      self.add_select(PSE_NAME, fci, 'pse')
+      entries = ''.join(tlv('61', tlv('4F', app.aid) +
+          tlv('50', app.label) + tlv('87', chr(app.priority)))
+          for app in apps)
+      self.add_read_record('pse', 1, 1, tlv('70', entries))
+
+    for app in apps:
+      self.add_select(app.aid, app.fci, app.index)
+      for (sfi, number), record in app.records.items():
+        self.add_read_record(app.index, sfi, number, record)
+      for tag, value in app.data.items():
+        key = (app.index, 0x80, 0xCA, tag >> 8, tag & 0xFF, '')
+        self.static[key] = (tlv('%04X' % tag, value), SW_OK, None)
+
+  def add_select(self, name, fci, selection):
+    # SELECT does not depend on the current selection
+    key = (None, 0x00, 0xA4, 0x04, 0x00, name)
+    self.static[key] = (fci, SW_OK, selection)
+
+  def add_read_record(self, selection, sfi, number, record):
+    key = (selection, 0x00, 0xB2, number, (sfi << 3) | 4, '')
+    self.static[key] = (record, SW_OK, None)
+
+  def reset(self):
+    """Resets the state of the card session, e.g. after a warm reset"""
+    self.selected = None
+    self.pending = None
+    self.ac_count = 0
+    self.verified = False
+
+  def app(self):
+    if isinstance(self.selected, int):
+      return self.profile.apps[self.selected]
+    return None
+
+  def process(self, capdu):
+    """
+    Returns the T=0 bytes to be sent to the terminal for a command.
+
+    Args:
+      capdu: the command header (5 bytes) followed by the command data
+    """
+    start = time.time()
+    cla, ins, p1, p2, p3 = [ord(c) for c in capdu[:5]]
+    data = capdu[5:]
+    kind = 'static'
+
+    if cla == 0x00 and ins == 0xC0:
+      reply = self.get_response(p3)
+    else:
+      self.pending = None
+      if ins == 0xA4:
+        key = (None, cla, ins, p1, p2, data)
+      else:
+        key = (self.selected, cla, ins, p1, p2, data)
+      entry = self.static.get(key)
+      if entry is not None:
+        rdata, sw, selection = entry
+        if selection is not None:
+          self.selected = selection
+          self.ac_count = 0
+      elif (cla, ins) in self.dynamic:
+        kind = 'dynamic'
+        rdata, sw = self.dynamic[(cla, ins)](p1, p2, data)
+      else:
+        kind = 'error'
+        rdata = ''
+        if ins == 0xA4:
+          sw = SW_FILE_NOT_FOUND
+        elif ins == 0xB2:
+          sw = SW_RECORD_NOT_FOUND
+        else:
+          sw = SW_INS_NOT_SUPPORTED
+      reply = self.encode_t0(cla, ins, p3, len(data), rdata, sw)
+
+    self.timings.append(CommandTiming(capdu, kind, time.time() - start))
+    return reply
+
+  def encode_t0(self, cla, ins, p3, lc, rdata, sw):
+    """Encodes a response for T=0, see ReceiveT0Command in emv.c"""
+    case = command_case(cla, ins)
+    if case == 0:
+      case = 4 if lc else 2
+    if not rdata or sw != SW_OK:
+      return sw
+    if case in (3, 4):
+      # the data is returned with GET RESPONSE
+      self.pending = rdata
+      return '\x61' + chr(len(rdata) & 0xFF)
+    if p3 != (len(rdata) & 0xFF):
+      return '\x6C' + chr(len(rdata) & 0xFF)
+    return chr(ins) + rdata + sw
+
+  def get_response(self, p3):
+    if self.pending is None:
+      return SW_CONDITIONS
+    if p3 != (len(self.pending) & 0xFF):
+      return '\x6C' + chr(len(self.pending) & 0xFF)
+    reply = '\xC0' + self.pending + SW_OK
+    self.pending = None
+    return reply
+
+  # Dynamic responses, each handler returns (data, status)
+
+  def get_processing_options(self, p1, p2, data):
+    app = self.app()
+    if app is None:
+      return '', SW_CONDITIONS
+    app.atc = (app.atc + 1) & 0xFFFF
+    self.ac_count = 0
+    return app.gpo, SW_OK
+
+  def get_data(self, p1, p2, data):
+    app = self.app()
+    if app is None:
+      return '', SW_CONDITIONS
+    tag = (p1 << 8) | p2
+    if tag == 0x9F36:
+      return tlv('9F36', struct.pack('>H', app.atc)), SW_OK
+    if tag == 0x9F13:
+      return tlv('9F13', struct.pack('>H', app.last_online_atc)), SW_OK
+    if tag == 0x9F17:
+      return tlv('9F17', chr(app.pin_tries)), SW_OK
+    return '', '\x6A\x88'
+
+  def verify(self, p1, p2, data):
+    app = self.app()
+    if app is None or not app.pin:
+      return '', SW_CONDITIONS
+    if p2 != 0x80 or len(data) != 8:
+      # only the plaintext PIN is supported
+      return '', SW_WRONG_P1P2
+    if app.pin_tries == 0:
+      return '', SW_PIN_BLOCKED
+    digits = b2a_hex(data[1:])[:ord(data[0]) & 0x0F]
+    if digits == app.pin:
+      app.pin_tries = app.pin_tries_max
+      self.verified = True
+      return '', SW_OK
+    app.pin_tries -= 1
+    return '', '\x63' + chr(0xC0 | app.pin_tries)
+
+  def get_challenge(self, p1, p2, data):
+    return os.urandom(8), SW_OK
+
+  def generate_ac(self, p1, p2, data):
+    """
+    Returns a cryptogram computed with HMAC-SHA1 over the ATC and the CDOL
+    data, using the test key of the profile. This is not the issuer
+    algorithm, so the cryptograms can only be checked by a test host
+    that uses the same method.
+    """
+    app = self.app()
+    if app is None or self.ac_count >= 2:
+      return '', SW_CONDITIONS
+
+    requested = p1 & 0xC0
+    if requested not in ac_rank:
+      return '', '\x6A\x86'
+    rule = app.first_ac if self.ac_count == 0 else app.second_ac
+    if ac_rank[rule] < ac_rank[requested]:
+      cid = rule
+    else:
+      cid = requested
+    self.ac_count += 1
+    if cid != AC_ARQC:
+      # no second GENERATE AC after a TC or AAC
+      self.ac_count = 2
+
+    atc = struct.pack('>H', app.atc)
+    ac = hmac.new(app.ac_key, atc + data, hashlib.sha1).digest()[:8]
+    if app.ac_format == 2:
+      body = (tlv('9F27', chr(cid)) + tlv('9F36', atc) +
+          tlv('9F26', ac) + tlv('9F10', app.iad))
+      return tlv('77', body), SW_OK
+    return tlv('80', chr(cid) + atc + ac + app.iad), SW_OK
+
+  def report(self, timing = None):
+    """Prints the time of one command, or a summary of all of them."""
+    if timing is not None:
+      header = b2a_hex(timing.capdu[:4]).upper()
+      print '  %s %-26s %-7s %8.1f us' % (header,
+          command_name(b2a_hex(timing.capdu[:2])), timing.kind,
+          timing.seconds * 1e6)
+      return
+    if not self.timings:
+      return
+    print 'Commands: %d' % len(self.timings)
+    for kind in ('static', 'dynamic', 'error'):
+      times = [t.seconds * 1e6 for t in self.timings if t.kind == kind]
+      if times:
+        print '  %-7s %3d commands, average %8.1f us, max %8.1f us' % (
+            kind, len(times), sum(times) / len(times), max(times))
+
+
+def serial_emulate(port, emulator, verbose = True):
+  """
+  Emulates a card for the terminal connected to the SCD, using the
+  TerminalUSB application (see serial_card in clis.py).
+
+  Args:
+    port: the serial port of the SCD
+    emulator: the CardEmulator that computes the responses
+    verbose: if True print the time of each command
+
+  Returns: True if ended correctly, False otherwise
+  """
+  import serial
+
+  atr_line = 'AT+UDATA=' + b2a_hex(emulator.profile.atr).upper() + '\r\n'
+  ser = serial.Serial(port)
+  ser.write(AT_CMD.AT_CTUSB)
+  ser.flush()
+  line = ser.readline()
+  if line.find('AT OK') < 0:
+    print 'Error initialising card'
+    ser.close()
+    return False
+  ser.write(atr_line)
+  ser.flush()
+
+  result = True
+  try:
+    while True:
+      line = ser.readline().strip()
+      if not line:
+        continue
+      if line.find('AT TRESET') >= 0:
+        # the terminal reset the card, it expects a new ATR
+        emulator.reset()
+        ser.write(atr_line)
+        ser.flush()
+        if verbose:
+          print 'Terminal reset'
+        continue
+      if line.find('AT OK') >= 0:
+        break
+      if line.find('AT BAD') >= 0:
+        result = False
+        break
+      reply = emulator.process(a2b_hex(line))
+      ser.write('AT+UDATA=' + b2a_hex(reply).upper() + '\r\n')
+      ser.flush()
+      if verbose:
+        emulator.report(emulator.timings[-1])
+  except KeyboardInterrupt:
+    ser.write(AT_CMD.AT_CCEND)
+    ser.flush()
+    result = False
+
+  ser.close()
+  return result
+
+
+def offline_emulate(fid, emulator):
+  """
+  Sends to the emulator the commands from a file (as terminal.txt, one
+  command per line ending with '0000000000') and prints the responses.
+  The GET RESPONSE and wrong length cases are handled as a terminal would.
+  """
+  for line in fid:
+    line = line.strip()
+    if not line:
+      continue
+    if line.find('0000000000') == 0:
+      break
+    capdu = a2b_hex(line)
+    while capdu:
+      reply = emulator.process(capdu)
+      print '%s -> %s' % (b2a_hex(capdu).upper(), b2a_hex(reply).upper())
+      emulator.report(emulator.timings[-1])
+      sw1 = ord(reply[-2])
+      if len(reply) == 2 and sw1 == 0x61:
+        capdu = '\x00\xC0\x00\x00' + reply[1]
+      elif len(reply) == 2 and sw1 == 0x6C:
+        capdu = capdu[:4] + reply[1]
+      else:
+        capdu = None
+
+
+def reader_exchange(emulator, capdu):
+  """
+  Sends a command to the emulator as the SCD does in reader mode (see
+  TerminalSendT0Command), handling the GET RESPONSE and wrong length cases.
+
+  Returns: the response data followed by SW1 SW2
+  """
+  while True:
+    reply = emulator.process(capdu)
+    if len(reply) == 2 and reply[0] == '\x61':
+      capdu = '\x00\xC0\x00\x00' + reply[1]
+    elif len(reply) == 2 and reply[0] == '\x6C':
+      capdu = capdu[:4] + reply[1]
+    else:
+      # remove the procedure byte
+      return reply[1:] if len(reply) > 2 else reply
+
+
+def reader_emulate(emulator, delay_ms, verbose = True):
+  """
+  Emulates an SCD in reader mode (AT+CREADER, see ReaderUSB in
+  avrsrc/serial.c) holding the emulated card, on a pseudo terminal whose
+  name is printed. This is used to test and benchmark the PC/SC driver in
+  tools/ifdscd without hardware. Runs until interrupted.
+
+  Args:
+    emulator: the CardEmulator that computes the responses
+    delay_ms: time taken by the card for each command, in ms
+    verbose: if True print the time of each command
+  """
+  import tty
+  master, slave = os.openpty()
+  # raw mode, so the frames are not changed by the line discipline
+  tty.setraw(slave)
+  print os.ttyname(slave)
+  sys.stdout.flush()
+
+  epoch = time.time()
+  def send(ftype, payload = ''):
+    counter = int((time.time() - epoch) / COUNTER_RES)
+    os.write(master, make_frame(ftype, payload, counter))
+
+  line = ''
+  frames = None
+  powered = False
+  atr = emulator.profile.atr
+  try:
+    while True:
+      data = os.read(master, 4096)
+      if frames is None:
+        # AT command mode, until AT+CREADER
+        line += data
+        if line.find('\n') < 0 and line.find('\r') < 0:
+          continue
+        if line.find(AT_CMD.AT_CREADER.strip()) >= 0:
+          os.write(master, 'AT OK\r\n')
+          frames = FrameReader()
+        elif line.strip():
+          os.write(master, 'AT BAD\r\n')
+        line = ''
+        continue
+
+      for ftype, dev_time, payload in frames.feed(data):
+        if ftype == FRAME_END:
+          powered = False
+          send(FRAME_END, '\x00')
+          os.write(master, 'AT OK\r\n')
+          frames = None
+          break
+        elif ftype in (FRAME_POWER_ON, FRAME_RESET):
+          emulator.reset()
+          powered = True
+          send(FRAME_ATR, '\x00\x00\x00' + atr)
+        elif ftype == FRAME_POWER_OFF:
+          powered = False
+          send(FRAME_STATUS, chr(0) + chr(STATUS_INSERTED))
+        elif ftype == FRAME_CAPDU and powered:
+          start = time.time()
+          rapdu = reader_exchange(emulator, payload)
+          time.sleep(max(delay_ms / 1000.0 - (time.time() - start), 0))
+          icc_time = int((time.time() - start) / COUNTER_RES)
+          send(FRAME_RAPDU,
+              struct.pack('<H', icc_time) + rapdu[-2:] + rapdu[:-2])
+          if verbose:
+            emulator.report(emulator.timings[-1])
+        else:
+          # RELAY_FRAME_STATUS, or a command without power (error 0x10)
+          error = 0x10 if ftype == FRAME_CAPDU else 0
+          flags = STATUS_INSERTED | (STATUS_POWERED if powered else 0)
+          send(FRAME_STATUS, chr(error) + chr(flags))
+  except KeyboardInterrupt:
+    pass
+  return True
+
+
+def main():
+  """Dynamic EMV card emulator for the SCD"""
+  parser = argparse.ArgumentParser(description = 'Emulates an EMV card '\
+      'described by a card profile, answering the terminal connected to the '\
+      'SCD (TerminalUSB application)')
+  parser.add_argument(
+      'profile',
+      help = 'card profile (JSON), see cardprofile.json')
+  parser.add_argument(
+      'port',
+      nargs = '?',
+      help = 'serial port of the SCD')
+  parser.add_argument(
+      '--commands',
+      type = argparse.FileType('r'),
+      help = 'do not use the SCD, send the commands from the given file\
+          (as terminal.txt) to the emulator and show the responses')
+  parser.add_argument(
+      '--reader',
+      action = 'store_true',
+      help = 'do not use the SCD, emulate an SCD in reader mode\
+          (AT+CREADER) with this card on a pseudo terminal, e.g. for the\
+          PC/SC driver in tools/ifdscd')
+  parser.add_argument(
+      '--delay',
+      type = float,
+      default = 0,
+      help = 'with --reader, time taken by the card for each command in ms\
+          (default 0)')
+  parser.add_argument(
+      '--quiet',
+      action = 'store_true',
+      help = 'only print the summary of the response times')
+  args = parser.parse_args()
+
+  start = time.time()
+  emulator = CardEmulator(CardProfile(args.profile))
+  print 'Profile loaded in %.1f ms, %d static responses' % (
+      (time.time() - start) * 1000, len(emulator.static))
+
+  if args.commands:
+    offline_emulate(args.commands, emulator)
+    result = True
+  elif args.reader:
+    result = reader_emulate(emulator, args.delay, not args.quiet)
+  elif args.port:
+    result = serial_emulate(args.port, emulator, not args.quiet)
+  else:
+    parser.print_help()
+    return 1
+
+  emulator.report()
+  return 0 if result else 1
+
+if __name__ == '__main__':
+  sys.exit(main())
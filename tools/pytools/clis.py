@@ -60,18 +60,20 @@ def serial_command(port, command, wait = False):
     return True;
 
 
-def serial_geteepromhex(port, filename):
+def serial_geteepromhex(port, filename, command = AT_CMD.AT_CGEE):
   """
   Requests the SCD to send the EEPROM contents in Intel Hex format via the serial port
 
   Args:
     port: the virtual port to communicate with the SCD
     filename: path of the file to store the EEPROM contents
+    command: the AT command used to request the data. Use AT_CMD.AT_CGLOG
+      to get only the log from the selected log storage
   """
 
   fid = open(filename, 'w')
   ser = serial.Serial(port)
-  ser.write(AT_CMD.AT_CGEE)
+  ser.write(command)
   ser.flush()
 
   while True:
@@ -85,6 +87,94 @@ def serial_geteepromhex(port, filename):
   fid.close()
   ser.close()
 
+def serial_usartstat(port):
+  """
+  Requests the USART statistics from the SCD and prints the sustained
+  throughput and the number of overruns, frame errors and dropped bytes
+  since the USART was initialised.
+
+  Args:
+    port: the serial port to communicate with the SCD
+
+  Returns:
+    True if success, False if error.
+  """
+
+  ser = serial.Serial(port)
+  ser.write(AT_CMD.AT_CUSTAT)
+  ser.flush()
+  line = ser.readline()
+  ser.close()
+
+  if line.find('AT+CUSTAT=') != 0:
+    return False
+  values = [int(x) for x in line[len('AT+CUSTAT='):].strip().split(',')]
+  rx, tx, overruns, frame_errors, dropped, units = values
+  seconds = units * 1.088 / 1000
+  print "Time:          %.3f s" % seconds
+  print "Received:      %d bytes" % rx
+  print "Transmitted:   %d bytes" % tx
+  if seconds > 0:
+    print "RX throughput: %.1f bytes/s" % (rx / seconds)
+    print "TX throughput: %.1f bytes/s" % (tx / seconds)
+  print "Overruns:      %d" % overruns
+  print "Frame errors:  %d" % frame_errors
+  print "Dropped:       %d" % dropped
+
+  return True
+
+# Functions profiled by the SCD, in the order of PROFILE_ID (scd_profile.h)
+PROFILE_NAMES = ['ReceiveT0Command', 'SendT0Response', 'LogByte1',
+    'ParseManyTLV', 'SendLCDCommand', 'GetHostData', 'SaveLog']
+
+def serial_profile(port, reset = False):
+  """
+  Requests the profile counters from the SCD (built with PROFILE=1) and
+  prints, for each profiled function, the number of calls, the total, mean
+  and maximum time and the share of the time since the counters were
+  cleared. The time of a function includes the profiled functions it calls.
+
+  Args:
+    port: the serial port to communicate with the SCD
+    reset: clear the counters after reading them
+
+  Returns:
+    True if success, False if error.
+  """
+
+  ser = serial.Serial(port)
+  ser.write(AT_CMD.AT_CPROF)
+  ser.flush()
+  line = ser.readline()
+  if reset and line.find('AT+CPROF=') == 0:
+    ser.write(AT_CMD.AT_CPROFR)
+    ser.flush()
+    ser.readline()
+  ser.close()
+
+  if line.find('AT+CPROF=') != 0:
+    return False
+  values = [int(x) for x in line[len('AT+CPROF='):].strip().split(',')]
+  cycles, elapsed = values[:2]
+  # microseconds in each time unit (F_CPU = 16 MHz)
+  unit = cycles / 16.0
+  print "Time: %.3f s (resolution %d cycles, %.0f us)" % (
+      elapsed * unit / 1e6, cycles, unit)
+  print "%-18s %10s %12s %10s %10s %6s" % (
+      "Function", "Calls", "Total (ms)", "Mean (us)", "Max (us)", "Time")
+  for k in range(len(values[2:]) / 3):
+    calls, total, maximum = values[2 + 3 * k:5 + 3 * k]
+    if k < len(PROFILE_NAMES):
+      name = PROFILE_NAMES[k]
+    else:
+      name = "Function %d" % k
+    mean = (total * unit / calls) if calls > 0 else 0
+    share = (100.0 * total / elapsed) if elapsed > 0 else 0
+    print "%-18s %10d %12.3f %10.1f %10.1f %5.1f%%" % (
+        name, calls, total * unit / 1000, mean, maximum * unit, share)
+
+  return True
+
 def serial_terminal(port, fid = sys.stdin):
   """
   Requests the SCD to act as an interactive terminal. A card must be inserted into the SCD.
@@ -207,6 +297,18 @@ def main():
       '--logt',
       action = 'store_true',
       help= 'log a card-reader transaction.')
+  parser.add_argument(
+      '--logtprefetch',
+      action = 'store_true',
+      help= 'log a card-reader transaction, reading the records given by\
+          the AFL in advance so that READ RECORD commands are answered\
+          without waiting for the card.')
+  parser.add_argument(
+      '--logtcache',
+      action = 'store_true',
+      help= 'log a card-reader transaction, answering the commands repeated\
+          by the reader (e.g. after a warm reset) from a session cache.\
+          The card does not see the repeated commands.')
   parser.add_argument(
       '--dummypin',
       action = 'store_true',
@@ -247,6 +349,47 @@ def main():
       default = False,
       metavar = 'filename',
       help='retrieve the EEPROM contents as an Intel Hex file and save to specified file')
+  parser.add_argument(
+      '--getloghex',
+      nargs = 1,
+      default = False,
+      metavar = 'filename',
+      help='retrieve the log from the selected log storage (EEPROM, DataFlash,\
+          FRAM or flash) as an Intel Hex file and save to specified file. Use\
+          "scdtrace.py --log" to parse it')
+  parser.add_argument(
+      '--logsink',
+      nargs = 1,
+      type = int,
+      default = False,
+      metavar = 'sink',
+      help='select the log storage: 0 for EEPROM, 1 for SPI DataFlash,\
+          2 for I2C FRAM or 3 for the internal flash (the backend must be\
+          enabled in the firmware build)')
+  parser.add_argument(
+      '--logpolicy',
+      nargs = 1,
+      type = int,
+      default = False,
+      metavar = 'policy',
+      help='select what is logged: 0 for everything, 1 for headers, status\
+          words and events plus the data of GPO, GENERATE AC and VERIFY,\
+          2 for headers, status words and events, 3 for events only,\
+          4 for transaction summaries only (see scdtrace.py --summary)')
+  parser.add_argument(
+      '--usartstat',
+      action = 'store_true',
+      help='show the throughput and overrun counts of the SCD USART\
+          (serial interface application)')
+  parser.add_argument(
+      '--profile',
+      nargs = '?',
+      const = 'show',
+      choices = ['show', 'reset'],
+      default = False,
+      help='show the calls and time spent in the profiled functions of the\
+          SCD (the firmware must be built with PROFILE=1). Use\
+          "--profile reset" to clear the counters after showing them')
   parser.add_argument(
       '--eraseeeprom',
       action = 'store_true',
@@ -258,6 +401,11 @@ def main():
       metavar = 'filename',
       help='visualise the EEPROM traces from SCD, storing the contents in\
           the specified file')
+  parser.add_argument(
+      '--logdrive',
+      action = 'store_true',
+      help='export the logs as a read-only USB drive (the SCD\
+          re-enumerates as a mass storage device until it is reset)')
   parser.add_argument(
       '--bootloader',
       action = 'store_true',
@@ -323,6 +471,26 @@ def main():
         print "Some error ocurred during communication, check log"
     except:
       print "Error sending command"
+  elif args.logtprefetch == True:
+    try:
+      print "Preparing to log transaction with prefetch, follow SCD screen..."
+      result = serial_command(args.port, AT_CMD.AT_CLETP, True)
+      if result == True:
+        print "All done"
+      else:
+        print "Some error ocurred during communication, check log"
+    except:
+      print "Error sending command"
+  elif args.logtcache == True:
+    try:
+      print "Preparing to log transaction with cache, follow SCD screen..."
+      result = serial_command(args.port, AT_CMD.AT_CLETC, True)
+      if result == True:
+        print "All done"
+      else:
+        print "Some error ocurred during communication, check log"
+    except:
+      print "Error sending command"
   elif args.dummypin == True:
     try:
       print "Preparing to log transaction with dummy PIN, follow SCD screen..."
@@ -341,6 +509,46 @@ def main():
     except:
       print "Error occurred"
       raise
+  elif args.getloghex != False:
+    try:
+      print "Retrieving log contents..."
+      serial_geteepromhex(args.port, args.getloghex[0], AT_CMD.AT_CGLOG)
+      print "Done"
+    except:
+      print "Error occurred"
+      raise
+  elif args.logsink != False:
+    try:
+      print "Selecting log storage..."
+      result = serial_command(args.port, AT_CMD.AT_CLSINK % args.logsink[0], True)
+      if result == True:
+        print "Done"
+      else:
+        print "Log storage not available in this firmware"
+    except:
+      print "Error sending command"
+  elif args.logpolicy != False:
+    try:
+      print "Selecting log policy..."
+      result = serial_command(args.port, AT_CMD.AT_CLPOL % args.logpolicy[0], True)
+      if result == True:
+        print "Done"
+      else:
+        print "Unknown log policy"
+    except:
+      print "Error sending command"
+  elif args.usartstat == True:
+    try:
+      if serial_usartstat(args.port) == False:
+        print "Unexpected response from the SCD"
+    except:
+      print "Error sending command"
+  elif args.profile != False:
+    try:
+      if serial_profile(args.port, args.profile == 'reset') == False:
+        print "Profiler not available in this firmware"
+    except:
+      print "Error sending command"
   elif args.eraseeeprom == True:
     try:
       print "Erasing EEPROM contents..."
@@ -356,6 +564,13 @@ def main():
     except:
       print "Error occurred"
       raise
+  elif args.logdrive == True:
+    try:
+      print "Switching to USB log drive..."
+      serial_command(args.port, AT_CMD.AT_CLDRV, True)
+      print "Done, mount the SCD Logs drive to copy the logs"
+    except:
+      print "Error sending command"
   elif args.bootloader == True:
     try:
       serial_command(args.port, AT_CMD.AT_CGBM)
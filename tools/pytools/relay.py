@@ -0,0 +1,475 @@
+# This file implements a relay bridge between two SCDs connected to the same
+# host: one SCD acts as a card for the terminal (AT+CRELAY=T) and the other
+# acts as a terminal for the card (AT+CRELAY=C).
+#
+# Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# - Redistributions of source code must retain the above copyright notice, this
+# list of conditions and the following disclaimer.
+#
+# - Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation
+# and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+import os
+import random
+import select
+import struct
+import sys
+import time
+import argparse # you need Python v2.7 or later
+from binascii import b2a_hex, a2b_hex
+from atcmds import *
+
+# Relay frames, see RELAY_FRAME in avrsrc/serial.h
+FRAME_SYNC = 0xA5
+FRAME_HEADER = '<BBHI'
+FRAME_HEADER_SIZE = 8
+FRAME_MAX_PAYLOAD = 264
+
+FRAME_ATR = 0x01
+FRAME_CAPDU = 0x02
+FRAME_RAPDU = 0x03
+FRAME_RESET = 0x04
+FRAME_SENT = 0x05
+FRAME_END = 0x06
+# reader mode only (see ReaderUSB in avrsrc/serial.c)
+FRAME_POWER_ON = 0x07
+FRAME_POWER_OFF = 0x08
+FRAME_STATUS = 0x09
+
+# Flags of the FRAME_STATUS reply
+STATUS_INSERTED = 0x01
+STATUS_POWERED = 0x02
+
+frame_names = {
+    FRAME_ATR: 'ATR',
+    FRAME_CAPDU: 'CAPDU',
+    FRAME_RAPDU: 'RAPDU',
+    FRAME_RESET: 'RESET',
+    FRAME_SENT: 'SENT',
+    FRAME_END: 'END',
+    FRAME_POWER_ON: 'POWER ON',
+    FRAME_POWER_OFF: 'POWER OFF',
+    FRAME_STATUS: 'STATUS',
+    }
+
+# Resolution of the SCD counter (see GetCounter) in seconds, 1.024e-3 for
+# firmware built with PROFILE=1 (see StartTimerT2)
+COUNTER_RES = 1.088e-3
+
+
+def make_frame(ftype, payload = '', dev_time = 0):
+  """
+  Returns the bytes of a relay frame.
+
+  Args:
+    ftype: the frame type (FRAME_*)
+    payload: the frame payload as a string of bytes
+    dev_time: the device time in counter units (only used by devices)
+  """
+  return struct.pack(FRAME_HEADER, FRAME_SYNC, ftype, len(payload),
+      dev_time & 0xFFFFFFFF) + payload
+
+
+class FrameReader:
+  """Assembles the relay frames from the bytes received from one SCD"""
+
+  def __init__(self):
+    self.buf = ''
+
+  def feed(self, data):
+    """
+    Adds received bytes and returns the list of complete frames as
+    (type, device time, payload) tuples.
+    """
+    frames = []
+    self.buf += data
+    while True:
+      start = self.buf.find(chr(FRAME_SYNC))
+      if start < 0:
+        self.buf = ''
+        break
+      self.buf = self.buf[start:]
+      if len(self.buf) < FRAME_HEADER_SIZE:
+        break
+      sync, ftype, length, dev_time = struct.unpack(
+          FRAME_HEADER, self.buf[:FRAME_HEADER_SIZE])
+      if length > FRAME_MAX_PAYLOAD:
+        self.buf = self.buf[1:]
+        continue
+      if len(self.buf) < FRAME_HEADER_SIZE + length:
+        break
+      payload = self.buf[FRAME_HEADER_SIZE:FRAME_HEADER_SIZE + length]
+      self.buf = self.buf[FRAME_HEADER_SIZE + length:]
+      frames.append((ftype, dev_time, payload))
+    return frames
+
+
+class RelayCommand:
+  """Timing of one command relayed between terminal and card"""
+
+  def __init__(self, index, capdu, t_dev, host_rx):
+    self.index = index
+    self.capdu = capdu
+    self.rapdu = None
+    self.t_cmd = t_dev        # terminal side: command received
+    self.t_sent = None        # terminal side: response sent
+    self.icc_time = None      # card side: time taken by the card
+    self.null_bytes = 0
+    self.host_cmd = host_rx   # host: command frame received
+    self.host_rsp = None      # host: response frame received
+
+  def total_ms(self):
+    """Time seen by the terminal, from command to response (ms)"""
+    return (self.t_sent - self.t_cmd) * COUNTER_RES * 1000
+
+  def icc_ms(self):
+    """Time taken by the card (ms)"""
+    return self.icc_time * COUNTER_RES * 1000
+
+  def relay_ms(self):
+    """Time added by the relay (ms)"""
+    return self.total_ms() - self.icc_ms()
+
+
+class RelayBridge:
+  """
+  Bridges the relay frames between the terminal side SCD and the card side
+  SCD. The commands and responses are forwarded as soon as they are
+  received. The device timestamps are merged into one timeline, using the
+  host receive times to estimate the offset of each device clock.
+  """
+
+  def __init__(self, term_port, icc_port, verbose = True):
+    import serial
+    self.term = serial.Serial(term_port, timeout = 10)
+    self.icc = serial.Serial(icc_port, timeout = 10)
+    self.verbose = verbose
+    self.events = []          # (side, device time, host time, text)
+    self.commands = []
+    self.pending = None
+
+  def start_device(self, ser, command, name):
+    """Sends an AT command and waits for AT OK, then frames follow."""
+    ser.write(command)
+    ser.flush()
+    line = ser.readline()
+    if line.find('AT OK') < 0:
+      raise IOError('%s side did not start: %s' % (name, line.strip()))
+
+  def log_event(self, side, dev_time, host_time, text):
+    self.events.append((side, dev_time, host_time, text))
+    if self.verbose:
+      print '%-8s %10.3f ms  %s' % (side, dev_time * COUNTER_RES * 1000, text)
+
+  def run(self):
+    """
+    Runs the relay until one of the SCDs or the user ends it.
+
+    Returns: True if ended correctly, False otherwise
+    """
+    self.start_device(self.icc, AT_CMD.AT_CRELAYC, 'Card')
+    print 'Card side ready, waiting for terminal...'
+    self.start_device(self.term, AT_CMD.AT_CRELAYT, 'Terminal')
+
+    readers = {self.term.fileno(): (self.term, FrameReader(), 'terminal'),
+               self.icc.fileno(): (self.icc, FrameReader(), 'card')}
+    result = True
+    running = True
+    try:
+      while running:
+        ready, _, _ = select.select(readers.keys(), [], [])
+        for fd in ready:
+          ser, reader, side = readers[fd]
+          try:
+            data = os.read(fd, 4096)
+          except OSError:
+            data = ''
+          host_time = time.time()
+          if not data:
+            running = False
+            result = False
+            break
+          for frame in reader.feed(data):
+            if not self.handle_frame(side, frame, host_time):
+              running = False
+    except KeyboardInterrupt:
+      self.term.write(make_frame(FRAME_END, '\x00'))
+      self.icc.write(make_frame(FRAME_END, '\x00'))
+      result = False
+
+    self.term.close()
+    self.icc.close()
+    return result
+
+  def handle_frame(self, side, frame, host_time):
+    """
+    Forwards or records a frame received from one SCD.
+
+    Returns: False when the relay has ended, True otherwise
+    """
+    ftype, dev_time, payload = frame
+    name = frame_names.get(ftype, 'UNKNOWN')
+
+    if side == 'terminal' and ftype == FRAME_CAPDU:
+      # forward first, then do the bookkeeping
+      self.icc.write(make_frame(FRAME_CAPDU, payload))
+      self.icc.flush()
+      self.pending = RelayCommand(len(self.commands), payload,
+          dev_time, host_time)
+      self.log_event(side, dev_time, host_time, 'C-APDU ' + b2a_hex(payload))
+    elif side == 'card' and ftype == FRAME_RAPDU:
+      self.term.write(make_frame(FRAME_RAPDU, payload))
+      self.term.flush()
+      if self.pending:
+        self.pending.icc_time = struct.unpack('<H', payload[:2])[0]
+        self.pending.rapdu = payload[2:]
+        self.pending.host_rsp = host_time
+      self.log_event(side, dev_time, host_time,
+          'R-APDU ' + b2a_hex(payload[2:]))
+    elif side == 'terminal' and ftype == FRAME_SENT:
+      null_bytes = ord(payload[0]) if payload else 0
+      self.log_event(side, dev_time, host_time,
+          'response sent, %d NULL bytes' % null_bytes)
+      cmd = self.pending
+      self.pending = None
+      if cmd and cmd.icc_time is not None:
+        cmd.t_sent = dev_time
+        cmd.null_bytes = null_bytes
+        self.commands.append(cmd)
+        self.report_command(cmd)
+    elif side == 'terminal' and ftype == FRAME_RESET:
+      self.icc.write(make_frame(FRAME_RESET))
+      self.icc.flush()
+      self.log_event(side, dev_time, host_time, 'terminal reset')
+    elif ftype == FRAME_ATR:
+      self.log_event(side, dev_time, host_time,
+          'card reset, convention %d, protocol T=%d, TC1 %d' %
+          tuple(ord(c) for c in payload[:3]))
+    elif ftype == FRAME_END:
+      error = ord(payload[0]) if payload else 0
+      self.log_event(side, dev_time, host_time, 'end, result %02X' % error)
+      other = self.icc if side == 'terminal' else self.term
+      other.write(make_frame(FRAME_END, '\x00'))
+      other.flush()
+      return False
+    else:
+      self.log_event(side, dev_time, host_time, 'ignored frame ' + name)
+
+    return True
+
+  def report_command(self, cmd):
+    """Prints the latency added by the relay for a command."""
+    host_ms = (cmd.host_rsp - cmd.host_cmd) * 1000 - cmd.icc_ms()
+    print '  #%d %s: terminal %.1f ms, card %.1f ms, relay %.1f ms' \
+        ' (host path %.1f ms)' % (cmd.index, b2a_hex(cmd.capdu[:2]),
+        cmd.total_ms(), cmd.icc_ms(), cmd.relay_ms(), host_ms)
+
+  def timeline(self):
+    """
+    Returns the events of both SCDs in one timeline, as a list of
+    (time in ms, side, text). The offset of each device clock is the
+    minimum difference between the host receive time and the device time,
+    i.e. the frame with the shortest USB delay.
+    """
+    offsets = {}
+    for side, dev_time, host_time, text in self.events:
+      delta = host_time - dev_time * COUNTER_RES
+      if side not in offsets or delta < offsets[side]:
+        offsets[side] = delta
+    merged = []
+    for side, dev_time, host_time, text in self.events:
+      merged.append((dev_time * COUNTER_RES + offsets[side], side, text))
+    # the sort is stable, so the events of one side keep their order
+    merged.sort(key = lambda event: event[0])
+    if not merged:
+      return []
+    t0 = merged[0][0]
+    return [((t - t0) * 1000, side, text) for t, side, text in merged]
+
+  def summary(self):
+    """Prints the merged timeline and the latency statistics."""
+    print
+    print 'Merged timeline:'
+    for t, side, text in self.timeline():
+      print '%10.3f ms  %-8s %s' % (t, side, text)
+    if not self.commands:
+      return
+    relay = [cmd.relay_ms() for cmd in self.commands]
+    print
+    print 'Commands relayed: %d' % len(relay)
+    print 'Relay latency: min %.1f ms, average %.1f ms, max %.1f ms' % (
+        min(relay), sum(relay) / len(relay), max(relay))
+    print 'Note: device times have a resolution of %.3f ms' % (
+        COUNTER_RES * 1000)
+
+
+def read_hex_lines(fid):
+  """Returns the hex lines of a file until the '0000000000' line."""
+  lines = []
+  for line in fid:
+    line = line.strip()
+    if not line:
+      continue
+    if line.find('0000000000') == 0:
+      break
+    lines.append(a2b_hex(line))
+  return lines
+
+
+class VirtualSCD:
+  """
+  Emulates one SCD running the relay mode over a pseudo terminal, so the
+  bridge can be tested without hardware. The terminal side sends the
+  commands from a file (as terminal.txt) and the card side answers with
+  the responses from a file (as card.txt, data followed by SW1 SW2).
+  """
+
+  def __init__(self, side, data, delay_ms):
+    self.side = side
+    self.data = data
+    self.delay = delay_ms / 1000.0
+    # each SCD has its own counter, started at a random time
+    self.epoch = time.time() - random.uniform(1, 100)
+    self.master, slave = os.openpty()
+    self.port = os.ttyname(slave)
+    self.reader = FrameReader()
+    # raw mode, so the frames are not changed by the line discipline
+    import tty
+    tty.setraw(slave)
+
+  def counter(self):
+    return int((time.time() - self.epoch) / COUNTER_RES)
+
+  def send(self, ftype, payload = ''):
+    os.write(self.master, make_frame(ftype, payload, self.counter()))
+
+  def read_line(self):
+    line = ''
+    while not line.endswith('\n'):
+      line += os.read(self.master, 1)
+    return line
+
+  def read_frame(self):
+    frames = []
+    while not frames:
+      frames = self.reader.feed(os.read(self.master, 4096))
+    # the bridge sends at most one frame at a time to each side
+    return frames[0]
+
+  def run(self):
+    line = self.read_line()
+    expected = 'T' if self.side == 'terminal' else 'C'
+    if line.find('AT+CRELAY=' + expected) != 0:
+      os.write(self.master, 'AT BAD\r\n')
+      return False
+    os.write(self.master, 'AT OK\r\n')
+    if self.side == 'terminal':
+      self.run_terminal()
+    else:
+      self.run_card()
+    os.write(self.master, 'AT OK\r\n')
+    # give the bridge time to read the last frames, which are discarded
+    # when the pseudo terminal is closed
+    time.sleep(1)
+    return True
+
+  def run_terminal(self):
+    for capdu in self.data:
+      self.send(FRAME_CAPDU, capdu)
+      ftype, dev_time, payload = self.read_frame()
+      if ftype != FRAME_RAPDU:
+        return
+      # time to send the response to the terminal
+      time.sleep(self.delay)
+      self.send(FRAME_SENT, '\x00')
+    self.send(FRAME_END, '\x00')
+
+  def run_card(self):
+    self.send(FRAME_ATR, '\x00\x00\x00')
+    responses = list(self.data)
+    while True:
+      ftype, dev_time, payload = self.read_frame()
+      if ftype == FRAME_END:
+        break
+      elif ftype == FRAME_RESET:
+        self.send(FRAME_ATR, '\x00\x00\x00')
+      elif ftype == FRAME_CAPDU:
+        start = self.counter()
+        time.sleep(self.delay)
+        rapdu = responses.pop(0) if responses else '\x6A\x82'
+        icc_time = self.counter() - start
+        self.send(FRAME_RAPDU,
+            struct.pack('<H', icc_time) + rapdu[-2:] + rapdu[:-2])
+    self.send(FRAME_END, '\x00')
+
+
+def main():
+  """Relay bridge between two SCDs"""
+  parser = argparse.ArgumentParser(description = 'Relay bridge between a '\
+      'terminal side SCD (AT+CRELAY=T) and a card side SCD (AT+CRELAY=C)')
+  parser.add_argument(
+      '--emulate',
+      nargs = 2,
+      metavar = ('SIDE', 'FILE'),
+      help = 'emulate the SCD of one side ("terminal" or "card") on a\
+          pseudo terminal, using the commands or responses from FILE,\
+          and print the name of the pseudo terminal')
+  parser.add_argument(
+      '--delay',
+      type = float,
+      default = 5,
+      help = 'processing time in ms of an emulated SCD (default 5)')
+  parser.add_argument(
+      '--quiet',
+      action = 'store_true',
+      help = 'only print the latency of each command and the timeline')
+  parser.add_argument(
+      'ports',
+      nargs = '*',
+      help = 'serial ports of the terminal side and card side SCDs')
+  args = parser.parse_args()
+
+  if args.emulate:
+    side, filename = args.emulate
+    if side not in ('terminal', 'card'):
+      print 'SIDE must be "terminal" or "card"'
+      return 1
+    fid = open(filename, 'r')
+    data = read_hex_lines(fid)
+    fid.close()
+    # card.txt starts with the ATR, which the relay does not use
+    if side == 'card' and data:
+      data = data[1:]
+    scd = VirtualSCD(side, data, args.delay)
+    print scd.port
+    sys.stdout.flush()
+    return 0 if scd.run() else 1
+
+  if len(args.ports) != 2:
+    parser.print_help()
+    return 1
+
+  bridge = RelayBridge(args.ports[0], args.ports[1], not args.quiet)
+  result = bridge.run()
+  bridge.summary()
+  return 0 if result else 1
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -0,0 +1,618 @@
+# This file implements an APDU level diff of SCD traces. The commands of two
+# or more traces are aligned and the inserted, missing and changed commands
+# are reported, with the TLV tags that differ in the responses. It can also
+# index a corpus of traces and find the flows that are nearest to a trace.
+#
+# Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# - Redistributions of source code must retain the above copyright notice, this
+# list of conditions and the following disclaimer.
+#
+# - Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation
+# and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+import cPickle
+import multiprocessing
+import random
+import sys
+import time
+import zlib
+from binascii import a2b_hex, b2a_hex
+import argparse # you need Python v2.7 or later
+from scdtrace import SCDTrace
+from scdtiming import find_traces, ins_name
+from tlv import scan, taghex
+from emvtags import tagname
+
+# Event types (see scdtiming.py)
+EVENT_ATR_FROM_ICC = 0x00
+EVENT_BYTE_TO_ICC = 0x04
+EVENT_BYTE_FROM_ICC = 0x05
+
+# Alignment operations
+OP_SAME = 'same'
+OP_CHANGED = 'changed'
+OP_MISSING = 'missing'
+OP_INSERTED = 'inserted'
+
+# Symbols printed for each operation (OP_SAME with a different response is
+# printed as '!')
+OP_SYMBOLS = {OP_SAME: '=', OP_CHANGED: '~', OP_MISSING: '-', OP_INSERTED: '+'}
+
+# MinHash signature used by the index: SHINGLE commands per shingle,
+# INDEX_BANDS bands of INDEX_ROWS values each. Two flows with a Jaccard
+# similarity s share at least one band with probability 1-(1-s^2)^16, which
+# is 0.99 for s = 0.5 and 0.15 for s = 0.1
+SHINGLE = 3
+INDEX_BANDS = 16
+INDEX_ROWS = 2
+INDEX_VERSION = 1
+HASH_PRIME = 4294967311
+
+
+class Apdu:
+  """A command sent to the card and its response (hex strings)"""
+
+  def __init__(self, header, data):
+    self.cla = header[0:2]
+    self.ins = header[2:4]
+    self.p1p2 = header[4:8]
+    self.header = header
+    self.data = data
+    self.response = ''
+
+  def sw(self):
+    return self.response[-4:]
+
+  def response_data(self):
+    return self.response[:-4]
+
+  def token(self):
+    """The item aligned by the diff: (INS, P1 P2, CRC32 of the data)"""
+    return (self.ins, self.p1p2, zlib.crc32(self.data) & 0xFFFFFFFF)
+
+  def shape(self):
+    """The item used by the index: (INS, P1 P2, SW), which does not depend
+    on the data that changes on each transaction (e.g. the unpredictable
+    number sent with GENERATE AC)"""
+    return (self.ins, self.p1p2, self.sw())
+
+
+class Flow:
+  """The commands sent to a card after one ATR"""
+
+  def __init__(self, atr):
+    self.atr = atr
+    self.apdus = []
+
+  def tokens(self):
+    return [apdu.token() for apdu in self.apdus]
+
+  def shape(self):
+    return tuple(apdu.shape() for apdu in self.apdus)
+
+
+def extract_flows(events):
+  """
+  Extracts the commands sent to the card and their responses from the
+  events of a log, as the terminal sees them: a GET RESPONSE after 61xx
+  gives the response of the previous command and a command repeated after
+  6Cxx replaces it.
+
+  @Args:
+    events: list of (type, data) items, as returned by split_events
+
+  @Returns:
+    list of Flow objects, one for each ATR in the log
+  """
+  flows = []
+  flow = None
+  apdu = None
+
+  for event_type, data in events:
+    if event_type == EVENT_ATR_FROM_ICC:
+      flow = Flow(data)
+      flows.append(flow)
+      apdu = None
+    elif event_type == EVENT_BYTE_TO_ICC:
+      if apdu is not None and apdu.response == apdu.ins:
+        # the procedure byte asked for the data of the command
+        apdu.data += data
+        apdu.response = ''
+      elif len(data) >= 10:
+        if flow is None:
+          flow = Flow('')
+          flows.append(flow)
+        apdu = Apdu(data[0:10], data[10:])
+        flow.apdus.append(apdu)
+      elif apdu is not None:
+        apdu.data += data
+    elif event_type == EVENT_BYTE_FROM_ICC:
+      if apdu is not None:
+        apdu.response += data
+
+  for flow in flows:
+    for apdu in flow.apdus:
+      # remove the procedure byte sent before the response data
+      if len(apdu.response) > 4 and apdu.response[0:2] == apdu.ins:
+        apdu.response = apdu.response[2:]
+    merge_responses(flow)
+  return flows
+
+
+def merge_responses(flow):
+  """Merges GET RESPONSE and the commands repeated after 6Cxx into the
+  commands sent by the terminal"""
+  apdus = []
+  for apdu in flow.apdus:
+    if apdus:
+      last = apdus[-1]
+      if apdu.ins == 'C0' and last.sw().startswith('61'):
+        last.response = apdu.response
+        continue
+      if last.sw().startswith('6C') and apdu.header[0:8] == last.header[0:8]:
+        last.response = apdu.response
+        continue
+    apdus.append(apdu)
+  flow.apdus = apdus
+
+
+def load_flows(filename, raw_log):
+  """Returns the flows of a trace"""
+  return extract_flows(SCDTrace(filename, raw_log).load_events())
+
+
+def align(a, b):
+  """
+  Aligns two lists of tokens (see Apdu.token and Apdu.shape) with the
+  minimum number of edits: a token missing from b or inserted in b costs 1,
+  a token changed in b costs 1 if its first two fields (INS, P1 P2) are the
+  same and is not allowed otherwise.
+
+  @Args:
+    a: the reference list of tokens
+    b: the list of tokens compared with a
+
+  @Returns:
+    (cost, operations), where operations is a list of (operation, i, j)
+    items, with i or j set to None for missing and inserted tokens
+  """
+  n = len(a)
+  m = len(b)
+  cost = [range(m + 1)]
+  for i in range(1, n + 1):
+    row = [i] + [0] * m
+    prev = cost[i - 1]
+    x = a[i - 1]
+    for j in range(1, m + 1):
+      y = b[j - 1]
+      best = min(prev[j], row[j - 1]) + 1
+      if x == y:
+        best = min(best, prev[j - 1])
+      elif x[0:2] == y[0:2]:
+        best = min(best, prev[j - 1] + 1)
+      row[j] = best
+    cost.append(row)
+
+  operations = []
+  i = n
+  j = m
+  while i > 0 or j > 0:
+    if i > 0 and j > 0:
+      x = a[i - 1]
+      y = b[j - 1]
+      if x == y and cost[i][j] == cost[i - 1][j - 1]:
+        operations.append((OP_SAME, i - 1, j - 1))
+        i -= 1
+        j -= 1
+        continue
+      if x != y and x[0:2] == y[0:2] and \
+          cost[i][j] == cost[i - 1][j - 1] + 1:
+        operations.append((OP_CHANGED, i - 1, j - 1))
+        i -= 1
+        j -= 1
+        continue
+    if i > 0 and cost[i][j] == cost[i - 1][j] + 1:
+      operations.append((OP_MISSING, i - 1, None))
+      i -= 1
+    else:
+      operations.append((OP_INSERTED, None, j - 1))
+      j -= 1
+  operations.reverse()
+  return cost[n][m], operations
+
+
+def tlv_values(data):
+  """
+  Returns the primitive tags of TLV encoded data as a list of
+  (tag, value) items, in order, or None if the data is not TLV encoded.
+  """
+  try:
+    data = a2b_hex(data)
+    return [(taghex(tag), b2a_hex(data[start:end]).upper())
+        for tag, start, end in scan(data)]
+  except (TypeError, ValueError):
+    return None
+
+
+def response_diff(a, b):
+  """
+  Describes the differences between two responses.
+
+  @Args:
+    a: the reference Apdu
+    b: the Apdu compared with a
+
+  @Returns:
+    a list of strings, empty if the responses are the same
+  """
+  result = []
+  if a.sw() != b.sw():
+    result.append('SW %s -> %s' % (a.sw() or '-', b.sw() or '-'))
+  data_a = a.response_data()
+  data_b = b.response_data()
+  if data_a == data_b:
+    return result
+
+  tags_a = tlv_values(data_a)
+  tags_b = tlv_values(data_b)
+  if tags_a is None or tags_b is None:
+    result.append('data %d -> %d bytes' % (len(data_a) / 2, len(data_b) / 2))
+    return result
+
+  values_a = {}
+  values_b = {}
+  order = []
+  for tags, values in ((tags_a, values_a), (tags_b, values_b)):
+    for tag, value in tags:
+      if tag not in values_a and tag not in values_b:
+        order.append(tag)
+      values.setdefault(tag, []).append(value)
+  for tag in order:
+    if tag not in values_b:
+      change = 'missing'
+    elif tag not in values_a:
+      change = 'added'
+    elif values_a[tag] != values_b[tag]:
+      change = 'changed'
+    else:
+      continue
+    result.append('%s %s (%s)' % (tag, change, tagname(tag)))
+  return result
+
+
+def diff_flows(ref, other, show_all):
+  """
+  Aligns the commands of two flows and returns the report as a list of
+  lines and a dictionary with the number of commands for each result.
+  """
+  cost, operations = align(ref.tokens(), other.tokens())
+  counts = {'same': 0, 'changed commands': 0, 'changed responses': 0,
+      'inserted': 0, 'missing': 0}
+  lines = []
+  for operation, i, j in operations:
+    apdu = ref.apdus[i] if i is not None else other.apdus[j]
+    symbol = OP_SYMBOLS[operation]
+    details = []
+    if operation in (OP_SAME, OP_CHANGED):
+      details = response_diff(ref.apdus[i], other.apdus[j])
+    if operation == OP_SAME:
+      if details:
+        symbol = '!'
+        counts['changed responses'] += 1
+      else:
+        counts['same'] += 1
+    elif operation == OP_CHANGED:
+      details.insert(0, 'command data %s -> %s' % (ref.apdus[i].data or '-',
+          other.apdus[j].data or '-'))
+      counts['changed commands'] += 1
+    else:
+      details = ['SW %s' % (apdu.sw() or '-')]
+      counts[operation] += 1
+    if symbol == '=' and not show_all:
+      continue
+    lines.append('  %s %s %s %s %-24s %s' % (symbol, apdu.cla, apdu.ins,
+        apdu.p1p2, ins_name(apdu.ins), '; '.join(details)))
+  return lines, counts
+
+
+def print_diff(ref_name, ref_flows, name, flows, show_all):
+  """Prints the differences between the flows of two traces, which are
+  compared in order (first ATR with first ATR and so on)"""
+  print '--- %s' % ref_name
+  print '+++ %s' % name
+  for k in range(max(len(ref_flows), len(flows))):
+    if k >= len(flows):
+      print 'flow %d: only in %s' % (k + 1, ref_name)
+      continue
+    if k >= len(ref_flows):
+      print 'flow %d: only in %s' % (k + 1, name)
+      continue
+    ref = ref_flows[k]
+    flow = flows[k]
+    print 'flow %d: %d -> %d commands' % (k + 1, len(ref.apdus),
+        len(flow.apdus))
+    if ref.atr != flow.atr:
+      print '  ATR %s -> %s' % (ref.atr or '-', flow.atr or '-')
+    lines, counts = diff_flows(ref, flow, show_all)
+    for line in lines:
+      print line
+    print '  %d same, %d changed commands, %d changed responses, ' \
+        '%d inserted, %d missing' % (counts['same'],
+        counts['changed commands'], counts['changed responses'],
+        counts['inserted'], counts['missing'])
+  print
+
+
+def shingles(shape):
+  """Returns the set of hashes of SHINGLE consecutive commands of a flow,
+  including the start and the end of the flow"""
+  items = [('^',)] + list(shape) + [('$',)]
+  result = set()
+  for k in range(max(len(items) - SHINGLE + 1, 1)):
+    result.add(zlib.crc32(repr(items[k:k + SHINGLE])) & 0xFFFFFFFF)
+  return result
+
+
+class Index:
+  """
+  Index of the flows of a corpus. Flows with the same shape (see
+  Apdu.shape) are stored once, with the list of traces where they were
+  found. The MinHash signature of each flow is split into bands, and the
+  flows that share a band with a query are the candidates, which are then
+  compared with align.
+  """
+
+  def __init__(self):
+    self.version = INDEX_VERSION
+    rnd = random.Random(0x5CD)
+    self.coefs = [(rnd.randint(1, HASH_PRIME - 1), rnd.randint(0,
+        HASH_PRIME - 1)) for k in range(INDEX_BANDS * INDEX_ROWS)]
+    self.shapes = []
+    self.signatures = []
+    self.members = []
+    self.ids = {}
+    self.buckets = {}
+
+  def signature(self, shape):
+    values = shingles(shape)
+    return tuple(min((a * x + b) % HASH_PRIME for x in values)
+        for a, b in self.coefs)
+
+  def bands(self, signature):
+    for band in range(INDEX_BANDS):
+      yield (band,) + signature[band * INDEX_ROWS:(band + 1) * INDEX_ROWS]
+
+  def add(self, name, number, shape):
+    if shape in self.ids:
+      self.members[self.ids[shape]].append((name, number))
+      return
+    flow_id = len(self.shapes)
+    signature = self.signature(shape)
+    self.ids[shape] = flow_id
+    self.shapes.append(shape)
+    self.signatures.append(signature)
+    self.members.append([(name, number)])
+    for key in self.bands(signature):
+      self.buckets.setdefault(key, []).append(flow_id)
+
+  def nearest(self, shape, count, exhaustive=False):
+    """
+    Returns the flows nearest to the given one.
+
+    @Args:
+      shape: the shape of the flow (see Flow.shape)
+      count: the number of flows to return
+      exhaustive: set to True to compare with all the flows instead of
+      the candidates found through the bands
+
+    @Returns:
+      list of (cost, similarity, flow id) items, sorted by cost, where
+      similarity is the estimated Jaccard similarity of the shingles
+    """
+    signature = self.signature(shape)
+    if exhaustive:
+      candidates = range(len(self.shapes))
+    else:
+      candidates = set()
+      for key in self.bands(signature):
+        candidates.update(self.buckets.get(key, ()))
+
+    # only the most similar candidates are aligned
+    ranked = []
+    for flow_id in candidates:
+      same = sum(1 for x, y in zip(signature, self.signatures[flow_id])
+          if x == y)
+      ranked.append((same, flow_id))
+    ranked.sort(reverse = True)
+    result = []
+    for same, flow_id in ranked[:max(4 * count, 32)]:
+      cost, operations = align(shape, self.shapes[flow_id])
+      result.append((cost, same / float(len(signature)), flow_id))
+    result.sort(key = lambda item: (item[0], -item[1]))
+    return result[:count]
+
+
+def shape_file(job):
+  """
+  Reads one trace and returns the shapes of its flows (run by the worker
+  processes).
+
+  @Args:
+    job: (filename, raw_log) tuple, raw_log as in SCDTrace
+
+  @Returns:
+    (filename, list of shapes, error message or None)
+  """
+  filename, raw_log = job
+  try:
+    return (filename, [flow.shape() for flow in load_flows(filename,
+        raw_log)], None)
+  except Exception, e:
+    return (filename, [], str(e))
+
+
+def build_index(paths, raw_log, jobs):
+  """Parses the traces in paths with jobs processes and returns the
+  Index of their flows"""
+  start = time.time()
+  traces = find_traces(paths)
+  index = Index()
+  errors = 0
+  flows = 0
+  work = [(name, raw_log) for name in traces]
+
+  if jobs > 1 and len(work) > 1:
+    pool = multiprocessing.Pool(jobs)
+    results = pool.imap_unordered(shape_file, work, 16)
+  else:
+    pool = None
+    results = (shape_file(job) for job in work)
+
+  for filename, shapes, error in results:
+    if error is not None:
+      sys.stderr.write('%s: %s\n' % (filename, error))
+      errors += 1
+    for number, shape in enumerate(shapes):
+      index.add(filename, number + 1, shape)
+      flows += 1
+
+  if pool is not None:
+    pool.close()
+    pool.join()
+  print '%d traces (%d errors), %d flows, %d distinct, indexed in %.1f s' % (
+      len(traces), errors, flows, len(index.shapes), time.time() - start)
+  return index
+
+
+def save_index(index, filename):
+  f = open(filename, 'wb')
+  cPickle.dump(index, f, 2)
+  f.close()
+
+
+def load_index(filename):
+  f = open(filename, 'rb')
+  index = cPickle.load(f)
+  f.close()
+  if getattr(index, 'version', None) != INDEX_VERSION:
+    raise Exception('%s: unsupported index, build it again' % filename)
+  return index
+
+
+def search(index, filename, raw_log, count, exhaustive, show_diff,
+    show_all):
+  """Prints the flows of the index nearest to each flow of a trace"""
+  flows = load_flows(filename, raw_log)
+  if not flows:
+    print '%s: no commands found' % filename
+  for number, flow in enumerate(flows):
+    start = time.time()
+    result = index.nearest(flow.shape(), count, exhaustive)
+    print '%s flow %d (%d commands), nearest flows (%.3f s):' % (filename,
+        number + 1, len(flow.apdus), time.time() - start)
+    if not result:
+      print '  none found, try --exhaustive'
+      continue
+    for cost, similarity, flow_id in result:
+      members = index.members[flow_id]
+      name, member = members[0]
+      more = ''
+      if len(members) > 1:
+        more = ' and %d more' % (len(members) - 1)
+      print '  distance %3d, similarity %.2f: %s flow %d%s' % (cost,
+          similarity, name, member, more)
+    if show_diff:
+      name, member = index.members[result[0][2]][0]
+      nearest = load_flows(name, raw_log)
+      print
+      print_diff(filename, [flow], '%s flow %d' % (name, member),
+          [nearest[member - 1]], show_all)
+
+
+def main():
+  """APDU level diff and search of SCD traces"""
+  parser = argparse.ArgumentParser(description = 'Aligns the commands of SCD '\
+      'traces and shows the inserted, missing and changed commands, or '\
+      'finds the flows of a corpus nearest to a trace')
+  parser.add_argument(
+      'traces',
+      nargs = '+',
+      help = 'the trace files (Intel hex or .bin images); the first is the\
+          reference to which the others are compared. With --build these\
+          are the traces or directories to index, and with --index the\
+          traces to search for')
+  parser.add_argument('-l',
+      '--log',
+      action = 'store_true',
+      help = 'the files contain only log records (from "clis.py\
+          --getloghex" or LOGnn.BIN files) instead of full EEPROM images')
+  parser.add_argument('-a',
+      '--all',
+      action = 'store_true',
+      help = 'show also the commands that are the same')
+  parser.add_argument(
+      '--build',
+      metavar = 'INDEX',
+      help = 'index the flows of the given traces and save the index to\
+          this file')
+  parser.add_argument(
+      '--index',
+      help = 'search the flows nearest to the given traces in this index')
+  parser.add_argument('-n',
+      '--nearest',
+      type = int,
+      default = 5,
+      help = 'number of flows to show for each search (default: 5)')
+  parser.add_argument(
+      '--exhaustive',
+      action = 'store_true',
+      help = 'compare with all the flows of the index (slow)')
+  parser.add_argument('-d',
+      '--diff',
+      action = 'store_true',
+      help = 'show the diff with the nearest flow found in the index')
+  parser.add_argument('-j',
+      '--jobs',
+      type = int,
+      default = multiprocessing.cpu_count(),
+      help = 'number of processes used by --build (default: number of CPUs)')
+  args = parser.parse_args()
+
+  if args.build:
+    save_index(build_index(args.traces, args.log, args.jobs), args.build)
+    return 0
+
+  if args.index:
+    index = load_index(args.index)
+    for filename in args.traces:
+      search(index, filename, args.log, args.nearest, args.exhaustive,
+          args.diff, args.all)
+    return 0
+
+  if len(args.traces) < 2:
+    parser.error('at least two traces are needed')
+  ref_flows = load_flows(args.traces[0], args.log)
+  for filename in args.traces[1:]:
+    print_diff(args.traces[0], ref_flows, filename,
+        load_flows(filename, args.log), args.all)
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main())
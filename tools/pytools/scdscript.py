@@ -0,0 +1,572 @@
+# This file implements the assembler of the EMV flow scripts run by the SCD
+# (see avrsrc/scd_script.h), uploads them and runs them, either on the SCD
+# (AT+CSCRUN) or from the host through AT+CCINIT/AT+CCAPDU, to compare them.
+#
+# Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# - Redistributions of source code must retain the above copyright notice, this
+# list of conditions and the following disclaimer.
+#
+# - Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation
+# and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+import struct
+import sys
+import time
+import argparse # you need Python v2.7 or later
+from binascii import a2b_hex, b2a_hex
+from atcmds import AT_CMD
+
+# Opcodes, see SCRIPT_OPCODE in avrsrc/scd_script.h
+OP_END = 0x00
+OP_SEND = 0x01
+OP_SENDL = 0x02
+OP_GET = 0x03
+OP_SET = 0x04
+OP_DOL = 0x05
+OP_AFL = 0x06
+OP_READ = 0x07
+OP_JSW = 0x08
+OP_JNB = 0x09
+OP_JMP = 0x0A
+OP_FAIL = 0x0B
+
+REGISTERS = 8
+NO_REGISTER = 0xFF
+MAX_STEPS = 2000
+# EEPROM_SCRIPT_SIZE, including the 2 length bytes
+MAX_IMAGE = 256
+# Bytes sent in each AT+CSCRIPT command
+UPLOAD_CHUNK = 64
+
+# Errors, see RETURN_CODE in avrsrc/scd_values.h
+RET_ICC_GET_RESPONSE = 0x1F
+RET_SCRIPT_EMPTY = 0x60
+RET_SCRIPT_BAD_INSTRUCTION = 0x61
+RET_SCRIPT_FAIL = 0x62
+RET_SCRIPT_TOO_LONG = 0x63
+
+MNEMONICS = {
+    'end': OP_END, 'send': OP_SEND, 'sendl': OP_SENDL, 'get': OP_GET,
+    'set': OP_SET, 'dol': OP_DOL, 'afl': OP_AFL, 'read': OP_READ,
+    'jsw': OP_JSW, 'jnsw': OP_JSW, 'jnb': OP_JNB, 'jmp': OP_JMP,
+    'fail': OP_FAIL,
+    }
+
+
+class ScriptError(Exception):
+  pass
+
+
+def assemble(text):
+  """
+  Assembles a script, one instruction per line (see the README):
+    label:
+    sendl CLA INS P1 P2 DATA        send a command with literal data
+    send CLA INS P1 P2 LE [rN]      send a command, data from register N
+    get TAG rN                      copy a TLV of the last response to rN
+    set rN TAG VALUE                set rN to a value with a tag
+    dol rDOL rN [WRAP]              build the data of the DOL in rDOL
+    afl rN [SKIP]                   start reading the AFL in rN
+    read LABEL                      READ RECORD of the next AFL record,
+                                    jump to LABEL after the last one
+    jsw SW LABEL, jnsw SW LABEL     jump if SW (e.g. 9000, 61xx) matches
+                                    or does not match
+    jnb rN INDEX MASK LABEL         jump if byte INDEX of rN is missing or
+                                    has none of the MASK bits
+    jmp LABEL, fail CODE, end
+  All numbers are in hex. Text after '#' is ignored.
+
+  @Returns:
+    the script as a string
+  """
+  labels = {}
+  program = []
+  for number, line in enumerate(text.splitlines()):
+    words = line.split('#')[0].split()
+    while words and words[0].endswith(':'):
+      labels[words[0][:-1]] = None
+      program.append((number + 1, 'label', [words[0][:-1]]))
+      words = words[1:]
+    if words:
+      program.append((number + 1, words[0].lower(), words[1:]))
+
+  def byte(word):
+    value = int(word, 16)
+    if value < 0 or value > 0xFF:
+      raise ValueError('bad byte %s' % word)
+    return chr(value)
+
+  def reg(word, optional = False):
+    if optional and word is None:
+      return chr(NO_REGISTER)
+    if not word.lower().startswith('r') or int(word[1:]) >= REGISTERS:
+      raise ValueError('bad register %s' % word)
+    return chr(int(word[1:]))
+
+  def tag(word):
+    return struct.pack('>H', int(word, 16))
+
+  def data(word):
+    value = a2b_hex(word)
+    if len(value) > 255:
+      raise ValueError('value too long')
+    return chr(len(value)) + value
+
+  def sw(word, negate):
+    word = word.lower()
+    mask = 0x80 if negate else 0
+    if word[:2] != 'xx':
+      mask |= 0x01
+    if word[2:] != 'xx':
+      mask |= 0x02
+    return (byte(word[:2].replace('xx', '00')) +
+        byte(word[2:].replace('xx', '00')) + chr(mask))
+
+  # two passes: the first one finds the address of each label
+  for final in (False, True):
+    code = ''
+    for number, mnemonic, args in program:
+      def addr(word):
+        if final:
+          if word not in labels:
+            raise ValueError('unknown label %s' % word)
+          return struct.pack('>H', labels[word])
+        return '\x00\x00'
+      try:
+        if mnemonic == 'label':
+          labels[args[0]] = len(code)
+          continue
+        if mnemonic not in MNEMONICS:
+          raise ValueError('unknown instruction %s' % mnemonic)
+        op = chr(MNEMONICS[mnemonic])
+        if mnemonic == 'sendl':
+          code += op + ''.join(byte(a) for a in args[:4]) + data(
+              args[4] if len(args) > 4 else '')
+        elif mnemonic == 'send':
+          code += op + ''.join(byte(a) for a in args[:5]) + reg(
+              args[5] if len(args) > 5 else None, True)
+        elif mnemonic == 'get':
+          code += op + tag(args[0]) + reg(args[1])
+        elif mnemonic == 'set':
+          code += op + reg(args[0]) + tag(args[1]) + data(args[2])
+        elif mnemonic == 'dol':
+          code += op + reg(args[0]) + reg(args[1]) + byte(
+              args[2] if len(args) > 2 else '0')
+        elif mnemonic == 'afl':
+          code += op + reg(args[0]) + byte(args[1] if len(args) > 1 else '0')
+        elif mnemonic == 'read' or mnemonic == 'jmp':
+          code += op + addr(args[0])
+        elif mnemonic in ('jsw', 'jnsw'):
+          code += op + sw(args[0], mnemonic == 'jnsw') + addr(args[1])
+        elif mnemonic == 'jnb':
+          code += op + reg(args[0]) + byte(args[1]) + byte(args[2]) + addr(
+              args[3])
+        elif mnemonic == 'fail':
+          code += op + byte(args[0])
+        else:
+          code += op
+      except (IndexError, ValueError, TypeError) as e:
+        raise ScriptError('line %d: %s' % (number, e))
+
+  if len(code) + 2 > MAX_IMAGE:
+    raise ScriptError('script too long (%d bytes, at most %d)' % (
+        len(code), MAX_IMAGE - 2))
+  return code
+
+
+def find_tag(data, tag):
+  """Finds a tag at any depth of TLV data, as FindTag in scd_script.c"""
+  pos = 0
+  while pos < len(data):
+    if ord(data[pos]) in (0x00, 0xFF):
+      pos += 1
+      continue
+    constructed = ord(data[pos]) & 0x20
+    t = ord(data[pos])
+    pos += 1
+    if t & 0x1F == 0x1F:
+      if pos >= len(data):
+        return None
+      t = (t << 8) | ord(data[pos])
+      pos += 1
+    if pos >= len(data):
+      return None
+    l = ord(data[pos])
+    pos += 1
+    if l == 0x81:
+      if pos >= len(data):
+        return None
+      l = ord(data[pos])
+      pos += 1
+    elif l > 0x80:
+      return None
+    if pos + l > len(data):
+      return None
+    if t == tag:
+      return data[pos:pos + l]
+    if not constructed:
+      pos += l
+  return None
+
+
+def run_script(code, transmit):
+  """
+  Runs a script on the host, as RunScript in scd_script.c.
+
+  @Args:
+    code: the script
+    transmit: function sending a command (string) and returning the
+      response data and status (string), which handles 61xx and 6Cxx
+
+  @Returns:
+    a dictionary with error, code, pc, commands, sw, out (register 0) and
+    the registers as a list of (tag, value)
+  """
+  regs = [(0, '')] * REGISTERS
+  result = {'error': 0, 'code': 0, 'pc': 0, 'commands': 0, 'sw': None}
+  state = {'response': None}
+  afl = [None, 0, 0]
+
+  def send(header, data):
+    response = transmit(header + data)
+    if response is None or len(response) < 2:
+      raise ScriptError(RET_ICC_GET_RESPONSE)
+    state['response'] = response
+    result['commands'] += 1
+    result['sw'] = response[-2:]
+
+  def need(n):
+    if pc + 1 + n > len(code):
+      raise ScriptError(RET_SCRIPT_BAD_INSTRUCTION)
+    return [ord(c) for c in code[pc + 1:pc + 1 + n]]
+
+  def register(r):
+    if r >= REGISTERS:
+      raise ScriptError(RET_SCRIPT_BAD_INSTRUCTION)
+    return r
+
+  pc = 0
+  steps = 0
+  try:
+    if not code:
+      raise ScriptError(RET_SCRIPT_EMPTY)
+    while True:
+      if steps == MAX_STEPS:
+        raise ScriptError(RET_SCRIPT_TOO_LONG)
+      steps += 1
+      if pc >= len(code):
+        raise ScriptError(RET_SCRIPT_BAD_INSTRUCTION)
+      result['pc'] = pc
+      op = ord(code[pc])
+      if op == OP_END:
+        break
+      elif op == OP_SEND:
+        a = need(6)
+        header = ''.join(chr(b) for b in a[:4])
+        if a[5] == NO_REGISTER:
+          send(header + chr(a[4]), '')
+        else:
+          value = regs[register(a[5])][1]
+          send(header + chr(len(value)), value)
+        pc += 7
+      elif op == OP_SENDL:
+        a = need(5)
+        need(5 + a[4])
+        send(code[pc + 1:pc + 6], code[pc + 6:pc + 6 + a[4]])
+        pc += 6 + a[4]
+      elif op == OP_GET:
+        a = need(3)
+        tag = (a[0] << 8) | a[1]
+        if state['response'] and len(state['response']) > 2:
+          value = find_tag(state['response'][:-2], tag)
+          if value is not None:
+            regs[register(a[2])] = (tag, value)
+        register(a[2])
+        pc += 4
+      elif op == OP_SET:
+        a = need(4)
+        need(4 + a[3])
+        regs[register(a[0])] = ((a[1] << 8) | a[2], code[pc + 5:pc + 5 + a[3]])
+        pc += 5 + a[3]
+      elif op == OP_DOL:
+        a = need(3)
+        dol = regs[register(a[0])][1]
+        register(a[1])
+        data = ''
+        pos = 0
+        while pos < len(dol):
+          tag = ord(dol[pos])
+          pos += 1
+          if tag & 0x1F == 0x1F and pos < len(dol):
+            tag = (tag << 8) | ord(dol[pos])
+            pos += 1
+          if pos >= len(dol):
+            raise ScriptError(RET_SCRIPT_BAD_INSTRUCTION)
+          l = ord(dol[pos])
+          pos += 1
+          value = ''
+          for t, v in regs:
+            if t == tag:
+              value = v
+              break
+          data += (value + '\x00' * l)[:l]
+        if len(data) + (2 if a[2] else 0) > 255:
+          raise ScriptError(RET_SCRIPT_BAD_INSTRUCTION)
+        if a[2]:
+          data = chr(a[2]) + chr(len(data)) + data
+        regs[a[1]] = (a[2], data)
+        pc += 4
+      elif op == OP_AFL:
+        a = need(2)
+        afl[:] = [register(a[0]), a[1], 0]
+        pc += 3
+      elif op == OP_READ:
+        a = need(2)
+        value = regs[afl[0]][1] if afl[0] is not None else ''
+        if (afl[2] != 0 and afl[1] + 4 <= len(value) and
+            afl[2] > ord(value[afl[1] + 2])):
+          afl[1] += 4
+          afl[2] = 0
+        if afl[0] is None or afl[1] + 4 > len(value):
+          pc = (a[0] << 8) | a[1]
+          continue
+        if afl[2] == 0:
+          afl[2] = ord(value[afl[1] + 1])
+        send('\x00\xB2' + chr(afl[2]) + chr((ord(value[afl[1]]) & 0xF8) | 4) +
+            '\x00', '')
+        afl[2] += 1
+        pc += 3
+      elif op == OP_JSW:
+        a = need(5)
+        match = state['response'] is not None
+        if match and a[2] & 0x01 and ord(result['sw'][0]) != a[0]:
+          match = False
+        if match and a[2] & 0x02 and ord(result['sw'][1]) != a[1]:
+          match = False
+        if a[2] & 0x80:
+          match = not match
+        pc = (a[3] << 8) | a[4] if match else pc + 6
+      elif op == OP_JNB:
+        a = need(5)
+        value = regs[register(a[0])][1]
+        if a[1] >= len(value) or (a[2] != 0 and ord(value[a[1]]) & a[2] == 0):
+          pc = (a[3] << 8) | a[4]
+        else:
+          pc += 6
+      elif op == OP_JMP:
+        a = need(2)
+        pc = (a[0] << 8) | a[1]
+      elif op == OP_FAIL:
+        a = need(1)
+        result['code'] = a[0]
+        raise ScriptError(RET_SCRIPT_FAIL)
+      else:
+        raise ScriptError(RET_SCRIPT_BAD_INSTRUCTION)
+  except ScriptError as e:
+    result['error'] = e.args[0]
+
+  result['out'] = regs[0][1]
+  result['registers'] = regs
+  return result
+
+
+def format_result(result):
+  """Returns the result of a script as a line of text"""
+  return 'error %02X code %d pc %d commands %d SW %s r0 %s' % (
+      result['error'], result['code'], result['pc'], result['commands'],
+      b2a_hex(result['sw'] or '').upper() or '-',
+      b2a_hex(result['out']).upper())
+
+
+def emulator_transmit(emulator, verbose):
+  """Returns a transmit function for run_script using a CardEmulator"""
+  from cardemu import reader_exchange
+  def transmit(capdu):
+    rapdu = reader_exchange(emulator, capdu)
+    if verbose:
+      print '  %s -> %s' % (b2a_hex(capdu).upper(), b2a_hex(rapdu).upper())
+    return rapdu
+  return transmit
+
+
+def serial_upload(port, code):
+  """Stores the script in the SCD with AT+CSCRIPT"""
+  import serial
+  image = struct.pack('<H', len(code)) + code
+  ser = serial.Serial(port)
+  try:
+    for offset in range(0, len(image), UPLOAD_CHUNK):
+      ser.write(AT_CMD.AT_CSCRIPT % (offset,
+          b2a_hex(image[offset:offset + UPLOAD_CHUNK]).upper()))
+      ser.flush()
+      if ser.readline().find('AT OK') < 0:
+        return False
+  finally:
+    ser.close()
+  return True
+
+
+def serial_run(port, count):
+  """
+  Runs the script stored in the SCD count times with AT+CSCRUN.
+
+  @Returns:
+    the list of (result, host time in seconds, SCD time in seconds)
+  """
+  import serial
+  runs = []
+  ser = serial.Serial(port)
+  try:
+    for i in range(count):
+      start = time.time()
+      ser.write(AT_CMD.AT_CSCRUN)
+      ser.flush()
+      line = ser.readline().strip()
+      elapsed = time.time() - start
+      if not line.startswith('AT+CSCRUN='):
+        raise ScriptError('bad reply %s' % line)
+      f = line[len('AT+CSCRUN='):].split(',')
+      result = {'error': int(f[0]), 'code': int(f[1]), 'pc': int(f[2]),
+          'commands': int(f[3]), 'sw': a2b_hex(f[4]), 'out': a2b_hex(f[6])}
+      runs.append((result, elapsed, int(f[5]) * 1.088e-3))
+  finally:
+    ser.close()
+  return runs
+
+
+def serial_host_run(port, code, count):
+  """
+  Runs the script count times on the host, sending each command through
+  the SCD with AT+CCINIT, AT+CCAPDU and AT+CCEND (as clis.py --terminal).
+
+  @Returns:
+    the list of (result, host time in seconds)
+  """
+  import serial
+  runs = []
+  ser = serial.Serial(port)
+
+  def transmit(capdu):
+    ser.write('AT+CCAPDU=%s\r\n' % b2a_hex(capdu).upper())
+    ser.flush()
+    line = ser.readline().strip()
+    if line.startswith('AT'):
+      return None
+    # the reply is SW1 SW2 followed by the data
+    rapdu = a2b_hex(line)
+    return rapdu[2:] + rapdu[:2]
+
+  try:
+    for i in range(count):
+      start = time.time()
+      ser.write(AT_CMD.AT_CCINIT)
+      ser.flush()
+      if ser.readline().find('AT OK') < 0:
+        raise ScriptError('cannot initialise the card')
+      result = run_script(code, transmit)
+      ser.write(AT_CMD.AT_CCEND)
+      ser.flush()
+      ser.readline()
+      runs.append((result, time.time() - start))
+  finally:
+    ser.close()
+  return runs
+
+
+def print_times(name, times):
+  """Prints the mean and range of the times of the runs"""
+  times = sorted(times)
+  print '%-24s %4d runs, mean %7.1f ms, min %7.1f ms, max %7.1f ms' % (
+      name, len(times), 1000 * sum(times) / len(times), 1000 * times[0],
+      1000 * times[-1])
+
+
+def main():
+  """Command line tool for the EMV flow scripts of the SCD"""
+
+  parser = argparse.ArgumentParser(description = 'SCD EMV flow scripts')
+  parser.add_argument('script',
+      help = 'the script (text, see the README)')
+  parser.add_argument('-o', '--output',
+      help = 'save the EEPROM image of the script (length and bytecode)')
+  parser.add_argument('--emulate', metavar = 'PROFILE',
+      help = 'run the script on the host with the card emulator and the\
+      card profile (see cardemu.py)')
+  parser.add_argument('--upload', metavar = 'PORT',
+      help = 'store the script in the SCD (AT+CSCRIPT)')
+  parser.add_argument('--run', metavar = 'PORT',
+      help = 'run the script on the SCD (AT+CSCRUN)')
+  parser.add_argument('--host', metavar = 'PORT',
+      help = 'run the script on the host, sending each command through the\
+      SCD (AT+CCAPDU), to compare with --run')
+  parser.add_argument('-n', '--count', type = int, default = 1,
+      help = 'number of runs (default 1)')
+  parser.add_argument('-v', '--verbose', action = 'store_true',
+      help = 'print the commands and responses (--emulate)')
+  args = parser.parse_args()
+
+  try:
+    code = assemble(open(args.script).read())
+  except (IOError, ScriptError) as e:
+    print >> sys.stderr, e
+    return 1
+  print 'Script: %d bytes' % len(code)
+
+  if args.output:
+    open(args.output, 'wb').write(struct.pack('<H', len(code)) + code)
+
+  if args.emulate:
+    from cardemu import CardEmulator, CardProfile
+    emulator = CardEmulator(CardProfile(args.emulate))
+    times = []
+    for i in range(args.count):
+      emulator.reset()
+      start = time.time()
+      result = run_script(code, emulator_transmit(emulator,
+          args.verbose and i == 0))
+      times.append(time.time() - start)
+      if i == 0:
+        print format_result(result)
+        for k, (tag, value) in enumerate(result['registers']):
+          if tag or value:
+            print '  r%d %04X %s' % (k, tag, b2a_hex(value).upper())
+    print_times('emulator', times)
+
+  if args.upload:
+    if not serial_upload(args.upload, code):
+      print >> sys.stderr, 'Error storing the script'
+      return 1
+
+  if args.run:
+    runs = serial_run(args.run, args.count)
+    print format_result(runs[0][0])
+    print_times('SCD (AT+CSCRUN)', [r[1] for r in runs])
+    print_times('  card time on the SCD', [r[2] for r in runs])
+
+  if args.host:
+    runs = serial_host_run(args.host, code, args.count)
+    print format_result(runs[0][0])
+    print_times('host (AT+CCAPDU)', [r[1] for r in runs])
+
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main())
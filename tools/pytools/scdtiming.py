@@ -0,0 +1,452 @@
+# This file implements a command timing analyzer for a corpus of SCD traces.
+# It pairs the commands sent to the card with their responses, using the time
+# records of the log, and reports the latency distribution of each command
+# grouped by card (ATR), application (AID) and reader.
+#
+# Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# - Redistributions of source code must retain the above copyright notice, this
+# list of conditions and the following disclaimer.
+#
+# - Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation
+# and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+import csv
+import math
+import multiprocessing
+import os
+import sys
+import time
+import argparse # you need Python v2.7 or later
+from scdtrace import SCDTrace
+import emv_commands
+
+# Event types (the record type without the length bits, see SCD_LOG_BYTE in
+# avrsrc/scd_logger.h)
+EVENT_ATR_FROM_ICC = 0x00
+EVENT_BYTE_TO_ICC = 0x04
+EVENT_BYTE_FROM_ICC = 0x05
+EVENT_TIME_DATA_TO_ICC = 0x30
+EVENT_TIME_GENERAL = 0x31
+
+# One unit of the SCD counter (GetCounter) in milliseconds, 1.024 for
+# firmware built with PROFILE=1 (see StartTimerT2)
+COUNTER_MS = 1.088
+
+# A command closed by a time record right after the response of the card
+# (firmware that logs the end of each response), or by the next time record
+# otherwise, which then includes the terminal and the relay if any
+KIND_RESPONSE = 'response'
+KIND_INTERVAL = 'interval'
+
+GROUP_FIELDS = ('atr', 'aid', 'reader')
+PERCENTILES = (50, 90, 99)
+
+CSV_STATS = ['count', 'min_ms', 'p50_ms', 'p90_ms', 'p99_ms', 'max_ms',
+    'mean_ms', 'histogram']
+CSV_COMMANDS = ['file', 'atr', 'aid', 'reader', 'cla', 'ins', 'p1p2', 'name',
+    'sw', 'kind', 'latency_ms']
+
+
+class Command:
+  """A command sent to the card, paired with its response"""
+
+  def __init__(self, start, header, data):
+    self.start = start
+    self.header = header
+    self.data = data
+    self.response = ''
+
+
+def time_values(data):
+  """Returns the counter values in the data of a time event"""
+  values = []
+  for k in range(0, len(data) - 7, 8):
+    word = data[k + 6:k + 8] + data[k + 4:k + 6] + data[k + 2:k + 4] + \
+        data[k:k + 2]
+    values.append(int(word, 16))
+  return values
+
+
+def pair_commands(events):
+  """
+  Pairs the commands sent to the card with their responses.
+
+  A time record is logged when each command is sent to the card (see
+  SendT0Command) and, with current firmware, when its response ends (see
+  ReceiveT0Response). Each time record closes the current command and is
+  also taken as the start of the next one, unless another time record
+  comes before the next header, so older logs without the end of the
+  response still give the interval between commands.
+
+  @Args:
+    events: list of (type, data) items, as returned by split_events
+
+  @Returns:
+    list of (atr, aid, cla, ins, p1p2, sw, kind, ticks) items
+  """
+  commands = []
+  atr = ''
+  aid = ''
+  start = None
+  command = None
+  last_type = None
+
+  for event_type, data in events:
+    if event_type == EVENT_ATR_FROM_ICC:
+      atr = data
+      aid = ''
+    elif event_type in (EVENT_TIME_GENERAL, EVENT_TIME_DATA_TO_ICC):
+      for value in time_values(data):
+        if command is not None:
+          if last_type == EVENT_BYTE_FROM_ICC:
+            kind = KIND_RESPONSE
+          else:
+            kind = KIND_INTERVAL
+          header = command.header
+          sw = command.response[-4:]
+          commands.append((atr, aid, header[0:2], header[2:4], header[4:8],
+              sw, kind, (value - command.start) & 0xFFFFFFFF))
+          if header[2:4] == 'A4' and header[4:6] == '04' and \
+              (sw == '9000' or sw.startswith('61')):
+            aid = command.data
+          command = None
+        start = value
+    elif event_type == EVENT_BYTE_TO_ICC:
+      if command is None and start is not None and len(data) >= 10:
+        command = Command(start, data[0:10], data[10:])
+        start = None
+      elif command is not None:
+        command.data += data
+    elif event_type == EVENT_BYTE_FROM_ICC:
+      if command is not None:
+        command.response += data
+    last_type = event_type
+
+  return commands
+
+
+def analyze_file(job):
+  """
+  Reads one trace and pairs its commands (run by the worker processes).
+
+  @Args:
+    job: (filename, raw_log) tuple, raw_log as in SCDTrace
+
+  @Returns:
+    (filename, list of commands as in pair_commands, error message or None)
+  """
+  filename, raw_log = job
+  try:
+    events = SCDTrace(filename, raw_log).load_events()
+    return (filename, pair_commands(events), None)
+  except Exception, e:
+    return (filename, [], str(e))
+
+
+def find_traces(paths):
+  """Returns the trace files (.hex, .eep or .bin) in the given paths"""
+  traces = []
+  for path in paths:
+    if not os.path.isdir(path):
+      traces.append(path)
+      continue
+    for root, dirs, files in os.walk(path):
+      dirs.sort()
+      for name in sorted(files):
+        if os.path.splitext(name)[1].lower() in ('.hex', '.eep', '.bin'):
+          traces.append(os.path.join(root, name))
+  return traces
+
+
+def percentile(values, p):
+  """Returns the p-th percentile (nearest rank) of a sorted list"""
+  rank = int(math.ceil(p / 100.0 * len(values))) - 1
+  return values[min(max(rank, 0), len(values) - 1)]
+
+
+def histogram(values, width):
+  """Returns the histogram of the values as a list of (bin start, count)"""
+  bins = {}
+  for value in values:
+    start = int(value // width) * width
+    bins[start] = bins.get(start, 0) + 1
+  return sorted(bins.items())
+
+
+class Analyzer:
+  """Aggregates the commands of all the traces"""
+
+  def __init__(self, group_by, bin_width, factor, min_excess):
+    self.group_by = group_by
+    self.bin_width = bin_width
+    self.factor = factor
+    self.min_excess = min_excess
+    self.latencies = {}
+    self.command_latencies = {}
+    self.commands = []
+
+  def key(self, filename, command):
+    """Returns the group (including INS and kind) of a command"""
+    atr, aid, cla, ins, p1p2, sw, kind, ticks = command
+    fields = {'atr': atr, 'aid': aid, 'reader': reader_name(filename)}
+    return tuple(fields[name] for name in self.group_by) + (ins, kind)
+
+  def add(self, filename, commands):
+    for command in commands:
+      key = self.key(filename, command)
+      # the outliers are found among the same commands (CLA, INS, P1, P2),
+      # since e.g. each READ RECORD returns a record of a different length
+      command_key = key + (command[2], command[4])
+      latency = command[7] * COUNTER_MS
+      self.latencies.setdefault(key, []).append(latency)
+      self.command_latencies.setdefault(command_key, []).append(latency)
+      self.commands.append((filename, command_key, command, latency))
+
+  def stats(self):
+    """Returns a list of (key, statistics) items, sorted by key"""
+    result = []
+    for key in sorted(self.latencies):
+      values = sorted(self.latencies[key])
+      stats = {
+          'count': len(values),
+          'min_ms': values[0],
+          'max_ms': values[-1],
+          'mean_ms': sum(values) / len(values),
+          'histogram': ' '.join('%d:%d' % (start, count) for start, count in
+              histogram(values, self.bin_width))
+          }
+      for p in PERCENTILES:
+        stats['p%d_ms' % p] = percentile(values, p)
+      result.append((key, stats))
+    return result
+
+  def limits(self):
+    """
+    Returns the latency above which a command is an outlier, for each
+    command (CLA, INS, P1 and P2) of each group: the median plus factor times the median absolute deviation
+    (scaled to a standard deviation), but at least min_excess ms above the
+    median, since the SCD counter has a resolution of about 1 ms.
+    """
+    limits = {}
+    for key, values in self.command_latencies.items():
+      values = sorted(values)
+      median = percentile(values, 50)
+      mad = percentile(sorted(abs(v - median) for v in values), 50)
+      limits[key] = (median, median + max(self.factor * 1.4826 * mad,
+          self.min_excess))
+    return limits
+
+  def outliers(self):
+    """
+    Returns the commands slower than the limit of their command in their
+    group, as a list of (filename, command, latency, median) items, and the traces in
+    which at least half of the commands are outliers, which suggests a
+    relay or a faulty card or reader rather than a single slow command.
+    """
+    limits = self.limits()
+    outliers = []
+    counts = {}
+    for filename, key, command, latency in self.commands:
+      median, limit = limits[key]
+      total, slow = counts.get(filename, (0, 0))
+      if latency > limit:
+        outliers.append((filename, command, latency, median))
+        slow += 1
+      counts[filename] = (total + 1, slow)
+    suspects = sorted(name for name, (total, slow) in counts.items()
+        if slow * 2 >= total and slow > 0)
+    return outliers, suspects
+
+  def key_names(self):
+    return list(self.group_by) + ['ins', 'name', 'kind']
+
+  def key_values(self, key):
+    ins = key[-2]
+    return list(key[:-2]) + [ins, ins_name(ins), key[-1]]
+
+
+def reader_name(filename):
+  """Returns the reader of a trace: the name of its directory"""
+  return os.path.basename(os.path.dirname(os.path.abspath(filename)))
+
+
+def command_row(filename, command, latency):
+  """Returns the CSV row of a command (see CSV_COMMANDS)"""
+  atr, aid, cla, ins, p1p2, sw, kind, ticks = command
+  return [filename, atr, aid, reader_name(filename), cla, ins, p1p2,
+      ins_name(ins), sw, kind, '%.3f' % latency]
+
+
+def ins_name(ins):
+  """Returns the name of a command given its INS (hex string), for the
+  interindustry class or else the proprietary class (e.g. GENERATE AC)"""
+  name = emv_commands.command_name('00' + ins.lower())
+  if not name:
+    name = emv_commands.command_name('80' + ins.lower())
+  return name.strip('()')
+
+
+def format_value(value):
+  """Formats the latencies (in ms) saved to the CSV files"""
+  if isinstance(value, float):
+    return '%.3f' % value
+  return value
+
+
+def write_csv(filename, header, rows):
+  f = open(filename, 'wb')
+  writer = csv.writer(f)
+  writer.writerow(header)
+  for row in rows:
+    writer.writerow(row)
+  f.close()
+
+
+def print_report(analyzer, show_histogram):
+  """Prints the statistics of each group"""
+  for key, stats in analyzer.stats():
+    names = ['%s=%s' % (name, value or '-') for name, value in
+        zip(analyzer.group_by, key[:-2])]
+    print '%s INS %s %s (%s)' % (' '.join(names), key[-2],
+        ins_name(key[-2]), key[-1])
+    print '  count %d, min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, max %.1f ms' % (
+        stats['count'], stats['min_ms'], stats['p50_ms'], stats['p90_ms'],
+        stats['p99_ms'], stats['max_ms'])
+    if show_histogram:
+      bins = histogram(analyzer.latencies[key], analyzer.bin_width)
+      most = max(count for start, count in bins)
+      for start, count in bins:
+        print '  %6d ms %6d %s' % (start, count, '#' * (count * 40 // most))
+
+
+def main():
+  """Command timing analyzer for a corpus of SCD traces"""
+  parser = argparse.ArgumentParser(description = 'Pairs the commands of '\
+      'many SCD traces with their responses and reports the latency of '\
+      'each command (INS) grouped by ATR, AID and reader')
+  parser.add_argument(
+      'paths',
+      nargs = '+',
+      help = 'trace files (Intel hex or .bin images) or directories with\
+          traces; the reader of a trace is the name of its directory')
+  parser.add_argument('-l',
+      '--log',
+      action = 'store_true',
+      help = 'the files contain only log records (from "clis.py\
+          --getloghex" or LOGnn.BIN files) instead of full EEPROM images')
+  parser.add_argument('-g',
+      '--group-by',
+      default = 'aid',
+      help = 'comma separated fields used to group the commands, from\
+          atr, aid and reader (default: aid), or "none"')
+  parser.add_argument('-j',
+      '--jobs',
+      type = int,
+      default = multiprocessing.cpu_count(),
+      help = 'number of processes (default: number of CPUs)')
+  parser.add_argument(
+      '--csv',
+      help = 'save the statistics of each group to a CSV file')
+  parser.add_argument(
+      '--commands',
+      help = 'save each command and its latency to a CSV file')
+  parser.add_argument(
+      '--outliers',
+      help = 'save the outlier commands to a CSV file')
+  parser.add_argument(
+      '--histogram',
+      action = 'store_true',
+      help = 'print the histogram of each group')
+  parser.add_argument(
+      '--bin',
+      type = float,
+      default = 10,
+      help = 'width of the histogram bins in ms (default: 10)')
+  parser.add_argument(
+      '--factor',
+      type = float,
+      default = 5,
+      help = 'a command is an outlier if it is this many deviations above\
+          the median of its group (default: 5)')
+  parser.add_argument(
+      '--min-excess',
+      type = float,
+      default = 20,
+      help = 'and at least this many ms above the median (default: 20)')
+  args = parser.parse_args()
+
+  if args.group_by == 'none':
+    group_by = ()
+  else:
+    group_by = tuple(args.group_by.split(','))
+  for name in group_by:
+    if name not in GROUP_FIELDS:
+      parser.error('unknown group field: %s' % name)
+
+  start = time.time()
+  traces = find_traces(args.paths)
+  analyzer = Analyzer(group_by, args.bin, args.factor, args.min_excess)
+  jobs = [(name, args.log) for name in traces]
+  errors = 0
+
+  if args.jobs > 1 and len(jobs) > 1:
+    pool = multiprocessing.Pool(args.jobs)
+    results = pool.imap_unordered(analyze_file, jobs, 16)
+  else:
+    pool = None
+    results = (analyze_file(job) for job in jobs)
+
+  for filename, commands, error in results:
+    if error is not None:
+      sys.stderr.write('%s: %s\n' % (filename, error))
+      errors += 1
+    analyzer.add(filename, commands)
+
+  if pool is not None:
+    pool.close()
+    pool.join()
+
+  print_report(analyzer, args.histogram)
+  outliers, suspects = analyzer.outliers()
+  print '\n%d traces (%d errors), %d commands, %d outliers in %.1f s' % (
+      len(traces), errors, len(analyzer.commands), len(outliers),
+      time.time() - start)
+  if suspects:
+    print 'Traces where most commands are outliers (relay or fault?):'
+    for name in suspects:
+      print '  ' + name
+
+  if args.csv:
+    write_csv(args.csv, analyzer.key_names() + CSV_STATS,
+        [analyzer.key_values(key) + [format_value(stats[name])
+        for name in CSV_STATS] for key, stats in analyzer.stats()])
+  if args.commands:
+    write_csv(args.commands, CSV_COMMANDS,
+        [command_row(filename, command, latency)
+        for filename, key, command, latency in analyzer.commands])
+  if args.outliers:
+    write_csv(args.outliers, CSV_COMMANDS + ['median_ms'],
+        [command_row(filename, command, latency) + ['%.3f' % median]
+        for filename, command, latency, median in outliers])
+
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main())
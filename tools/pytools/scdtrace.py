@@ -26,11 +26,199 @@
 
 import argparse
 import string
+import struct
 import sys
+import zlib
 from binascii import b2a_hex, a2b_hex
 from tlv import T
 import emv_commands
 
+# Record type of a compressed log session and the other values of the
+# compression (see avrsrc/scd_logzip.h)
+LOG_COMPRESSED_SESSION = 0x1F
+LOGZIP_MIN_MATCH = 3
+LOGZIP_RUN = 0x39
+
+# Record type of a reference to a payload already in the log (see
+# avrsrc/scd_logdedup.h)
+LOG_PAYLOAD_REF = 0x3F
+
+# Record type of a transaction summary and the layout of the summary, as
+# txn_summary_t in avrsrc/scd_summary.h
+LOG_TRANSACTION_SUMMARY = 0x3A
+TXN_SUMMARY_VERSION = 1
+TXN_SUMMARY_SIZE = 64
+TXN_SUMMARY_FORMAT = '<BBBBIB8s2sBII2s6s2s3s2sB8s2s5H'
+TXN_SUMMARY_FIELDS = ('version', 'flags', 'commands', 'errors', 'atr_hash',
+        'aid_len', 'aid', 'aip', 'afl_len', 'afl_hash', 'pan_hash', 'atc',
+        'amount', 'currency', 'cvm_results', 'verify_sw', 'cid',
+        'cryptogram', 'last_sw')
+TXN_SUMMARY_PHASES = ('select', 'gpo', 'records', 'first_ac', 'second_ac')
+
+# Metadata of the SCD in EEPROM, as the two copies of scd_meta_copy_t at
+# EEPROM_SCD_META in avrsrc/scd_meta.c
+SCD_META_ADDRESS = 0x60
+SCD_META_COPY_SIZE = 16
+SCD_META_VERSION = 1
+SCD_META_FORMAT = '<BBBBBBHII'
+
+# Flags of the fields found (TXN_SUMMARY_FLAG)
+TXN_SUMMARY_AID = 0x01
+TXN_SUMMARY_GPO = 0x02
+TXN_SUMMARY_PAN = 0x04
+TXN_SUMMARY_ATC = 0x08
+TXN_SUMMARY_AMOUNT = 0x10
+TXN_SUMMARY_CVM = 0x20
+TXN_SUMMARY_VERIFY = 0x40
+TXN_SUMMARY_AC = 0x80
+
+# Cryptogram types given by bits 8-7 of the CID
+CRYPTOGRAM_TYPES = {0x00: "AAC", 0x40: "TC", 0x80: "ARQC", 0xC0: "RFU"}
+
+# Columns of the table printed by scdtrace.py --summary, with their width
+SUMMARY_COLUMNS = (("ATR", 8), ("AID", 17), ("AIP", 4), ("AFL", 11),
+        ("PAN", 8), ("ATC", 4), ("Amount", 12), ("Cur", 3), ("CVM", 6),
+        ("PIN", 4), ("Cryptogram", 21), ("SW", 4), ("Cmd", 3), ("Err", 3),
+        ("Sel", 5), ("GPO", 5), ("Rec", 5), ("AC1", 5), ("AC2", 5))
+
+def decompress(data, length):
+    """
+    Decompresses a log session compressed by the SCD (see the format in
+    avrsrc/scd_logzip.h).
+
+    @Args:
+        data: the compressed bytes
+        length: the length of the original session
+
+    @Returns:
+        the bytes of the session, which are less than length if the
+        compressed data was truncated (e.g. the log storage was full)
+    """
+    out = bytearray()
+    data = bytearray(data)
+    i = 0
+    while i < len(data):
+        flags = data[i]
+        i += 1
+        for k in range(8):
+            if i >= len(data):
+                break
+            if flags & (1 << k):
+                out.append(data[i])
+                i += 1
+            elif i + 1 < len(data):
+                distance = data[i] + 1
+                count = data[i + 1] + LOGZIP_MIN_MATCH
+                i += 2
+                for n in range(count):
+                    out.append(out[-distance])
+            else:
+                i = len(data)
+
+    # replace the runs by the original records
+    session = bytearray()
+    i = 0
+    while i < len(out):
+        if out[i] == LOGZIP_RUN and i + 2 < len(out):
+            record_type = out[i + 1]
+            count = out[i + 2]
+            for value in out[i + 3:i + 3 + count]:
+                session.append(record_type)
+                session.append(value)
+            i += 3 + count
+        else:
+            size = (out[i] & 0x03) + 2
+            session.extend(out[i:i + size])
+            i += size
+    return str(session[:length])
+
+def decode_summaries(data):
+    """
+    Decodes the transaction summaries logged by the SCD (see
+    avrsrc/scd_summary.h). Consecutive summaries are in the same event, so
+    the data is split every TXN_SUMMARY_SIZE bytes.
+
+    @Args:
+        data: hex string with the data of a LOG_TRANSACTION_SUMMARY event
+
+    @Returns:
+        list of dictionaries with the fields of each summary, using the
+        names in TXN_SUMMARY_FIELDS plus 'times' with the end of each phase
+        in ms (None if the phase was not seen)
+    """
+    summaries = []
+    raw = a2b_hex(data)
+    for k in range(0, len(raw) - TXN_SUMMARY_SIZE + 1, TXN_SUMMARY_SIZE):
+        values = struct.unpack(TXN_SUMMARY_FORMAT,
+                raw[k:k + TXN_SUMMARY_SIZE])
+        summary = dict(zip(TXN_SUMMARY_FIELDS, values))
+        if summary['version'] != TXN_SUMMARY_VERSION:
+            continue
+        summary['times'] = [(t * 1088 / 1000) if t else None
+                for t in values[len(TXN_SUMMARY_FIELDS):]]
+        summaries.append(summary)
+    return summaries
+
+def format_summary(summary):
+    """
+    Formats a transaction summary as a line of the table printed by
+    scdtrace.py --summary (see summary_header).
+
+    @Args:
+        summary: dictionary as returned by decode_summaries
+
+    @Returns:
+        string with the fields of the summary
+    """
+    flags = summary['flags']
+
+    def field(flag, value):
+        if flags & flag:
+            return value
+        return "-"
+
+    aid = b2a_hex(summary['aid'][:summary['aid_len']]).upper()
+    if summary['aid_len'] > len(summary['aid']):
+        aid += "+"
+    afl = "%d:%08X" % (summary['afl_len'] / 4, summary['afl_hash'])
+    ac = "%s %s" % (CRYPTOGRAM_TYPES[summary['cid'] & 0xC0],
+            b2a_hex(summary['cryptogram']).upper())
+    values = [
+            "%08X" % summary['atr_hash'],
+            field(TXN_SUMMARY_AID, aid),
+            field(TXN_SUMMARY_GPO, b2a_hex(summary['aip']).upper()),
+            field(TXN_SUMMARY_GPO, afl),
+            field(TXN_SUMMARY_PAN, "%08X" % summary['pan_hash']),
+            field(TXN_SUMMARY_ATC, b2a_hex(summary['atc']).upper()),
+            field(TXN_SUMMARY_AMOUNT, b2a_hex(summary['amount'])),
+            field(TXN_SUMMARY_AMOUNT, b2a_hex(summary['currency'])[1:]),
+            field(TXN_SUMMARY_CVM, b2a_hex(summary['cvm_results']).upper()),
+            field(TXN_SUMMARY_VERIFY, b2a_hex(summary['verify_sw']).upper()),
+            field(TXN_SUMMARY_AC, ac),
+            b2a_hex(summary['last_sw']).upper(),
+            str(summary['commands']),
+            str(summary['errors'])]
+    values += [str(t) if t is not None else "-" for t in summary['times']]
+
+    return format_columns(values)
+
+def summary_header():
+    """
+    Returns the header of the table printed by scdtrace.py --summary. The
+    ATR, AFL and PAN are given as their CRC32, with the number of AFL
+    entries before it. The last columns are the end of each phase (SELECT,
+    GET PROCESSING OPTS, READ RECORD and each GENERATE AC) in ms after the
+    ATR.
+    """
+    return format_columns([name for name, width in SUMMARY_COLUMNS])
+
+def format_columns(values):
+    """
+    Aligns the values of a line of the summary table (see SUMMARY_COLUMNS)
+    """
+    return " ".join([value.ljust(width) for value, (name, width) in
+        zip(values, SUMMARY_COLUMNS)]).rstrip()
+
 class CAPDU:
     def __init__(self, hexstring):
         self.hexstring = hexstring
@@ -66,24 +254,31 @@ class SCDTrace:
         __init__: constructor
         parse_data: not sure yet
         process_data: performs all the necessary parsing of a file. Use this!
+        process_summaries: prints the transaction summaries of a file
+        load_events: parses a file and returns its events without printing
         parse_intel_hex: parse a file in Intel Hex format (such as SCD EEPROM)
+        parse_binary: parse a binary EEPROM image (such as EEPROM.BIN)
         extract_log_data: get log data from the larger parsed EEPROM contents
         split_events: split bytes into clusters of events
         print_events: print event information on standard output
     """
 
-    def __init__(self, filename):
+    def __init__(self, filename, raw_log=False):
         """
         Constructor for the SCDTrace class.
 
         @Args:
             filename: the name of the file containing the SCD EEPROM data to be
             parsed
+            raw_log: set to true if the file contains only log records (as
+            sent by AT+CGLOG or a LOGnn.BIN file) instead of a full EEPROM image
 
         @Return:
             None
         """
         self.filename = filename
+        self.raw_log = raw_log
+        self.has_references = False
         self.event_dict = {
                 0x00: "ATR Byte from ICC",
                 0x01: "ATR Byte to Terminal",
@@ -91,6 +286,9 @@ class SCDTrace:
                 0x03: "Byte from Terminal",
                 0x04: "Byte to ICC",
                 0x05: "Byte from ICC",
+                0x06: "Repeated commands not logged (log policy sampling)",
+                0x07: "Compressed session",
+                0x0F: "Repeated payload (CRC32 not found in the log)",
                 0x08: "ATR from USB",
                 0x09: "CCEND from USB",
                 0x0A: "Byte from USB",
@@ -104,12 +302,19 @@ class SCDTrace:
                 0x14: "Error sending byte to terminal",
                 0x15: "No clock from terminal",
                 0x16: "More time requested to terminal",
+                0x17: "NULL bytes sent to terminal during response",
                 0x20: "ICC activated",
                 0x21: "ICC deactivated",
                 0x22: "ICC reset high",
                 0x23: "Error receiving byte from ICC",
                 0x24: "Error sending byte to ICC",
                 0x25: "ICC inserted",
+                0x26: "READ RECORD answered from prefetched records",
+                0x27: "Command answered from session cache (INS)",
+                0x28: "Command not found in session cache (INS)",
+                0x29: "Session cache cleared by command (INS)",
+                0x2A: "Card cache result (0 hit, 1 empty, 2 changed, "
+                      "3 fingerprint, 4 offline auth)",
                 0x30: "Time data sent to ICC",
                 0x31: "Time for a general event",
                 0x32: "Error allocating memory",
@@ -118,6 +323,10 @@ class SCDTrace:
                 0x35: "Debug event type 2",
                 0x36: "Debug event type 3",
                 0x37: "Debug event type 4",
+                0x38: "ICC time saved by the READ RECORD prefetch",
+                0x39: "Time from start to ready for the terminal",
+                0x3A: "Transaction summary",
+                0x3B: "Time from ICC reset to card data read",
                 }
         #self.errors = []
         #self.warnings = []
@@ -171,20 +380,65 @@ class SCDTrace:
         @Returns:
             None
         """
-        self.bigtrace = self.parse_intel_hex(self.filename)
-        self.log_data = self.extract_log_data(self.bigtrace)
-        if len(self.log_data) < 2:
+        if not self.load_events():
             print "No data available"
             return
         if verbose:
             print "Log bytes: \n", self.log_data
-        self.events_list = self.split_events(self.log_data)
         self.print_events(self.events_list, verbose)
 
+    def process_summaries(self):
+        """
+        Parses the given file and prints the transaction summaries in it as
+        a table, one line for each transaction (see avrsrc/scd_summary.h).
+        The summaries are logged with the log policy 4 (clis.py --logpolicy).
+
+        @Returns:
+            None
+        """
+        summaries = []
+        for event_type, data in self.load_events():
+            if event_type == LOG_TRANSACTION_SUMMARY:
+                summaries.extend(decode_summaries(data))
+        if len(summaries) == 0:
+            print "No transaction summaries available"
+            return
+        print "%4s %s" % ("#", summary_header())
+        for k, summary in enumerate(summaries):
+            print "%4d %s" % (k + 1, format_summary(summary))
+
+    def load_events(self):
+        """
+        Parses the given file and splits the log into events (see
+        split_events), without printing anything. This is used by other
+        tools, such as scdtiming.py.
+
+        @Returns:
+            list of (type, data) items, empty if the file has no log data
+        """
+        if self.filename.lower().endswith('.bin'):
+            self.bigtrace = self.parse_binary(self.filename)
+        else:
+            self.bigtrace = self.parse_intel_hex(self.filename)
+        if self.raw_log:
+            self.log_data = self.bigtrace
+        else:
+            self.log_data = self.extract_log_data(self.bigtrace)
+        if len(self.log_data) < 2:
+            self.events_list = []
+            return self.events_list
+        self.log_data = self.expand_compressed(self.log_data)
+        if self.has_references:
+            self.log_data = self.resolve_references(self.log_data)
+        self.events_list = self.split_events(self.log_data)
+        return self.events_list
+
     def parse_intel_hex(self, filename):
         """
         Parses an Intel Hex file containing an SCD trace and returns a
         string of bytes, removing starting and trailing Intel Hex bytes.
+        Data records are placed at their address, including extended linear
+        address records as used for logs larger than 64 KB.
 
         @Args:
             filename: the name of the file to be parsed
@@ -192,24 +446,52 @@ class SCDTrace:
         @Returns:
             a string of bytes representing the parsed file.
         """
-        bigtrace = ""
+        chunks = []
+        base = 0
+        size = 0
 
         f = open(filename, 'r')
 
         #first we get the bytes, removing format
         for line in f:
-            if line[0] != ':':
+            line = line.strip()
+            if len(line) < 11 or line[0] != ':':
                 break
-            if line[1] == '1':
-                llen = 43
-            else:
-                llen = 75
-            if len(line) < llen:
+            dlen = int(line[1:3], 16)
+            addr = int(line[3:7], 16)
+            rtype = int(line[7:9], 16)
+            data = line[9:9 + dlen * 2]
+            if len(data) < dlen * 2 or rtype == 0x01:
                 break
+            if rtype == 0x04:
+                base = int(data, 16) << 16
+            elif rtype == 0x00:
+                chunks.append((base + addr, data))
+                size = max(size, base + addr + dlen)
 
-            line = line[9:llen - 2]
-            bigtrace = bigtrace + line
+        f.close()
 
+        bigtrace = ['FF'] * size
+        for addr, data in chunks:
+            for k in range(len(data) / 2):
+                bigtrace[addr + k] = data[k * 2:k * 2 + 2]
+
+        return "".join(bigtrace).upper()
+
+    def parse_binary(self, filename):
+        """
+        Parses a binary EEPROM image, such as the EEPROM.BIN file from the
+        SCD log drive, and returns the same string of bytes (as hex
+        characters) that parse_intel_hex returns.
+
+        @Args:
+            filename: the name of the file to be parsed
+
+        @Returns:
+            a string of bytes representing the parsed file.
+        """
+        f = open(filename, 'rb')
+        bigtrace = b2a_hex(f.read()).upper()
         f.close()
 
         return bigtrace
@@ -222,8 +504,9 @@ class SCDTrace:
 
         The EEPROM of the SCD has 4K. The first 128 bytes contain metadata, with
         the following important fields (starting from 0):
-        bytes 4-7: last counter value
-        bytes 72-73: address of last log byte
+        bytes 96-127: two copies of the SCD metadata, with the address of
+        the last log byte (see get_log_pointer)
+        bytes 72-73: address of last log byte, for older versions
         byte 128: start of log data
         
         In the following take in consideration that each character in the
@@ -235,9 +518,132 @@ class SCDTrace:
         @Returns:
             a string of bytes representing the log data
         """
-        last_byte = int(bigtrace[72*2:74*2], 16)
+        last_byte = self.get_log_pointer(bigtrace)
+        if last_byte is None:
+            last_byte = int(bigtrace[72*2:74*2], 16)
         return bigtrace[128*2:last_byte*2]
 
+    def get_log_pointer(self, bigtrace):
+        """
+        Returns the address of the last log byte from the newest valid copy
+        of the SCD metadata (see avrsrc/scd_meta.h). Each copy has a version,
+        a sequence number incremented on each commit, the metadata and a
+        CRC32 of the bytes before it.
+
+        @Args:
+            bigtrace: the string of bytes representing the parsed EEPROM data
+
+        @Returns:
+            the address of the last log byte, or None if there is no valid
+            copy (i.e. the EEPROM was written by an older version)
+        """
+        newest = None
+        for k in range(2):
+            start = (SCD_META_ADDRESS + k * SCD_META_COPY_SIZE) * 2
+            copy = a2b_hex(bigtrace[start:start + SCD_META_COPY_SIZE * 2])
+            if len(copy) < SCD_META_COPY_SIZE:
+                continue
+            fields = struct.unpack(SCD_META_FORMAT, copy)
+            crc = zlib.crc32(copy[:-4]) & 0xFFFFFFFF
+            if fields[0] != SCD_META_VERSION or fields[-1] != crc:
+                continue
+            if newest is None or ((fields[1] - newest[1]) & 0xFF) < 0x80:
+                newest = fields
+        if newest is None:
+            return None
+        return newest[6]
+
+    def expand_compressed(self, data):
+        """
+        Replaces each compressed session in the log data with the log
+        records it contains, so the result can be given to split_events.
+        Logs without compressed sessions are returned unchanged. It also
+        sets has_references if the log may contain references to payloads,
+        so resolve_references is only run when needed.
+
+        @Args:
+            data: string of bytes containing a log from the SCD.
+
+        @Returns:
+            string of bytes with all the log records uncompressed
+        """
+        result = []
+        data_len = len(data)
+        i = 0
+        self.has_references = False
+        while i + 2 <= data_len:
+            byte_value = int(data[i:i+2], 16)
+            if byte_value == LOG_PAYLOAD_REF:
+                self.has_references = True
+            if byte_value != LOG_COMPRESSED_SESSION:
+                size = ((byte_value & 0x03) + 2) * 2
+                result.append(data[i:i+size])
+                i += size
+                continue
+
+            if i + 10 > data_len:
+                break
+            header = a2b_hex(data[i+2:i+10])
+            length = ord(header[0]) | (ord(header[1]) << 8)
+            packed_len = ord(header[2]) | (ord(header[3]) << 8)
+            packed = a2b_hex(data[i+10:i+10+packed_len*2])
+            self.has_references = True
+            result.append(b2a_hex(decompress(packed, length)).upper())
+            i += 10 + packed_len * 2
+
+        return "".join(result)
+
+    def resolve_references(self, data):
+        """
+        Replaces each reference to a payload (a run of records of the same
+        type with one data byte) with the last payload before it in the log
+        that has the same CRC32. References that cannot be resolved (e.g.
+        the payload was saved before the log was erased) are kept.
+
+        @Args:
+            data: string of bytes containing a log from the SCD, with the
+            compressed sessions already expanded.
+
+        @Returns:
+            string of bytes with the references replaced
+        """
+        result = []
+        payloads = {}
+        run = []
+        data_len = len(data)
+        i = 0
+        while i + 2 <= data_len:
+            byte_value = int(data[i:i+2], 16)
+            size = ((byte_value & 0x03) + 2) * 2
+            record = data[i:i+size]
+            i += size
+            if len(record) < size:
+                result.append(record)
+                break
+
+            if byte_value == LOG_PAYLOAD_REF:
+                crc = a2b_hex(record[2:])
+                crc = ord(crc[0]) | (ord(crc[1]) << 8) | \
+                      (ord(crc[2]) << 16) | (ord(crc[3]) << 24)
+                if crc in payloads:
+                    records = payloads[crc]
+                else:
+                    records = [record]
+            else:
+                records = [record]
+
+            for record in records:
+                if run and record[0:2] != run[0][0:2]:
+                    payload = a2b_hex("".join(run))
+                    crc = zlib.crc32(payload[0] + payload[1::2]) & 0xFFFFFFFF
+                    payloads[crc] = run
+                    run = []
+                if int(record[0:2], 16) & 0x03 == 0:
+                    run.append(record)
+                result.append(record)
+
+        return "".join(result)
+
     def split_events(self, data):
         """
         Split a string of bytes representing a parsed log from the SCD and
@@ -315,9 +721,16 @@ class SCDTrace:
             len_data = len(data)
             print("event: ", hex(event_type), self.event_dict[event_type])
             print("data: ", data)
-            if event_type == 0x30 or event_type == 0x31:
+            if event_type in (0x30, 0x31, 0x38, 0x3B):
+                time = data[6:8] + data[4:6] + data[2:4] + data[0:2]
+                print("time in ms: ", int(time, 16) * 1088 / 1000)
+            if event_type == 0x39:
                 time = data[6:8] + data[4:6] + data[2:4] + data[0:2]
-                print("time in ms: ", int(time, 16) * 1024 / 1000)
+                print("time in us: ", int(time, 16))
+            if event_type == LOG_TRANSACTION_SUMMARY:
+                print summary_header()
+                for summary in decode_summaries(data):
+                    print format_summary(summary)
             if event_type == 0x02 or event_type == 0x05:
                 if len_data > 6:
                     try:
@@ -341,7 +754,17 @@ def main():
     parser = argparse.ArgumentParser(description='SCD log parser')
     parser.add_argument(
             'log_file',
-            help='the file containing the log (Intel hex format)')
+            help='the file containing the log (Intel hex format or .bin image)')
+    parser.add_argument('-l',
+            '--log',
+            action = 'store_true',
+            help='the file contains only log records (from "clis.py\
+            --getloghex" or a LOGnn.BIN file) instead of a full EEPROM image')
+    parser.add_argument('-s',
+            '--summary',
+            action = 'store_true',
+            help='print only the transaction summaries, one line for each\
+            transaction (logged with "clis.py --logpolicy 4")')
     parser.add_argument('-v',
             '--verbose',
             action = 'store_true',
@@ -350,8 +773,11 @@ def main():
     
 
     fname = args.log_file
-    trace = SCDTrace(fname)
-    trace.process_data(True)
+    trace = SCDTrace(fname, args.log)
+    if args.summary:
+        trace.process_summaries()
+    else:
+        trace.process_data(True)
 
 if __name__ == "__main__":
     main()
@@ -1,6 +1,9 @@
 # Mike's much better TLV class
 
 from itertools import chain
+from struct import pack
+import sys
+import time
 
 from binascii import b2a_hex
 from binascii import a2b_hex as fromhex
@@ -16,10 +19,59 @@ DEBUG=False
 #---------------------------- TLV STUFF --------------------------------------
 
 def maketlv(tag,value):
-    if len(value) < 256:
-        return tag + chr(len(value)) + value
+    return tag + makelength(len(value)) + value
 
-    return '\x82' + pack('!H',len(value)) + value
+def makelength(length):
+    '''BER encoding of a length: short form below 128, then 81 xx and 82 xx xx'''
+    if length < 0x80:
+        return chr(length)
+    if length < 0x100:
+        return '\x81' + chr(length)
+    return '\x82' + pack('!H',length)
+
+def decode_tag(buf,offset,end):
+    '''
+    decodes the BER tag at buf[offset] (buf is a bytearray)
+    returns (tag as integer, offset after the tag)
+    '''
+    if offset >= end:
+        raise ValueError('TLV truncated in tag at offset %d' % offset)
+    tag = buf[offset]
+    offset += 1
+    if tag & 0x1F == 0x1F:
+        # subsequent tag bytes have bit 8 set, except the last one
+        while True:
+            if offset >= end:
+                raise ValueError('TLV truncated in tag at offset %d' % offset)
+            b = buf[offset]
+            tag = (tag << 8) | b
+            offset += 1
+            if b & 0x80 == 0:
+                break
+    return tag, offset
+
+def decode_length(buf,offset,end):
+    '''
+    decodes the BER length at buf[offset] (buf is a bytearray): one byte
+    below 0x80, otherwise 0x81 to 0x84 followed by 1 to 4 length bytes.
+    The indefinite form (0x80) is not used by EMV and is rejected.
+    returns (length, offset after the length)
+    '''
+    if offset >= end:
+        raise ValueError('TLV truncated in length at offset %d' % offset)
+    l = buf[offset]
+    offset += 1
+    if l < 0x80:
+        return l, offset
+    n = l & 0x7F
+    if n == 0 or n > 4:
+        raise ValueError('bad TLV length byte %02X at offset %d' % (l, offset - 1))
+    if offset + n > end:
+        raise ValueError('TLV truncated in length at offset %d' % offset)
+    l = 0
+    for i in xrange(offset, offset + n):
+        l = (l << 8) | buf[i]
+    return l, offset + n
 
 def constructed(tag):
     assert len(tag) in [1,2]
@@ -103,7 +155,7 @@ class T:
         
     '''
 
-    def __init__(self,arg1,arg2=None,depth=0):
+    def __init__(self,arg1,arg2=None,depth=0,raw=None):
         '''
         make a TLV object, either by parsing data (1 arg) or constructing from tag+value (2 args)
         PARSING:  arg1=data in hex
@@ -112,13 +164,16 @@ class T:
         BUILDING: arg1=tag in hex
                   arg2=value as hex or T object (for a primitive or a singleton constructed T object)
                        list of hex or T objects (for a constructed T object)
+        raw is used internally to parse the items of a constructed tag in binary
         '''
         
         self.depth = depth                        # (int)    nest depth of this TLV item
         self._d = ' ' * (depth * TLV_TABSIZE)     # (int)    depth as a string of spaces         
         self.raw = ''                             # (binary) raw value of entire TLV item (covers everything)
         
-        if arg1 != None and arg2 != None:
+        if raw != None:
+            self._parse(raw)
+        elif arg1 != None and arg2 != None:
             if DEBUG: print self._d, 'BUILD',arg1,arg2
             # BUILDING MODE: tag and value
             assert validhex(arg1)
@@ -215,101 +270,58 @@ class T:
             for i in self.items:
                 i._setdepth(depth+1)
                 
+    def _addshortcut(self,tagName,value,counts):
+        '''adds the member tagName, or tagName_00 ... tagName_nn for repeated tags'''
+        n = counts.get(tagName,0)
+        counts[tagName] = n + 1
+        if n == 0:
+            self.__dict__[tagName] = value
+            return
+        if n == 1:
+            # rename single tag to a numbered tag
+            self.__dict__[tagName + '_00'] = self.__dict__.pop(tagName)
+        self.__dict__[tagName + '_%02d' % n] = value
+
     def _parse(self,data):
+        '''parses the first TLV object of data (binary), which may be followed by other data'''
         if DEBUG: print self._d,tohex(data)
-        raw = data
-        t = data[0]
-        if ord(t) & 0x1F == 0x1F:
-            t += data[1]
-            
-        data = data[len(t):]
-
-        if ord(data[0]) & 0x80 == 0x80:
-            l = ord(data[0]) * 256 + ord(data[1])
-            self.lenb = data[:2]
-            data = data[2:]
-        else:
-            l = ord(data[0])
-            self.lenb = data[:1]
-            data = data[1:]
+        buf = bytearray(data[:8])
+        end = len(data)
+        _, offset = decode_tag(buf,0,min(end,len(buf)))
+        t = data[:offset]
+        l, vstart = decode_length(buf,offset,min(end,len(buf)))
+        if vstart + l > end:
+            raise ValueError('TLV %s has length %d beyond the data' % (tohex(t), l))
 
-        v = data[:l]
-        data = data[l:]
+        self.lenb = data[offset:vstart]
+        v = data[vstart:vstart + l]
         self.tag = t
         self.tagh = tohex(t)
         self.len = l
-        self.raw = raw
+        self.raw = data[:vstart + l]
         self.rawh = tohex(self.raw)
-        
+
         self.header = self.tag + self.lenb
         self.remlen = len(self.header) + len(v)
-        
+
         self.constructed = ord(t[0]) & 0x20 == 0x20
-        
-        if self.constructed:    #constructed
-            #print self.d, 'CONSTRUCTED',hex(ord(self.tag))
-            self.count = 0
-            self.items = []
-            
-            self.v = v
-            self.vh = tohex(self.v)
-            
-            while len(v) > 0:
+
+        self.v = v
+        self.vh = tohex(self.v)
+        self.items = []
+        self.count = 0
+        counts = {}
+
+        if self.constructed:
+            pos = 0
+            while pos < l:
+                ncls = T(None,depth=self.depth+1,raw=v[pos:])
+                pos += ncls.remlen
                 self.count += 1
-                #print self.d, 'LENV', len(v), tohex(v)
-                ncls = T(tohex(v),depth=self.depth+1)
-                #print self.d, 'SETVAL',hex(ord(self.tag))
-                #print 'NCLS', ncls.tag, ncls.len, ncls.vh
-                #print 'NCLS RAW', ncls.rawh, len(ncls.raw)
-                #print self.d, 'VBEF', tohex(v)
-                v = v[ncls.remlen:]                
-                #print self.d, 'VAFT', tohex(v)
-                
-                tagName = 'T' + tohex(ncls.tag).upper()
-                
-                if tagName in self.__dict__:
-                    # rename single tag to a numbered tag
-                    tagVal = self.__dict__[tagName]
-                    del self.__dict__[tagName]
-                    self.__dict__[tagName + '_00'] = tagVal
-
-                    # find next free numbered tag
-                    ctr = 0
-                    while (tagName + '_%02d' % ctr) in self.__dict__:
-                        ctr+=1
-
-                    # add in new tag
-                    self.__dict__[tagName + '_%02d' % ctr] = ncls
-                else:
-                    self.__dict__[tagName] = ncls                 
+                self._addshortcut('T' + ncls.tagh,ncls,counts)
                 self.items.append(ncls)
-                #print self.d, 'LOOP ITEMS=',len(self.items)
         else:
-            tagName = 'T' + tohex(t).upper()
-            #print self.d, 'PRIMITIVE', tagName
-            self.items = []
-            self.count = 0
-            
-            #self.raw = self.raw[len(self.tag):len(self.tag)+self.len]
-            
-            self.v = v
-            self.vh = tohex(self.v)
-                        
-            if tagName in self.__dict__:
-                # rename single tag to a numbered tag
-                tagVal = self.__dict__[tagName]
-                del self.__dict__[tagName]
-                self.__dict__[tagName + '_00'] = tagVal
-
-                # find next free numbered tag
-                ctr = 0
-                while (tagName + '_%02d' % ctr) in self.__dict__:
-                    ctr+=1
-
-                # add in new tag
-                self.__dict__[tagName + '_%02d' % ctr] = v
-            else:
-                self.__dict__[tagName] = v
+            self._addshortcut('T' + self.tagh,v,counts)
                 
     def __repr__(self):
         if self.constructed:
@@ -341,6 +353,260 @@ class TI:
         self.i += 1
         return self.t.items[self.i-1]    
 
+#---------------------------- FAST DECODER --------------------------------------
+
+def taghex(tag):
+    '''converts a tag given as integer to hex; the first tag byte is never 00,
+    so the tag has as many bytes as the integer'''
+    h = '%X' % tag
+    if len(h) & 1:
+        return '0' + h
+    return h
+
+def tagint(tag):
+    '''converts a tag given as integer or hex string to an integer'''
+    if isinstance(tag,str):
+        return int(tag,16)
+    return tag
+
+class TLVView:
+    '''
+    Read-only view of a TLV object within a buffer, for decoding many
+    responses quickly (e.g. a corpus of traces). Unlike T, nothing is
+    converted to hex and the items of a constructed tag are only decoded
+    when they are used. Use decode(data) to get the view of a response.
+
+    EXTERNALLY ACCESSIBLE READ-ONLY FIELDS
+    --------------------------------------
+
+    self.tag  - tag as integer (None for the root returned by decode)
+    self.start, self.vstart, self.end - offsets of the TLV object and of
+                its value in the buffer
+
+    self.constructed - as in T
+    self.tagh, self.value, self.vh, self.raw, self.rawh, self.len,
+    self.remlen, self.items - as in T, computed on use
+    self.view - value as a memoryview, without a copy
+
+    METHOD SUMMARY
+    --------------
+
+    tlvobj[tag]     -- first item with this tag (integer or hex), KeyError if none
+    tag in tlvobj   -- True if one of the items has this tag
+    get(tag)        -- first item with this tag or None
+    get_all(tag)    -- list of the items with this tag
+    find(tag)       -- first TLV object with this tag at any depth or None
+    search(tag)     -- list of the TLV objects with this tag at any depth
+    primitives()    -- iterator over the primitive TLV objects, in order
+
+    find and search use an index of all the tags, built on first use.
+    '''
+
+    __slots__ = ('buf','mv','tag','constructed','start','vstart','end','_items','_index')
+
+    def __init__(self,buf,mv,tag,constructed,start,vstart,end):
+        self.buf = buf          # (bytearray)  the data
+        self.mv = mv            # (memoryview) the data, for slices without copies
+        self.tag = tag
+        self.constructed = constructed
+        self.start = start
+        self.vstart = vstart
+        self.end = end
+        self._items = None
+        self._index = None
+
+    @property
+    def tagh(self):
+        if self.tag is None:
+            return ''
+        return taghex(self.tag)
+
+    @property
+    def len(self):
+        return self.end - self.vstart
+
+    @property
+    def remlen(self):
+        return self.end - self.start
+
+    @property
+    def view(self):
+        return self.mv[self.vstart:self.end]
+
+    @property
+    def value(self):
+        return self.mv[self.vstart:self.end].tobytes()
+
+    @property
+    def vh(self):
+        return tohex(self.value)
+
+    @property
+    def raw(self):
+        return self.mv[self.start:self.end].tobytes()
+
+    @property
+    def rawh(self):
+        return tohex(self.raw)
+
+    @property
+    def items(self):
+        if self._items is None:
+            if self.constructed:
+                self._items = decode_items(self.buf,self.mv,self.vstart,self.end)
+            else:
+                self._items = []
+        return self._items
+
+    def __iter__(self):
+        return iter(self.items)
+
+    def __len__(self):
+        return len(self.items)
+
+    def __getitem__(self,tag):
+        item = self.get(tag)
+        if item is None:
+            raise KeyError(tag)
+        return item
+
+    def __contains__(self,tag):
+        return self.get(tag) is not None
+
+    def get(self,tag):
+        tag = tagint(tag)
+        for item in self.items:
+            if item.tag == tag:
+                return item
+        return None
+
+    def get_all(self,tag):
+        tag = tagint(tag)
+        return [ item for item in self.items if item.tag == tag ]
+
+    def _build_index(self):
+        index = {}
+        stack = [ self ]
+        while stack:
+            t = stack.pop()
+            items = t.items
+            for item in items:
+                index.setdefault(item.tag,[]).append(item)
+            stack.extend(reversed([ item for item in items if item.constructed ]))
+        self._index = index
+
+    def search(self,tag):
+        if self._index is None:
+            self._build_index()
+        return self._index.get(tagint(tag),[])
+
+    def find(self,tag):
+        found = self.search(tag)
+        if found:
+            return found[0]
+        return None
+
+    def primitives(self):
+        stack = [ iter(self.items) ]
+        while stack:
+            for item in stack[-1]:
+                if item.constructed:
+                    stack.append(iter(item.items))
+                    break
+                yield item
+            else:
+                stack.pop()
+
+    def __repr__(self):
+        if self.constructed:
+            return 'T' + self.tagh + '={' + ''.join(' ' + repr(k) for k in self.items) + ' }'
+        return 'T_' + self.tagh + '=' + self.vh
+
+def decode_items(buf,mv,offset,end):
+    '''decodes the TLV objects in buf[offset:end] (not their items), returns a list of TLVView'''
+    items = []
+    append = items.append
+    while offset < end:
+        start = offset
+        tag = buf[offset]
+        if tag == 0x00 or tag == 0xFF:
+            # padding between TLV objects
+            offset += 1
+            continue
+        # one byte tags and short lengths are decoded here, as they are the most common
+        if tag & 0x1F == 0x1F:
+            tag, offset = decode_tag(buf,offset,end)
+        else:
+            offset += 1
+        if offset < end and buf[offset] < 0x80:
+            l = buf[offset]
+            offset += 1
+        else:
+            l, offset = decode_length(buf,offset,end)
+        if offset + l > end:
+            raise ValueError('TLV %X at offset %d has length %d beyond the data' % (tag, start, l))
+        append(TLVView(buf,mv,tag,buf[start] & 0x20 == 0x20,start,offset,offset + l))
+        offset += l
+    return items
+
+def scan(data):
+    '''
+    returns the primitive TLV objects of data in binary, at all depths, as a
+    list of (tag as integer, value offset, value end) without building any
+    TLVView, for when all the tags are needed (e.g. comparing responses).
+    Raises ValueError if the data is not valid.
+    '''
+    buf = data if isinstance(data,bytearray) else bytearray(data)
+    result = []
+    append = result.append
+    ends = []
+    offset = 0
+    end = len(buf)
+    while True:
+        if offset >= end:
+            if not ends:
+                return result
+            end = ends.pop()
+            continue
+        tag = buf[offset]
+        if tag == 0x00 or tag == 0xFF:
+            offset += 1
+            continue
+        constructed = tag & 0x20
+        if tag & 0x1F == 0x1F:
+            tag, offset = decode_tag(buf,offset,end)
+        else:
+            offset += 1
+        if offset < end and buf[offset] < 0x80:
+            l = buf[offset]
+            offset += 1
+        else:
+            l, offset = decode_length(buf,offset,end)
+        if offset + l > end:
+            raise ValueError('TLV %X at offset %d has length %d beyond the data' % (tag, offset, l))
+        if constructed:
+            # continue with the items, then with the rest of this level
+            ends.append(end)
+            end = offset + l
+        else:
+            append((tag, offset, offset + l))
+            offset += l
+
+def decode(data):
+    '''
+    decodes TLV data in binary (str, bytearray or memoryview) and returns a
+    TLVView holding the top level TLV objects as its items. Raises
+    ValueError if the data is not valid, which for the items within a
+    constructed tag only happens when they are used.
+    '''
+    buf = data if isinstance(data,bytearray) else bytearray(data)
+    mv = memoryview(buf)
+    return TLVView(buf,mv,None,True,0,0,len(buf))
+
+def decodehex(data):
+    '''as decode, with the data in hex'''
+    return decode(fromhex(data))
+
 # RANDOM OLD FUNCTIONS        
 #def constructed(tlv):
 #    return ord(tlv[0][0]) & 0x20 == 0x20
@@ -384,5 +650,81 @@ def run_tests():
     print
     print t.dump()
     
+def benchmark_responses(count):
+    '''returns count typical EMV responses in binary (FCI, records, GPO, GENERATE AC)'''
+    import random
+    rnd = random.Random(1)
+    def rand(n): return ''.join(chr(rnd.getrandbits(8)) for i in xrange(n))
+    def tlv(tagh,value): return fromhex(tagh) + makelength(len(value)) + value
+    templates = [
+        lambda: tlv('6F', tlv('84', 'A0000000031010') + tlv('A5', tlv('50', 'VISA DEBIT') +
+            tlv('87', '\x01') + tlv('9F38', fromhex('9F66049F02069F37045F2A02')) +
+            tlv('BF0C', tlv('9F4D', '\x0B\x0A')))),
+        lambda: tlv('70', tlv('57', rand(19)) + tlv('5F20', 'CARDHOLDER/TEST') +
+            tlv('9F1F', rand(rnd.randint(10, 40)))),
+        lambda: tlv('70', tlv('8C', rand(27)) + tlv('8D', rand(26)) + tlv('5A', rand(8)) +
+            tlv('5F24', rand(3)) + tlv('5F25', rand(3)) + tlv('5F28', rand(2)) +
+            tlv('5F34', rand(1)) + tlv('8E', rand(14)) + tlv('9F07', rand(2)) +
+            tlv('9F0D', rand(5)) + tlv('9F0E', rand(5)) + tlv('9F0F', rand(5))),
+        lambda: tlv('70', tlv('90', rand(176)) + tlv('8F', rand(1)) + tlv('9F32', '\x03') +
+            tlv('92', rand(36))),
+        lambda: tlv('70', tlv('9F46', rand(rnd.choice([128, 144, 176]))) + tlv('9F47', '\x03') +
+            tlv('9F48', rand(42)) + tlv('9F49', fromhex('9F3704'))),
+        lambda: tlv('77', tlv('82', '\x39\x00') + tlv('94', rand(4 * rnd.randint(1, 4)))),
+        lambda: tlv('77', tlv('9F27', '\x80') + tlv('9F36', rand(2)) + tlv('9F26', rand(8)) +
+            tlv('9F10', rand(rnd.choice([7, 18, 32])))),
+        ]
+    return [ rnd.choice(templates)() for i in xrange(count) ]
+
+def run_benchmark(count):
+    '''compares T and decode on count responses: all primitive tags, then one tag lookup'''
+    responses = benchmark_responses(count)
+    print 'BENCHMARK: %d responses, %d bytes' % (count, sum(len(r) for r in responses))
+
+    def walk(t,values):
+        if t.constructed:
+            for item in t.items:
+                walk(item,values)
+        else:
+            values.append((t.tagh, t.v))
+
+    start = time.time()
+    slow = []
+    for r in responses:
+        values = []
+        walk(T(tohex(r)),values)
+        slow.append(values)
+    slow_time = time.time() - start
+
+    start = time.time()
+    fast = []
+    for r in responses:
+        fast.append([ (t.tagh, t.value) for t in decode(r).primitives() ])
+    fast_time = time.time() - start
+    assert fast == slow
+
+    start = time.time()
+    scanned = []
+    for r in responses:
+        scanned.append([ (taghex(t), r[s:e]) for t, s, e in scan(r) ])
+    scan_time = time.time() - start
+    assert scanned == slow
+
+    start = time.time()
+    slow_found = [ T(tohex(r)).findone('5A') for r in responses ]
+    slow_find = time.time() - start
+    start = time.time()
+    fast_found = [ decode(r).find(0x5A) for r in responses ]
+    fast_find = time.time() - start
+    assert [ t is None for t in slow_found ] == [ t is None for t in fast_found ]
+
+    print '%-26s %10s %10s %8s' % ('', 'T (s)', 'decode (s)', 'speedup')
+    print '%-26s %10.3f %10.3f %7.1fx' % ('all primitive tags', slow_time, fast_time, slow_time / fast_time)
+    print '%-26s %10.3f %10.3f %7.1fx' % ('all primitive tags (scan)', slow_time, scan_time, slow_time / scan_time)
+    print '%-26s %10.3f %10.3f %7.1fx' % ('find tag 5A', slow_find, fast_find, slow_find / fast_find)
+
 if __name__ == '__main__':
-    run_tests()
+    if len(sys.argv) > 1 and sys.argv[1] == '--benchmark':
+        run_benchmark(int(sys.argv[2]) if len(sys.argv) > 2 else 100000)
+    else:
+        run_tests()